@@ -0,0 +1,146 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/**
+ * Overhead of the access log at a steady 100k requests/s. Requests
+ * arrive open loop in 1ms ticks, each one takes the two timestamps and
+ * hands its record over the way the server does. Reported are the
+ * caller side cost per request and the CPU the whole process used,
+ * flusher included, against a run with the access log disabled.
+ * Writes to ACCESS_BENCH_FILE. Prints one JSON object per result line.
+ */
+
+#include "access_log.h"
+#include "logger.h"
+
+#include <sys/stat.h>
+
+#define REQ_PER_SEC       100000
+#define TICK_NS           1000000L
+#define RUN_SEC           2
+#define ACCESS_BENCH_FILE "/tmp/legion_bench_access.log"
+
+static unsigned long clock_of(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+/**
+ * One request as the server would record it
+ */
+static void fake_request(access_record *rec, unsigned long seq)
+{
+    rec->start_ns = access_log_clock();
+    rec->method = ACCESS_METHOD_GET;
+    rec->status = (seq % 50 == 0) ? 404 : 200;
+    rec->bytes = 1160;
+    rec->path_len = (unsigned short)snprintf(rec->path, ACCESS_PATH_LEN, "assets/page_%lu.html", seq % 1000);
+    rec->duration_us = (unsigned int)((access_log_clock() - rec->start_ns) / 1000);
+    access_log_write(rec);
+}
+
+static void run_mode(const char *name, const access_log_config *config)
+{
+    unsigned long seq = 0;
+    unsigned long tick = 0;
+    unsigned long start = 0;
+    unsigned long busy = 0;
+    unsigned long cpu = 0;
+    unsigned long wall = 0;
+    size_t written = 0;
+    size_t dropped = 0;
+    size_t written0 = 0;
+    size_t dropped0 = 0;
+    struct stat st;
+    struct timespec next;
+    access_record rec;
+    const unsigned long per_tick = REQ_PER_SEC / (1000000000L / TICK_NS);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.addr[0] = 10;
+    rec.addr[3] = 7;
+
+    if (config != NULL && init_access_log(config) != 0)
+        return;
+    access_log_stats(&written0, &dropped0);
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    cpu = clock_of(CLOCK_PROCESS_CPUTIME_ID);
+    wall = clock_of(CLOCK_MONOTONIC);
+    for (tick = 0; tick < RUN_SEC * 1000000000L / TICK_NS; tick++)
+    {
+        start = clock_of(CLOCK_MONOTONIC);
+        for (seq = tick * per_tick; seq < (tick + 1) * per_tick; seq++)
+            fake_request(&rec, seq);
+        busy += clock_of(CLOCK_MONOTONIC) - start;
+
+        next.tv_nsec += TICK_NS;
+        if (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    if (config != NULL)
+        stop_access_log();
+    cpu = clock_of(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    wall = clock_of(CLOCK_MONOTONIC) - wall;
+
+    access_log_stats(&written, &dropped);
+    if (stat(ACCESS_BENCH_FILE, &st) != 0 || config == NULL)
+        st.st_size = 0;
+    unlink(ACCESS_BENCH_FILE);
+
+    printf("{\"bench\":\"access_log\",\"mode\":\"%s\",\"requests\":%lu,\"ns_per_request\":%.1f,"
+           "\"cpu_pct\":%.2f,\"records\":%zu,\"dropped\":%zu,\"file_bytes\":%ld}\n",
+           name, tick * per_tick, (double)busy / (double)(tick * per_tick),
+           100.0 * (double)cpu / (double)wall, written - written0, dropped - dropped0, (long)st.st_size);
+}
+
+int main()
+{
+    access_log_config config;
+
+    memset(&config, 0, sizeof(config));
+    config.path = ACCESS_BENCH_FILE;
+
+    // Debug log only takes the flusher's drop reports
+    if (init_logging(LOG_MODE_TEXT, LOG_LEVEL_ERROR) != 0)
+        return EXIT_FAILURE;
+
+    run_mode("disabled", NULL);
+    config.format = ACCESS_LOG_CSV;
+    run_mode("csv", &config);
+    config.format = ACCESS_LOG_BINARY;
+    run_mode("binary", &config);
+    config.format = ACCESS_LOG_CSV;
+    config.sample = 10;
+    run_mode("csv_sample_10", &config);
+
+    stop_logging();
+    return EXIT_SUCCESS;
+}
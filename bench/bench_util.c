@@ -0,0 +1,230 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include "bench_util.h"
+
+#include <ftw.h>
+#include <sys/stat.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+// Normally defined by server.c, which can't be linked for its main()
+bool server_run = true;
+int g_epoll_fd = -1;
+bool g_stats_endpoint = false;
+bool g_vhosts_enabled = false;
+bool g_http2_enabled = true;
+
+unsigned long bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+/**
+ * Creates the scratch directory from the mkdtemp() template and moves
+ * into it, assets go to DEFAULT_ASSET_PATH within
+ */
+int bench_scratch_open(char *dir_template)
+{
+    if (mkdtemp(dir_template) == NULL || chdir(dir_template) != 0)
+        return -1;
+    return mkdir(DEFAULT_ASSET_PATH, 0755);
+}
+
+/**
+ * Writes an asset of the given size under DEFAULT_ASSET_PATH
+ */
+int bench_write_asset(const char *name, size_t size)
+{
+    char path[PATH_MAX];
+    FILE *fp = NULL;
+    size_t i = 0;
+
+    snprintf(path, sizeof(path), "%s%s", DEFAULT_ASSET_PATH, name);
+    fp = fopen(path, "w");
+    if (fp == NULL)
+        return -1;
+    for (i = 0; i < size; i++)
+        fputc('a' + (int)(i % 26), fp);
+    fclose(fp);
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+    (void)sb;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+/**
+ * Removes the scratch directory with everything in it
+ */
+void bench_scratch_close(const char *dir)
+{
+    if (chdir("/") == 0)
+        nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * Self signed certificate for the key, valid for a day
+ */
+int bench_write_cert(const char *cert_file, const char *key_file, EVP_PKEY *key)
+{
+    int ret = -1;
+    FILE *fp = NULL;
+    X509 *cert = X509_new();
+
+    if (cert == NULL || key == NULL)
+        goto out;
+
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                               (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, X509_get_subject_name(cert));
+    X509_set_pubkey(cert, key);
+    // Ed25519 signs without a separate digest
+    if (X509_sign(cert, key, (EVP_PKEY_get_id(key) == EVP_PKEY_ED25519) ? NULL : EVP_sha256()) == 0)
+        goto out;
+
+    fp = fopen(cert_file, "w");
+    if (fp == NULL || PEM_write_X509(fp, cert) == 0)
+        goto out;
+    fclose(fp);
+    fp = fopen(key_file, "w");
+    if (fp == NULL || PEM_write_PrivateKey(fp, key, NULL, NULL, 0, NULL, NULL) == 0)
+        goto out;
+    ret = 0;
+
+out:
+    if (fp != NULL)
+        fclose(fp);
+    X509_free(cert);
+    return ret;
+}
+
+/**
+ * Client context accepting the generated self signed certificates
+ */
+SSL_CTX *bench_client_ctx()
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+
+    if (ctx != NULL)
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    return ctx;
+}
+
+static unsigned long thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+/**
+ * Server and client ends over a fresh BIO pair, ready to handshake.
+ * The server half is referenced once more through server_bio so what
+ * the server wrote stays readable after its SSL_free
+ */
+int bench_tls_new(SSL_CTX *server_ctx, SSL_CTX *client_ctx, SSL **server, SSL **client, BIO **server_bio)
+{
+    BIO *client_bio = NULL;
+
+    *server = SSL_new(server_ctx);
+    *client = SSL_new(client_ctx);
+    *server_bio = NULL;
+    if (*server == NULL || *client == NULL ||
+        BIO_new_bio_pair(server_bio, BENCH_BIO_PAIR_SIZE, &client_bio, BENCH_BIO_PAIR_SIZE) == 0)
+    {
+        bench_tls_free(*server, *client, *server_bio);
+        return -1;
+    }
+
+    BIO_up_ref(*server_bio);
+    SSL_set_bio(*server, *server_bio, *server_bio);
+    SSL_set_bio(*client, client_bio, client_bio);
+    SSL_set_accept_state(*server);
+    SSL_set_connect_state(*client);
+    return 0;
+}
+
+/**
+ * Runs both ends until the handshake is done, adds the CPU time the
+ * server end took to server_cpu_ns unless it is NULL
+ */
+int bench_tls_handshake(SSL *server, SSL *client, unsigned long *server_cpu_ns)
+{
+    int i = 0;
+    int server_ret = 0;
+    int client_ret = 0;
+    unsigned long start = 0;
+
+    for (i = 0; i < 16 && (server_ret != 1 || client_ret != 1); i++)
+    {
+        client_ret = SSL_do_handshake(client);
+        if (server_cpu_ns != NULL)
+            start = thread_cpu_ns();
+        server_ret = SSL_do_handshake(server);
+        if (server_cpu_ns != NULL)
+            *server_cpu_ns += thread_cpu_ns() - start;
+    }
+    return (server_ret == 1 && client_ret == 1) ? 0 : -1;
+}
+
+/**
+ * The server BIO goes last, see bench_tls_new()
+ */
+void bench_tls_free(SSL *server, SSL *client, BIO *server_bio)
+{
+    SSL_free(server);
+    SSL_free(client);
+    BIO_free(server_bio);
+}
+
+/**
+ * Fresh TLS pair with the handshake done
+ */
+int bench_tls_pair(SSL_CTX *server_ctx, SSL_CTX *client_ctx, SSL **server, SSL **client, BIO **server_bio)
+{
+    if (bench_tls_new(server_ctx, client_ctx, server, client, server_bio) != 0)
+        return -1;
+
+    if (bench_tls_handshake(*server, *client, NULL) != 0)
+    {
+        bench_tls_free(*server, *client, *server_bio);
+        *server = NULL;
+        *client = NULL;
+        *server_bio = NULL;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+/**
+ * Shared setup for the benchmarks running server code in-process: a
+ * scratch directory whose assets/ is the cache root, generated
+ * certificates and TLS connections over BIO pairs. Linked together with
+ * the server objects minus server.c, which is why the globals it would
+ * define live in bench_util.c.
+ */
+
+#include "server.h"
+
+#include <openssl/evp.h>
+
+// Sized like a socket send buffer so SEND_BUDGET decides the yields
+#define BENCH_BIO_PAIR_SIZE (256 * 1024)
+
+extern bool server_run;
+extern int g_epoll_fd;
+extern bool g_stats_endpoint;
+extern bool g_vhosts_enabled;
+extern bool g_http2_enabled;
+extern SSL_CTX *g_ssl_ctx;
+
+unsigned long bench_now_ns();
+
+int bench_scratch_open(char *dir_template);
+int bench_write_asset(const char *name, size_t size);
+void bench_scratch_close(const char *dir);
+
+int bench_write_cert(const char *cert_file, const char *key_file, EVP_PKEY *key);
+SSL_CTX *bench_client_ctx();
+int bench_tls_new(SSL_CTX *server_ctx, SSL_CTX *client_ctx, SSL **server, SSL **client, BIO **server_bio);
+int bench_tls_handshake(SSL *server, SSL *client, unsigned long *server_cpu_ns);
+void bench_tls_free(SSL *server, SSL *client, BIO *server_bio);
+int bench_tls_pair(SSL_CTX *server_ctx, SSL_CTX *client_ctx, SSL **server, SSL **client, BIO **server_bio);
+
+#endif
@@ -0,0 +1,258 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Costs of the cache side of a request: get_page_cache() hits and misses
+ * as the number of assets grows, get_mime_type() over common names, and
+ * sendfile_to_client() from an mmapped entry against fd backed entries
+ * read with pread. Responses go over a BIO pair whose client end is only
+ * drained, never decrypted, so encryption on the server side is the one
+ * TLS cost included. Prints one JSON object per result line.
+ */
+
+#include "bench_util.h"
+
+#define RUN_NS          (200 * 1000000UL)
+// Clock is read once per batch of calls
+#define CALL_BATCH      256
+#define BASE_ASSETS     6
+#define LOOKUP_NAME_LEN 32
+#define LARGE_SIZE      (256 * 1024)
+
+static const size_t asset_counts[] = {16, 256, 4096};
+
+static const char *mime_names[] = {
+    "index.html", "about.htm", "style.css", "app.js", "data.json", "logo.png", "photo.jpeg",
+    "banner.JPG", "anim.gif", "favicon.ico", "manual.pdf", "notes.txt", "archive.tar.gz", "font.woff2",
+};
+
+static char work_dir[] = "/tmp/legion_microbench.XXXXXX";
+static volatile const void *sink = NULL;
+
+static unsigned long xorshift(unsigned long *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * Random hits over every generated asset and misses
+ */
+static void bench_lookup(size_t assets, char (*names)[LOOKUP_NAME_LEN], size_t nr_names)
+{
+    size_t i = 0;
+    unsigned long calls = 0;
+    unsigned long state = 88172645463325252UL;
+    unsigned long start = 0;
+    unsigned long elapsed = 0;
+
+    start = bench_now_ns();
+    do
+    {
+        for (i = 0; i < CALL_BATCH; i++)
+            sink = get_page_cache(names[xorshift(&state) % nr_names]);
+        calls += CALL_BATCH;
+        elapsed = bench_now_ns() - start;
+    } while (elapsed < RUN_NS);
+    printf("{\"bench\":\"page_cache_lookup\",\"assets\":%zu,\"pattern\":\"hit\",\"lookups\":%lu,\"ns_per_lookup\":%.1f}\n",
+           assets, calls, (double)elapsed / (double)calls);
+
+    calls = 0;
+    start = bench_now_ns();
+    do
+    {
+        for (i = 0; i < CALL_BATCH; i++)
+            sink = get_page_cache("missing.html");
+        calls += CALL_BATCH;
+        elapsed = bench_now_ns() - start;
+    } while (elapsed < RUN_NS);
+    printf("{\"bench\":\"page_cache_lookup\",\"assets\":%zu,\"pattern\":\"miss\",\"lookups\":%lu,\"ns_per_lookup\":%.1f}\n",
+           assets, calls, (double)elapsed / (double)calls);
+}
+
+static void bench_mime()
+{
+    size_t i = 0;
+    size_t nr_names = sizeof(mime_names) / sizeof(mime_names[0]);
+    unsigned long calls = 0;
+    unsigned long start = 0;
+    unsigned long elapsed = 0;
+
+    start = bench_now_ns();
+    do
+    {
+        for (i = 0; i < CALL_BATCH; i++)
+            sink = get_mime_type(mime_names[i % nr_names]);
+        calls += CALL_BATCH;
+        elapsed = bench_now_ns() - start;
+    } while (elapsed < RUN_NS);
+    printf("{\"bench\":\"mime_type\",\"names\":%zu,\"calls\":%lu,\"ns_per_call\":%.1f}\n",
+           nr_names, calls, (double)elapsed / (double)calls);
+}
+
+static void drain(BIO *bio)
+{
+    char buf[16384];
+
+    while (BIO_read(bio, buf, sizeof(buf)) > 0)
+        ;
+}
+
+/**
+ * Whole responses of one cache entry, sendfile_to_client() is called
+ * again after draining whenever it yields like a worker would on EPOLLOUT
+ */
+static void bench_send(const char *label, const page_cache *page, SSL_CTX *client_ctx)
+{
+    int ret = 0;
+    SSL *server = NULL;
+    SSL *client = NULL;
+    BIO *server_bio = NULL;
+    client_info cinfo;
+    unsigned long responses = 0;
+    unsigned long calls = 0;
+    unsigned long errors = 0;
+    unsigned long start = 0;
+    unsigned long busy = 0;
+    unsigned long begin = 0;
+
+    if (page == NULL || bench_tls_pair(g_ssl_ctx, client_ctx, &server, &client, &server_bio) != 0)
+    {
+        fprintf(stderr, "%s: unable to set up\n", label);
+        return;
+    }
+    // Session tickets
+    drain(SSL_get_rbio(client));
+
+    memset(&cinfo, 0, sizeof(cinfo));
+    cinfo.fd = -1;
+    cinfo.ssl = server;
+    cinfo.keep_alive = true;
+
+    begin = bench_now_ns();
+    while (bench_now_ns() - begin < RUN_NS)
+    {
+        start = bench_now_ns();
+        send_response(&cinfo, page, false);
+        do
+        {
+            ret = sendfile_to_client(&cinfo);
+            calls++;
+            if (ret == CONN_WANT_WRITE)
+            {
+                busy += bench_now_ns() - start;
+                drain(SSL_get_rbio(client));
+                start = bench_now_ns();
+            }
+        } while (ret == CONN_WANT_WRITE);
+        busy += bench_now_ns() - start;
+        drain(SSL_get_rbio(client));
+
+        if (ret != CONN_DONE)
+        {
+            errors++;
+            break;
+        }
+        responses++;
+    }
+
+    printf("{\"bench\":\"sendfile_to_client\",\"entry\":\"%s\",\"size\":%lu,\"responses\":%lu,"
+           "\"ns_per_response\":%.1f,\"mb_per_sec\":%.1f,\"calls_per_response\":%.2f,\"errors\":%lu}\n",
+           label, (unsigned long)page->file_size, responses, (double)busy / (double)(responses ? responses : 1),
+           (double)responses * (double)page->file_size / ((double)busy / 1e9) / 1e6,
+           (double)calls / (double)(responses ? responses : 1), errors);
+
+    bench_tls_free(server, client, server_bio);
+}
+
+int main()
+{
+    int ret = 0;
+    size_t c = 0;
+    size_t generated = 0;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    EVP_PKEY *key = NULL;
+    SSL_CTX *client_ctx = NULL;
+    char (*names)[LOOKUP_NAME_LEN] = NULL;
+
+    names = calloc(asset_counts[sizeof(asset_counts) / sizeof(asset_counts[0]) - 1], LOOKUP_NAME_LEN);
+    if (names == NULL || bench_scratch_open(work_dir) != 0)
+        goto err;
+
+    // Entries up to a page are mmapped, anything larger is read with pread
+    key = EVP_EC_gen("P-256");
+    ret = bench_write_cert("cert.pem", "key.pem", key);
+    EVP_PKEY_free(key);
+    if (ret != 0 ||
+        bench_write_asset(INDEX_PAGE, 1024) != 0 ||
+        bench_write_asset(ERROR_404_PAGE, 1024) != 0 ||
+        bench_write_asset(ERROR_500_PAGE, 1024) != 0 ||
+        bench_write_asset("mmap.bin", page_size) != 0 ||
+        bench_write_asset("pread.bin", page_size + 1) != 0 ||
+        bench_write_asset("large.bin", LARGE_SIZE) != 0)
+        goto err;
+
+    client_ctx = bench_client_ctx();
+    if (client_ctx == NULL || init_openssl_context((const char *[]){"cert.pem"}, (const char *[]){"key.pem"}, 1) != 0 ||
+        initiate_cache(DEFAULT_ASSET_PATH) != BASE_ASSETS)
+        goto err;
+
+    bench_mime();
+    bench_send("mmap", get_page_cache("mmap.bin"), client_ctx);
+    bench_send("pread", get_page_cache("pread.bin"), client_ctx);
+    bench_send("pread_large", get_page_cache("large.bin"), client_ctx);
+
+    for (c = 0; c < sizeof(asset_counts) / sizeof(asset_counts[0]); c++)
+    {
+        for (; generated < asset_counts[c] - BASE_ASSETS; generated++)
+        {
+            snprintf(names[generated], LOOKUP_NAME_LEN, "page_%05zu.html", generated);
+            if (bench_write_asset(names[generated], 512) != 0)
+                goto err;
+        }
+
+        release_cache();
+        if (initiate_cache(DEFAULT_ASSET_PATH) != asset_counts[c])
+            goto err;
+        bench_lookup(asset_counts[c], names, generated);
+    }
+
+    release_cache();
+    SSL_CTX_free(client_ctx);
+    SSL_CTX_free(g_ssl_ctx);
+    bench_scratch_close(work_dir);
+    free(names);
+    return EXIT_SUCCESS;
+
+err:
+    fprintf(stderr, "Unable to set up the benchmark in %s\n", work_dir);
+    ERR_print_errors_fp(stderr);
+    release_cache();
+    SSL_CTX_free(client_ctx);
+    bench_scratch_close(work_dir);
+    free(names);
+    return EXIT_FAILURE;
+}
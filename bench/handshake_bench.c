@@ -0,0 +1,324 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Server side cost of TLS handshakes against the context the server
+ * builds in init_openssl_context(). Certificates for RSA-2048, RSA-4096,
+ * ECDSA P-256 and Ed25519 are generated at start, and every key is run
+ * with full and resumed handshakes over TLS 1.2 and TLS 1.3. The server
+ * holding both a P-256 and an RSA-2048 chain is also run with a client
+ * offering RSA signatures only, cert names the key type served. Threads
+ * handshake in parallel over BIO pairs, each playing both ends, and only
+ * the CPU time spent in the server end is charged to the handshake.
+ * handshakes_per_sec_per_core is what one core would sustain doing
+ * nothing but server handshakes. Prints one JSON object per case.
+ *
+ * Usage: bench_handshake [-t threads] [-d ms per case] [-k key]
+ *   -t  defaults to the number of online cores
+ *   -k  one of rsa2048, rsa4096, p256, ed25519, p256+rsa2048
+ */
+
+#include "bench_util.h"
+
+#include <getopt.h>
+#include <pthread.h>
+
+#define RUN_MS_DEFAULT 500
+#define MAX_THREADS    256
+// Signatures of a client too old for anything but RSA
+#define RSA_ONLY_SIGALGS "rsa_pss_rsae_sha256:RSA+SHA256:RSA+SHA384"
+
+typedef struct
+{
+    SSL_CTX *client_ctx;
+    bool resume;
+    // Key type of the certificate the server sent last
+    const char *cert;
+    unsigned long run_ns;
+    unsigned long handshakes;
+    unsigned long server_cpu_ns;
+    unsigned long not_resumed;
+    unsigned long errors;
+} bench_worker;
+
+// Chains loaded together are joined by '+'
+static const char *keys[] = {"rsa2048", "rsa4096", "p256", "ed25519", "p256+rsa2048"};
+
+static const int versions[] = {TLS1_2_VERSION, TLS1_3_VERSION};
+
+static char work_dir[] = "/tmp/legion_handshake.XXXXXX";
+
+static EVP_PKEY *generate_key(const char *type, size_t len)
+{
+    if (len == 7 && strncmp(type, "rsa2048", len) == 0)
+        return EVP_RSA_gen(2048);
+    if (len == 7 && strncmp(type, "rsa4096", len) == 0)
+        return EVP_RSA_gen(4096);
+    if (len == 4 && strncmp(type, "p256", len) == 0)
+        return EVP_EC_gen("P-256");
+    if (len == 7 && strncmp(type, "ed25519", len) == 0)
+        return EVP_PKEY_Q_keygen(NULL, NULL, "ED25519");
+    return NULL;
+}
+
+/**
+ * Builds g_ssl_ctx with a freshly generated chain for every key type in key
+ */
+static int setup_server(const char *key)
+{
+    int ret = 0;
+    size_t len = 0;
+    size_t nr_certs = 0;
+    EVP_PKEY *pkey = NULL;
+    char cert_names[MAX_SSL_CERTS][16];
+    char key_names[MAX_SSL_CERTS][16];
+    const char *cert_files[MAX_SSL_CERTS];
+    const char *key_files[MAX_SSL_CERTS];
+
+    while (*key != '\0' && nr_certs < MAX_SSL_CERTS)
+    {
+        len = strcspn(key, "+");
+        pkey = generate_key(key, len);
+        snprintf(cert_names[nr_certs], sizeof(cert_names[0]), "cert%zu.pem", nr_certs);
+        snprintf(key_names[nr_certs], sizeof(key_names[0]), "key%zu.pem", nr_certs);
+        ret = (pkey != NULL) ? bench_write_cert(cert_names[nr_certs], key_names[nr_certs], pkey) : -1;
+        EVP_PKEY_free(pkey);
+        if (ret != 0)
+            return -1;
+
+        cert_files[nr_certs] = cert_names[nr_certs];
+        key_files[nr_certs] = key_names[nr_certs];
+        nr_certs++;
+        key += len + (key[len] == '+');
+    }
+    return init_openssl_context(cert_files, key_files, nr_certs);
+}
+
+/**
+ * Sends close_notify both ways so the client session stays resumable
+ */
+static void close_pair(SSL *server, SSL *client, BIO *server_bio)
+{
+    SSL_shutdown(client);
+    SSL_shutdown(server);
+    ERR_clear_error();
+    bench_tls_free(server, client, server_bio);
+}
+
+/**
+ * One handshake, the session the client ends up with replaces *session.
+ * TLS 1.3 tickets come after the handshake and are single use on the
+ * client side, hence the read and the fresh session every time
+ */
+static int handshake(bench_worker *worker, SSL_SESSION **session, unsigned long *server_cpu_ns)
+{
+    int ret = 0;
+    char byte = 0;
+    SSL *server = NULL;
+    SSL *client = NULL;
+    BIO *server_bio = NULL;
+
+    if (bench_tls_new(g_ssl_ctx, worker->client_ctx, &server, &client, &server_bio) != 0)
+        return -1;
+    if (*session != NULL)
+        SSL_set_session(client, *session);
+
+    ret = bench_tls_handshake(server, client, server_cpu_ns);
+    if (ret == 0 && !SSL_session_reused(server) && SSL_get_certificate(server) != NULL)
+        worker->cert = EVP_PKEY_get0_type_name(X509_get0_pubkey(SSL_get_certificate(server)));
+    if (ret == 0 && worker->resume)
+    {
+        if (*session != NULL && !SSL_session_reused(server))
+            worker->not_resumed++;
+        SSL_read(client, &byte, 1);
+        SSL_SESSION_free(*session);
+        *session = SSL_get1_session(client);
+    }
+    close_pair(server, client, server_bio);
+    return ret;
+}
+
+static void *run_worker(void *arg)
+{
+    bench_worker *worker = arg;
+    SSL_SESSION *session = NULL;
+    unsigned long start = 0;
+
+    // Resumed runs start from a session of a full handshake left out of the count
+    if (worker->resume && handshake(worker, &session, NULL) != 0)
+    {
+        worker->errors++;
+        return NULL;
+    }
+
+    start = bench_now_ns();
+    while (bench_now_ns() - start < worker->run_ns)
+    {
+        if (handshake(worker, &session, &worker->server_cpu_ns) != 0)
+        {
+            worker->errors++;
+            break;
+        }
+        worker->handshakes++;
+    }
+    SSL_SESSION_free(session);
+    return NULL;
+}
+
+static void run_case(const char *key, int version, bool resume, bool rsa_only, int nr_threads, unsigned long run_ns)
+{
+    int i = 0;
+    int started = 0;
+    unsigned long start = 0;
+    unsigned long elapsed = 0;
+    unsigned long handshakes = 0;
+    unsigned long server_cpu_ns = 0;
+    unsigned long not_resumed = 0;
+    unsigned long errors = 0;
+    const char *cert = NULL;
+    SSL_CTX *client_ctx = NULL;
+    pthread_t threads[MAX_THREADS];
+    bench_worker workers[MAX_THREADS];
+
+    client_ctx = bench_client_ctx();
+    if (client_ctx == NULL || SSL_CTX_set_min_proto_version(client_ctx, version) != 1 ||
+        SSL_CTX_set_max_proto_version(client_ctx, version) != 1 ||
+        (rsa_only && SSL_CTX_set1_sigalgs_list(client_ctx, RSA_ONLY_SIGALGS) != 1))
+    {
+        fprintf(stderr, "%s: unable to set up the client\n", key);
+        SSL_CTX_free(client_ctx);
+        return;
+    }
+
+    memset(workers, 0, sizeof(workers));
+    start = bench_now_ns();
+    for (i = 0; i < nr_threads; i++)
+    {
+        workers[i].client_ctx = client_ctx;
+        workers[i].resume = resume;
+        workers[i].run_ns = run_ns;
+        if (pthread_create(&threads[i], NULL, run_worker, &workers[i]) != 0)
+            break;
+        started++;
+    }
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+        handshakes += workers[i].handshakes;
+        server_cpu_ns += workers[i].server_cpu_ns;
+        not_resumed += workers[i].not_resumed;
+        errors += workers[i].errors;
+        if (workers[i].cert != NULL)
+            cert = workers[i].cert;
+    }
+    elapsed = bench_now_ns() - start;
+
+    printf("{\"bench\":\"handshake\",\"key\":\"%s\",\"client\":\"%s\",\"cert\":\"%s\",\"tls\":\"%s\","
+           "\"mode\":\"%s\",\"threads\":%d,"
+           "\"handshakes\":%lu,\"server_us_per_handshake\":%.1f,\"handshakes_per_sec_per_core\":%.0f,"
+           "\"handshakes_per_sec\":%.0f,\"not_resumed\":%lu,\"errors\":%lu}\n",
+           key, rsa_only ? "rsa_only" : "any", cert != NULL ? cert : "none", version == TLS1_3_VERSION ? "1.3" : "1.2", resume ? "resumed" : "full", started, handshakes,
+           (double)server_cpu_ns / 1e3 / (double)(handshakes ? handshakes : 1),
+           server_cpu_ns ? (double)handshakes * 1e9 / (double)server_cpu_ns : 0.0,
+           (double)handshakes * 1e9 / (double)elapsed, not_resumed, errors);
+    fflush(stdout);
+    SSL_CTX_free(client_ctx);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt = 0;
+    int nr_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned long run_ns = RUN_MS_DEFAULT * 1000000UL;
+    const char *only = NULL;
+    size_t k = 0;
+    size_t v = 0;
+
+    while ((opt = getopt(argc, argv, "t:d:k:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            nr_threads = atoi(optarg);
+            break;
+        case 'd':
+            run_ns = strtoul(optarg, NULL, 10) * 1000000UL;
+            break;
+        case 'k':
+            only = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-d ms per case] [-k rsa2048|rsa4096|p256|ed25519|p256+rsa2048]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (nr_threads < 1 || nr_threads > MAX_THREADS || run_ns == 0)
+    {
+        fprintf(stderr, "Threads must be within 1-%d and the duration positive\n", MAX_THREADS);
+        return EXIT_FAILURE;
+    }
+
+    for (k = 0; only != NULL && k < sizeof(keys) / sizeof(keys[0]); k++)
+        if (strcmp(only, keys[k]) == 0)
+            break;
+    if (k == sizeof(keys) / sizeof(keys[0]))
+    {
+        fprintf(stderr, "Unknown key %s\n", only);
+        return EXIT_FAILURE;
+    }
+
+    if (bench_scratch_open(work_dir) != 0)
+    {
+        fprintf(stderr, "Unable to create %s\n", work_dir);
+        return EXIT_FAILURE;
+    }
+
+    for (k = 0; k < sizeof(keys) / sizeof(keys[0]); k++)
+    {
+        if (only != NULL && strcmp(only, keys[k]) != 0)
+            continue;
+
+        if (setup_server(keys[k]) != 0)
+        {
+            fprintf(stderr, "%s: unable to set up the server\n", keys[k]);
+            ERR_print_errors_fp(stderr);
+            bench_scratch_close(work_dir);
+            return EXIT_FAILURE;
+        }
+
+        for (v = 0; v < sizeof(versions) / sizeof(versions[0]); v++)
+        {
+            run_case(keys[k], versions[v], false, false, nr_threads, run_ns);
+            run_case(keys[k], versions[v], true, false, nr_threads, run_ns);
+            // Clients that can't verify the cheaper chain still get in
+            if (strchr(keys[k], '+') != NULL)
+                run_case(keys[k], versions[v], false, true, nr_threads, run_ns);
+        }
+        SSL_CTX_free(g_ssl_ctx);
+        g_ssl_ctx = NULL;
+    }
+
+    bench_scratch_close(work_dir);
+    return EXIT_SUCCESS;
+}
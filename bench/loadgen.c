@@ -0,0 +1,963 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * HTTPS load generator for legion or any HTTP/1.1
+ * TLS server. Every thread runs its own epoll loop and SSL_CTX over
+ * its share of the connections.
+ *
+ * Usage: loadgen [-h host] [-p port] [-c connections] [-t threads]
+ *                [-d seconds] [-u path | -U url file] [-P depth]
+ *                [-r requests/s] [-n] [-H] [-R] [-j json file]
+ *   -n  new connection per request instead of keep-alive
+ *   -H  handshake only, connect, handshake, close, repeat
+ *   -R  resume TLS sessions on reconnect
+ *   -r  open loop at a fixed total rate, latency is counted from
+ *       when a request was due so a slow server can't hide queueing
+ *
+ * Pipelined requests go out as separate TLS records, legion reads
+ * one request per record. Prints a text summary and one JSON object.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define MAX_THREADS     64
+#define MAX_PIPELINE    64
+#define MAX_URLS        1024
+#define MAX_EVENTS      256
+#define IN_BUF_SIZE     16384
+#define REQ_SIZE        512
+// Connections with requests outstanding this long are dropped
+#define STALL_NS        (5 * 1000000000UL)
+#define TICK_MS         1
+
+// Log-linear histogram, 2^HIST_SUB_BITS buckets per power of two ns
+#define HIST_SUB_BITS   5
+#define HIST_MAX_EXP    40
+#define HIST_BUCKETS    ((HIST_MAX_EXP - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
+
+typedef enum
+{
+    CONN_IDLE = 0,
+    CONN_CONNECTING,
+    CONN_HANDSHAKE,
+    // Handshake only with -R on TLS 1.3, waiting for a fresh ticket
+    // since OpenSSL clients use every TLS 1.3 ticket only once
+    CONN_TICKET,
+    CONN_READY
+} lg_state;
+
+typedef struct
+{
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+    unsigned long buckets[HIST_BUCKETS];
+} histogram;
+
+typedef struct
+{
+    int fd;
+    SSL *ssl;
+    lg_state state;
+    unsigned int events;
+    size_t url;
+    size_t served;
+    // Requests written or waiting to be, and responses still owed
+    size_t to_write;
+    size_t inflight;
+    unsigned long due[MAX_PIPELINE];
+    size_t due_head;
+    unsigned long next_due;
+    unsigned long opened_ns;
+    unsigned long active_ns;
+    long body_left;
+    int status;
+    // Server announced Connection: close, what is still in flight is lost
+    bool closing;
+    size_t in_len;
+    char in[IN_BUF_SIZE];
+} lg_conn;
+
+typedef struct
+{
+    pthread_t thread;
+    int epoll_fd;
+    SSL_CTX *ctx;
+    SSL_SESSION *session;
+    lg_conn *conns;
+    size_t nr_conns;
+    // Index of the first connection across all threads
+    size_t first;
+    unsigned long interval_ns;
+    unsigned long requests;
+    unsigned long handshakes_full;
+    unsigned long handshakes_resumed;
+    unsigned long bytes;
+    unsigned long status_2xx;
+    unsigned long status_4xx;
+    unsigned long status_5xx;
+    unsigned long errors;
+    histogram latency;
+    histogram handshake;
+} lg_thread;
+
+typedef struct
+{
+    const char *host;
+    const char *port;
+    size_t connections;
+    size_t threads;
+    unsigned long duration_s;
+    size_t depth;
+    double rate;
+    bool keep_alive;
+    bool handshake_only;
+    bool resume;
+    const char *json_file;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+} lg_config;
+
+static lg_config cfg;
+static char *urls[MAX_URLS];
+static char requests[MAX_URLS][REQ_SIZE];
+static size_t request_len[MAX_URLS];
+static size_t nr_urls = 0;
+static unsigned long start_ns = 0;
+static unsigned long stop_ns = 0;
+
+static unsigned long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+static void hist_add(histogram *hist, unsigned long ns)
+{
+    int exp = 0;
+    size_t bucket = 0;
+
+    if (ns < (1UL << HIST_SUB_BITS))
+    {
+        bucket = ns;
+    }
+    else
+    {
+        exp = 63 - __builtin_clzl(ns);
+        if (exp > HIST_MAX_EXP)
+            exp = HIST_MAX_EXP;
+        bucket = ((size_t)(exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+                 ((ns >> (exp - HIST_SUB_BITS)) & ((1UL << HIST_SUB_BITS) - 1));
+    }
+
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum += ns;
+    if (ns > hist->max)
+        hist->max = ns;
+}
+
+static void hist_merge(histogram *into, const histogram *from)
+{
+    size_t i = 0;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        into->buckets[i] += from->buckets[i];
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+/**
+ * Value at quantile q in ns, the middle of the bucket it falls in
+ */
+static double hist_quantile(const histogram *hist, double q)
+{
+    size_t i = 0;
+    size_t exp = 0;
+    unsigned long seen = 0;
+    unsigned long low = 0;
+    unsigned long width = 0;
+
+    if (hist->count == 0)
+        return 0;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if ((double)seen >= q * (double)hist->count)
+            break;
+    }
+
+    if (i < (1UL << HIST_SUB_BITS))
+        return (double)i;
+
+    exp = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    width = 1UL << (exp - HIST_SUB_BITS);
+    low = ((1UL << HIST_SUB_BITS) + (i & ((1UL << HIST_SUB_BITS) - 1))) << (exp - HIST_SUB_BITS);
+    return (double)low + (double)width / 2;
+}
+
+/**
+ * Keeps the newest session of the thread for -R,
+ * TLS 1.3 tickets only show up after the handshake
+ */
+static int new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+    lg_thread *th = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    if (th->session != NULL)
+        SSL_SESSION_free(th->session);
+    th->session = session;
+    return 1;
+}
+
+static void set_events(lg_thread *th, lg_conn *conn, unsigned int events)
+{
+    struct epoll_event ev;
+
+    if (conn->events == events)
+        return;
+
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(th->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->events = events;
+}
+
+static void conn_close(lg_conn *conn)
+{
+    if (conn->ssl != NULL)
+    {
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+    }
+    if (conn->fd >= 0)
+    {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->state = CONN_IDLE;
+    conn->to_write = 0;
+    conn->inflight = 0;
+    conn->served = 0;
+    conn->in_len = 0;
+    conn->body_left = -1;
+    conn->closing = false;
+}
+
+static void conn_fail(lg_thread *th, lg_conn *conn)
+{
+    th->errors++;
+    // SSL_get_error would report leftovers for the next connection
+    ERR_clear_error();
+    conn_close(conn);
+}
+
+static void conn_open(lg_thread *th, lg_conn *conn);
+
+/**
+ * Connection finished its job, in closed loop the next one starts
+ * right away, otherwise the tick opens it once it is due
+ */
+static void conn_recycle(lg_thread *th, lg_conn *conn)
+{
+    // Without close_notify OpenSSL marks the session as not resumable
+    if (conn->ssl != NULL)
+        SSL_shutdown(conn->ssl);
+    conn_close(conn);
+    if (th->interval_ns == 0 && now_ns() < stop_ns)
+        conn_open(th, conn);
+}
+
+/**
+ * Starts a non blocking connect, the handshake
+ * follows once the socket is writable
+ */
+static void conn_open(lg_thread *th, lg_conn *conn)
+{
+    int one = 1;
+    struct epoll_event ev;
+
+    conn->fd = socket(cfg.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0)
+    {
+        th->errors++;
+        return;
+    }
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn->opened_ns = now_ns();
+    conn->active_ns = conn->opened_ns;
+    if (connect(conn->fd, (struct sockaddr *)&cfg.addr, cfg.addr_len) != 0 && errno != EINPROGRESS)
+    {
+        conn_fail(th, conn);
+        return;
+    }
+
+    conn->state = CONN_CONNECTING;
+    conn->events = EPOLLOUT;
+    ev.events = conn->events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(th->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) != 0)
+        conn_fail(th, conn);
+}
+
+/**
+ * Queues every request that is due and fits in the pipeline
+ */
+static void queue_requests(lg_thread *th, lg_conn *conn, unsigned long now)
+{
+    while (conn->inflight < cfg.depth && now < stop_ns && conn->closing == false)
+    {
+        // Without keep-alive each connection carries one request
+        if (cfg.keep_alive == false && conn->served + conn->inflight > 0)
+            break;
+
+        if (th->interval_ns > 0)
+        {
+            if (conn->next_due > now)
+                break;
+            conn->due[(conn->due_head + conn->inflight) % MAX_PIPELINE] = conn->next_due;
+            conn->next_due += th->interval_ns;
+        }
+        else
+        {
+            conn->due[(conn->due_head + conn->inflight) % MAX_PIPELINE] = now;
+        }
+        conn->inflight++;
+        conn->to_write++;
+    }
+}
+
+/**
+ * Writes queued requests one TLS record each, returns -1 on error
+ */
+static int flush_requests(lg_thread *th, lg_conn *conn)
+{
+    int ret = 0;
+    size_t url = 0;
+
+    while (conn->to_write > 0)
+    {
+        url = conn->url % nr_urls;
+        ret = SSL_write(conn->ssl, requests[url], (int)request_len[url]);
+        if (ret <= 0)
+        {
+            if (SSL_get_error(conn->ssl, ret) == SSL_ERROR_WANT_WRITE)
+            {
+                set_events(th, conn, EPOLLIN | EPOLLOUT);
+                return 0;
+            }
+            return -1;
+        }
+        conn->url++;
+        conn->to_write--;
+    }
+    set_events(th, conn, EPOLLIN);
+    return 0;
+}
+
+/**
+ * Response header complete, picks the status and body length
+ * Returns the header length, 0 if incomplete, -1 if malformed
+ */
+static long parse_response(lg_conn *conn)
+{
+    char *end = NULL;
+    char *field = NULL;
+
+    end = memmem(conn->in, conn->in_len, "\r\n\r\n", 4);
+    if (end == NULL)
+        return (conn->in_len == IN_BUF_SIZE) ? -1 : 0;
+
+    *end = '\0';
+    if (sscanf(conn->in, "HTTP/1.%*d %d", &conn->status) != 1)
+        return -1;
+
+    conn->body_left = 0;
+    for (field = strstr(conn->in, "\r\n"); field != NULL; field = strstr(field + 2, "\r\n"))
+    {
+        if (strncasecmp(field + 2, "content-length:", 15) == 0)
+            conn->body_left = strtol(field + 17, NULL, 10);
+        else if (strncasecmp(field + 2, "connection: close", 17) == 0)
+            conn->closing = true;
+    }
+    return end + 4 - conn->in;
+}
+
+static void response_done(lg_thread *th, lg_conn *conn, unsigned long now)
+{
+    if (conn->status >= 200 && conn->status < 300)
+        th->status_2xx++;
+    else if (conn->status >= 400 && conn->status < 500)
+        th->status_4xx++;
+    else
+        th->status_5xx++;
+
+    hist_add(&th->latency, now - conn->due[conn->due_head]);
+    conn->due_head = (conn->due_head + 1) % MAX_PIPELINE;
+    conn->inflight--;
+    conn->served++;
+    th->requests++;
+    conn->body_left = -1;
+}
+
+/**
+ * Consumes whatever SSL has buffered, body bytes are only counted
+ * Returns -1 when the connection has to go
+ */
+static int read_responses(lg_thread *th, lg_conn *conn)
+{
+    int ret = 0;
+    long used = 0;
+    unsigned long now = 0;
+
+    while (1)
+    {
+        ret = SSL_read(conn->ssl, conn->in + conn->in_len, (int)(IN_BUF_SIZE - conn->in_len));
+        if (ret <= 0)
+            return (SSL_get_error(conn->ssl, ret) == SSL_ERROR_WANT_READ) ? 0 : -1;
+
+        now = now_ns();
+        conn->active_ns = now;
+        th->bytes += (unsigned long)ret;
+        conn->in_len += (size_t)ret;
+
+        while (conn->in_len > 0)
+        {
+            if (conn->inflight == 0)
+                return -1;
+
+            if (conn->body_left < 0)
+            {
+                used = parse_response(conn);
+                if (used <= 0)
+                    return (int)used;
+            }
+            else
+            {
+                used = ((size_t)conn->body_left < conn->in_len) ? conn->body_left : (long)conn->in_len;
+                conn->body_left -= used;
+            }
+
+            memmove(conn->in, conn->in + used, conn->in_len - (size_t)used);
+            conn->in_len -= (size_t)used;
+            if (conn->body_left == 0)
+            {
+                response_done(th, conn, now);
+                if (conn->closing)
+                    return -1;
+            }
+        }
+
+        if (cfg.keep_alive == false && conn->served > 0)
+            return -1;
+    }
+}
+
+/**
+ * Runs the connection as far as it can go without blocking
+ */
+static void conn_drive(lg_thread *th, lg_conn *conn, unsigned int events)
+{
+    int ret = 0;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    unsigned long now = now_ns();
+
+    if (conn->state == CONN_CONNECTING)
+    {
+        // Events for an earlier socket on the same fd may still be around
+        if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) == 0)
+            return;
+
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err != 0)
+        {
+            conn_fail(th, conn);
+            return;
+        }
+
+        conn->ssl = SSL_new(th->ctx);
+        if (conn->ssl == NULL)
+        {
+            conn_fail(th, conn);
+            return;
+        }
+        SSL_set_fd(conn->ssl, conn->fd);
+        SSL_set_tlsext_host_name(conn->ssl, cfg.host);
+        if (cfg.resume && th->session != NULL)
+            SSL_set_session(conn->ssl, th->session);
+        conn->state = CONN_HANDSHAKE;
+    }
+
+    if (conn->state == CONN_HANDSHAKE)
+    {
+        ret = SSL_connect(conn->ssl);
+        if (ret != 1)
+        {
+            err = SSL_get_error(conn->ssl, ret);
+            if (err == SSL_ERROR_WANT_READ)
+                set_events(th, conn, EPOLLIN);
+            else if (err == SSL_ERROR_WANT_WRITE)
+                set_events(th, conn, EPOLLOUT);
+            else
+                conn_fail(th, conn);
+            return;
+        }
+
+        now = now_ns();
+        hist_add(&th->handshake, now - conn->opened_ns);
+        if (SSL_session_reused(conn->ssl))
+            th->handshakes_resumed++;
+        else
+            th->handshakes_full++;
+
+        if (cfg.handshake_only)
+        {
+            if (cfg.resume && (th->session == NULL || SSL_SESSION_is_resumable(th->session) == 0))
+            {
+                conn->state = CONN_TICKET;
+                set_events(th, conn, EPOLLIN);
+                return;
+            }
+            th->requests++;
+            conn_recycle(th, conn);
+            return;
+        }
+        conn->state = CONN_READY;
+        events |= EPOLLIN;
+    }
+
+    if (conn->state == CONN_TICKET)
+    {
+        ret = SSL_read(conn->ssl, conn->in, IN_BUF_SIZE);
+        if ((th->session != NULL && SSL_SESSION_is_resumable(th->session)) ||
+            (ret <= 0 && SSL_get_error(conn->ssl, ret) != SSL_ERROR_WANT_READ))
+        {
+            th->requests++;
+            conn_recycle(th, conn);
+        }
+        return;
+    }
+
+    if (events & EPOLLIN)
+    {
+        if (read_responses(th, conn) != 0)
+        {
+            // Expected once the single request of the connection is answered
+            // or the server said it closes, requests past that are dropped
+            if ((conn->closing && conn->body_left < 0) ||
+                (cfg.keep_alive == false && conn->served > 0 && conn->inflight == 0))
+                conn_recycle(th, conn);
+            else
+                conn_fail(th, conn);
+            return;
+        }
+    }
+
+    queue_requests(th, conn, now);
+    if (flush_requests(th, conn) != 0)
+        conn_fail(th, conn);
+}
+
+/**
+ * Runs the periodic work, reopening closed connections, sending what
+ * became due in open loop mode and dropping stalled connections
+ */
+static void tick(lg_thread *th, unsigned long now)
+{
+    size_t i = 0;
+    lg_conn *conn = NULL;
+
+    for (i = 0; i < th->nr_conns; i++)
+    {
+        conn = &th->conns[i];
+        if (conn->state == CONN_IDLE)
+        {
+            // Open loop handshake runs connect at the rate
+            if (cfg.handshake_only && th->interval_ns > 0)
+            {
+                if (conn->next_due > now)
+                    continue;
+                conn->next_due += th->interval_ns;
+            }
+            conn_open(th, conn);
+            continue;
+        }
+
+        if (conn->inflight > 0 && now - conn->active_ns > STALL_NS)
+        {
+            conn_fail(th, conn);
+            continue;
+        }
+
+        if (conn->state == CONN_READY && th->interval_ns > 0 && conn->next_due <= now)
+        {
+            queue_requests(th, conn, now);
+            if (flush_requests(th, conn) != 0)
+                conn_fail(th, conn);
+        }
+    }
+}
+
+static void *run_thread(void *arg)
+{
+    int i = 0;
+    int nfds = 0;
+    size_t c = 0;
+    unsigned long now = 0;
+    unsigned long last_tick = 0;
+    lg_thread *th = (lg_thread *)arg;
+    lg_conn *conn = NULL;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (c = 0; c < th->nr_conns; c++)
+    {
+        conn = &th->conns[c];
+        conn->fd = -1;
+        conn->body_left = -1;
+        conn->url = c;
+        // Spread the connections over one interval
+        conn->next_due = start_ns + th->interval_ns * (th->first + c) / cfg.connections;
+        conn_open(th, conn);
+    }
+
+    while ((now = now_ns()) < stop_ns)
+    {
+        nfds = epoll_wait(th->epoll_fd, events, MAX_EVENTS, TICK_MS);
+        for (i = 0; i < nfds; i++)
+        {
+            conn = (lg_conn *)events[i].data.ptr;
+            if (conn->fd >= 0)
+                conn_drive(th, conn, events[i].events);
+        }
+
+        now = now_ns();
+        if (now - last_tick >= TICK_MS * 1000000UL)
+        {
+            tick(th, now);
+            last_tick = now;
+        }
+    }
+
+    for (c = 0; c < th->nr_conns; c++)
+        conn_close(&th->conns[c]);
+    return NULL;
+}
+
+static int load_urls(const char *file)
+{
+    char line[REQ_SIZE];
+    size_t len = 0;
+    FILE *fp = fopen(file, "r");
+
+    if (fp == NULL)
+    {
+        perror(file);
+        return -1;
+    }
+
+    while (nr_urls < MAX_URLS && fgets(line, sizeof(line), fp) != NULL)
+    {
+        len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+        urls[nr_urls++] = strdup(line);
+    }
+    fclose(fp);
+    return (nr_urls > 0) ? 0 : -1;
+}
+
+static int resolve(const char *host, const char *port)
+{
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0 || res == NULL)
+        return -1;
+
+    memcpy(&cfg.addr, res->ai_addr, res->ai_addrlen);
+    cfg.addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static void report(lg_thread *threads, double elapsed_s)
+{
+    size_t i = 0;
+    FILE *fp = NULL;
+    lg_thread total;
+    const char *mode = cfg.handshake_only ? "handshake" : (cfg.keep_alive ? "keepalive" : "close");
+    char json[1024];
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < cfg.threads; i++)
+    {
+        total.requests += threads[i].requests;
+        total.handshakes_full += threads[i].handshakes_full;
+        total.handshakes_resumed += threads[i].handshakes_resumed;
+        total.bytes += threads[i].bytes;
+        total.status_2xx += threads[i].status_2xx;
+        total.status_4xx += threads[i].status_4xx;
+        total.status_5xx += threads[i].status_5xx;
+        total.errors += threads[i].errors;
+        hist_merge(&total.latency, &threads[i].latency);
+        hist_merge(&total.handshake, &threads[i].handshake);
+    }
+    // Handshake only mode measures the handshakes
+    if (cfg.handshake_only)
+        total.latency = total.handshake;
+
+    printf("%s:%s %s, %zu connections, %zu threads, pipeline %zu, %s, %.1fs\n",
+           cfg.host, cfg.port, mode, cfg.connections, cfg.threads, cfg.depth,
+           (cfg.rate > 0) ? "open loop" : "closed loop", elapsed_s);
+    if (cfg.rate > 0)
+        printf("  target      %.0f/s\n", cfg.rate);
+    printf("  %-11s %lu, %.1f/s\n", cfg.handshake_only ? "connects" : "requests",
+           total.requests, (double)total.requests / elapsed_s);
+    printf("  handshakes  %lu full, %lu resumed\n", total.handshakes_full, total.handshakes_resumed);
+    printf("  received    %.1f MB, %.1f MB/s\n", (double)total.bytes / 1e6, (double)total.bytes / 1e6 / elapsed_s);
+    printf("  status      2xx %lu, 4xx %lu, 5xx %lu, errors %lu\n",
+           total.status_2xx, total.status_4xx, total.status_5xx, total.errors);
+    printf("  latency us  p50 %.1f, p99 %.1f, p999 %.1f, max %.1f, mean %.1f\n",
+           hist_quantile(&total.latency, 0.5) / 1e3, hist_quantile(&total.latency, 0.99) / 1e3,
+           hist_quantile(&total.latency, 0.999) / 1e3, (double)total.latency.max / 1e3,
+           total.latency.count ? (double)total.latency.sum / (double)total.latency.count / 1e3 : 0.0);
+
+    snprintf(json, sizeof(json),
+             "{\"bench\":\"loadgen\",\"mode\":\"%s\",\"resume\":%s,\"connections\":%zu,\"threads\":%zu,"
+             "\"pipeline\":%zu,\"rate\":%.0f,\"duration_s\":%.2f,\"requests\":%lu,\"rps\":%.1f,"
+             "\"handshakes_full\":%lu,\"handshakes_resumed\":%lu,\"bytes\":%lu,\"status_2xx\":%lu,"
+             "\"status_4xx\":%lu,\"status_5xx\":%lu,\"errors\":%lu,\"latency_us\":{\"p50\":%.1f,"
+             "\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f,\"mean\":%.1f}}\n",
+             mode, cfg.resume ? "true" : "false", cfg.connections, cfg.threads, cfg.depth, cfg.rate,
+             elapsed_s, total.requests, (double)total.requests / elapsed_s,
+             total.handshakes_full, total.handshakes_resumed, total.bytes, total.status_2xx,
+             total.status_4xx, total.status_5xx, total.errors,
+             hist_quantile(&total.latency, 0.5) / 1e3, hist_quantile(&total.latency, 0.99) / 1e3,
+             hist_quantile(&total.latency, 0.999) / 1e3, (double)total.latency.max / 1e3,
+             total.latency.count ? (double)total.latency.sum / (double)total.latency.count / 1e3 : 0.0);
+    printf("%s", json);
+
+    if (cfg.json_file != NULL)
+    {
+        fp = fopen(cfg.json_file, "w");
+        if (fp == NULL)
+        {
+            perror(cfg.json_file);
+            return;
+        }
+        fputs(json, fp);
+        fclose(fp);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-t threads] [-d seconds] "
+                    "[-u path | -U url file] [-P depth] [-r requests/s] [-n] [-H] [-R] [-j json file]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt = 0;
+    size_t i = 0;
+    size_t share = 0;
+    const char *url_file = NULL;
+    const char *path = "/index.html";
+    unsigned long end_ns = 0;
+    static lg_thread threads[MAX_THREADS];
+
+    cfg.host = "127.0.0.1";
+    cfg.port = "8443";
+    cfg.connections = 16;
+    cfg.threads = 2;
+    cfg.duration_s = 10;
+    cfg.depth = 1;
+    cfg.keep_alive = true;
+
+    while ((opt = getopt(argc, argv, "h:p:c:t:d:u:U:P:r:nHRj:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            cfg.host = optarg;
+            break;
+        case 'p':
+            cfg.port = optarg;
+            break;
+        case 'c':
+            cfg.connections = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            cfg.threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            cfg.duration_s = strtoul(optarg, NULL, 10);
+            break;
+        case 'u':
+            path = optarg;
+            break;
+        case 'U':
+            url_file = optarg;
+            break;
+        case 'P':
+            cfg.depth = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            cfg.rate = strtod(optarg, NULL);
+            break;
+        case 'n':
+            cfg.keep_alive = false;
+            break;
+        case 'H':
+            cfg.handshake_only = true;
+            break;
+        case 'R':
+            cfg.resume = true;
+            break;
+        case 'j':
+            cfg.json_file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (cfg.threads == 0 || cfg.threads > MAX_THREADS || cfg.connections < cfg.threads ||
+        cfg.depth == 0 || cfg.depth > MAX_PIPELINE || cfg.duration_s == 0 || cfg.rate < 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (cfg.keep_alive == false)
+        cfg.depth = 1;
+
+    if (url_file != NULL)
+    {
+        if (load_urls(url_file) != 0)
+            return EXIT_FAILURE;
+    }
+    else
+    {
+        urls[nr_urls++] = strdup(path);
+    }
+
+    for (i = 0; i < nr_urls; i++)
+    {
+        request_len[i] = (size_t)snprintf(requests[i], REQ_SIZE, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                                          urls[i], cfg.host, cfg.keep_alive ? "keep-alive" : "close");
+        if (request_len[i] >= REQ_SIZE)
+        {
+            fprintf(stderr, "URL too long: %s\n", urls[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (resolve(cfg.host, cfg.port) != 0)
+    {
+        fprintf(stderr, "Unable to resolve %s:%s\n", cfg.host, cfg.port);
+        return EXIT_FAILURE;
+    }
+
+    // Servers closing mid pipeline show up as write errors instead
+    signal(SIGPIPE, SIG_IGN);
+    start_ns = now_ns();
+    stop_ns = start_ns + cfg.duration_s * 1000000000UL;
+    for (i = 0; i < cfg.threads; i++)
+    {
+        // Connections are split as evenly as possible
+        share = cfg.connections / cfg.threads + ((i < cfg.connections % cfg.threads) ? 1 : 0);
+        threads[i].nr_conns = share;
+        threads[i].first = (i == 0) ? 0 : threads[i - 1].first + threads[i - 1].nr_conns;
+        threads[i].conns = calloc(share, sizeof(lg_conn));
+        threads[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        threads[i].ctx = SSL_CTX_new(TLS_client_method());
+        // Every connection sends its share of the rate
+        if (cfg.rate > 0)
+            threads[i].interval_ns = (unsigned long)(1e9 * (double)cfg.connections / cfg.rate);
+        if (threads[i].conns == NULL || threads[i].epoll_fd < 0 || threads[i].ctx == NULL)
+        {
+            fprintf(stderr, "Unable to set up thread %zu\n", i);
+            return EXIT_FAILURE;
+        }
+
+        SSL_CTX_set_verify(threads[i].ctx, SSL_VERIFY_NONE, NULL);
+        SSL_CTX_set_app_data(threads[i].ctx, &threads[i]);
+        SSL_CTX_set_session_cache_mode(threads[i].ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(threads[i].ctx, new_session_cb);
+
+        if (pthread_create(&threads[i].thread, NULL, run_thread, &threads[i]) != 0)
+        {
+            fprintf(stderr, "Unable to start thread %zu\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < cfg.threads; i++)
+        pthread_join(threads[i].thread, NULL);
+    end_ns = now_ns();
+
+    report(threads, (double)(end_ns - start_ns) / 1e9);
+
+    for (i = 0; i < cfg.threads; i++)
+    {
+        if (threads[i].session != NULL)
+            SSL_SESSION_free(threads[i].session);
+        SSL_CTX_free(threads[i].ctx);
+        close(threads[i].epoll_fd);
+        free(threads[i].conns);
+    }
+    for (i = 0; i < nr_urls; i++)
+        free(urls[i]);
+    return EXIT_SUCCESS;
+}
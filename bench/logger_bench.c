@@ -0,0 +1,143 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Cost of one LOG_INFO on the calling thread in text and binary mode,
+ * and of a LOG_DEBUG below the enabled level, against the synchronous
+ * logline it replaced, which is kept below as the baseline. Lines are logged in
+ * bursts that fit the thread's ring with pauses for the flusher, so
+ * only the caller side is timed. Writes to the regular log files.
+ * Prints one JSON object per result line.
+ */
+
+#include "logger.h"
+
+#define BURSTS      200
+#define BURST_LINES (LOG_RING_SLOTS / 2)
+#define PAUSE_NS    (4 * LOG_FLUSH_MIN_MS * 1000000L)
+#define SYNC_LOG_FILE "/tmp/legion_bench_sync.log"
+
+static int g_sync_fd = -1;
+
+static unsigned long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+/**
+ * Baseline: formats the timestamp and the line and
+ * writes it out on the calling thread
+ */
+static void sync_logline(const char *prefix, const char *fmt, ...)
+{
+    va_list args;
+    size_t buf_len = 0;
+    time_t time_epoch = 0;
+    struct tm time_local;
+    char buffer[LOG_SIZE];
+
+    time(&time_epoch);
+    if (localtime_r(&time_epoch, &time_local) == NULL)
+        return;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+    buf_len = strftime(buffer, 40, prefix, &time_local);
+    va_start(args, fmt);
+    buf_len += (size_t)vsnprintf(buffer + buf_len, LOG_SIZE - buf_len - 1, fmt, args);
+    va_end(args);
+#pragma GCC diagnostic pop
+
+    if (write(g_sync_fd, buffer, buf_len) < 0)
+        perror("sync_logline: write");
+}
+
+static void run_sync()
+{
+    int i = 0;
+    int j = 0;
+    unsigned long start = 0;
+    unsigned long elapsed = 0;
+    struct timespec pause = {0, PAUSE_NS};
+
+    g_sync_fd = open(SYNC_LOG_FILE, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (g_sync_fd < 0)
+        return;
+
+    for (i = 0; i < BURSTS; i++)
+    {
+        start = now_ns();
+        for (j = 0; j < BURST_LINES; j++)
+            sync_logline("[INFO] [%Y-%m-%d %H:%M:%S] ", "%s /%s on client_fd: %d\n", "GET", "assets/index.html", j);
+        elapsed += now_ns() - start;
+        nanosleep(&pause, NULL);
+    }
+    close(g_sync_fd);
+    unlink(SYNC_LOG_FILE);
+
+    printf("{\"bench\":\"logline\",\"mode\":\"sync\",\"lines\":%d,\"ns_per_line\":%.1f}\n",
+           BURSTS * BURST_LINES, (double)elapsed / (BURSTS * BURST_LINES));
+}
+
+static void run_mode(const char *name, log_mode mode, bool debug_line)
+{
+    int i = 0;
+    int j = 0;
+    unsigned long start = 0;
+    unsigned long elapsed = 0;
+    struct timespec pause = {0, PAUSE_NS};
+
+    if (init_logging(mode, LOG_LEVEL_INFO) != 0)
+        return;
+
+    for (i = 0; i < BURSTS; i++)
+    {
+        start = now_ns();
+        for (j = 0; j < BURST_LINES; j++)
+        {
+            // Same shape as the per request line in process_get_request
+            if (debug_line)
+                LOG_DEBUG("%s /%s on client_fd: %d", "GET", "assets/index.html", j);
+            else
+                LOG_INFO("%s /%s on client_fd: %d", "GET", "assets/index.html", j);
+        }
+        elapsed += now_ns() - start;
+        nanosleep(&pause, NULL);
+    }
+    stop_logging();
+
+    printf("{\"bench\":\"logline\",\"mode\":\"%s\",\"lines\":%d,\"ns_per_line\":%.1f}\n",
+           name, BURSTS * BURST_LINES, (double)elapsed / (BURSTS * BURST_LINES));
+}
+
+int main()
+{
+    run_sync();
+    run_mode("text", LOG_MODE_TEXT, false);
+    run_mode("binary", LOG_MODE_BINARY, false);
+    run_mode("debug_disabled", LOG_MODE_BINARY, true);
+    return EXIT_SUCCESS;
+}
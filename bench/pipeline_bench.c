@@ -0,0 +1,452 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Socketless benchmark of the request path. handle_http_request() runs
+ * over an in-memory BIO pair against a cache built by initiate_cache()
+ * from generated assets, the client end of every connection lives in
+ * the same thread and replays a canned request stream. Reported are the
+ * server side ns/request and the malloc family calls and bytes made
+ * while server code runs, OpenSSL's included. OpenSSL allocates from
+ * the server's buffer pool as it does in the server, so once warm the
+ * count should stay at 0. Handshakes and client work are left out of
+ * both. Prints one JSON object per scenario.
+ *
+ * Usage: bench_pipeline [-d ms per scenario] [-s scenario] [-L]
+ *   -L  logs at the server's default level to /tmp/legion.log
+ */
+
+#define _GNU_SOURCE
+#include "bench_util.h"
+
+#include <sys/eventfd.h>
+
+#define RUN_MS_DEFAULT   1000
+#define WARMUP_REQUESTS  1000
+#define CLIENT_BUF_SIZE  16384
+#define SMALL_ASSET_SIZE 1024
+#define LARGE_ASSET_SIZE (256 * 1024)
+#define MAX_DEPTH        16
+// Cookie of the large_header scenario, past the first read's BUFFER_SIZE
+#define LARGE_COOKIE     (8 * 1024)
+#define REQUEST_SIZE     (LARGE_COOKIE + 512)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+// Only calls made while the server code runs on this thread count
+static __thread bool counting = false;
+static __thread unsigned long alloc_calls = 0;
+static __thread unsigned long alloc_bytes = 0;
+
+void *malloc(size_t size)
+{
+    if (counting)
+    {
+        alloc_calls++;
+        alloc_bytes += size;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (counting)
+    {
+        alloc_calls++;
+        alloc_bytes += nmemb * size;
+    }
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (counting)
+    {
+        alloc_calls++;
+        alloc_bytes += size;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+typedef struct
+{
+    const char *name;
+    const char *path;
+    bool is_head;
+    // Requests written back to back before the server runs
+    int depth;
+    // Bytes of Cookie header sent along
+    int cookie_len;
+} scenario;
+
+static const scenario scenarios[] = {
+    {"get_small", "/index.html", false, 1, 0},
+    {"head_small", "/index.html", true, 1, 0},
+    {"get_large", "/large.bin", false, 1, 0},
+    {"pipeline_8", "/index.html", false, 8, 0},
+    // Read in pieces into a pooled request buffer
+    {"large_header", "/index.html", false, 1, LARGE_COOKIE},
+    // Answered with Connection: close, every request pays the teardown
+    {"not_found", "/missing.html", false, 1, 0},
+};
+
+typedef struct
+{
+    int fd;
+    SSL *client;
+    // Server half, referenced so it outlives the server's SSL_free
+    BIO *server_bio;
+    client_info *cinfo;
+    // Response parsing on the client end
+    size_t in_len;
+    long body_left;
+    bool closing;
+    char in[CLIENT_BUF_SIZE];
+} bench_conn;
+
+typedef struct
+{
+    unsigned long requests;
+    unsigned long server_ns;
+    unsigned long calls;
+    unsigned long allocs;
+    unsigned long alloc_bytes;
+    unsigned long errors;
+} bench_result;
+
+static SSL_CTX *client_ctx = NULL;
+static char work_dir[] = "/tmp/legion_pipeline.XXXXXX";
+
+/**
+ * Builds the assets, certificate and both TLS contexts
+ * in a scratch directory
+ */
+static int setup(bool logging)
+{
+    int ret = 0;
+    EVP_PKEY *key = NULL;
+
+    // Before OpenSSL allocates anything
+    init_tls_memory();
+    if (bench_scratch_open(work_dir) != 0)
+        return -1;
+
+    key = EVP_EC_gen("P-256");
+    ret = bench_write_cert("cert.pem", "key.pem", key);
+    EVP_PKEY_free(key);
+    if (ret != 0 ||
+        bench_write_asset(INDEX_PAGE, SMALL_ASSET_SIZE) != 0 ||
+        bench_write_asset("large.bin", LARGE_ASSET_SIZE) != 0 ||
+        bench_write_asset(ERROR_404_PAGE, SMALL_ASSET_SIZE) != 0 ||
+        bench_write_asset(ERROR_500_PAGE, SMALL_ASSET_SIZE) != 0)
+        return -1;
+
+    if (logging && init_logging(LOG_MODE_TEXT, LOG_LEVEL_INFO) != 0)
+        return -1;
+
+    if (init_openssl_context((const char *[]){"cert.pem"}, (const char *[]){"key.pem"}, 1) != 0 || initiate_cache(DEFAULT_ASSET_PATH) == 0)
+        return -1;
+
+    client_ctx = bench_client_ctx();
+    if (client_ctx == NULL)
+        return -1;
+
+    // Parked connections are re-armed here like on the epoll engine
+    g_epoll_fd = epoll_create1(0);
+    init_client_list();
+    return (g_epoll_fd < 0) ? -1 : 0;
+}
+
+static void teardown()
+{
+    release_cache();
+    cleanup_client_list();
+    SSL_CTX_free(client_ctx);
+    SSL_CTX_free(g_ssl_ctx);
+    close(g_epoll_fd);
+    stop_logging();
+    bench_scratch_close(work_dir);
+}
+
+static void conn_close(bench_conn *conn)
+{
+    // The server may have released its end already
+    if (conn->cinfo != NULL && conn->cinfo->fd >= 0)
+        remove_client_info(conn->cinfo);
+    conn->cinfo = NULL;
+    SSL_free(conn->client);
+    conn->client = NULL;
+    BIO_free(conn->server_bio);
+    conn->server_bio = NULL;
+}
+
+/**
+ * Hands the server end of a fresh TLS pair to the client list
+ * under an eventfd standing in for the socket
+ */
+static int conn_open(bench_conn *conn)
+{
+    SSL *server = NULL;
+    struct epoll_event ev;
+
+    memset(conn, 0, sizeof(*conn));
+    conn->body_left = -1;
+    if (bench_tls_pair(g_ssl_ctx, client_ctx, &server, &conn->client, &conn->server_bio) != 0)
+        return -1;
+
+    conn->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.fd = conn->fd;
+    if (conn->fd < 0 || epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) != 0 ||
+        add_client_info(conn->fd, server, -1) != 0)
+        goto err;
+    conn->cinfo = get_client_info(conn->fd);
+    return 0;
+
+err:
+    SSL_free(server);
+    if (conn->fd >= 0)
+        close(conn->fd);
+    conn_close(conn);
+    return -1;
+}
+
+/**
+ * Reads whatever the server produced, returns the number of complete
+ * responses or -1 if the stream is broken
+ */
+static int drain_responses(bench_conn *conn, bool is_head)
+{
+    int ret = 0;
+    int done = 0;
+    long used = 0;
+    char *end = NULL;
+    char *field = NULL;
+
+    while ((ret = SSL_read(conn->client, conn->in + conn->in_len, (int)(CLIENT_BUF_SIZE - conn->in_len - 1))) > 0)
+    {
+        conn->in_len += (size_t)ret;
+        while (conn->in_len > 0)
+        {
+            if (conn->body_left < 0)
+            {
+                conn->in[conn->in_len] = '\0';
+                end = strstr(conn->in, "\r\n\r\n");
+                if (end == NULL)
+                    break;
+
+                conn->body_left = 0;
+                for (field = strstr(conn->in, "\r\n"); field < end; field = strstr(field + 2, "\r\n"))
+                {
+                    if (strncasecmp(field + 2, "Content-Length:", 15) == 0 && is_head == false)
+                        conn->body_left = strtol(field + 17, NULL, 10);
+                    else if (strncasecmp(field + 2, "Connection: close", 17) == 0)
+                        conn->closing = true;
+                }
+                used = end + 4 - conn->in;
+            }
+            else
+            {
+                used = ((size_t)conn->body_left < conn->in_len) ? conn->body_left : (long)conn->in_len;
+                conn->body_left -= used;
+            }
+
+            memmove(conn->in, conn->in + used, conn->in_len - (size_t)used);
+            conn->in_len -= (size_t)used;
+            if (conn->body_left == 0)
+            {
+                conn->body_left = -1;
+                done++;
+            }
+        }
+    }
+
+    ret = SSL_get_error(conn->client, ret);
+    if (ret != SSL_ERROR_WANT_READ && ret != SSL_ERROR_ZERO_RETURN)
+        return -1;
+    return done;
+}
+
+/**
+ * Runs the server on one burst of requests until every response is in,
+ * the way a worker would on each readiness event
+ */
+static int serve_burst(bench_conn *conn, const scenario *sc, const char *request, int req_len, bench_result *res)
+{
+    int i = 0;
+    int done = 0;
+    int ret = 0;
+    unsigned long start = 0;
+
+    for (i = 0; i < sc->depth; i++)
+    {
+        if (SSL_write(conn->client, request, req_len) != req_len)
+            return -1;
+    }
+
+    while (done < sc->depth)
+    {
+        if (conn->cinfo == NULL || conn->cinfo->fd < 0)
+            return -1;
+
+        start = bench_now_ns();
+        counting = true;
+        handle_http_request(conn->cinfo);
+        counting = false;
+        res->server_ns += bench_now_ns() - start;
+        res->calls++;
+
+        ret = drain_responses(conn, sc->is_head);
+        if (ret < 0)
+            return -1;
+        done += ret;
+    }
+    return done;
+}
+
+static void run_scenario(const scenario *sc, unsigned long run_ns)
+{
+    int ret = 0;
+    int req_len = 0;
+    unsigned long served = 0;
+    unsigned long end = 0;
+    static char cookie[LARGE_COOKIE + 1];
+    static char request[REQUEST_SIZE];
+    bench_conn conn;
+    bench_result res;
+
+    memset(cookie, 'c', (size_t)sc->cookie_len);
+    cookie[sc->cookie_len] = '\0';
+    req_len = snprintf(request, sizeof(request),
+                       "%s %s HTTP/1.1\r\nHost: localhost\r\n%s%s%sConnection: keep-alive\r\n\r\n",
+                       sc->is_head ? "HEAD" : "GET", sc->path, sc->cookie_len ? "Cookie: id=" : "", cookie,
+                       sc->cookie_len ? "\r\n" : "");
+    memset(&res, 0, sizeof(res));
+    if (conn_open(&conn) != 0)
+    {
+        fprintf(stderr, "%s: unable to set up a connection\n", sc->name);
+        return;
+    }
+
+    end = 0;
+    while (end == 0 || bench_now_ns() < end)
+    {
+        // Connection: close responses end the connection, reopening is not timed
+        if (conn.cinfo == NULL || conn.cinfo->fd < 0 || conn.closing)
+        {
+            conn_close(&conn);
+            if (conn_open(&conn) != 0)
+            {
+                res.errors++;
+                break;
+            }
+        }
+
+        ret = serve_burst(&conn, sc, request, req_len, &res);
+        if (ret < 0)
+        {
+            res.errors++;
+            conn.closing = true;
+            continue;
+        }
+
+        served += (unsigned long)ret;
+        res.requests += (unsigned long)ret;
+        if (end == 0 && served >= WARMUP_REQUESTS)
+        {
+            // Warm up done, caches and OpenSSL buffers are in place
+            memset(&res, 0, sizeof(res));
+            alloc_calls = 0;
+            alloc_bytes = 0;
+            end = bench_now_ns() + run_ns;
+        }
+    }
+    conn_close(&conn);
+
+    res.allocs = alloc_calls;
+    res.alloc_bytes = alloc_bytes;
+    if (res.requests == 0)
+        res.requests = 1;
+    printf("{\"bench\":\"pipeline\",\"scenario\":\"%s\",\"requests\":%lu,\"ns_per_request\":%.1f,"
+           "\"calls_per_request\":%.2f,\"allocs_per_request\":%.2f,\"alloc_bytes_per_request\":%.1f,\"errors\":%lu}\n",
+           sc->name, res.requests, (double)res.server_ns / (double)res.requests,
+           (double)res.calls / (double)res.requests, (double)res.allocs / (double)res.requests,
+           (double)res.alloc_bytes / (double)res.requests, res.errors);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt = 0;
+    size_t i = 0;
+    size_t ran = 0;
+    bool logging = false;
+    const char *only = NULL;
+    unsigned long run_ms = RUN_MS_DEFAULT;
+
+    while ((opt = getopt(argc, argv, "d:s:L")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            run_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            only = optarg;
+            break;
+        case 'L':
+            logging = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d ms per scenario] [-s scenario] [-L]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (setup(logging) != 0)
+    {
+        fprintf(stderr, "Unable to set up the harness in %s\n", work_dir);
+        ERR_print_errors_fp(stderr);
+        teardown();
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+    {
+        if (only == NULL || strcmp(only, scenarios[i].name) == 0)
+        {
+            run_scenario(&scenarios[i], run_ms * 1000000UL);
+            ran++;
+        }
+    }
+
+    teardown();
+    if (ran == 0)
+    {
+        fprintf(stderr, "Unknown scenario %s\n", only);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,375 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Throughput and latency of lib/threadpool against the single
+ * mutex + condvar queue it replaced, which is kept below as the baseline.
+ * Prints one JSON object per result line.
+ */
+
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_TASKS     200000
+#define LATENCY_TASKS   20000
+#define LATENCY_GAP_NS  20000
+#define MAX_PRODUCERS   8
+#define BATCH_SIZE      32
+#define LEGACY_THREADS  16
+#define BULK_TASK_NS    200000
+#define BULK_BACKLOG    32
+#define HOL_PROBES      500
+#define HOL_GAP_NS      2000000
+
+typedef int (*submit_fn)(func_ptr_t f_ptr, void *arg);
+
+static size_t g_done = 0;
+static size_t g_bulk_done = 0;
+static unsigned long *g_latency = NULL;
+
+static unsigned long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+/**
+ * Baseline: the original queue, every submit and every
+ * dequeue goes through qlock and the task_avail condvar
+ */
+static struct
+{
+    pthread_mutex_t qlock;
+    pthread_cond_t task_avail;
+    pthread_t thread_arr[LEGACY_THREADS];
+    th_task queue[TASK_QUEUE_SIZE];
+    size_t queue_len;
+    size_t first;
+    size_t last;
+    bool is_run;
+} g_legacy;
+
+static int legacy_add_task(func_ptr_t f_ptr, void *arg)
+{
+    size_t next = 0;
+
+    pthread_mutex_lock(&g_legacy.qlock);
+    if (g_legacy.queue_len == TASK_QUEUE_SIZE)
+    {
+        pthread_mutex_unlock(&g_legacy.qlock);
+        return -1;
+    }
+    next = (g_legacy.queue_len == 0) ? 0 : (g_legacy.last + 1) % TASK_QUEUE_SIZE;
+    if (g_legacy.queue_len == 0)
+        g_legacy.first = 0;
+
+    g_legacy.queue[next].func = f_ptr;
+    g_legacy.queue[next].arg = arg;
+    g_legacy.last = next;
+    g_legacy.queue_len++;
+    pthread_cond_signal(&g_legacy.task_avail);
+    pthread_mutex_unlock(&g_legacy.qlock);
+    return 0;
+}
+
+static void *legacy_worker(void *arg)
+{
+    th_task task;
+    (void)arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&g_legacy.qlock);
+        while (g_legacy.queue_len == 0 && g_legacy.is_run)
+            pthread_cond_wait(&g_legacy.task_avail, &g_legacy.qlock);
+
+        if (g_legacy.is_run == false)
+            break;
+
+        task = g_legacy.queue[g_legacy.first];
+        g_legacy.first = (g_legacy.first + 1) % TASK_QUEUE_SIZE;
+        g_legacy.queue_len--;
+        pthread_mutex_unlock(&g_legacy.qlock);
+        task.func(task.arg);
+    }
+    pthread_mutex_unlock(&g_legacy.qlock);
+    return NULL;
+}
+
+static int legacy_init()
+{
+    size_t i = 0;
+
+    pthread_mutex_init(&g_legacy.qlock, NULL);
+    pthread_cond_init(&g_legacy.task_avail, NULL);
+    g_legacy.is_run = true;
+    for (i = 0; i < LEGACY_THREADS; i++)
+    {
+        if (pthread_create(&g_legacy.thread_arr[i], NULL, legacy_worker, NULL) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void legacy_stop()
+{
+    size_t i = 0;
+
+    pthread_mutex_lock(&g_legacy.qlock);
+    g_legacy.is_run = false;
+    pthread_cond_broadcast(&g_legacy.task_avail);
+    pthread_mutex_unlock(&g_legacy.qlock);
+
+    for (i = 0; i < LEGACY_THREADS; i++)
+        pthread_join(g_legacy.thread_arr[i], NULL);
+}
+
+/**
+ * Task bodies, the latency one records time spent queued
+ */
+static void noop_task(void *arg)
+{
+    (void)arg;
+    __atomic_add_fetch(&g_done, 1, __ATOMIC_RELAXED);
+}
+
+static void latency_task(void *arg)
+{
+    unsigned long *slot = (unsigned long *)arg;
+    *slot = now_ns() - *slot;
+    __atomic_add_fetch(&g_done, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Stands in for streaming a large file, keeps a worker busy
+ */
+static void bulk_task(void *arg)
+{
+    unsigned long end = now_ns() + BULK_TASK_NS;
+    (void)arg;
+
+    while (now_ns() < end)
+        ;
+    __atomic_add_fetch(&g_bulk_done, 1, __ATOMIC_RELEASE);
+}
+
+static int pool_add_task(func_ptr_t f_ptr, void *arg)
+{
+    return add_task_to_queue(TASK_INTERACTIVE, f_ptr, arg);
+}
+
+typedef struct
+{
+    submit_fn submit;
+    size_t count;
+} producer_arg;
+
+static void *producer(void *arg)
+{
+    size_t i = 0;
+    producer_arg *parg = (producer_arg *)arg;
+
+    for (i = 0; i < parg->count; i++)
+    {
+        while (parg->submit(noop_task, NULL) != 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+/**
+ * Submits like run_https_server does, one add_tasks_batch
+ * per batch of ready connections
+ */
+static void *batch_producer(void *arg)
+{
+    size_t i = 0;
+    size_t sent = 0;
+    th_task batch[BATCH_SIZE];
+    producer_arg *parg = (producer_arg *)arg;
+
+    for (i = 0; i < BATCH_SIZE; i++)
+    {
+        batch[i].func = noop_task;
+        batch[i].arg = NULL;
+    }
+
+    for (i = 0; i < parg->count; i += BATCH_SIZE)
+    {
+        sent = 0;
+        while (sent < BATCH_SIZE)
+        {
+            sent += add_tasks_batch(TASK_INTERACTIVE, batch + sent, BATCH_SIZE - sent);
+            if (sent < BATCH_SIZE)
+                sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void wait_done(size_t target)
+{
+    while (__atomic_load_n(&g_done, __ATOMIC_ACQUIRE) < target)
+        sched_yield();
+}
+
+static void run_throughput(const char *name, submit_fn submit, size_t producers)
+{
+    size_t i = 0;
+    unsigned long start = 0, elapsed = 0;
+    pthread_t threads[MAX_PRODUCERS];
+    producer_arg parg = {submit, BENCH_TASKS / producers};
+
+    // Batches are always submitted whole
+    if (submit == NULL)
+        parg.count -= parg.count % BATCH_SIZE;
+
+    g_done = 0;
+    start = now_ns();
+    for (i = 0; i < producers; i++)
+        pthread_create(&threads[i], NULL, (submit != NULL) ? producer : batch_producer, &parg);
+    for (i = 0; i < producers; i++)
+        pthread_join(threads[i], NULL);
+    wait_done(parg.count * producers);
+    elapsed = now_ns() - start;
+
+    printf("{\"bench\":\"threadpool_throughput\",\"queue\":\"%s\",\"producers\":%lu,"
+           "\"tasks\":%lu,\"ns\":%lu,\"ops_per_sec\":%.0f}\n",
+           name, producers, parg.count * producers, elapsed,
+           (double)(parg.count * producers) * 1e9 / (double)elapsed);
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+static void run_latency(const char *name, submit_fn submit)
+{
+    size_t i = 0;
+    unsigned long next = 0;
+
+    g_done = 0;
+    next = now_ns();
+    for (i = 0; i < LATENCY_TASKS; i++)
+    {
+        // Paced submissions so workers go idle and have to be woken
+        while (now_ns() < next)
+            ;
+        next += LATENCY_GAP_NS;
+
+        g_latency[i] = now_ns();
+        while (submit(latency_task, &g_latency[i]) != 0)
+            sched_yield();
+    }
+    wait_done(LATENCY_TASKS);
+
+    qsort(g_latency, LATENCY_TASKS, sizeof(unsigned long), cmp_ulong);
+    printf("{\"bench\":\"threadpool_latency\",\"queue\":\"%s\",\"tasks\":%d,"
+           "\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu}\n",
+           name, LATENCY_TASKS, g_latency[LATENCY_TASKS / 2],
+           g_latency[LATENCY_TASKS * 99 / 100], g_latency[LATENCY_TASKS * 999 / 1000],
+           g_latency[LATENCY_TASKS - 1]);
+}
+
+/**
+ * Latency of cheap probes while the bulk lane always has BULK_BACKLOG
+ * long tasks queued, with the probes queued behind them in the same
+ * lane and in their own interactive lane
+ */
+static void run_head_of_line(const char *name, task_class probe_class)
+{
+    size_t i = 0;
+    size_t bulk_sent = 0;
+    struct timespec gap = {0, HOL_GAP_NS};
+    thpool_class_stats stats;
+
+    g_done = 0;
+    g_bulk_done = 0;
+    for (i = 0; i < HOL_PROBES; i++)
+    {
+        while (bulk_sent - __atomic_load_n(&g_bulk_done, __ATOMIC_ACQUIRE) < BULK_BACKLOG &&
+               add_task_to_queue(TASK_BULK, bulk_task, NULL) == 0)
+            bulk_sent++;
+
+        g_latency[i] = now_ns();
+        while (add_task_to_queue(probe_class, latency_task, &g_latency[i]) != 0)
+            sched_yield();
+        nanosleep(&gap, NULL);
+    }
+    wait_done(HOL_PROBES);
+    while (__atomic_load_n(&g_bulk_done, __ATOMIC_ACQUIRE) < bulk_sent)
+        sched_yield();
+
+    qsort(g_latency, HOL_PROBES, sizeof(unsigned long), cmp_ulong);
+    threadpool_class_stats(probe_class, &stats);
+    printf("{\"bench\":\"threadpool_head_of_line\",\"probe_lane\":\"%s\",\"probes\":%d,"
+           "\"p50_ns\":%lu,\"p99_ns\":%lu,\"max_ns\":%lu,\"lane_avg_wait_ns\":%lu}\n",
+           name, HOL_PROBES, g_latency[HOL_PROBES / 2], g_latency[HOL_PROBES * 99 / 100],
+           g_latency[HOL_PROBES - 1], (stats.completed > 0) ? stats.wait_ns / stats.completed : 0);
+}
+
+static void run_suite(const char *name, submit_fn submit)
+{
+    size_t producers = 0;
+
+    for (producers = 1; producers <= MAX_PRODUCERS; producers *= 2)
+        run_throughput(name, submit, producers);
+    run_latency(name, submit);
+}
+
+int main()
+{
+    size_t producers = 0;
+
+    g_latency = calloc(LATENCY_TASKS, sizeof(unsigned long));
+    if (g_latency == NULL)
+        return EXIT_FAILURE;
+
+    if (legacy_init() != 0)
+        return EXIT_FAILURE;
+    run_suite("mutex", legacy_add_task);
+    legacy_stop();
+
+    // Sized from the machine like the server does
+    if (init_threadpool(NULL) != 0)
+        return EXIT_FAILURE;
+    run_suite("workstealing", pool_add_task);
+    for (producers = 1; producers <= MAX_PRODUCERS; producers *= 2)
+        run_throughput("workstealing_batch", NULL, producers);
+    run_head_of_line("bulk", TASK_BULK);
+    run_head_of_line("interactive", TASK_INTERACTIVE);
+    stop_threadpool();
+
+    free(g_latency);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,133 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define ACCESS_LOG_FILE "/tmp/legion_access.log"
+
+// Records each thread can have pending before new ones are dropped,
+// about 20ms worth at 100k requests/s on one thread. A producer past
+// half full wakes the flusher early, the rest covers write stalls
+#define ACCESS_RING_SLOTS    2048
+#define ACCESS_FLUSH_MIN_MS  2
+#define ACCESS_FLUSH_MAX_MS  100
+// Encoded records are collected up to this size before a write
+#define ACCESS_WRITE_BUFFER  (64 * 1024)
+#define ACCESS_CACHE_LINE    64
+
+// Rotation defaults, 0 disables either limit
+#define ACCESS_LOG_MAX_BYTES (64UL * 1024 * 1024)
+#define ACCESS_LOG_ROTATE_SEC 86400
+
+#define ACCESS_PATH_LEN      86
+#define ACCESS_BINARY_MAGIC  "LEGIONAL"
+#define ACCESS_BINARY_VERSION 1
+
+typedef enum
+{
+    ACCESS_LOG_CSV = 0,
+    // Fixed part of access_record followed by the path bytes
+    ACCESS_LOG_BINARY
+} access_log_format;
+
+typedef enum
+{
+    ACCESS_METHOD_OTHER = 0,
+    ACCESS_METHOD_GET,
+    ACCESS_METHOD_HEAD
+} access_method;
+
+// access_record flags
+#define ACCESS_FLAG_IPV6     0x01
+#define ACCESS_FLAG_RESUMED  0x02
+// Connection went away before the response was sent
+#define ACCESS_FLAG_ABORTED  0x04
+
+/**
+ * One request as handed to the access log. start_ns is CLOCK_MONOTONIC,
+ * the flusher turns it into wall time. In binary files every record is
+ * written up to path followed by path_len bytes of path
+ */
+typedef struct
+{
+    unsigned long start_ns;
+    unsigned long bytes;
+    unsigned int duration_us;
+    unsigned short status;
+    unsigned short path_len;
+    unsigned char addr[16];
+    unsigned char method;
+    unsigned char flags;
+    char path[ACCESS_PATH_LEN];
+} access_record;
+
+/**
+ * Binary access log file header
+ */
+typedef struct
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int record_size;
+} access_file_header;
+
+typedef struct
+{
+    // NULL logs to ACCESS_LOG_FILE
+    const char *path;
+    access_log_format format;
+    // Record one in sample requests, errors are always recorded
+    unsigned int sample;
+    size_t max_bytes;
+    unsigned int rotate_sec;
+} access_log_config;
+
+/**
+ * Single producer single consumer ring of records,
+ * one per thread, drained by the access log flusher
+ */
+typedef struct access_ring
+{
+    size_t head __attribute__((aligned(ACCESS_CACHE_LINE)));
+    size_t tail __attribute__((aligned(ACCESS_CACHE_LINE)));
+    size_t dropped;
+    unsigned int seen;
+    int orphaned;
+    struct access_ring *next;
+    access_record slots[ACCESS_RING_SLOTS];
+} access_ring;
+
+extern bool g_access_log;
+
+int init_access_log(const access_log_config *config);
+void stop_access_log();
+void access_log_write(const access_record *rec);
+void access_log_stats(size_t *written, size_t *dropped);
+unsigned long access_log_clock();
+
+#endif
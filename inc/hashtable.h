@@ -26,5 +26,36 @@
 #define HASHTABLE_H
 
 #include <stdio.h>
+#include <stddef.h>
 
-#endif
\ No newline at end of file
+// Table doubles once entries take up more than NUM/DEN of the slots
+#define HT_LOAD_NUM 3
+#define HT_LOAD_DEN 4
+#define HT_MIN_CAPACITY 16
+
+/**
+ * Open addressing with linear probing, keys are byte strings the
+ * caller keeps alive for as long as they are in the table. Lookups
+ * may run concurrently, anything that modifies the table may not
+ */
+typedef struct
+{
+    const char *key;
+    size_t key_len;
+    size_t hash;
+    void *value;
+} ht_entry;
+
+typedef struct
+{
+    ht_entry *entries;
+    size_t capacity;
+    size_t count;
+} hashtable;
+
+int init_hashtable(hashtable *table, size_t capacity);
+void free_hashtable(hashtable *table);
+int hashtable_insert(hashtable *table, const char *key, size_t key_len, void *value);
+void *hashtable_lookup(const hashtable *table, const char *key, size_t key_len);
+
+#endif
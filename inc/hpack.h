@@ -0,0 +1,89 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * HPACK header compression for HTTP/2 (RFC 7541). Every connection has
+ * one table for decoding request headers and one for encoding response
+ * headers, each mirrors the dynamic table on the other end. Strings are
+ * sent without Huffman coding, received ones may use it.
+ */
+
+// Dynamic table size the decoder advertises, the default of SETTINGS_HEADER_TABLE_SIZE
+#define HPACK_TABLE_SIZE     4096
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_ENTRIES    (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+#define HPACK_STATIC_ENTRIES 61
+
+typedef struct
+{
+    // Name and value share one allocation
+    char *name;
+    char *value;
+    uint32_t name_len;
+    uint32_t value_len;
+} hpack_entry;
+
+/**
+ * Dynamic table, a ring of entries with the newest at first
+ */
+typedef struct
+{
+    hpack_entry entries[HPACK_MAX_ENTRIES];
+    size_t first;
+    size_t count;
+    // Sum of entry sizes as RFC 7541 counts them
+    size_t size;
+    size_t max_size;
+    // Encoder only, the smallest size since the peer was last told
+    size_t min_size;
+    bool size_update;
+} hpack_table;
+
+typedef enum
+{
+    // Added to the dynamic table so later blocks can refer to it
+    HPACK_INDEX = 0,
+    // Values which differ every time
+    HPACK_NO_INDEX
+} hpack_indexing;
+
+typedef int (*hpack_field_cb)(const char *name, size_t name_len, const char *value, size_t value_len, void *arg);
+
+void hpack_init(hpack_table *table, size_t max_size);
+void hpack_free(hpack_table *table);
+int hpack_decode(hpack_table *table, const unsigned char *in, size_t len, char *buf, size_t cap, hpack_field_cb cb,
+                 void *arg);
+void hpack_set_limit(hpack_table *table, size_t limit);
+size_t hpack_encode_begin(hpack_table *table, unsigned char *out, size_t cap);
+size_t hpack_encode(hpack_table *table, unsigned char *out, size_t cap, const char *name, size_t name_len,
+                    const char *value, size_t value_len, hpack_indexing indexing);
+
+#endif
@@ -37,24 +37,152 @@
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/uio.h>
  
-#define PREFIX_LEN      40
+#define STAMP_LEN       20
 #define LOG_SIZE        1024
 #define LOG_FILE_LIMIT  8192
 #define DEBUG_LOG_FILE "/tmp/legion.log"
 #define DEBUG_LOG_OLD  "/tmp/old_legion.log"
+#define BINARY_LOG_FILE "/tmp/legion.bin"
+#define BINARY_LOG_OLD  "/tmp/old_legion.bin"
 
-int init_logging();
+// Lines each thread can have pending before new ones are dropped
+#define LOG_RING_SLOTS  64
+// Flusher polls every LOG_FLUSH_MIN_MS while there is output,
+// backing off to LOG_FLUSH_MAX_MS when idle
+#define LOG_FLUSH_MIN_MS 5
+#define LOG_FLUSH_MAX_MS 100
+#define LOG_CACHE_LINE  64
+// Lines handed to a single writev
+#define LOG_IOV_BATCH   256
+
+// Binary records carry at most this many arguments
+#define LOG_MAX_ARGS    12
+#define LOG_SITE_SECTION "legion_logsites"
+#define LOG_BINARY_MAGIC "LEGIONBL"
+#define LOG_BINARY_VERSION 1
+
+typedef enum
+{
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_INFO,
+    // Verbose, only recorded when enabled at startup
+    LOG_LEVEL_DEBUG
+} log_level;
+
+typedef enum
+{
+    // Lines formatted on the calling thread
+    LOG_MODE_TEXT = 0,
+    // Raw records expanded offline by legion-logdump
+    LOG_MODE_BINARY
+} log_mode;
+
+// Argument kinds of a binary record, every value takes 8 bytes
+// except strings which are a 2 byte length and the bytes
+typedef enum
+{
+    LOG_ARG_INT = 1,
+    LOG_ARG_LONG,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_PTR,
+    LOG_ARG_STR
+} log_arg;
+
+/**
+ * Static descriptor of one LOG_* call site, all of them are
+ * laid out back to back in LOG_SITE_SECTION so the index of a site
+ * in the section is its id. Argument kinds are parsed from the
+ * format on first use, nargs is -1 until then and -2 if the format
+ * can't be recorded raw, such records carry the formatted text
+ */
+typedef struct
+{
+    const char *fmt;
+    const char *file;
+    int line;
+    int level;
+    int nargs;
+    unsigned char args[LOG_MAX_ARGS];
+} __attribute__((aligned(64))) log_site;
+
+/**
+ * Binary record header, followed by the arguments
+ */
+typedef struct
+{
+    unsigned int site;
+    unsigned short len;
+    unsigned short err;
+    unsigned long tsc;
+} log_record;
+
+/**
+ * Binary log file header, followed by nr_sites entries of
+ * level, line, file and format, then the records.
+ * Timestamps are tsc_hz ticks after tsc0, taken at realtime_ns0
+ */
+typedef struct
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int nr_sites;
+    unsigned long tsc_hz;
+    unsigned long tsc0;
+    unsigned long realtime_ns0;
+} log_file_header;
+
+typedef struct
+{
+    unsigned int len;
+    // Binary records start with a log_record
+    char buf[LOG_SIZE] __attribute__((aligned(8)));
+} log_slot;
+
+/**
+ * Single producer single consumer ring of formatted lines,
+ * one per logging thread, drained by the flusher thread
+ */
+typedef struct log_ring
+{
+    size_t head __attribute__((aligned(LOG_CACHE_LINE)));
+    size_t tail __attribute__((aligned(LOG_CACHE_LINE)));
+    size_t dropped;
+    // Owning thread exited, freed by the flusher once drained
+    int orphaned;
+    struct log_ring *next;
+    log_slot slots[LOG_RING_SLOTS];
+} log_ring;
+
+extern log_level g_log_level;
+
+int init_logging(log_mode mode, log_level level);
 void stop_logging();
-void logline(const char *prefix, const char *fmt, ...);
+void logline(log_site *site, ...);
+int log_parse_format(const char *fmt, unsigned char *args, int max_args);
+
+// Never called, lets the compiler check LOG_* arguments against the format
+static inline void __attribute__((format(printf, 1, 2))) log_check_format(const char *fmt, ...)
+{
+    (void)fmt;
+}
 
-#ifdef DEBUG
-#define LOG_INFO(fmt, ...) logline("[INFO] [%Y-%m-%d %H:%M:%S] ", fmt "\n", ##__VA_ARGS__)
-#define LOG_ERROR(fmt, ...) logline("[ERROR] [%Y-%m-%d %H:%M:%S] ", fmt "\n", ##__VA_ARGS__)
-#else
-#define LOG_INFO(fmt, ...)
-#define LOG_ERROR(fmt, ...)
-#endif
+#define LOG_AT(lvl, fmt, ...)                                                                   \
+    do                                                                                          \
+    {                                                                                           \
+        static log_site log_site_ __attribute__((section(LOG_SITE_SECTION), used)) =            \
+            {fmt "\n", __FILE__, __LINE__, lvl, -1, {0}};                                       \
+        if (0)                                                                                  \
+            log_check_format(fmt, ##__VA_ARGS__);                                               \
+        if ((lvl) <= g_log_level)                                                               \
+            logline(&log_site_, ##__VA_ARGS__);                                                 \
+    } while (0)
 
+#define LOG_ERROR(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define LOG_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
 
 #endif
\ No newline at end of file
@@ -26,13 +26,18 @@
 #define _SERVER_H
 
 #include "logger.h"
+#include "access_log.h"
+#include "trace.h"
+#include "hashtable.h"
 
 #include <stdbool.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
@@ -42,11 +47,31 @@
 
 #define MAX_FD_COUNT    4096
 #define TLS_TIMEOUT_SEC 4
+#define KEEP_ALIVE_TIMEOUT_SEC 5
+
+// Handshake workers, the default of 0 takes half the CPU budget.
+// They run HANDSHAKE_NICE below the request workers
+#define HANDSHAKE_THREADS_DEFAULT 0
+#define HANDSHAKE_NICE         5
+#define HANDSHAKE_EVENTS       64
+#define HANDSHAKE_ACCEPT_BATCH 16
+#define HANDSHAKE_POLL_MS      1000
+// Poll interval while a handshake waits for a free ASYNC_JOB
+#define HANDSHAKE_RETRY_MS     1
+#define HANDSHAKE_ASYNC_JOBS   64
+#define HANDSHAKE_ASYNC_FDS    8
+
+#define RESP_HEADER_SIZE 256
+#define SEND_CHUNK_SIZE  16384
+// Requests not read whole into BUFFER_SIZE go to a pooled
+// buffer that grows up to this size for their header block
+#define MAX_REQUEST_SIZE BUF_LARGE
+#define SEND_BUDGET      (256 * 1024)
+#define MAX_REQ_PER_RUN  16
 
 #define DEFAULT_PAGE_SIZE 4096
 
 #define DEFAULT_ASSET_PATH "assets/"
-#define DEFAULT_ASSET_LEN  sizeof(DEFAULT_ASSET_PATH)
 
 #define DEFAULT_MIME_T  "application/octet-stream"
 #define INDEX_PAGE      "index.html"
@@ -55,52 +80,324 @@
 
 #define DEFAULT_SSL_CERT_FILE "/home/qubit/cf_cert.pem" 
 #define DEFAULT_SSL_KEY_FILE  "/home/qubit/cf_key.pem"
+// Certificate chains loaded at once, one per key type
+#define MAX_SSL_CERTS 4
+
+// Key exchange and cipher preferences, most preferred first.
+// AES-GCM leads for AES-NI, ChaCha20 is picked for clients that prefer it
+#define TLS_GROUPS "X25519:P-256:P-384"
+#define TLS13_CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+#define TLS12_CIPHERS "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+                      "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:" \
+                      "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:" \
+                      "ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES128-SHA:AES128-GCM-SHA256:AES128-SHA"
+// Signatures in the order of their signing cost, RSA only for clients without the rest
+#define TLS_SIGALGS "ECDSA+SHA256:ed25519:ECDSA+SHA384:ECDSA+SHA512:" \
+                    "rsa_pss_rsae_sha256:rsa_pss_rsae_sha384:rsa_pss_rsae_sha512:" \
+                    "rsa_pss_pss_sha256:rsa_pss_pss_sha384:rsa_pss_pss_sha512:" \
+                    "RSA+SHA256:RSA+SHA384:RSA+SHA512:ECDSA+SHA1:RSA+SHA1"
+
+// Reserved path serving the metrics in Prometheus text format
+#define STATS_PATH      "__legion/stats"
+#define METRICS_CACHE_LINE 64
+// Latency histograms keep 2^METRIC_SUB_BITS linear buckets per power
+// of two ns, within 12.5% of the value, up to 2^METRIC_MAX_EXP ns
+#define METRIC_SUB_BITS 3
+#define METRIC_MAX_EXP  39
+#define METRIC_BUCKETS  ((METRIC_MAX_EXP - 1) << METRIC_SUB_BITS)
+
+// Stapled OCSP responses, see ocsp.c. Files are checked for
+// changes every OCSP_CHECK_SEC, a response may be dated up to
+// OCSP_MAX_SKEW_SEC ahead of our clock
+#define OCSP_CHECK_SEC     1
+#define OCSP_MAX_SKEW_SEC  300
+#define OCSP_MAX_RESPONSE  (64 * 1024)
+
+// SSL objects of closed connections kept for reuse, each
+// about 4KB once cleared and without its record buffers
+#define SSL_POOL_SIZE  1024
+// Size prefix of OpenSSL heap blocks, keeps malloc alignment
+#define TLS_MEM_HEADER 16
+
+// Slab caches, see pool.c. A thread keeps up to SLAB_THREAD_BYTES
+// of free blocks per cache, the rest goes to a shared depot of up
+// to SLAB_DEPOT_BYTES, and malloc is called when both are empty
+#define SLAB_MAX_CACHES   16
+#define SLAB_THREAD_BYTES (256 * 1024)
+#define SLAB_DEPOT_BYTES  (4 * 1024 * 1024)
+#define SLAB_THREAD_MAX   256
+#define SLAB_DEPOT_MAX    4096
+// Size classes of pooled buffers. The three large ones are BUF_SLACK
+// bigger so a full TLS record with its header and MAC fits in 16KB
+#define BUF_SMALL  (4 * 1024)
+#define BUF_MEDIUM (16 * 1024)
+#define BUF_LARGE  (64 * 1024)
+#define BUF_SLACK  512
+
+// Per client limits, see ratelimit.c. Clients are tracked in RATE_SETS
+// sets of RATE_WAYS slots, RATE_AGE_SETS sets are aged per pass
+#define RATE_SET_BITS  12
+#define RATE_SETS      (1 << RATE_SET_BITS)
+#define RATE_WAYS      8
+#define RATE_AGE_SETS  256
+#define RATE_BURST_SEC 2
+// Up to this many per second, a full bucket has to fit in 32 bits
+#define RATE_MAX       1000000
+// Open connections of one client, a sixteenth of the client slots
+#define RATE_MAX_OPEN  (MAX_FD_COUNT / 16)
+
+// Sessions resumable with TLS 1.3 early data, every ticket is good for one use
+#define EARLY_SESSION_CACHE_SIZE 32768
+
+// Virtual hosts file, see vhost.c
+#define VHOST_NAME_LEN   255
+#define VHOST_LINE_LEN   4096
+#define VHOST_MAX_FIELDS (2 + 2 * MAX_SSL_CERTS)
 
 #define SERVER_IP_ADDR "127.0.0.1"
 #define SERVER_PORT    "8080"
 
+// Result of driving a connection, tells the caller how to park it
+typedef enum
+{
+    CONN_DONE = 0,
+    CONN_WANT_READ,
+    CONN_WANT_WRITE,
+    CONN_WANT_FILE,
+    CONN_CLOSE
+} conn_status;
+
 typedef struct
 {
     int fd;
+    char *file_map;
+    const char *file_name;
+    const char *mime_type;
+    off_t file_size;
+} page_cache;
+
+/**
+ * Pages under one asset root, indexed by their path relative to it.
+ * Error pages are NULL when the root has none
+ */
+typedef struct
+{
+    char *root;
+    size_t root_len;
+    page_cache *pages;
+    size_t nr_pages;
+    hashtable index;
+    const page_cache *page_404;
+    const page_cache *page_500;
+} page_namespace;
+
+/**
+ * Cache of equally sized blocks, defined statically with SLAB_CACHE()
+ * and registered on first use. The depot fields are under lock
+ */
+typedef struct
+{
+    size_t size;
+    int id;
+    unsigned int thread_max;
+    unsigned int depot_max;
+    unsigned int depot_count;
+    void *depot;
+    pthread_mutex_t lock;
+} slab_cache;
+
+#define SLAB_CACHE(obj_size) {.size = (obj_size), .lock = PTHREAD_MUTEX_INITIALIZER}
+
+/**
+ * Bump allocator for memory that lives as long as one response,
+ * carved out of pooled buffers and emptied by arena_reset()
+ */
+typedef struct
+{
+    struct arena_block *head;
+} request_arena;
+
+/**
+ * Resumable state of the response being sent on a connection.
+ * out/out_len always point at bytes SSL_write has not accepted yet,
+ * they have to be retried as is after SSL_ERROR_WANT_WRITE
+ */
+typedef struct
+{
+    const page_cache *page;
+    off_t offset;
+    const char *out;
+    int out_len;
+    // Bounce buffer for fd backed pages, allocated from the arena
+    char *chunk;
+    request_arena arena;
+    char header[RESP_HEADER_SIZE];
+} send_state;
+
+// HTTP/2 state of a connection, see http2.c
+struct h2_conn;
+
+/**
+ * One slot per fd, ordered so that nothing is lost to padding
+ */
+typedef struct
+{
     SSL *ssl;
+    time_t last_active;
+    // Read as early data, answered after the handshake instead of read off SSL
+    char *early_request;
+    // Pooled buffer of a request whose header block is still coming
+    char *req_buf;
+    // Set once the client picked h2 through ALPN, resp is unused then
+    struct h2_conn *h2;
+    int fd;
+    int early_len;
+    int req_len;
+    int req_cap;
+    // Slot of the client in the rate limits, -1 when not tracked
+    int rate_slot;
     bool keep_alive;
+    bool is_parked;
+    bool async_file;
+    // Responses go out as TLS 1.3 early data, the handshake is not done yet
+    bool early_data;
+    send_state resp;
+    // Request in flight for the access log, status is 0 when there is none
+    access_record access;
+#ifdef PHASE_TRACE
+    phase_trace trace;
+#endif
 } client_info;
 
+typedef enum
+{
+    RESP_OK = 0,
+    RESP_NOT_FOUND,
+    RESP_SERVER_ERROR,
+    RESP_TOO_MANY,
+    RESP_KIND_COUNT
+} resp_kind;
+
+/**
+ * Counters of one thread, only ever written by it and
+ * summed up when the metrics are read. Blocks of exited
+ * threads are taken over by the next new thread
+ */
+typedef struct worker_metrics
+{
+    unsigned long requests;
+    unsigned long responses[RESP_KIND_COUNT];
+    unsigned long aborted;
+    unsigned long bytes_sent;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned long connections;
+    unsigned long handshakes_full;
+    unsigned long handshakes_resumed;
+    unsigned long handshake_failures;
+    unsigned long early_answered;
+    // Connections closed after their handshake
+    unsigned long closed;
+    // Turned away by the per client limits
+    unsigned long connections_limited;
+    unsigned long requests_limited;
+    // Bytes of HTTP/2 state, freed by other threads as well so
+    // only the sum over all threads means anything
+    unsigned long http2_memory;
+    unsigned long latency_sum_ns;
+    unsigned long latency[METRIC_BUCKETS];
+    int orphaned;
+    struct worker_metrics *next;
+} __attribute__((aligned(METRICS_CACHE_LINE))) worker_metrics;
+
+// Single writer, a plain store keeps concurrent readers well defined
+#define METRIC_ADD(m, field, n) __atomic_store_n(&(m)->field, (m)->field + (n), __ATOMIC_RELAXED)
+
 typedef struct
 {
     SSL* ssl[MAX_ALIVE_CONN];
     ssize_t last_free;
 } client_list;
 
-typedef struct
-{
-    int fd;
-    char *file_map;
-    const char *file_name;
-    const char *mime_type;
-    off_t file_size;
-} page_cache;
-
 const page_cache *get_page_cache(const char *path);
 size_t initiate_cache(const char *root_path);
 void release_cache();
+size_t load_namespace(page_namespace *ns, const char *root_path);
+void release_namespace(page_namespace *ns);
+const page_cache *get_namespace_page(const page_namespace *ns, const char *path);
+const char *get_mime_type(const char *filename);
 
 int set_fd_limit();
 void init_client_list();
 void cleanup_client_list();
 void remove_client_info_fd(const int fd);
 void remove_client_info(client_info * cinfo);
-int add_client_info(const int client_fd, SSL *client_ssl);
+int add_client_info(const int client_fd, SSL *client_ssl, const int rate_slot);
 client_info *get_client_info(const int client_fd);
+void park_client(client_info *cinfo, conn_status status);
+void reap_idle_clients(const int epoll_fd, const time_t now);
+void record_peer(client_info *cinfo);
+void release_client_buffers(client_info *cinfo);
 
+void *slab_alloc(slab_cache *cache);
+void *slab_zalloc(slab_cache *cache);
+void slab_free(slab_cache *cache, void *block);
+void *buf_alloc(size_t size);
+void *buf_realloc(void *buf, size_t old_size, size_t size);
+void buf_free(void *buf, size_t size);
+void *arena_alloc(request_arena *arena, size_t size);
+void arena_reset(request_arena *arena);
+
+SSL_CTX *new_ssl_context(const char *const *cert_files, const char *const *key_files, const size_t nr_certs);
+int init_openssl_context(const char *const *cert_files, const char *const *key_files, const size_t nr_certs);
+int init_ocsp_stapling(SSL_CTX *ctx, const char *const *files, const size_t nr_files);
+void stop_ocsp_stapling();
+int enable_early_data(SSL_CTX *ctx, const uint32_t max_early_data);
+SSL *new_client_ssl();
+void release_client_ssl(SSL *ssl);
+void release_ssl_pool();
+void init_tls_memory();
+long tls_memory_in_use();
+int init_rate_limit(const long conns_per_sec, const long requests_per_sec);
+int rate_limit_connect(const struct sockaddr *addr, int *slot);
+int rate_limit_request(const int slot);
+void rate_limit_disconnect(const int slot);
+void rate_limit_age();
+int load_vhosts(const char *path);
+void release_vhosts();
+const page_namespace *find_host_pages(const char *host, size_t len);
 int ssl_log_err(const char *errstr, size_t len, void *u);
 int set_non_blocking(const int fd, bool is_non_block);
 int set_socket_timeout(const int fd, const time_t sec, const time_t usec);
+int set_socket_nodelay(const int fd);
 
+int sendfile_to_client(client_info *cinfo);
+int send_response(client_info *cinfo, const page_cache *page, bool is_head);
+conn_status ssl_status(SSL *ssl, int ssl_ret, const char *op);
+void begin_request(access_record *rec, access_method method);
+void record_response(SSL *ssl, access_record *rec, unsigned char flags);
+void finish_request(client_info *cinfo, unsigned char flags);
+int queue_early_response(client_info *cinfo, char *buffer);
+conn_status serve_client(client_info *cinfo);
 void handle_http_request(void *arg);
 
+int h2_attach(client_info *cinfo);
+conn_status h2_serve(client_info *cinfo);
+void h2_free(client_info *cinfo);
+
+int run_uring_server(const int server_fd);
+
+extern const char *g_task_class_names[];
+worker_metrics *thread_metrics();
+void record_latency(worker_metrics *metrics, unsigned long ns);
+void record_handshake(SSL *ssl, bool success);
+void record_close();
+char *render_metrics(size_t *len);
+
 int initiate_server(const char *server_ip, const char *port);
-int accept_connections(const int server_fd, const int epoll_fd);
+const char *get_ip_address(struct sockaddr *addr);
+int start_handshake_pool(const int server_fd, size_t nr_threads, bool use_async);
+void stop_handshake_pool();
 
 #ifdef IPV6_SERVER
 // char * get_internet_facing_ipv6();
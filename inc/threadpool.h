@@ -29,35 +29,195 @@
 #include <stdbool.h>
 #include <pthread.h>
 
-#define THREAD_COUNT 16
+// Bounds on the pool size, the default size comes from
+// detect_cpu_budget() and may grow up to twice that under backlog
+#define MIN_THREAD_COUNT 1
+#define MAX_THREAD_COUNT 256
+// Default injection ring capacity, rounded up to a power of two
 #define TASK_QUEUE_SIZE 64
 #define PTHREAD_STACK_SIZE (128 * 1024)
 
+// Per worker deque, has to be a power of two
+#define DEQUE_SIZE 256
+// Empty polls of all queues before a worker parks on the futex,
+// only used when there is more than one CPU to spin on
+#define SPIN_BEFORE_PARK 64
+#define CACHE_LINE_SIZE 64
+
+// Pool monitor samples the injection ring every RESIZE_INTERVAL_MS,
+// a worker is added after GROW_AFTER_TICKS samples in a row with
+// backlog and retired after SHRINK_AFTER_TICKS samples in a row idle
+#define RESIZE_INTERVAL_MS 100
+#define GROW_AFTER_TICKS 3
+#define SHRINK_AFTER_TICKS 50
+
 typedef void (*func_ptr_t)(void *arg);
 
+/**
+ * Task classes, each has its own injection ring and deques so a
+ * backlog in one class never sits in front of tasks of another
+ */
+typedef enum
+{
+    // Cheap latency sensitive work such as a newly readable request
+    TASK_INTERACTIVE = 0,
+    // Long transfers resumed after using up their send budget
+    TASK_BULK,
+    // Work nobody is waiting on right away
+    TASK_BACKGROUND,
+    TASK_CLASS_COUNT
+} task_class;
+
+// Share of picks each class gets while all of them have work
+#define DEFAULT_CLASS_WEIGHTS {8, 2, 1}
+// Workers kept free for a class whenever the pool is large enough
+#define DEFAULT_CLASS_RESERVED {1, 0, 0}
+
 typedef struct
 {
     func_ptr_t func;
     void *arg;
+    // CLOCK_MONOTONIC time the task was submitted
+    unsigned long queued_ns;
 } th_task;
 
+/**
+ * Queue wait of the tasks a worker ran, per class
+ */
+typedef struct
+{
+    size_t completed;
+    unsigned long wait_ns;
+    unsigned long max_wait_ns;
+} class_stats;
+
+/**
+ * Per class totals returned by threadpool_class_stats()
+ */
 typedef struct
 {
-    pthread_mutex_t qlock;
-    pthread_cond_t task_avail;
+    size_t queued;
+    size_t completed;
+    size_t rejected;
+    unsigned long wait_ns;
+    unsigned long max_wait_ns;
+} thpool_class_stats;
 
-    pthread_t thread_arr[THREAD_COUNT];
+/**
+ * Chase-Lev work stealing deque, the owning worker pushes and pops
+ * at the bottom, any other worker steals from the top
+ */
+typedef struct
+{
+    long top __attribute__((aligned(CACHE_LINE_SIZE)));
+    long bottom __attribute__((aligned(CACHE_LINE_SIZE)));
+    th_task buf[DEQUE_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+} ws_deque;
 
-    th_task queue[TASK_QUEUE_SIZE];
-    size_t queue_len;
+/**
+ * Bounded MPMC ring with per slot sequence numbers (Vyukov),
+ * producers and consumers only contend on their own position
+ */
+typedef struct
+{
+    size_t seq;
+    th_task task;
+} mpmc_cell;
 
-    size_t first;
-    size_t last;
+typedef struct
+{
+    size_t enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    mpmc_cell *cells __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t mask;
+} mpmc_ring;
+
+/**
+ * Pool sizing, zero fields are filled in from the machine topology
+ */
+typedef struct
+{
+    size_t min_threads;
+    size_t max_threads;
+    size_t queue_size;
+    // Pin each worker to one CPU instead of to its NUMA node
+    bool pin_threads;
+    // Scheduling weight and reserved workers per class, all zero for defaults
+    unsigned int weight[TASK_CLASS_COUNT];
+    size_t reserved[TASK_CLASS_COUNT];
+} thpool_config;
+
+typedef struct
+{
+    int cpu;
+    int node;
+} cpu_slot;
+
+typedef struct
+{
+    ws_deque deque[TASK_CLASS_COUNT];
+    // Smooth weighted round robin state, owner only
+    long credit[TASK_CLASS_COUNT];
+    class_stats stats[TASK_CLASS_COUNT];
+    pthread_t thread;
+    unsigned int seed;
+    size_t index;
+    // CPU and NUMA node the worker was placed on, cpu is -1 if unknown
+    int cpu;
+    int node;
+    // Set when shrinking, the worker drains its deque, sets exited
+    // and is joined by the next resize, running until then
+    bool retire;
+    bool exited;
+    bool running;
+} th_worker;
+
+typedef struct
+{
+    // Injection rings for tasks submitted from outside the pool
+    mpmc_ring ring[TASK_CLASS_COUNT];
+
+    unsigned int weight[TASK_CLASS_COUNT];
+    unsigned int total_weight;
+    size_t reserved[TASK_CLASS_COUNT];
+    size_t total_reserved;
+    // Workers running a task of each class, only kept with reservations
+    size_t busy[TASK_CLASS_COUNT] __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t rejected[TASK_CLASS_COUNT];
+
+    // Slots up to max_threads, workers below nr_slots may own tasks,
+    // nr_active of them are running and not retiring
+    th_worker *workers;
+    size_t nr_slots;
+    size_t nr_active;
+    size_t min_threads;
+    size_t max_threads;
+    bool pin_threads;
+
+    cpu_slot *cpus;
+    size_t nr_cpus;
+    size_t nr_nodes;
+    pthread_t monitor;
+    bool has_monitor;
+
+    // Futex word counting wakeups handed to parked workers, count of
+    // parked workers and of awake workers looking beyond their own deque
+    unsigned int wake_tokens __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned int sleepers __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned int searching;
+    size_t spin_limit;
     bool is_run;
 } thpool_queue;
 
-int init_threadpool();
+int init_threadpool(const thpool_config *config);
 void stop_threadpool();
-int add_task_to_queue(func_ptr_t f_ptr, void *arg);
+size_t threadpool_size();
+int resize_threadpool(size_t count);
+int add_task_to_queue(task_class cls, func_ptr_t f_ptr, void *arg);
+size_t add_tasks_batch(task_class cls, const th_task *tasks, size_t count);
+void threadpool_class_stats(task_class cls, thpool_class_stats *stats);
+
+size_t detect_cpu_budget();
+size_t detect_cpu_topology(cpu_slot **slots);
 
 #endif
\ No newline at end of file
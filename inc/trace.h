@@ -0,0 +1,157 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * Per request phase tracing, only built with -DPHASE_TRACE
+ * (make PHASE_TRACE=1 after a make clean). Every hook below
+ * compiles to nothing otherwise.
+ *
+ * Each thread records the phase segments it ran into its own ring
+ * and a summary of every finished request into another. SIGUSR1
+ * writes the slowest TRACE_SLOWEST requests with their breakdown to
+ * TRACE_SLOWEST_FILE and all recorded segments as Chrome trace
+ * events to TRACE_JSON_FILE, both rings keep the most recent entries
+ */
+
+typedef enum
+{
+    // TLS handshake, charged to the first request on the connection
+    PHASE_HANDSHAKE = 0,
+    // Ready connection waiting for a worker
+    PHASE_QUEUE,
+    // Response parked until the socket is writable again
+    PHASE_WAIT,
+    // SSL_read and request line parsing
+    PHASE_PARSE,
+    // get_page_cache
+    PHASE_LOOKUP,
+    // sendfile_to_client
+    PHASE_SEND,
+    PHASE_COUNT
+} trace_phase;
+
+#ifdef PHASE_TRACE
+
+#define TRACE_EVENT_SLOTS   8192
+#define TRACE_REQUEST_SLOTS 1024
+#define TRACE_PATH_LEN      48
+#define TRACE_SLOWEST       20
+#define TRACE_SLOWEST_FILE  "/tmp/legion_slowest.txt"
+#define TRACE_JSON_FILE     "/tmp/legion_trace.json"
+#define TRACE_CACHE_LINE    64
+
+/**
+ * Trace state of the connection, ticks add up the phases
+ * since the last request finished
+ */
+typedef struct
+{
+    // First tick charged since the last request, 0 if none yet
+    unsigned long first;
+    // Request started, 0 between requests
+    unsigned long start;
+    // Last boundary crossed outside a worker, queued or parked
+    unsigned long mark;
+    unsigned long parked;
+    unsigned long ticks[PHASE_COUNT];
+    unsigned int req;
+} phase_trace;
+
+/**
+ * Every slot is stamped with its position last so a dump
+ * running alongside the writer can skip torn entries
+ */
+typedef struct
+{
+    unsigned long seq;
+    unsigned long begin;
+    unsigned long end;
+    unsigned int req;
+    int fd;
+    int phase;
+} trace_event;
+
+typedef struct
+{
+    unsigned long seq;
+    unsigned long first;
+    unsigned long end;
+    unsigned long ticks[PHASE_COUNT];
+    unsigned int req;
+    int fd;
+    int status;
+    char path[TRACE_PATH_LEN];
+} trace_request;
+
+typedef struct trace_ring
+{
+    unsigned long events_head __attribute__((aligned(TRACE_CACHE_LINE)));
+    unsigned long requests_head;
+    int tid;
+    struct trace_ring *next;
+    trace_event events[TRACE_EVENT_SLOTS];
+    trace_request requests[TRACE_REQUEST_SLOTS];
+} trace_ring;
+
+unsigned long trace_now();
+void trace_init();
+void trace_phase_end(phase_trace *trace, int fd, trace_phase phase, unsigned long since);
+void trace_begin(phase_trace *trace, unsigned long since);
+void trace_end(phase_trace *trace, int fd, int status, const char *path, size_t path_len);
+void trace_resume(phase_trace *trace, int fd, bool in_request);
+void trace_poll();
+
+#define TRACE_ENABLED 1
+#define TRACE_STAMP(var) unsigned long var = trace_now()
+#define TRACE_INIT() trace_init()
+#define TRACE_RESET(cinfo) memset(&(cinfo)->trace, 0, sizeof(phase_trace))
+#define TRACE_PHASE(cinfo, phase, since) trace_phase_end(&(cinfo)->trace, (cinfo)->fd, phase, since)
+#define TRACE_MARK(cinfo) ((cinfo)->trace.mark = trace_now())
+#define TRACE_PARK(cinfo) ((cinfo)->trace.parked = trace_now())
+#define TRACE_RESUME(cinfo) trace_resume(&(cinfo)->trace, (cinfo)->fd, (cinfo)->access.status != 0)
+#define TRACE_BEGIN(cinfo, since) trace_begin(&(cinfo)->trace, since)
+#define TRACE_END(cinfo) \
+    trace_end(&(cinfo)->trace, (cinfo)->fd, (cinfo)->access.status, (cinfo)->access.path, (cinfo)->access.path_len)
+#define TRACE_POLL() trace_poll()
+
+#else
+
+#define TRACE_ENABLED 0
+#define TRACE_STAMP(var)
+#define TRACE_INIT()
+#define TRACE_RESET(cinfo)
+#define TRACE_PHASE(cinfo, phase, since)
+#define TRACE_MARK(cinfo)
+#define TRACE_PARK(cinfo)
+#define TRACE_RESUME(cinfo)
+#define TRACE_BEGIN(cinfo, since)
+#define TRACE_END(cinfo)
+#define TRACE_POLL()
+
+#endif
+
+#endif
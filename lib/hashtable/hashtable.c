@@ -24,7 +24,125 @@
 
 #include "hashtable.h"
 
-void fizz()
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * FNV-1a, short keys like paths and host names hash well enough
+ */
+static size_t hash_key(const char *key, size_t key_len)
+{
+    size_t i = 0;
+    size_t hash = 14695981039346656037UL;
+
+    for (i = 0; i < key_len; i++)
+    {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/**
+ * Slot holding the key, or the empty slot it would go into
+ */
+static ht_entry *find_slot(const ht_entry *entries, size_t capacity, const char *key, size_t key_len, size_t hash)
+{
+    size_t i = hash & (capacity - 1);
+
+    while (entries[i].key != NULL)
+    {
+        if (entries[i].hash == hash && entries[i].key_len == key_len && memcmp(entries[i].key, key, key_len) == 0)
+            break;
+        i = (i + 1) & (capacity - 1);
+    }
+    return (ht_entry *)&entries[i];
+}
+
+static int resize_hashtable(hashtable *table, size_t capacity)
+{
+    size_t i = 0;
+    ht_entry *slot = NULL;
+    ht_entry *entries = calloc(capacity, sizeof(ht_entry));
+
+    if (entries == NULL)
+        return -1;
+
+    for (i = 0; i < table->capacity; i++)
+    {
+        if (table->entries[i].key == NULL)
+            continue;
+        slot = find_slot(entries, capacity, table->entries[i].key, table->entries[i].key_len, table->entries[i].hash);
+        *slot = table->entries[i];
+    }
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Sets up an empty table sized for capacity entries
+ * Returns 0 on success, -1 otherwise
+ */
+int init_hashtable(hashtable *table, size_t capacity)
+{
+    size_t slots = HT_MIN_CAPACITY;
+
+    while (slots * HT_LOAD_NUM / HT_LOAD_DEN < capacity)
+        slots <<= 1;
+
+    table->entries = NULL;
+    table->capacity = 0;
+    table->count = 0;
+    return resize_hashtable(table, slots);
+}
+
+/**
+ * Frees the slots, keys and values belong to the caller
+ */
+void free_hashtable(hashtable *table)
+{
+    free(table->entries);
+    table->entries = NULL;
+    table->capacity = 0;
+    table->count = 0;
+}
+
+/**
+ * Adds or replaces the value of key
+ * Returns 0 if added, 1 if replaced, -1 if out of memory
+ */
+int hashtable_insert(hashtable *table, const char *key, size_t key_len, void *value)
+{
+    size_t hash = hash_key(key, key_len);
+    ht_entry *slot = NULL;
+
+    if ((table->count + 1) * HT_LOAD_DEN > table->capacity * HT_LOAD_NUM &&
+        resize_hashtable(table, table->capacity << 1) != 0)
+        return -1;
+
+    slot = find_slot(table->entries, table->capacity, key, key_len, hash);
+    if (slot->key != NULL)
+    {
+        slot->value = value;
+        return 1;
+    }
+
+    slot->key = key;
+    slot->key_len = key_len;
+    slot->hash = hash;
+    slot->value = value;
+    table->count++;
+    return 0;
+}
+
+/**
+ * Returns the value stored under key, NULL if there is none
+ */
+void *hashtable_lookup(const hashtable *table, const char *key, size_t key_len)
 {
-    printf("Buzz\n");
-}
\ No newline at end of file
+    if (table->capacity == 0)
+        return NULL;
+    return find_slot(table->entries, table->capacity, key, key_len, hash_key(key, key_len))->value;
+}
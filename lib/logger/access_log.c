@@ -0,0 +1,491 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "access_log.h"
+#include "logger.h"
+
+#include <stddef.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+bool g_access_log = false;
+
+static int access_fd = -1;
+static access_log_config cfg;
+static size_t file_bytes = 0;
+static time_t opened_at = 0;
+// CLOCK_REALTIME - CLOCK_MONOTONIC, taken once at init
+static unsigned long wall_offset_ns = 0;
+static size_t total_written = 0;
+static size_t total_dropped = 0;
+
+// Same scheme as the debug log, rings of every thread that ever
+// recorded a request, the lock is only taken on a thread's first record
+static access_ring *ring_list = NULL;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+static pthread_t flusher;
+static bool flusher_run = false;
+// Set by a producer whose ring is half full, the flusher sleeps on it
+static unsigned int flush_kick = 0;
+
+static __thread access_ring *tl_ring = NULL;
+
+// Only touched by the flusher
+static char wbuf[ACCESS_WRITE_BUFFER];
+static size_t wbuf_len = 0;
+static time_t stamp_sec = -1;
+static char stamp[STAMP_LEN + 4];
+
+static const char *method_names[] = {"-", "GET", "HEAD"};
+
+/**
+ * Monotonic time in ns, what access_record durations are measured with
+ */
+unsigned long access_log_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+static void futex_wait_ms(unsigned int *addr, unsigned int val, long ms)
+{
+    struct timespec timeout = {ms / 1000, (ms % 1000) * 1000000L};
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &timeout, NULL, 0);
+}
+
+static void futex_wake(unsigned int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void release_ring(void *arg)
+{
+    access_ring *ring = (access_ring *)arg;
+    __atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static void create_ring_key()
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+
+/**
+ * Ring of the calling thread, allocated on its first record
+ */
+static access_ring *get_ring()
+{
+    access_ring *ring = NULL;
+
+    if (tl_ring != NULL)
+        return tl_ring;
+
+    ring = calloc(1, sizeof(access_ring));
+    if (ring == NULL)
+        return NULL;
+
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_setspecific(ring_key, ring);
+
+    pthread_mutex_lock(&ring_lock);
+    ring->next = ring_list;
+    ring_list = ring;
+    pthread_mutex_unlock(&ring_lock);
+
+    tl_ring = ring;
+    return ring;
+}
+
+/**
+ * Writes out whatever is buffered, short writes are retried
+ * and the buffer is dropped if the file can't take it
+ */
+static void write_out()
+{
+    size_t done = 0;
+    ssize_t ret = 0;
+
+    while (done < wbuf_len)
+    {
+        ret = write(access_fd, wbuf + done, wbuf_len - done);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("access_log: write");
+            break;
+        }
+        done += (size_t)ret;
+    }
+    file_bytes += done;
+    wbuf_len = 0;
+}
+
+static int open_access_file()
+{
+    access_file_header header;
+
+    access_fd = open(cfg.path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+    if (access_fd < 0)
+        return -1;
+
+    file_bytes = 0;
+    opened_at = time(NULL);
+    if (cfg.format == ACCESS_LOG_BINARY)
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, ACCESS_BINARY_MAGIC, sizeof(header.magic));
+        header.version = ACCESS_BINARY_VERSION;
+        header.record_size = (unsigned int)sizeof(access_record);
+        memcpy(wbuf, &header, sizeof(header));
+        wbuf_len = sizeof(header);
+    }
+    else
+    {
+        wbuf_len = (size_t)snprintf(wbuf, sizeof(wbuf), "time,client,method,path,status,bytes,duration_us,resumed,aborted\n");
+    }
+    write_out();
+    return 0;
+}
+
+/**
+ * Moves the current file aside as <path>.<UTC time>,
+ * with a counter appended if that name is taken already
+ */
+static void move_aside()
+{
+    int seq = 0;
+    time_t now = time(NULL);
+    struct tm tm;
+    char suffix[32];
+    char name[PATH_MAX];
+
+    gmtime_r(&now, &tm);
+    strftime(suffix, sizeof(suffix), "%Y%m%d-%H%M%S", &tm);
+    snprintf(name, sizeof(name), "%s.%s", cfg.path, suffix);
+    while (access(name, F_OK) == 0 && seq < 100)
+        snprintf(name, sizeof(name), "%s.%s.%d", cfg.path, suffix, ++seq);
+
+    if (rename(cfg.path, name) != 0)
+        perror("access_log: rename");
+}
+
+/**
+ * Only ever called on the flusher thread
+ */
+static void rotate_access_log()
+{
+    write_out();
+    close(access_fd);
+    move_aside();
+
+    if (open_access_file() != 0)
+    {
+        perror("rotate_access_log: open");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Path as a quoted CSV field, quotes are doubled and
+ * anything unprintable is replaced
+ */
+static size_t csv_path(char *out, const access_record *rec)
+{
+    size_t len = 0;
+    unsigned short i = 0;
+    char c = 0;
+
+    out[len++] = '"';
+    out[len++] = '/';
+    for (i = 0; i < rec->path_len; i++)
+    {
+        c = rec->path[i];
+        if (c == '"')
+            out[len++] = '"';
+        else if (c < 0x20 || c == 0x7f)
+            c = '?';
+        out[len++] = c;
+    }
+    out[len++] = '"';
+    out[len] = '\0';
+    return len;
+}
+
+static void encode_csv(const access_record *rec)
+{
+    int ret = 0;
+    unsigned long wall_ns = rec->start_ns + wall_offset_ns;
+    time_t sec = (time_t)(wall_ns / 1000000000UL);
+    struct tm tm;
+    char client[INET6_ADDRSTRLEN];
+    char path[ACCESS_PATH_LEN * 2 + 4];
+
+    if (sec != stamp_sec)
+    {
+        stamp_sec = sec;
+        gmtime_r(&sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    }
+
+    if (inet_ntop((rec->flags & ACCESS_FLAG_IPV6) ? AF_INET6 : AF_INET, rec->addr, client, sizeof(client)) == NULL)
+        strcpy(client, "-");
+    csv_path(path, rec);
+
+    ret = snprintf(wbuf + wbuf_len, sizeof(wbuf) - wbuf_len, "%s.%06luZ,%s,%s,%s,%u,%lu,%u,%d,%d\n",
+                   stamp, (wall_ns % 1000000000UL) / 1000, client,
+                   method_names[rec->method <= ACCESS_METHOD_HEAD ? rec->method : 0], path,
+                   rec->status, rec->bytes, rec->duration_us,
+                   (rec->flags & ACCESS_FLAG_RESUMED) ? 1 : 0,
+                   (rec->flags & ACCESS_FLAG_ABORTED) ? 1 : 0);
+    if (ret > 0)
+        wbuf_len += (size_t)ret;
+}
+
+static void encode_binary(const access_record *rec)
+{
+    access_record *out = (access_record *)(wbuf + wbuf_len);
+    size_t len = offsetof(access_record, path) + rec->path_len;
+
+    memcpy(out, rec, len);
+    // Wall time so files can be read without knowing the boot time
+    out->start_ns = rec->start_ns + wall_offset_ns;
+    wbuf_len += len;
+}
+
+/**
+ * Encodes everything queued in all rings into the write buffer,
+ * writing it out whenever the next record might not fit.
+ * Returns the number of records taken off the rings
+ */
+static size_t drain_rings()
+{
+    size_t head = 0;
+    size_t tail = 0;
+    size_t drained = 0;
+    access_ring *ring = NULL;
+    access_ring **link = NULL;
+
+    pthread_mutex_lock(&ring_lock);
+    for (ring = ring_list; ring != NULL; ring = ring->next)
+    {
+        __atomic_add_fetch(&total_dropped, __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED),
+                           __ATOMIC_RELAXED);
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        tail = ring->tail;
+
+        while (tail != head)
+        {
+            // Worst case CSV line is the escaped path plus a few short fields
+            if (sizeof(wbuf) - wbuf_len < 2 * sizeof(access_record) + 128)
+            {
+                // Records are copied out already, hand their slots back first
+                __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+                write_out();
+            }
+
+            if (cfg.format == ACCESS_LOG_BINARY)
+                encode_binary(&ring->slots[tail % ACCESS_RING_SLOTS]);
+            else
+                encode_csv(&ring->slots[tail % ACCESS_RING_SLOTS]);
+            tail++;
+            drained++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    // Rings of exited threads go once empty, nothing else can fill them
+    link = &ring_list;
+    while (*link != NULL)
+    {
+        ring = *link;
+        if (__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE) &&
+            ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        {
+            *link = ring->next;
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    if (wbuf_len > 0)
+        write_out();
+    __atomic_add_fetch(&total_written, drained, __ATOMIC_RELAXED);
+    return drained;
+}
+
+/**
+ * Background thread that owns the access log file,
+ * rotates it on size and age
+ */
+static void *access_flush_worker(void *arg)
+{
+    long delay_ms = ACCESS_FLUSH_MIN_MS;
+    size_t reported = 0;
+    (void)arg;
+
+    while (__atomic_load_n(&flusher_run, __ATOMIC_ACQUIRE))
+    {
+        if (drain_rings() > 0)
+            delay_ms = ACCESS_FLUSH_MIN_MS;
+        else if (delay_ms < ACCESS_FLUSH_MAX_MS)
+            delay_ms *= 2;
+
+        if (total_dropped > reported)
+        {
+            LOG_ERROR("Access log dropped %zu records", total_dropped - reported);
+            reported = total_dropped;
+        }
+
+        if ((cfg.max_bytes > 0 && file_bytes >= cfg.max_bytes) ||
+            (cfg.rotate_sec > 0 && time(NULL) - opened_at >= (time_t)cfg.rotate_sec))
+            rotate_access_log();
+
+        // Backing off is cut short by a producer filling up
+        __atomic_store_n(&flush_kick, 0, __ATOMIC_RELEASE);
+        futex_wait_ms(&flush_kick, 0, (delay_ms < ACCESS_FLUSH_MAX_MS) ? delay_ms : ACCESS_FLUSH_MAX_MS);
+    }
+    drain_rings();
+    return NULL;
+}
+
+/**
+ * Moves any previous access log aside, opens a new one
+ * and starts the flusher. NULL config means defaults
+ */
+int init_access_log(const access_log_config *config)
+{
+    struct timespec real;
+    struct timespec mono;
+
+    memset(&cfg, 0, sizeof(cfg));
+    if (config != NULL)
+    {
+        cfg = *config;
+    }
+    else
+    {
+        cfg.max_bytes = ACCESS_LOG_MAX_BYTES;
+        cfg.rotate_sec = ACCESS_LOG_ROTATE_SEC;
+    }
+    if (cfg.path == NULL)
+        cfg.path = ACCESS_LOG_FILE;
+    if (cfg.sample == 0)
+        cfg.sample = 1;
+
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    wall_offset_ns = ((unsigned long)real.tv_sec - (unsigned long)mono.tv_sec) * 1000000000UL +
+                     (unsigned long)real.tv_nsec - (unsigned long)mono.tv_nsec;
+
+    if (access(cfg.path, F_OK) == 0)
+        move_aside();
+
+    if (open_access_file() != 0)
+    {
+        LOG_ERROR("%s unable to open %s", __func__, cfg.path);
+        return -1;
+    }
+
+    flusher_run = true;
+    flush_kick = 0;
+    if (pthread_create(&flusher, NULL, access_flush_worker, NULL) != 0)
+    {
+        LOG_ERROR("%s pthread_create", __func__);
+        flusher_run = false;
+        close(access_fd);
+        access_fd = -1;
+        return -1;
+    }
+    __atomic_store_n(&g_access_log, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Stops recording, writes out everything queued and closes the file
+ */
+void stop_access_log()
+{
+    if (access_fd < 0)
+        return;
+
+    __atomic_store_n(&g_access_log, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&flusher_run, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&flush_kick, 1, __ATOMIC_RELEASE);
+    futex_wake(&flush_kick);
+    pthread_join(flusher, NULL);
+
+    close(access_fd);
+    access_fd = -1;
+}
+
+/**
+ * Queues a copy of the record for the flusher. Successful requests
+ * are sampled, nothing blocks, the record is dropped if the ring is full
+ */
+void access_log_write(const access_record *rec)
+{
+    size_t head = 0;
+    access_ring *ring = NULL;
+
+    if (__atomic_load_n(&g_access_log, __ATOMIC_ACQUIRE) == false)
+        return;
+
+    ring = get_ring();
+    if (ring == NULL)
+        return;
+
+    if (rec->status < 400 && cfg.sample > 1 && (ring->seen++ % cfg.sample) != 0)
+        return;
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ACCESS_RING_SLOTS)
+    {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    memcpy(&ring->slots[head % ACCESS_RING_SLOTS], rec, offsetof(access_record, path) + rec->path_len);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    if (head + 1 - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) >= ACCESS_RING_SLOTS / 2 &&
+        __atomic_exchange_n(&flush_kick, 1, __ATOMIC_ACQ_REL) == 0)
+        futex_wake(&flush_kick);
+}
+
+/**
+ * Records written to the file and dropped so far
+ */
+void access_log_stats(size_t *written, size_t *dropped)
+{
+    *written = __atomic_load_n(&total_written, __ATOMIC_RELAXED);
+    // Drops still sitting in the rings are only counted on the next flush
+    *dropped = __atomic_load_n(&total_dropped, __ATOMIC_RELAXED);
+}
@@ -21,97 +21,624 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
-
 #include "logger.h"
 
+#include <ctype.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+log_level g_log_level = LOG_LEVEL_INFO;
+
 static int log_fd = -1;
 static unsigned int line_count = 0;
+static log_mode mode = LOG_MODE_TEXT;
+static log_file_header bin_header;
+
+// Rings of every thread that ever logged, the lock is only taken when
+// a thread logs for the first time and by the flusher
+static log_ring *ring_list = NULL;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+static pthread_t flusher;
+static bool flusher_run = false;
+// Lines are only recorded between init_logging and stop_logging,
+// before that the record format isn't known yet
+static bool log_ready = false;
+
+static __thread log_ring *tl_ring = NULL;
+static __thread bool tl_in_log = false;
+static __thread time_t tl_stamp_sec = 0;
+static __thread char tl_stamp[STAMP_LEN];
+
+static const char *level_names[] = {"ERROR", "INFO", "DEBUG"};
+
+// Bounds of LOG_SITE_SECTION provided by the linker,
+// weak so programs without any LOG_* call still link
+extern log_site __start_legion_logsites[] __attribute__((weak));
+extern log_site __stop_legion_logsites[] __attribute__((weak));
+
+static unsigned long read_tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+#endif
+}
+
+static unsigned long clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+/**
+ * Measures the TSC rate against CLOCK_MONOTONIC over 20ms and
+ * records a TSC / wall clock pair for legion-logdump
+ */
+static void calibrate_tsc()
+{
+    unsigned long tsc = 0;
+    unsigned long mono = 0;
+    struct timespec delay = {0, 20000000L};
+
+    mono = clock_ns(CLOCK_MONOTONIC);
+    tsc = read_tsc();
+    nanosleep(&delay, NULL);
+    bin_header.tsc_hz = (unsigned long)((double)(read_tsc() - tsc) * 1e9 /
+                                        (double)(clock_ns(CLOCK_MONOTONIC) - mono));
+
+    bin_header.tsc0 = read_tsc();
+    bin_header.realtime_ns0 = clock_ns(CLOCK_REALTIME);
+}
+
+/**
+ * Argument kinds of a printf format, * widths and precisions
+ * count as int arguments.
+ * Returns the number of arguments, -1 for conversions that
+ * can't be recorded raw (%n, long double) or too many arguments
+ */
+int log_parse_format(const char *fmt, unsigned char *args, int max_args)
+{
+    int nargs = 0;
+    bool is_long = false;
+    const char *p = fmt;
+
+    for (; *p != '\0'; p++)
+    {
+        if (*p != '%')
+            continue;
+
+        p++;
+        if (*p == '%')
+            continue;
+
+        while (*p != '\0' && strchr("-+ #0'", *p) != NULL)
+            p++;
+
+        if (*p == '*')
+        {
+            if (nargs == max_args)
+                return -1;
+            args[nargs++] = LOG_ARG_INT;
+            p++;
+        }
+        while (isdigit((unsigned char)*p))
+            p++;
+
+        if (*p == '.')
+        {
+            p++;
+            if (*p == '*')
+            {
+                if (nargs == max_args)
+                    return -1;
+                args[nargs++] = LOG_ARG_INT;
+                p++;
+            }
+            while (isdigit((unsigned char)*p))
+                p++;
+        }
+
+        is_long = false;
+        while (*p != '\0' && strchr("hlqjzt", *p) != NULL)
+        {
+            is_long = is_long || (*p != 'h');
+            p++;
+        }
+
+        if (nargs == max_args)
+            return -1;
+
+        switch (*p)
+        {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            args[nargs++] = is_long ? LOG_ARG_LONG : LOG_ARG_INT;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            args[nargs++] = LOG_ARG_DOUBLE;
+            break;
+        case 'p':
+            args[nargs++] = LOG_ARG_PTR;
+            break;
+        case 's':
+            args[nargs++] = LOG_ARG_STR;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return nargs;
+}
+
+/**
+ * Called when a logging thread exits, its ring is
+ * left to the flusher to drain and free
+ */
+static void release_ring(void *arg)
+{
+    log_ring *ring = (log_ring *)arg;
+    __atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static void create_ring_key()
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+
+/**
+ * Ring of the calling thread, allocated on its first log line
+ */
+static log_ring *get_ring()
+{
+    log_ring *ring = NULL;
+
+    if (tl_ring != NULL)
+        return tl_ring;
+
+    ring = calloc(1, sizeof(log_ring));
+    if (ring == NULL)
+        return NULL;
+
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_setspecific(ring_key, ring);
+
+    pthread_mutex_lock(&ring_lock);
+    ring->next = ring_list;
+    ring_list = ring;
+    pthread_mutex_unlock(&ring_lock);
+
+    tl_ring = ring;
+    return ring;
+}
+
+/**
+ * Binary log files start with the header and the table of
+ * every call site so they can be decoded without the binary
+ */
+static void write_binary_header()
+{
+    log_site *site = NULL;
+    unsigned int entry[2];
+    unsigned short len = 0;
+    FILE *fp = fdopen(dup(log_fd), "w");
+
+    if (fp == NULL)
+        return;
+
+    memcpy(bin_header.magic, LOG_BINARY_MAGIC, sizeof(bin_header.magic));
+    bin_header.version = LOG_BINARY_VERSION;
+    bin_header.nr_sites = (unsigned int)(__stop_legion_logsites - __start_legion_logsites);
+    fwrite(&bin_header, sizeof(bin_header), 1, fp);
 
+    for (site = __start_legion_logsites; site < __stop_legion_logsites; site++)
+    {
+        entry[0] = (unsigned int)site->level;
+        entry[1] = (unsigned int)site->line;
+        fwrite(entry, sizeof(entry), 1, fp);
+
+        len = (unsigned short)strlen(site->file);
+        fwrite(&len, sizeof(len), 1, fp);
+        fwrite(site->file, 1, len, fp);
+
+        len = (unsigned short)strlen(site->fmt);
+        fwrite(&len, sizeof(len), 1, fp);
+        fwrite(site->fmt, 1, len, fp);
+    }
+    fclose(fp);
+}
+
+static int open_log_file()
+{
+    const char *file = (mode == LOG_MODE_BINARY) ? BINARY_LOG_FILE : DEBUG_LOG_FILE;
+
+    log_fd = open(file, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (log_fd < 0)
+        return -1;
+
+    if (mode == LOG_MODE_BINARY)
+        write_binary_header();
+    return 0;
+}
+
+/**
+ * Only ever called on the flusher thread
+ */
 static void rotate_logs()
 {
     line_count = 0;
     close(log_fd);
-    rename(DEBUG_LOG_FILE, DEBUG_LOG_OLD);
-    log_fd = open(DEBUG_LOG_FILE, O_CREAT | O_WRONLY ,  0644);
-    if(log_fd < 0)
+    if (mode == LOG_MODE_BINARY)
+        rename(BINARY_LOG_FILE, BINARY_LOG_OLD);
+    else
+        rename(DEBUG_LOG_FILE, DEBUG_LOG_OLD);
+
+    if (open_log_file() != 0)
     {
         perror("rotate_logs: open");
         exit(EXIT_FAILURE);
     }
 }
 
+/**
+ * Writes one batch of lines and hands their slots back to the
+ * producers, lines are not retried if the write fails.
+ * Returns the number of lines in the batch
+ */
+static size_t write_batch(const struct iovec *iov, int iov_count, log_ring **rings,
+                          const size_t *tails, size_t nr_rings)
+{
+    size_t i = 0;
+
+    if (writev(log_fd, iov, iov_count) < 0)
+        perror("flush_rings: writev");
+
+    for (i = 0; i < nr_rings; i++)
+        __atomic_store_n(&rings[i]->tail, tails[i], __ATOMIC_RELEASE);
+    return (size_t)iov_count;
+}
+
+/**
+ * Writes out everything queued in all rings with as few writev
+ * calls as possible, lines of one thread stay in order.
+ * Returns the number of lines written, lines dropped
+ * since the last flush are added to *dropped
+ */
+static size_t flush_rings(size_t *dropped)
+{
+    int iov_count = 0;
+    size_t head = 0;
+    size_t tail = 0;
+    size_t written = 0;
+    size_t nr_batch = 0;
+    log_ring *ring = NULL;
+    log_ring **link = NULL;
+    log_ring *batch[LOG_IOV_BATCH];
+    size_t batch_tail[LOG_IOV_BATCH];
+    struct iovec iov[LOG_IOV_BATCH];
+
+    pthread_mutex_lock(&ring_lock);
+    for (ring = ring_list; ring != NULL; ring = ring->next)
+    {
+        *dropped += __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        tail = ring->tail;
+
+        while (tail != head)
+        {
+            if (iov_count == LOG_IOV_BATCH)
+            {
+                written += write_batch(iov, iov_count, batch, batch_tail, nr_batch);
+                iov_count = 0;
+                nr_batch = 0;
+            }
+
+            iov[iov_count].iov_base = ring->slots[tail % LOG_RING_SLOTS].buf;
+            iov[iov_count].iov_len = ring->slots[tail % LOG_RING_SLOTS].len;
+            iov_count++;
+            tail++;
+
+            if (nr_batch == 0 || batch[nr_batch - 1] != ring)
+                batch[nr_batch++] = ring;
+            batch_tail[nr_batch - 1] = tail;
+        }
+    }
+
+    if (iov_count > 0)
+        written += write_batch(iov, iov_count, batch, batch_tail, nr_batch);
+
+    // Rings of exited threads go once empty, nothing else can fill them
+    link = &ring_list;
+    while (*link != NULL)
+    {
+        ring = *link;
+        if (__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE) &&
+            ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        {
+            *link = ring->next;
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    line_count += (unsigned int)written;
+    if (line_count >= LOG_FILE_LIMIT)
+        rotate_logs();
+    return written;
+}
+
+/**
+ * Background thread that owns log_fd, polls the rings
+ * and backs off while nobody is logging
+ */
+static void *flush_worker(void *arg)
+{
+    long delay_ms = LOG_FLUSH_MIN_MS;
+    size_t dropped = 0;
+    struct timespec delay = {0, 0};
+    (void)arg;
+
+    while (__atomic_load_n(&flusher_run, __ATOMIC_ACQUIRE))
+    {
+        if (flush_rings(&dropped) > 0)
+            delay_ms = LOG_FLUSH_MIN_MS;
+        else if (delay_ms < LOG_FLUSH_MAX_MS)
+            delay_ms *= 2;
+
+        // Goes through our own ring, written on the next round
+        if (dropped > 0)
+        {
+            LOG_ERROR("Logger dropped %zu lines", dropped);
+            dropped = 0;
+        }
+
+        delay.tv_nsec = ((delay_ms < LOG_FLUSH_MAX_MS) ? delay_ms : LOG_FLUSH_MAX_MS) * 1000000L;
+        nanosleep(&delay, NULL);
+    }
+    flush_rings(&dropped);
+    return NULL;
+}
+
 /**
  * Check if previous log file existed,
  * if yes rename it to a backup file
- * and create new file for logging
+ * and create new file for logging,
+ * then start the flusher thread.
+ * Lines above level are not recorded
  */
-int init_logging()
+int init_logging(log_mode log_mode, log_level level)
 {
-#ifdef DEBUG
-    if (access(DEBUG_LOG_FILE, F_OK) == 0)
+    mode = log_mode;
+    g_log_level = level;
+
+    if (mode == LOG_MODE_BINARY)
+    {
+        calibrate_tsc();
+        if (access(BINARY_LOG_FILE, F_OK) == 0)
+            rename(BINARY_LOG_FILE, BINARY_LOG_OLD);
+    }
+    else if (access(DEBUG_LOG_FILE, F_OK) == 0)
     {
         rename(DEBUG_LOG_FILE, DEBUG_LOG_OLD);
     }
 
-    log_fd = open(DEBUG_LOG_FILE, O_CREAT | O_WRONLY ,  0644);
-    if (log_fd < 0)
+    if (open_log_file() != 0)
     {
         perror("init_logging: open");
         return -1;
     }
-#endif
+
+    flusher_run = true;
+    __atomic_store_n(&log_ready, true, __ATOMIC_RELEASE);
+    if (pthread_create(&flusher, NULL, flush_worker, NULL) != 0)
+    {
+        perror("init_logging: pthread_create");
+        flusher_run = false;
+        log_ready = false;
+        close(log_fd);
+        log_fd = -1;
+        return -1;
+    }
     return 0;
 }
 
 /**
- * Clear write buffered log_file contents to memory
- * and close the file pointer
+ * Stops the flusher after it wrote out everything
+ * queued so far and close the log file
  */
 void stop_logging()
 {
-#ifdef DEBUG
     if(log_fd < 0)
         return;
 
+    __atomic_store_n(&flusher_run, false, __ATOMIC_RELEASE);
+    pthread_join(flusher, NULL);
+    __atomic_store_n(&log_ready, false, __ATOMIC_RELEASE);
+
     close(log_fd);
     log_fd = -1;
-#endif
 }
 
 /**
- * Debug function to write the logs to a file
- * Currently work in progress
+ * Text record, the line formatted the way it is written out,
+ * the timestamp is only formatted once a second
  */
-void logline(const char * prefix, const char *fmt, ...)
+static size_t format_line(log_site *site, int err, char *buf, va_list args)
 {
-    va_list args;
+    int len = 0;
     size_t buf_len = 0;
-    time_t time_epoch = 0;
+    time_t now = 0;
     struct tm time_local;
-    char buffer[LOG_SIZE];
 
-    time(&time_epoch);
-    if (localtime_r(&time_epoch, &time_local) == NULL)
-        return;
+    // time() is served from the vDSO, localtime_r only runs once a second
+    now = time(NULL);
+    if (now != tl_stamp_sec && localtime_r(&now, &time_local) != NULL)
+    {
+        strftime(tl_stamp, STAMP_LEN, "%Y-%m-%d %H:%M:%S", &time_local);
+        tl_stamp_sec = now;
+    }
+
+    len = snprintf(buf, LOG_SIZE, "[%s] [%s] ", level_names[site->level], tl_stamp);
+    buf_len = (size_t)len;
+
+    if (site->level == LOG_LEVEL_ERROR && err != 0)
+    {
+        len = snprintf(buf + buf_len, LOG_SIZE - buf_len, "%s ", strerror(err));
+        buf_len += (size_t)len;
+    }
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-nonliteral"
-    buf_len = strftime(buffer, PREFIX_LEN, prefix, &time_local);
+    len = vsnprintf(buf + buf_len, LOG_SIZE - buf_len, site->fmt, args);
 #pragma GCC diagnostic pop
 
-    if(prefix[1] == 'E' && errno != 0)
+    // Truncated lines keep their newline
+    buf_len += (size_t)len;
+    if (buf_len >= LOG_SIZE)
     {
-        buf_len += (size_t) snprintf(buffer + buf_len, LOG_SIZE - buf_len - 1, "%s ", strerror(errno));
-        errno = 0;
+        buf_len = LOG_SIZE - 1;
+        buf[LOG_SIZE - 2] = '\n';
     }
+    return buf_len;
+}
 
-    va_start(args, fmt);
-    buf_len += (size_t) vsnprintf(buffer + buf_len, LOG_SIZE - buf_len - 1, fmt, args);
+/**
+ * Binary record, site id, TSC and the raw arguments, no formatting.
+ * Strings are copied since they may not outlive the call, and sites
+ * whose format can't be recorded raw store the formatted text instead
+ */
+static size_t format_record(log_site *site, int err, char *buf, va_list args)
+{
+    int i = 0;
+    int nargs = __atomic_load_n(&site->nargs, __ATOMIC_ACQUIRE);
+    long lval = 0;
+    double dval = 0;
+    const char *str = NULL;
+    unsigned short len = 0;
+    size_t avail = 0;
+    size_t pos = sizeof(log_record);
+    log_record *rec = (log_record *)buf;
+    unsigned char args_kind[LOG_MAX_ARGS];
+
+    rec->site = (unsigned int)(site - __start_legion_logsites);
+    rec->err = (site->level == LOG_LEVEL_ERROR) ? (unsigned short)err : 0;
+    rec->tsc = read_tsc();
+
+    if (nargs == -1)
+    {
+        // Same result on every thread, racing first uses are harmless
+        nargs = log_parse_format(site->fmt, args_kind, LOG_MAX_ARGS);
+        memcpy(site->args, args_kind, sizeof(args_kind));
+        __atomic_store_n(&site->nargs, (nargs < 0) ? -2 : nargs, __ATOMIC_RELEASE);
+        nargs = (nargs < 0) ? -2 : nargs;
+    }
+
+    if (nargs == -2)
+    {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+        i = vsnprintf(buf + pos + sizeof(len), LOG_SIZE - pos - sizeof(len), site->fmt, args);
+#pragma GCC diagnostic pop
+        len = (unsigned short)((i < (int)(LOG_SIZE - pos - sizeof(len))) ? i : (int)(LOG_SIZE - pos - sizeof(len)) - 1);
+        memcpy(buf + pos, &len, sizeof(len));
+        pos += sizeof(len) + len;
+        rec->len = (unsigned short)pos;
+        return pos;
+    }
+
+    for (i = 0; i < nargs; i++)
+    {
+        switch (site->args[i])
+        {
+        case LOG_ARG_INT:
+            lval = va_arg(args, int);
+            memcpy(buf + pos, &lval, sizeof(lval));
+            pos += sizeof(lval);
+            break;
+        case LOG_ARG_LONG:
+            lval = va_arg(args, long);
+            memcpy(buf + pos, &lval, sizeof(lval));
+            pos += sizeof(lval);
+            break;
+        case LOG_ARG_DOUBLE:
+            dval = va_arg(args, double);
+            memcpy(buf + pos, &dval, sizeof(dval));
+            pos += sizeof(dval);
+            break;
+        case LOG_ARG_PTR:
+            lval = (long)va_arg(args, void *);
+            memcpy(buf + pos, &lval, sizeof(lval));
+            pos += sizeof(lval);
+            break;
+        default:
+            // Room is kept for the arguments after this one,
+            // strings share what is left of the slot
+            str = va_arg(args, const char *);
+            if (str == NULL)
+                str = "(null)";
+            avail = LOG_SIZE - pos - sizeof(len) - (size_t)(nargs - i - 1) * (sizeof(lval) + sizeof(len));
+            len = (unsigned short)strnlen(str, avail / (size_t)(nargs - i));
+            memcpy(buf + pos, &len, sizeof(len));
+            memcpy(buf + pos + sizeof(len), str, len);
+            pos += sizeof(len) + len;
+            break;
+        }
+    }
+    rec->len = (unsigned short)pos;
+    return pos;
+}
+
+/**
+ * Records a LOG_* call into the calling thread's ring, no locks
+ * and no syscalls. Lines are dropped and counted when the ring
+ * is full, or when called from a signal handler interrupting
+ * this thread's logline
+ */
+void logline(log_site *site, ...)
+{
+    va_list args;
+    size_t head = 0;
+    log_ring *ring = NULL;
+    log_slot *slot = NULL;
+    int saved_errno = errno;
+
+    if (tl_in_log || __atomic_load_n(&log_ready, __ATOMIC_ACQUIRE) == false)
+        return;
+    tl_in_log = true;
+
+    ring = get_ring();
+    if (ring == NULL)
+        goto out;
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS)
+    {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        goto out;
+    }
+
+    slot = &ring->slots[head % LOG_RING_SLOTS];
+    va_start(args, site);
+    if (mode == LOG_MODE_BINARY)
+        slot->len = (unsigned int)format_record(site, saved_errno, slot->buf, args);
+    else
+        slot->len = (unsigned int)format_line(site, saved_errno, slot->buf, args);
     va_end(args);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
 
-    buf_len = (size_t) write(log_fd, buffer, buf_len);
+    // Error lines consume errno like the text logger always did
+    if (site->level == LOG_LEVEL_ERROR)
+        saved_errno = 0;
 
-    line_count++;
-    if(line_count == LOG_FILE_LIMIT)
-        rotate_logs();
-}
\ No newline at end of file
+out:
+    tl_in_log = false;
+    errno = saved_errno;
+}
@@ -22,172 +22,1016 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include "threadpool.h"
 
+#include <time.h>
+#include <sched.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define DEQUE_MASK (DEQUE_SIZE - 1)
+
 thpool_queue g_th_queue;
 
+// Serialises resize_threadpool against the monitor thread
+static pthread_mutex_t g_resize_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Worker owning the calling thread, NULL outside the pool
+static __thread th_worker *tl_worker = NULL;
+
+static void futex_wait(unsigned int *addr, unsigned int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned int *addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
 /**
- * Function to add task to the queue,
- * If the queue is full - 1 is returned
- * Check threadpool.h for queue size limits
+ * Owner side push onto the bottom of the deque
+ * Returns -1 if the deque is full
  */
-int add_task_to_queue(func_ptr_t f_ptr, void *arg)
+static int deque_push(ws_deque *dq, const th_task *task)
 {
-    size_t next = 0;
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    th_task *slot = NULL;
 
-    if (f_ptr == NULL)
+    if (b - t >= DEQUE_SIZE)
         return -1;
 
-    pthread_mutex_lock(&g_th_queue.qlock);
-    if (g_th_queue.queue_len == TASK_QUEUE_SIZE)
+    slot = &dq->buf[b & DEQUE_MASK];
+    __atomic_store_n(&slot->func, task->func, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->arg, task->arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->queued_ns, task->queued_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Owner side pop from the bottom, races thieves only for the last task
+ * Returns true if a task was taken
+ */
+static bool deque_pop(ws_deque *dq, th_task *task)
+{
+    bool found = true;
+    long t = 0;
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+    th_task *slot = &dq->buf[b & DEQUE_MASK];
+
+    __atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+    if (t > b)
     {
-        // Queue is full
-        pthread_mutex_unlock(&(g_th_queue.qlock));
-        return -1;
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+        return false;
     }
-    else if (g_th_queue.queue_len == 0)
+
+    task->func = __atomic_load_n(&slot->func, __ATOMIC_RELAXED);
+    task->arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+    task->queued_ns = __atomic_load_n(&slot->queued_ns, __ATOMIC_RELAXED);
+    if (t == b)
     {
-        g_th_queue.first = 0;
-        next = 0;
+        found = __atomic_compare_exchange_n(&dq->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
     }
-    else
+    return found;
+}
+
+/**
+ * Thief side steal from the top of another worker's deque
+ * Returns true if a task was taken
+ */
+static bool deque_steal(ws_deque *dq, th_task *task)
+{
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    long b = 0;
+    th_task *slot = NULL;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return false;
+
+    // Slot may be reused once top moves on, the CAS below discards such reads
+    slot = &dq->buf[t & DEQUE_MASK];
+    task->func = __atomic_load_n(&slot->func, __ATOMIC_RELAXED);
+    task->arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+    task->queued_ns = __atomic_load_n(&slot->queued_ns, __ATOMIC_RELAXED);
+    return __atomic_compare_exchange_n(&dq->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static bool deque_empty(ws_deque *dq)
+{
+    return __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Claims up to count consecutive free slots of the ring with a single CAS
+ * Returns the number of slots claimed starting at *pos, 0 if the ring is full
+ */
+static size_t ring_claim(mpmc_ring *ring, size_t count, size_t *pos)
+{
+    size_t i = 0;
+    size_t seq = 0;
+    size_t start = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+
+    while (1)
+    {
+        // Slot start + i is free once its sequence caught up with it
+        for (i = 0; i < count; i++)
+        {
+            seq = __atomic_load_n(&ring->cells[(start + i) & ring->mask].seq, __ATOMIC_ACQUIRE);
+            if (seq != start + i)
+                break;
+        }
+
+        if (i == 0 && (long)(seq - start) < 0)
+            return 0;
+
+        if (i > 0 && __atomic_compare_exchange_n(&ring->enqueue_pos, &start, start + i, true,
+                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            *pos = start;
+            return i;
+        }
+
+        if (i == 0)
+            start = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Fills a claimed slot and makes it visible to consumers
+ */
+static void ring_publish(mpmc_ring *ring, size_t pos, const th_task *task)
+{
+    mpmc_cell *cell = &ring->cells[pos & ring->mask];
+
+    cell->task = *task;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Takes one task off the ring
+ * Returns true if a task was taken, false if the ring is empty
+ */
+static bool ring_pop(mpmc_ring *ring, th_task *task)
+{
+    long diff = 0;
+    mpmc_cell *cell = NULL;
+    size_t pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+
+    while (1)
+    {
+        cell = &ring->cells[pos & ring->mask];
+        diff = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *task = cell->task;
+    // Hand the slot to the producer one lap ahead
+    __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Approximate number of tasks waiting in the ring,
+ * claimed but unpublished slots are counted as well
+ */
+static size_t ring_len(mpmc_ring *ring)
+{
+    size_t head = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_ACQUIRE);
+    return (tail > head) ? tail - head : 0;
+}
+
+static unsigned long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+/**
+ * Wakes up to count parked workers, cheap when nobody is parked or
+ * an awake worker is already searching and will find the task.
+ * A parked worker consumes exactly one token, so workers already
+ * woken but not yet running are never woken twice, and all tokens
+ * of a batch go out with a single futex call.
+ * The fence pairs with the one in park_worker so a worker either
+ * sees the new task or gets a token
+ */
+static void wake_workers(unsigned int count)
+{
+    unsigned int tokens = 0;
+    unsigned int sleepers = 0;
+    unsigned int grant = 0;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g_th_queue.searching, __ATOMIC_RELAXED) > 0)
+        return;
+
+    do
+    {
+        tokens = __atomic_load_n(&g_th_queue.wake_tokens, __ATOMIC_RELAXED);
+        sleepers = __atomic_load_n(&g_th_queue.sleepers, __ATOMIC_RELAXED);
+        if (sleepers <= tokens)
+            return;
+
+        grant = (sleepers - tokens < count) ? sleepers - tokens : count;
+    } while (__atomic_compare_exchange_n(&g_th_queue.wake_tokens, &tokens, tokens + grant, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) == false);
+
+    futex_wake(&g_th_queue.wake_tokens, (int)grant);
+}
+
+/**
+ * Function to add a task of the given class to the queue,
+ * Workers push onto their own deque, everyone else
+ * goes through the class injection ring, -1 is returned if full
+ * Check threadpool.h for queue size limits
+ */
+int add_task_to_queue(task_class cls, func_ptr_t f_ptr, void *arg)
+{
+    size_t pos = 0;
+    th_task task = {f_ptr, arg, 0};
+
+    if (f_ptr == NULL || cls >= TASK_CLASS_COUNT)
+        return -1;
+
+    task.queued_ns = now_ns();
+    if (tl_worker != NULL && deque_push(&tl_worker->deque[cls], &task) == 0)
     {
-        next = (g_th_queue.last + 1) % TASK_QUEUE_SIZE;
+        wake_workers(1);
+        return 0;
     }
 
-    g_th_queue.queue[next].func = f_ptr;
-    g_th_queue.queue[next].arg = arg;
-    g_th_queue.last = next;
-    g_th_queue.queue_len++;
+    if (ring_claim(&g_th_queue.ring[cls], 1, &pos) == 0)
+    {
+        __atomic_add_fetch(&g_th_queue.rejected[cls], 1, __ATOMIC_RELAXED);
+        return -1;
+    }
 
-    pthread_cond_signal(&(g_th_queue.task_avail));
-    pthread_mutex_unlock(&(g_th_queue.qlock));
+    ring_publish(&g_th_queue.ring[cls], pos, &task);
+    wake_workers(1);
     return 0;
 }
 
 /**
- * Retireves a task struct from the queue,
- * the calling thread should have the qlock acquired
- * fills the task pointer with a function and argument
+ * Publishes a batch of tasks of one class, e.g. everything one
+ * epoll_wait returned, claiming ring slots with as few CAS as possible
+ * and waking all the workers needed with one futex call.
+ * Returns the number of leading tasks queued, the rest did not fit
+ */
+size_t add_tasks_batch(task_class cls, const th_task *tasks, size_t count)
+{
+    size_t i = 0;
+    size_t pos = 0;
+    size_t done = 0;
+    size_t claimed = 0;
+    size_t active = 0;
+    th_task task;
+
+    if (cls >= TASK_CLASS_COUNT)
+        return 0;
+
+    task.queued_ns = now_ns();
+    while (done < count)
+    {
+        claimed = ring_claim(&g_th_queue.ring[cls], count - done, &pos);
+        if (claimed == 0)
+            break;
+
+        for (i = 0; i < claimed; i++)
+        {
+            task.func = tasks[done + i].func;
+            task.arg = tasks[done + i].arg;
+            ring_publish(&g_th_queue.ring[cls], pos + i, &task);
+        }
+        done += claimed;
+    }
+
+    if (done < count)
+        __atomic_add_fetch(&g_th_queue.rejected[cls], count - done, __ATOMIC_RELAXED);
+
+    active = __atomic_load_n(&g_th_queue.nr_active, __ATOMIC_RELAXED);
+    if (done > 0)
+        wake_workers((unsigned int)((done < active) ? done : active));
+    return done;
+}
+
+/**
+ * Runs a task and accounts its queue wait to its class
+ */
+static void run_task(th_worker *self, task_class cls, th_task *task)
+{
+    unsigned long wait = now_ns() - task->queued_ns;
+    class_stats *stats = &self->stats[cls];
+
+    __atomic_store_n(&stats->completed, stats->completed + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->wait_ns, stats->wait_ns + wait, __ATOMIC_RELAXED);
+    if (wait > stats->max_wait_ns)
+        __atomic_store_n(&stats->max_wait_ns, wait, __ATOMIC_RELAXED);
+
+    if (g_th_queue.total_reserved > 0)
+        __atomic_add_fetch(&g_th_queue.busy[cls], 1, __ATOMIC_RELAXED);
+    task->func(task->arg);
+    if (g_th_queue.total_reserved > 0)
+        __atomic_sub_fetch(&g_th_queue.busy[cls], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Takes a fair share of a class injection ring, the first task is
+ * returned and the rest moved to the worker's deque of that class
+ * where idle workers can steal them without touching the ring
  */
-static void get_task_from_queue(th_task *task)
+static bool get_task_from_queue(th_worker *self, task_class cls, th_task *task)
 {
-    th_task *temp = NULL;
+    size_t count = 0;
+    size_t active = 0;
+    mpmc_ring *ring = &g_th_queue.ring[cls];
+    th_task temp;
+
     task->func = NULL;
     task->arg = NULL;
-    if (g_th_queue.queue_len == 0)
-        return;
+    count = ring_len(ring);
+    if (count == 0 || ring_pop(ring, task) == false)
+        return false;
+
+    active = __atomic_load_n(&g_th_queue.nr_active, __ATOMIC_RELAXED);
+    count = count / ((active > 0) ? active : 1);
+    if (count > DEQUE_SIZE / 2)
+        count = DEQUE_SIZE / 2;
+
+    for (; count > 0; count--)
+    {
+        if (ring_pop(ring, &temp) == false)
+            break;
+
+        // Own deque is drained before the ring is visited so this
+        // only fails if thieves lag far behind, run the task ourselves then
+        if (deque_push(&self->deque[cls], &temp) != 0)
+        {
+            run_task(self, cls, &temp);
+            break;
+        }
+    }
+
+    // Pass the baton if there is more than this worker can run right away
+    if (ring_len(ring) > 0 || deque_empty(&self->deque[cls]) == false)
+        wake_workers(1);
+    return true;
+}
+
+/**
+ * Steals one task of a class trying every other worker once,
+ * starting from a random victim, workers on our own NUMA node first
+ */
+static bool steal_task(th_worker *self, task_class cls, th_task *task)
+{
+    size_t i = 0;
+    size_t victim = 0;
+    size_t slots = __atomic_load_n(&g_th_queue.nr_slots, __ATOMIC_ACQUIRE);
+    int pass = 0;
+    int passes = (g_th_queue.nr_nodes > 1) ? 2 : 1;
+    th_worker *other = NULL;
+
+    // xorshift, only needs to spread thieves across victims
+    self->seed ^= self->seed << 13;
+    self->seed ^= self->seed >> 17;
+    self->seed ^= self->seed << 5;
+
+    for (pass = 0; pass < passes; pass++)
+    {
+        victim = self->seed % slots;
+        for (i = 0; i < slots; i++, victim = (victim + 1) % slots)
+        {
+            other = &g_th_queue.workers[victim];
+            if (other == self || (passes > 1 && (other->node == self->node) != (pass == 0)))
+                continue;
+
+            if (deque_steal(&other->deque[cls], task))
+                return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Checks whether a worker may start a task of cls without eating
+ * into the workers reserved for other classes. Pools too small to
+ * honour every reservation ignore them. Counts are racy snapshots,
+ * reservations are a best effort
+ */
+static bool may_run_class(task_class cls)
+{
+    int i = 0;
+    size_t busy = 0;
+    size_t unmet = 0;
+    size_t busy_total = 0;
+    size_t active = __atomic_load_n(&g_th_queue.nr_active, __ATOMIC_RELAXED);
+
+    if (g_th_queue.total_reserved == 0 || active <= g_th_queue.total_reserved)
+        return true;
+
+    for (i = 0; i < TASK_CLASS_COUNT; i++)
+    {
+        busy = __atomic_load_n(&g_th_queue.busy[i], __ATOMIC_RELAXED);
+        busy_total += busy;
+        if ((task_class)i == cls && busy < g_th_queue.reserved[i])
+            return true;
+        if ((task_class)i != cls && busy < g_th_queue.reserved[i])
+            unmet += g_th_queue.reserved[i] - busy;
+    }
+
+    // We are one of the free workers, others must still cover unmet
+    return active > busy_total && active - busy_total > unmet;
+}
+
+/**
+ * Picks the next task for a worker using smooth weighted round robin
+ * over the classes: every class earns its weight, the richest class
+ * with work runs and pays the total weight. A class found empty loses
+ * its credit so idle classes can't save up for a burst later.
+ * Each class is looked up in the own deque, ring, then other deques
+ * Returns the class of the task found or -1
+ */
+static int find_task(th_worker *self, th_task *task)
+{
+    int i = 0;
+    int j = 0;
+    int order[TASK_CLASS_COUNT];
+    task_class cls = TASK_INTERACTIVE;
+
+    for (i = 0; i < TASK_CLASS_COUNT; i++)
+    {
+        self->credit[i] += g_th_queue.weight[i];
+        // Insertion sort by credit, richest first
+        for (j = i; j > 0 && self->credit[order[j - 1]] < self->credit[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    for (i = 0; i < TASK_CLASS_COUNT; i++)
+    {
+        cls = (task_class)order[i];
+        if (may_run_class(cls) == false)
+            continue;
+
+        if (deque_pop(&self->deque[cls], task) || get_task_from_queue(self, cls, task) ||
+            steal_task(self, cls, task))
+        {
+            self->credit[cls] -= g_th_queue.total_weight;
+            return (int)cls;
+        }
+        self->credit[cls] = 0;
+    }
+    return -1;
+}
 
-    temp = &g_th_queue.queue[g_th_queue.first];
+static bool has_pending_work()
+{
+    int cls = 0;
+    size_t i = 0;
+    size_t slots = __atomic_load_n(&g_th_queue.nr_slots, __ATOMIC_ACQUIRE);
+
+    for (cls = 0; cls < TASK_CLASS_COUNT; cls++)
+    {
+        if (may_run_class((task_class)cls) == false)
+            continue;
+
+        if (ring_len(&g_th_queue.ring[cls]) > 0)
+            return true;
+
+        for (i = 0; i < slots; i++)
+        {
+            if (deque_empty(&g_th_queue.workers[i].deque[cls]) == false)
+                return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Sleeps on the futex until a submitter hands over a wake token,
+ * the queues are checked again after announcing ourselves
+ * so a task pushed in between is never missed
+ */
+static void park_worker(th_worker *self)
+{
+    unsigned int tokens = 0;
 
-    task->func = temp->func;
-    task->arg = temp->arg;
+    __atomic_add_fetch(&g_th_queue.sleepers, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&g_th_queue.searching, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-    temp->func = NULL;
-    temp->arg = NULL;
-    g_th_queue.queue_len--;
+    while (has_pending_work() == false && __atomic_load_n(&g_th_queue.is_run, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&self->retire, __ATOMIC_ACQUIRE) == false)
+    {
+        tokens = __atomic_load_n(&g_th_queue.wake_tokens, __ATOMIC_ACQUIRE);
+        if (tokens == 0)
+        {
+            futex_wait(&g_th_queue.wake_tokens, 0);
+            continue;
+        }
 
-    g_th_queue.first = (g_th_queue.first + 1) % TASK_QUEUE_SIZE;
+        if (__atomic_compare_exchange_n(&g_th_queue.wake_tokens, &tokens, tokens - 1, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            break;
+    }
+
+    __atomic_add_fetch(&g_th_queue.searching, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&g_th_queue.sleepers, 1, __ATOMIC_SEQ_CST);
 }
 
 /**
  * Main worker function to always keep running until
- * stop_threadpool is called, automatically fetches tasks
- * from queue and executes them.
+ * stop_threadpool is called or the worker is retired,
+ * runs tasks picked by find_task and parks when there are none
  */
 static void *thread_worker(void *arg)
 {
+    int i = 0;
+    int cls = 0;
     th_task task;
-    (void)arg;
-    while (g_th_queue.is_run)
-    {
-        pthread_mutex_lock(&g_th_queue.qlock);
+    size_t spins = 0;
+    th_worker *self = (th_worker *)arg;
 
-        while (g_th_queue.queue_len == 0 && g_th_queue.is_run == true)
-            pthread_cond_wait(&(g_th_queue.task_avail), &(g_th_queue.qlock));
+    tl_worker = self;
+    __atomic_add_fetch(&g_th_queue.searching, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&g_th_queue.is_run, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&self->retire, __ATOMIC_ACQUIRE) == false)
+    {
+        cls = find_task(self, &task);
+        if (cls >= 0)
+        {
+            spins = 0;
+            // Submitters skip the wakeup while anyone searches, the last
+            // searcher to stop hands the rest of the work to a parked worker
+            if (__atomic_sub_fetch(&g_th_queue.searching, 1, __ATOMIC_SEQ_CST) == 0 && has_pending_work())
+                wake_workers(1);
+            run_task(self, (task_class)cls, &task);
+            __atomic_add_fetch(&g_th_queue.searching, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
 
-        if (g_th_queue.is_run == false)
-            break;
+        if (++spins < g_th_queue.spin_limit)
+        {
+            sched_yield();
+            continue;
+        }
 
-        get_task_from_queue(&task);
-        pthread_mutex_unlock(&g_th_queue.qlock);
+        park_worker(self);
+        spins = 0;
+    }
 
-        if (task.func != NULL)
-            task.func(task.arg);
+    // Nobody else pushes to our deques, whatever is left would only be
+    // reachable by stealing so a retiring worker runs it before leaving
+    for (i = 0; i < TASK_CLASS_COUNT; i++)
+    {
+        while (__atomic_load_n(&g_th_queue.is_run, __ATOMIC_ACQUIRE) && deque_pop(&self->deque[i], &task))
+            run_task(self, (task_class)i, &task);
     }
-    pthread_mutex_unlock(&g_th_queue.qlock);
+
+    if (__atomic_sub_fetch(&g_th_queue.searching, 1, __ATOMIC_SEQ_CST) == 0 && has_pending_work())
+        wake_workers(1);
+    __atomic_store_n(&self->exited, true, __ATOMIC_RELEASE);
     return NULL;
 }
 
 /**
- * Initializes the threadpool queue and
- * launches THREAD_COUNT threads waiting for incoming tasks
+ * Places a worker on the CPU it is pinned to, or on all CPUs of
+ * its NUMA node so its deque stays in node local memory.
+ * Single node machines without pinning are left to the scheduler
  */
-int init_threadpool()
+static void place_worker(th_worker *worker, pthread_attr_t *attr)
+{
+    size_t i = 0;
+    cpu_set_t set;
+    cpu_slot *slot = NULL;
+
+    worker->cpu = -1;
+    worker->node = 0;
+    if (g_th_queue.nr_cpus == 0)
+        return;
+
+    slot = &g_th_queue.cpus[worker->index % g_th_queue.nr_cpus];
+    worker->cpu = slot->cpu;
+    worker->node = slot->node;
+
+    CPU_ZERO(&set);
+    if (g_th_queue.pin_threads)
+    {
+        CPU_SET((size_t)slot->cpu, &set);
+    }
+    else if (g_th_queue.nr_nodes > 1)
+    {
+        for (i = 0; i < g_th_queue.nr_cpus; i++)
+        {
+            if (g_th_queue.cpus[i].node == slot->node)
+                CPU_SET((size_t)g_th_queue.cpus[i].cpu, &set);
+        }
+    }
+    else
+    {
+        return;
+    }
+    pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/**
+ * Joins workers that finished retiring so their slots can be reused
+ * Needs g_resize_lock
+ */
+static void join_retired()
+{
+    size_t i = 0;
+    th_worker *worker = NULL;
+
+    for (i = 0; i < g_th_queue.nr_slots; i++)
+    {
+        worker = &g_th_queue.workers[i];
+        if (worker->running && __atomic_load_n(&worker->exited, __ATOMIC_ACQUIRE))
+        {
+            pthread_join(worker->thread, NULL);
+            worker->running = false;
+        }
+    }
+}
+
+/**
+ * Starts a worker in the lowest free slot
+ * Needs g_resize_lock, returns -1 if the pool is at max_threads
+ */
+static int grow_pool()
 {
     int res = 0;
     size_t i = 0;
+    th_worker *worker = NULL;
     pthread_attr_t thread_attr;
 
-    g_th_queue.first = 0;
-    g_th_queue.last = 0;
-    g_th_queue.is_run = true;
-    g_th_queue.queue_len = 0;
+    join_retired();
+    for (i = 0; i < g_th_queue.max_threads; i++)
+    {
+        if (g_th_queue.workers[i].running == false)
+            break;
+    }
+    if (i == g_th_queue.max_threads)
+        return -1;
 
-    res = pthread_mutex_init(&(g_th_queue.qlock), NULL);
-    if (res != 0)
+    worker = &g_th_queue.workers[i];
+    worker->index = i;
+    worker->seed = (unsigned int)(i * 2654435761U) | 1;
+    worker->retire = false;
+    worker->exited = false;
+
+    if (pthread_attr_init(&thread_attr) != 0)
         return -1;
 
-    res = pthread_cond_init(&(g_th_queue.task_avail), NULL);
+    res = pthread_attr_setstacksize(&thread_attr, PTHREAD_STACK_SIZE);
+    if (res == 0)
+    {
+        place_worker(worker, &thread_attr);
+        // Slot has to be visible to thieves before the worker can push
+        if (i >= g_th_queue.nr_slots)
+            __atomic_store_n(&g_th_queue.nr_slots, i + 1, __ATOMIC_RELEASE);
+        res = pthread_create(&worker->thread, &thread_attr, thread_worker, worker);
+    }
+    pthread_attr_destroy(&thread_attr);
     if (res != 0)
         return -1;
 
-    res = pthread_attr_init(&thread_attr);
-    if (res != 0)
+    worker->running = true;
+    __atomic_add_fetch(&g_th_queue.nr_active, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Asks the highest numbered active worker to retire, parked
+ * workers are all woken since the futex can't target one thread
+ * Needs g_resize_lock, returns -1 if the pool is at min_threads
+ */
+static int shrink_pool()
+{
+    size_t i = g_th_queue.nr_slots;
+    th_worker *worker = NULL;
+
+    if (g_th_queue.nr_active <= g_th_queue.min_threads)
         return -1;
 
-    res = pthread_attr_setstacksize(&thread_attr, PTHREAD_STACK_SIZE);
-    if (res != 0)
+    while (i-- > 0)
+    {
+        worker = &g_th_queue.workers[i];
+        if (worker->running && __atomic_load_n(&worker->retire, __ATOMIC_RELAXED) == false)
+            break;
+    }
+
+    __atomic_store_n(&worker->retire, true, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&g_th_queue.nr_active, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&g_th_queue.wake_tokens, __atomic_load_n(&g_th_queue.sleepers, __ATOMIC_ACQUIRE),
+                       __ATOMIC_SEQ_CST);
+    futex_wake(&g_th_queue.wake_tokens, INT_MAX);
+    return 0;
+}
+
+/**
+ * Samples the injection rings and adds a worker while tasks keep
+ * piling up faster than the pool drains them, e.g. workers stuck
+ * in pread, and retires one after a long stretch with idle workers
+ */
+static void *pool_monitor(void *arg)
+{
+    int i = 0;
+    size_t depth = 0;
+    size_t grow_ticks = 0;
+    size_t idle_ticks = 0;
+    struct timespec interval = {0, RESIZE_INTERVAL_MS * 1000000L};
+    (void)arg;
+
+    while (__atomic_load_n(&g_th_queue.is_run, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&interval, NULL);
+
+        depth = 0;
+        for (i = 0; i < TASK_CLASS_COUNT; i++)
+            depth += ring_len(&g_th_queue.ring[i]);
+        if (depth > __atomic_load_n(&g_th_queue.nr_active, __ATOMIC_RELAXED))
+        {
+            grow_ticks++;
+            idle_ticks = 0;
+        }
+        else if (depth == 0 && __atomic_load_n(&g_th_queue.sleepers, __ATOMIC_RELAXED) > 1)
+        {
+            idle_ticks++;
+            grow_ticks = 0;
+        }
+        else
+        {
+            grow_ticks = 0;
+            idle_ticks = 0;
+        }
+
+        pthread_mutex_lock(&g_resize_lock);
+        if (grow_ticks >= GROW_AFTER_TICKS)
+        {
+            grow_pool();
+            grow_ticks = 0;
+        }
+        else if (idle_ticks >= SHRINK_AFTER_TICKS)
+        {
+            shrink_pool();
+            idle_ticks = 0;
+        }
+        join_retired();
+        pthread_mutex_unlock(&g_resize_lock);
+    }
+    return NULL;
+}
+
+/**
+ * Number of workers currently taking tasks
+ */
+size_t threadpool_size()
+{
+    return __atomic_load_n(&g_th_queue.nr_active, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Grows or shrinks the pool to count workers, clamped to the
+ * configured bounds. Retiring workers finish their queued tasks first
+ * Returns 0 on success, -1 if a worker could not be started
+ */
+int resize_threadpool(size_t count)
+{
+    int res = 0;
+
+    if (count < g_th_queue.min_threads)
+        count = g_th_queue.min_threads;
+    if (count > g_th_queue.max_threads)
+        count = g_th_queue.max_threads;
+
+    pthread_mutex_lock(&g_resize_lock);
+    while (res == 0 && g_th_queue.nr_active < count)
+        res = grow_pool();
+    while (res == 0 && g_th_queue.nr_active > count)
+        res = shrink_pool();
+    pthread_mutex_unlock(&g_resize_lock);
+    return res;
+}
+
+/**
+ * Totals of one class over all workers, a worker retired since
+ * keeps its slot so its history is still counted
+ */
+void threadpool_class_stats(task_class cls, thpool_class_stats *stats)
+{
+    size_t i = 0;
+    size_t slots = __atomic_load_n(&g_th_queue.nr_slots, __ATOMIC_ACQUIRE);
+    th_worker *worker = NULL;
+    long depth = 0;
+
+    memset(stats, 0, sizeof(thpool_class_stats));
+    if (cls >= TASK_CLASS_COUNT || g_th_queue.ring[cls].cells == NULL)
+        return;
+
+    stats->queued = ring_len(&g_th_queue.ring[cls]);
+    stats->rejected = __atomic_load_n(&g_th_queue.rejected[cls], __ATOMIC_RELAXED);
+    for (i = 0; i < slots; i++)
+    {
+        worker = &g_th_queue.workers[i];
+        depth = __atomic_load_n(&worker->deque[cls].bottom, __ATOMIC_RELAXED) -
+                __atomic_load_n(&worker->deque[cls].top, __ATOMIC_RELAXED);
+        if (depth > 0)
+            stats->queued += (size_t)depth;
+
+        stats->completed += __atomic_load_n(&worker->stats[cls].completed, __ATOMIC_RELAXED);
+        stats->wait_ns += __atomic_load_n(&worker->stats[cls].wait_ns, __ATOMIC_RELAXED);
+        if (worker->stats[cls].max_wait_ns > stats->max_wait_ns)
+            stats->max_wait_ns = __atomic_load_n(&worker->stats[cls].max_wait_ns, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Initializes the threadpool queue with an injection ring of at
+ * least queue_size slots per task class and launches one worker
+ * per CPU the process may use, bounded by min_threads and max_threads.
+ * Unset config fields default to the detected CPU budget and
+ * DEFAULT_CLASS_WEIGHTS / DEFAULT_CLASS_RESERVED, config may be NULL
+ */
+int init_threadpool(const thpool_config *config)
+{
+    int cls = 0;
+    size_t i = 0;
+    size_t budget = detect_cpu_budget();
+    size_t capacity = 2;
+    unsigned int weights[TASK_CLASS_COUNT] = DEFAULT_CLASS_WEIGHTS;
+    size_t reserved[TASK_CLASS_COUNT] = DEFAULT_CLASS_RESERVED;
+    bool custom_classes = false;
+    thpool_config cfg;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.min_threads = budget;
+    cfg.max_threads = budget * 2;
+    cfg.queue_size = TASK_QUEUE_SIZE;
+
+    if (config != NULL)
+    {
+        cfg.pin_threads = config->pin_threads;
+        if (config->min_threads > 0)
+            cfg.min_threads = config->min_threads;
+        if (config->max_threads > 0)
+            cfg.max_threads = config->max_threads;
+        if (config->queue_size > 0)
+            cfg.queue_size = config->queue_size;
+
+        for (cls = 0; cls < TASK_CLASS_COUNT; cls++)
+            custom_classes = custom_classes || config->weight[cls] > 0 || config->reserved[cls] > 0;
+    }
+
+    if (cfg.max_threads > MAX_THREAD_COUNT)
+        cfg.max_threads = MAX_THREAD_COUNT;
+    if (cfg.min_threads < MIN_THREAD_COUNT)
+        cfg.min_threads = MIN_THREAD_COUNT;
+    if (cfg.min_threads > cfg.max_threads)
+        cfg.min_threads = cfg.max_threads;
+
+    while (capacity < cfg.queue_size)
+        capacity <<= 1;
+
+    g_th_queue.is_run = true;
+    g_th_queue.nr_slots = 0;
+    g_th_queue.nr_active = 0;
+    g_th_queue.min_threads = cfg.min_threads;
+    g_th_queue.max_threads = cfg.max_threads;
+    g_th_queue.pin_threads = cfg.pin_threads;
+    g_th_queue.has_monitor = false;
+    g_th_queue.wake_tokens = 0;
+    g_th_queue.sleepers = 0;
+    g_th_queue.searching = 0;
+    g_th_queue.spin_limit = (budget > 1) ? SPIN_BEFORE_PARK : 0;
+
+    g_th_queue.total_weight = 0;
+    g_th_queue.total_reserved = 0;
+    for (cls = 0; cls < TASK_CLASS_COUNT; cls++)
+    {
+        // A class without weight would never be picked while others have work
+        g_th_queue.weight[cls] = custom_classes ? config->weight[cls] : weights[cls];
+        if (g_th_queue.weight[cls] == 0)
+            g_th_queue.weight[cls] = 1;
+        g_th_queue.reserved[cls] = custom_classes ? config->reserved[cls] : reserved[cls];
+        g_th_queue.total_weight += g_th_queue.weight[cls];
+        g_th_queue.total_reserved += g_th_queue.reserved[cls];
+        g_th_queue.busy[cls] = 0;
+        g_th_queue.rejected[cls] = 0;
+    }
+
+    g_th_queue.nr_cpus = detect_cpu_topology(&g_th_queue.cpus);
+    g_th_queue.nr_nodes = (g_th_queue.nr_cpus > 0) ? 1 : 0;
+    for (i = 1; i < g_th_queue.nr_cpus; i++)
+    {
+        if (g_th_queue.cpus[i].node != g_th_queue.cpus[i - 1].node)
+            g_th_queue.nr_nodes++;
+    }
+
+    g_th_queue.workers = aligned_alloc(CACHE_LINE_SIZE, cfg.max_threads * sizeof(th_worker));
+    if (g_th_queue.workers == NULL)
+    {
+        stop_threadpool();
         return -1;
+    }
+    memset(g_th_queue.workers, 0, cfg.max_threads * sizeof(th_worker));
 
-    for (i = 0; i < TASK_QUEUE_SIZE; i++)
+    for (cls = 0; cls < TASK_CLASS_COUNT; cls++)
     {
-        g_th_queue.queue[i].func = NULL;
-        g_th_queue.queue[i].arg = NULL;
+        g_th_queue.ring[cls].cells = calloc(capacity, sizeof(mpmc_cell));
+        if (g_th_queue.ring[cls].cells == NULL)
+        {
+            stop_threadpool();
+            return -1;
+        }
+
+        g_th_queue.ring[cls].mask = capacity - 1;
+        g_th_queue.ring[cls].enqueue_pos = 0;
+        g_th_queue.ring[cls].dequeue_pos = 0;
+        for (i = 0; i < capacity; i++)
+            g_th_queue.ring[cls].cells[i].seq = i;
     }
 
-    for (i = 0; i < THREAD_COUNT; i++)
+    if (resize_threadpool((budget > cfg.min_threads) ? budget : cfg.min_threads) != 0)
     {
-        res = pthread_create(&(g_th_queue.thread_arr[i]), &thread_attr, thread_worker, NULL);
-        if (res != 0)
+        stop_threadpool();
+        return -1;
+    }
+
+    if (cfg.min_threads < cfg.max_threads)
+    {
+        if (pthread_create(&g_th_queue.monitor, NULL, pool_monitor, NULL) != 0)
         {
             stop_threadpool();
             return -1;
         }
-        pthread_detach(g_th_queue.thread_arr[i]);
+        g_th_queue.has_monitor = true;
     }
     return 0;
 }
 
 /**
- * Signals all threads to stop execution
- * and perform graceful shutdown
+ * Signals all threads to stop execution and waits for them,
+ * tasks still queued are dropped
  */
 void stop_threadpool()
 {
+    int cls = 0;
     size_t i = 0;
 
-    pthread_mutex_lock(&(g_th_queue.qlock));
-    g_th_queue.is_run = false;
-    g_th_queue.queue_len = 0;
-    for (i = 0; i < TASK_QUEUE_SIZE; i++)
+    __atomic_store_n(&g_th_queue.is_run, false, __ATOMIC_RELEASE);
+    if (g_th_queue.has_monitor)
+        pthread_join(g_th_queue.monitor, NULL);
+    g_th_queue.has_monitor = false;
+
+    if (g_th_queue.workers != NULL)
     {
-        g_th_queue.queue[i].func = NULL;
-        g_th_queue.queue[i].arg = NULL;
+        __atomic_add_fetch(&g_th_queue.wake_tokens, (unsigned int)g_th_queue.nr_slots, __ATOMIC_RELEASE);
+        futex_wake(&g_th_queue.wake_tokens, INT_MAX);
+
+        for (i = 0; i < g_th_queue.nr_slots; i++)
+        {
+            if (g_th_queue.workers[i].running)
+                pthread_join(g_th_queue.workers[i].thread, NULL);
+        }
+        free(g_th_queue.workers);
+        g_th_queue.workers = NULL;
     }
-    pthread_cond_broadcast(&(g_th_queue.task_avail));
-    pthread_mutex_unlock(&(g_th_queue.qlock));
+    g_th_queue.nr_slots = 0;
+    g_th_queue.nr_active = 0;
 
-    pthread_mutex_destroy(&(g_th_queue.qlock));
-    pthread_cond_destroy(&(g_th_queue.task_avail));
-}
\ No newline at end of file
+    free(g_th_queue.cpus);
+    g_th_queue.cpus = NULL;
+    for (cls = 0; cls < TASK_CLASS_COUNT; cls++)
+    {
+        free(g_th_queue.ring[cls].cells);
+        g_th_queue.ring[cls].cells = NULL;
+    }
+}
@@ -0,0 +1,263 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+#include "threadpool.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define NODE_ROOT "/sys/devices/system/node"
+
+/**
+ * Reads the first line of a small sysfs/procfs file
+ * Returns 0 on success, -1 if the file could not be read
+ */
+static int read_line(const char *path, char *buf, int len)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return -1;
+
+    if (fgets(buf, len, fp) == NULL)
+    {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+/**
+ * cgroup v2 limit, cpu.max of our own cgroup and of every
+ * parent up to the root, the tightest one wins
+ * Returns the number of CPUs allowed, 0 when unlimited
+ */
+static double cgroup_v2_limit()
+{
+    char line[PATH_MAX];
+    char group[PATH_MAX] = {0};
+    char path[PATH_MAX + 64];
+    char *slash = NULL;
+    double limit = 0;
+    double quota = 0;
+    double period = 0;
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+
+    if (fp == NULL)
+        return 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        // Unified hierarchy entry looks like 0::/path
+        if (strncmp(line, "0::", 3) == 0)
+        {
+            line[strcspn(line, "\n")] = '\0';
+            strncpy(group, line + 3, sizeof(group) - 1);
+            break;
+        }
+    }
+    fclose(fp);
+
+    while (1)
+    {
+        snprintf(path, sizeof(path), CGROUP_ROOT "%s/cpu.max", group);
+        if (read_line(path, line, sizeof(line)) == 0 &&
+            sscanf(line, "%lf %lf", &quota, &period) == 2 && period > 0)
+        {
+            if (limit == 0 || quota / period < limit)
+                limit = quota / period;
+        }
+
+        slash = strrchr(group, '/');
+        if (slash == NULL || group[0] == '\0')
+            break;
+        *slash = '\0';
+    }
+    return limit;
+}
+
+/**
+ * cgroup v1 limit from the cfs quota of the cpu controller,
+ * quota of -1 means unlimited
+ * Returns the number of CPUs allowed, 0 when unlimited
+ */
+static double cgroup_v1_limit()
+{
+    char line[64];
+    long quota = 0;
+    long period = 0;
+
+    if (read_line(CGROUP_ROOT "/cpu/cpu.cfs_quota_us", line, sizeof(line)) != 0 &&
+        read_line(CGROUP_ROOT "/cpu,cpuacct/cpu.cfs_quota_us", line, sizeof(line)) != 0)
+        return 0;
+    quota = strtol(line, NULL, 10);
+
+    if (read_line(CGROUP_ROOT "/cpu/cpu.cfs_period_us", line, sizeof(line)) != 0 &&
+        read_line(CGROUP_ROOT "/cpu,cpuacct/cpu.cfs_period_us", line, sizeof(line)) != 0)
+        return 0;
+    period = strtol(line, NULL, 10);
+
+    if (quota <= 0 || period <= 0)
+        return 0;
+    return (double)quota / (double)period;
+}
+
+/**
+ * Number of CPUs the pool can actually use, the affinity mask
+ * capped by the cgroup CPU quota rounded up
+ */
+size_t detect_cpu_budget()
+{
+    cpu_set_t set;
+    size_t budget = 0;
+    size_t quota = 0;
+    double limit = 0;
+
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        budget = (size_t)CPU_COUNT(&set);
+    else
+        budget = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+
+    limit = cgroup_v2_limit();
+    if (limit == 0)
+        limit = cgroup_v1_limit();
+
+    // A 1.5 CPU quota still keeps two workers busy part of the time
+    quota = (size_t)limit;
+    if ((double)quota < limit)
+        quota++;
+
+    if (quota > 0 && quota < budget)
+        budget = quota;
+
+    return (budget > 0) ? budget : 1;
+}
+
+/**
+ * Marks every CPU of a sysfs cpulist such as 0-3,8-11 with node
+ */
+static void parse_cpulist(const char *list, int node, int *cpu_node, int max_cpu)
+{
+    long lo = 0;
+    long hi = 0;
+    char *end = NULL;
+
+    while (*list != '\0')
+    {
+        lo = strtol(list, &end, 10);
+        if (end == list)
+            break;
+
+        hi = lo;
+        if (*end == '-')
+        {
+            list = end + 1;
+            hi = strtol(list, &end, 10);
+        }
+
+        for (; lo <= hi && lo < max_cpu; lo++)
+            cpu_node[lo] = node;
+
+        list = (*end == ',') ? end + 1 : end;
+    }
+}
+
+static int cmp_cpu_slot(const void *a, const void *b)
+{
+    const cpu_slot *x = (const cpu_slot *)a;
+    const cpu_slot *y = (const cpu_slot *)b;
+
+    if (x->node != y->node)
+        return x->node - y->node;
+    return x->cpu - y->cpu;
+}
+
+/**
+ * Lists the CPUs in our affinity mask with the NUMA node each
+ * belongs to, grouped by node so consecutive workers share a node.
+ * Machines without /sys node information are treated as one node.
+ * Returns the number of entries in *slots, caller frees it
+ */
+size_t detect_cpu_topology(cpu_slot **slots)
+{
+    int cpu = 0;
+    int node = 0;
+    int cpu_node[CPU_SETSIZE];
+    char path[PATH_MAX];
+    char list[4096];
+    size_t count = 0;
+    cpu_set_t set;
+    DIR *dir = NULL;
+    struct dirent *entry = NULL;
+
+    *slots = NULL;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return 0;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        cpu_node[cpu] = 0;
+
+    dir = opendir(NODE_ROOT);
+    if (dir != NULL)
+    {
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (strncmp(entry->d_name, "node", 4) != 0 || sscanf(entry->d_name + 4, "%d", &node) != 1)
+                continue;
+
+            snprintf(path, sizeof(path), NODE_ROOT "/%s/cpulist", entry->d_name);
+            if (read_line(path, list, sizeof(list)) == 0)
+                parse_cpulist(list, node, cpu_node, CPU_SETSIZE);
+        }
+        closedir(dir);
+    }
+
+    *slots = calloc((size_t)CPU_COUNT(&set), sizeof(cpu_slot));
+    if (*slots == NULL)
+        return 0;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET((size_t)cpu, &set) == 0)
+            continue;
+
+        (*slots)[count].cpu = cpu;
+        (*slots)[count].node = cpu_node[cpu];
+        count++;
+    }
+
+    qsort(*slots, count, sizeof(cpu_slot), cmp_cpu_slot);
+    return count;
+}
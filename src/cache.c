@@ -31,8 +31,8 @@
 // #include <zlib.h>
 // #include <brotli/encode.h>
 
-static size_t g_cache_size;
-static page_cache *g_cache;
+// Pages of the -a root, served to every host without pages of its own
+static page_namespace g_default_ns;
 const page_cache *page_404 = NULL;
 const page_cache *page_500 = NULL;
 
@@ -173,27 +173,35 @@ cleanup:
 }
  */
 /**
- * Function to perform cache cleanup
  * Releases all dynamically allocated memory and
- * open file descriptors of asset files
+ * open file descriptors of the namespace's asset files
  */
-void release_cache()
+void release_namespace(page_namespace *ns)
 {
     size_t i = 0;
-    if (g_cache == NULL)
-        return;
-    for (i = 0; i < g_cache_size; i++)
+    for (i = 0; ns->pages != NULL && i < ns->nr_pages; i++)
     {
-        if (g_cache[i].file_name != NULL)
-            free((void *)g_cache[i].file_name);
-        if (g_cache[i].fd > 0)
-            close(g_cache[i].fd);
-        if (g_cache[i].file_map != NULL)
-            munmap(g_cache[i].file_map, (size_t)g_cache[i].file_size);
+        if (ns->pages[i].file_name != NULL)
+            free((void *)ns->pages[i].file_name);
+        if (ns->pages[i].fd > 0)
+            close(ns->pages[i].fd);
+        if (ns->pages[i].file_map != NULL)
+            munmap(ns->pages[i].file_map, (size_t)ns->pages[i].file_size);
     }
-    free(g_cache);
-    g_cache = NULL;
-    g_cache_size = 0;
+    free(ns->pages);
+    free(ns->root);
+    free_hashtable(&ns->index);
+    memset(ns, 0, sizeof(page_namespace));
+}
+
+/**
+ * Function to perform cache cleanup
+ */
+void release_cache()
+{
+    release_namespace(&g_default_ns);
+    page_404 = NULL;
+    page_500 = NULL;
 }
 
 /**
@@ -207,7 +215,7 @@ const char *get_mime_type(const char *filename)
     const char *ptr = strrchr(filename, '.');
     if (ptr == NULL)
     {
-        LOG_ERROR("%s: mime type not defined for %s", filename);
+        LOG_ERROR("%s: mime type not defined for %s", __func__, filename);
         return DEFAULT_MIME_T;
     }
 
@@ -237,10 +245,10 @@ const char *get_mime_type(const char *filename)
 /**
  * Recursively add each file in the root directory
  * and sub directories to the cache for faster access
- * If g_cache is NULL while calling this function then
+ * If ns->pages is NULL while calling this function then
  * it only counts and returns the number of files.
  */
-static size_t recursive_read(const char *root_path, size_t curr_count, const long page_size)
+static size_t recursive_read(page_namespace *ns, const char *root_path, size_t curr_count, const long page_size)
 {
     struct dirent *entry;
     struct stat statbuf;
@@ -249,7 +257,9 @@ static size_t recursive_read(const char *root_path, size_t curr_count, const lon
     char fullpath[PATH_MAX];
     ssize_t path_len = 0;
 
-    if (g_cache == NULL)
+    page_cache *page = NULL;
+
+    if (ns->pages == NULL)
         is_insert = false;
 
     dir = opendir(root_path);
@@ -286,7 +296,7 @@ static size_t recursive_read(const char *root_path, size_t curr_count, const lon
             // Remove it after exiting for further use
             fullpath[path_len] = '/';
             fullpath[path_len + 1] = '\0';
-            curr_count = recursive_read(fullpath, curr_count, page_size);
+            curr_count = recursive_read(ns, fullpath, curr_count, page_size);
             fullpath[path_len] = '\0';
             continue;
         }
@@ -297,30 +307,35 @@ static size_t recursive_read(const char *root_path, size_t curr_count, const lon
             continue;
         }
 
-        // Need to perform error checking here in future
-        g_cache[curr_count].file_name = strdup(fullpath);
-        g_cache[curr_count].file_size = statbuf.st_size;
-        g_cache[curr_count].fd = open(fullpath, O_RDONLY);
-        g_cache[curr_count].file_map = NULL;
-        g_cache[curr_count].mime_type = get_mime_type(fullpath);
+        // Files showing up between the two passes are left for the next start
+        if (curr_count >= ns->nr_pages)
+            break;
 
-        if (g_cache[curr_count].file_size <= page_size)
+        // Need to perform error checking here in future
+        page = &ns->pages[curr_count];
+        page->file_name = strdup(fullpath);
+        page->file_size = statbuf.st_size;
+        page->fd = open(fullpath, O_RDONLY);
+        page->file_map = NULL;
+        page->mime_type = get_mime_type(fullpath);
+
+        if (page->file_size <= page_size)
         {
-            g_cache[curr_count].file_map = mmap(NULL, (size_t)g_cache[curr_count].file_size, PROT_READ, MAP_PRIVATE, g_cache[curr_count].fd, 0);
-            if (g_cache[curr_count].file_map == NULL)
+            page->file_map = mmap(NULL, (size_t)page->file_size, PROT_READ, MAP_PRIVATE, page->fd, 0);
+            if (page->file_map == NULL)
             {
                 LOG_ERROR("%s: mmap failed for %s", __func__, fullpath);
             }
         }
 
-        if (g_cache[curr_count].file_map != NULL)
+        if (page->file_map != NULL)
         {
-            LOG_INFO("mmap successful file: %s size: %lu", fullpath, g_cache[curr_count].file_size);
-            close(g_cache[curr_count].fd);
-            g_cache[curr_count].fd = -1;
+            LOG_INFO("mmap successful file: %s size: %lu", fullpath, page->file_size);
+            close(page->fd);
+            page->fd = -1;
         }
 
-        LOG_INFO("Adding file %s of type %s to cache", fullpath, g_cache[curr_count].mime_type);
+        LOG_INFO("Adding file %s of type %s to cache", fullpath, page->mime_type);
         curr_count++;
     }
     closedir(dir);
@@ -328,35 +343,86 @@ static size_t recursive_read(const char *root_path, size_t curr_count, const lon
 }
 
 /**
- * Construct the cache by calling above function twice
+ * Construct a namespace by calling above function twice
  * First to calculate the number of entries
- * Later to populate the cache entries
+ * Later to populate the entries, which are then indexed
+ * by their path relative to root_path
+ * Returns the number of pages, 0 on failure
  */
-size_t initiate_cache(const char *root_path)
+size_t load_namespace(page_namespace *ns, const char *root_path)
 {
+    size_t i = 0;
     size_t file_count = 0;
+    size_t root_len = strlen(root_path);
     long page_size = sysconf(_SC_PAGESIZE);
 
     if (page_size < 0)
         page_size = DEFAULT_PAGE_SIZE;
 
-    file_count = recursive_read(root_path, 0, page_size);
+    memset(ns, 0, sizeof(page_namespace));
+    // Paths are looked up relative to the root, which has to end in '/'
+    ns->root = malloc(root_len + 2);
+    if (ns->root == NULL)
+    {
+        LOG_ERROR("%s malloc", __func__);
+        return 0;
+    }
+    memcpy(ns->root, root_path, root_len + 1);
+    if (root_len == 0 || root_path[root_len - 1] != '/')
+    {
+        ns->root[root_len++] = '/';
+        ns->root[root_len] = '\0';
+    }
+    ns->root_len = root_len;
+
+    file_count = recursive_read(ns, ns->root, 0, page_size);
     if (file_count == 0)
     {
-        fprintf(stderr, "No assets found at %s\n", root_path);
+        fprintf(stderr, "No assets found at %s\n", ns->root);
+        release_namespace(ns);
         return 0;
     }
 
     // Allocates an array of struct and intitalizes it to zero
-    g_cache = (page_cache *)calloc(file_count, sizeof(page_cache));
-    if (g_cache == NULL)
+    ns->pages = (page_cache *)calloc(file_count, sizeof(page_cache));
+    if (ns->pages == NULL || init_hashtable(&ns->index, file_count) != 0)
     {
         LOG_ERROR("%s calloc", __func__);
+        free(ns->pages);
+        ns->pages = NULL;
+        release_namespace(ns);
         return 0;
     }
-    g_cache_size = recursive_read(root_path, 0, page_size);
-    page_404 = get_page_cache(ERROR_404_PAGE);
-    page_500 = get_page_cache(ERROR_500_PAGE);
+    ns->nr_pages = file_count;
+    ns->nr_pages = recursive_read(ns, ns->root, 0, page_size);
+
+    for (i = 0; i < ns->nr_pages; i++)
+    {
+        if (ns->pages[i].file_name == NULL ||
+            hashtable_insert(&ns->index, ns->pages[i].file_name + root_len,
+                             strlen(ns->pages[i].file_name + root_len), &ns->pages[i]) < 0)
+        {
+            LOG_ERROR("%s: unable to index %s", __func__, ns->root);
+            release_namespace(ns);
+            return 0;
+        }
+    }
+
+    ns->page_404 = get_namespace_page(ns, ERROR_404_PAGE);
+    ns->page_500 = get_namespace_page(ns, ERROR_500_PAGE);
+    return ns->nr_pages;
+}
+
+/**
+ * Builds the default namespace, it has to provide the error pages
+ */
+size_t initiate_cache(const char *root_path)
+{
+    if (load_namespace(&g_default_ns, root_path) == 0)
+        return 0;
+
+    page_404 = g_default_ns.page_404;
+    page_500 = g_default_ns.page_500;
     if (page_404 == NULL || page_500 == NULL)
     {
         LOG_ERROR("page 404 and page 500 are not defined");
@@ -364,26 +430,26 @@ size_t initiate_cache(const char *root_path)
         return 0;
     }
 
-    return g_cache_size;
+    return g_default_ns.nr_pages;
 }
 
 /**
- * Retrive a cache entry given a potential
- * filepath relative to asset directory
+ * Retrive a cache entry of the namespace given a
+ * potential filepath relative to its asset directory
  * Returns NULL if unable to find a matching cache entry
  */
-const page_cache *get_page_cache(const char *path)
+const page_cache *get_namespace_page(const page_namespace *ns, const char *path)
 {
-    size_t curr = 0;
-    const char *curr_path = NULL;
     if (*path == '\0')
-        return get_page_cache(INDEX_PAGE);
+        path = INDEX_PAGE;
 
-    for (; curr < g_cache_size; curr++)
-    {
-        curr_path = g_cache[curr].file_name + DEFAULT_ASSET_LEN - 1;
-        if (strcmp(curr_path, path) == 0)
-            return &g_cache[curr];
-    }
-    return NULL;
-}
\ No newline at end of file
+    return hashtable_lookup(&ns->index, path, strlen(path));
+}
+
+/**
+ * Retrive a cache entry of the default namespace
+ */
+const page_cache *get_page_cache(const char *path)
+{
+    return get_namespace_page(&g_default_ns, path);
+}
@@ -26,6 +26,74 @@
 
 static client_info clist[MAX_FD_COUNT];
 
+extern int g_epoll_fd;
+
+/**
+ * Drops any response still attached to the client
+ */
+static void reset_send_state(send_state *resp)
+{
+    arena_reset(&resp->arena);
+    resp->page = NULL;
+    resp->offset = 0;
+    resp->out = NULL;
+    resp->out_len = 0;
+    resp->chunk = NULL;
+}
+
+/**
+ * Drops early data that was never answered
+ * and requests that were never read whole
+ */
+static void reset_requests(client_info *cinfo)
+{
+    buf_free(cinfo->early_request, BUFFER_SIZE);
+    cinfo->early_request = NULL;
+    cinfo->early_len = 0;
+    buf_free(cinfo->req_buf, (size_t)cinfo->req_cap);
+    cinfo->req_buf = NULL;
+    cinfo->req_len = 0;
+    cinfo->req_cap = 0;
+}
+
+/**
+ * Gives back the buffers of a connection that is going away
+ */
+void release_client_buffers(client_info *cinfo)
+{
+    reset_send_state(&cinfo->resp);
+    reset_requests(cinfo);
+}
+
+/**
+ * Keeps the peer address for the access log,
+ * IPv4 mapped addresses are stored as plain IPv4
+ */
+void record_peer(client_info *cinfo)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&addr;
+
+    memset(&cinfo->access, 0, offsetof(access_record, path));
+    if (getpeername(cinfo->fd, (struct sockaddr *)&addr, &addr_len) != 0)
+        return;
+
+    if (addr.ss_family == AF_INET)
+    {
+        memcpy(cinfo->access.addr, &((const struct sockaddr_in *)&addr)->sin_addr, 4);
+    }
+    else if (addr.ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+    {
+        memcpy(cinfo->access.addr, &in6->sin6_addr.s6_addr[12], 4);
+    }
+    else if (addr.ss_family == AF_INET6)
+    {
+        memcpy(cinfo->access.addr, &in6->sin6_addr, 16);
+        cinfo->access.flags = ACCESS_FLAG_IPV6;
+    }
+}
+
 /**
  * Initiated list of to store incoming client connections
  */
@@ -37,6 +105,21 @@ void init_client_list()
         clist[curr].fd = -1;
         clist[curr].ssl = NULL;
         clist[curr].keep_alive = false;
+        clist[curr].is_parked = false;
+        clist[curr].async_file = false;
+        clist[curr].early_data = false;
+        clist[curr].early_request = NULL;
+        clist[curr].early_len = 0;
+        clist[curr].req_buf = NULL;
+        clist[curr].req_len = 0;
+        clist[curr].req_cap = 0;
+        clist[curr].rate_slot = -1;
+        clist[curr].h2 = NULL;
+        clist[curr].last_active = 0;
+        clist[curr].resp.chunk = NULL;
+        clist[curr].resp.arena.head = NULL;
+        clist[curr].access.status = 0;
+        reset_send_state(&clist[curr].resp);
     }
 }
 
@@ -49,6 +132,7 @@ void cleanup_client_list()
 
     for (curr = 0; curr < MAX_FD_COUNT; curr++)
     {
+        h2_free(&clist[curr]);
         if (clist[curr].ssl != NULL)
         {
             SSL_free(clist[curr].ssl);
@@ -60,51 +144,85 @@ void cleanup_client_list()
             close(clist[curr].fd);
             clist[curr].fd = -1;
         }
+        release_client_buffers(&clist[curr]);
     }
 }
 
 /**
  * Stores the metadata abour incoming client in an array for future use.
  * Since the file descriptor for each client is unique and won't exceed MAX_FD_COUNT
- * the clients are stored directly at the location indexed by file descriptor 
+ * the clients are stored directly at the location indexed by file descriptor.
+ * The rate limit slot of the connection is given back when it is removed
  */
-int add_client_info(const int client_fd, SSL *client_ssl)
+int add_client_info(const int client_fd, SSL *client_ssl, const int rate_slot)
 {
     if (client_fd < 0 || client_fd >= MAX_FD_COUNT || client_ssl == NULL)
     {
         LOG_ERROR("%s: Invalid client details received", __func__);
         return -1;
     }
-    clist[client_fd].fd = client_fd;
+    // Handshake workers add clients while the event loop reaps,
+    // the slot only shows up with a fresh timestamp
+    clist[client_fd].last_active = time(NULL);
     clist[client_fd].ssl = client_ssl;
     clist[client_fd].keep_alive = false;
+    clist[client_fd].is_parked = true;
+    clist[client_fd].rate_slot = rate_slot;
+    release_client_buffers(&clist[client_fd]);
+    TRACE_RESET(&clist[client_fd]);
+    __atomic_store_n(&clist[client_fd].fd, client_fd, __ATOMIC_RELEASE);
+    if (g_access_log)
+        record_peer(&clist[client_fd]);
     return 0;
 }
 
 /**
- * Removes client info from array using cinfo data directly
+ * Empties the slot and hands back the fd it held. The fd number
+ * can be accepted again by a handshake worker the moment it is
+ * closed, so the caller closes it only after the slot is cleared
  */
-void remove_client_info(client_info *cinfo)
+static int clear_client_info(client_info *cinfo)
 {
-    if (cinfo == NULL)
-    {
-        LOG_ERROR("%s: Invalid client details received", __func__);
-        return;
-    }
+    const int fd = cinfo->fd;
 
+    h2_free(cinfo);
+    __atomic_store_n(&cinfo->fd, -1, __ATOMIC_RELEASE);
     if(cinfo->ssl != NULL)
     {
         SSL_shutdown(cinfo->ssl);
-        SSL_free(cinfo->ssl);
+        // Failed connections leave errors behind which SSL_get_error
+        // would otherwise report for the next connection on this thread
+        ERR_clear_error();
+        release_client_ssl(cinfo->ssl);
         cinfo->ssl = NULL;
+        record_close();
     }
 
-    if(cinfo->fd >= 0)
+    rate_limit_disconnect(cinfo->rate_slot);
+    cinfo->rate_slot = -1;
+    cinfo->keep_alive = false;
+    cinfo->is_parked = false;
+    release_client_buffers(cinfo);
+    return fd;
+}
+
+/**
+ * Removes client info from array using cinfo data directly
+ */
+void remove_client_info(client_info *cinfo)
+{
+    int fd = -1;
+
+    if (cinfo == NULL)
     {
-        close(cinfo->fd);
-        cinfo->fd = -1;
+        LOG_ERROR("%s: Invalid client details received", __func__);
+        return;
     }
-    cinfo->keep_alive = false;
+
+    finish_request(cinfo, ACCESS_FLAG_ABORTED);
+    fd = clear_client_info(cinfo);
+    if(fd >= 0)
+        close(fd);
 }
 
 /**
@@ -115,16 +233,7 @@ void remove_client_info_fd(const int fd)
     if(fd < 0)
         return;
 
-    if(clist[fd].ssl != NULL)
-    {
-        SSL_shutdown(clist[fd].ssl);
-        SSL_free(clist[fd].ssl);
-        clist[fd].ssl = NULL;
-    }
-
-    close(clist[fd].fd);
-    clist[fd].fd = -1;
-    clist[fd].keep_alive = false;
+    close(clear_client_info(&clist[fd]));
 }
 
 /**
@@ -139,3 +248,60 @@ client_info *get_client_info(const int client_fd)
     }
     return &clist[client_fd];
 }
+
+/**
+ * Hands a connection back to epoll once a worker is done with it.
+ * The fd is registered with EPOLLONESHOT, so it stays disarmed while
+ * a worker owns it and gets re-armed here for the event it waits on
+ */
+void park_client(client_info *cinfo, conn_status status)
+{
+    struct epoll_event ev = {0};
+
+    if (status == CONN_CLOSE || status == CONN_DONE)
+    {
+        remove_client_info(cinfo);
+        return;
+    }
+
+    ev.events = EPOLLONESHOT | EPOLLRDHUP;
+    ev.events |= (status == CONN_WANT_WRITE) ? EPOLLOUT : EPOLLIN;
+    ev.data.fd = cinfo->fd;
+    // Idle until the client sends more, the 32KB of TLS record
+    // buffers are allocated again when it does
+    if (status == CONN_WANT_READ)
+        SSL_free_buffers(cinfo->ssl);
+
+    // Timestamp has to be fresh before the fd is visible to epoll again
+    // so the reaper never closes a connection a worker is about to pick up
+    cinfo->last_active = time(NULL);
+    cinfo->is_parked = true;
+    if (epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, cinfo->fd, &ev) != 0)
+    {
+        LOG_ERROR("%s epoll_ctl", __func__);
+        remove_client_info(cinfo);
+    }
+}
+
+/**
+ * Closes parked connections which made no progress for
+ * KEEP_ALIVE_TIMEOUT_SEC, either idle keep-alive clients
+ * or readers which stopped draining their socket
+ */
+void reap_idle_clients(const int epoll_fd, const time_t now)
+{
+    size_t curr = 0;
+
+    for (curr = 0; curr < MAX_FD_COUNT; curr++)
+    {
+        if (clist[curr].fd < 0 || clist[curr].is_parked == false)
+            continue;
+
+        if (now - clist[curr].last_active < KEEP_ALIVE_TIMEOUT_SEC)
+            continue;
+
+        LOG_INFO("Closing idle connection on client_fd: %d", clist[curr].fd);
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, clist[curr].fd, NULL);
+        remove_client_info(&clist[curr]);
+    }
+}
@@ -0,0 +1,696 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "server.h"
+#include "threadpool.h"
+
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <openssl/async.h>
+
+/**
+ * Handshake workers, a separate pool that accepts new connections and
+ * runs their TLS handshakes so full handshakes never hold up the event
+ * loop or the request workers. Every worker waits on the listening
+ * socket through its own epoll instance (EPOLLEXCLUSIVE, so a connection
+ * wakes one worker), drives any number of non-blocking handshakes at
+ * once and registers the established ones on g_epoll_fd, after which
+ * they are served like any other client. Workers run at a lower
+ * priority so a reconnect storm takes CPU from new clients rather than
+ * from the ones already connected.
+ *
+ * With async mode the handshakes run as OpenSSL ASYNC_JOBs, an engine
+ * able to offload private key operations then parks the job on a wait
+ * fd and the worker carries on with other handshakes in the meantime.
+ *
+ * With early data enabled, resumed TLS 1.3 handshakes read the requests
+ * the client sent along with its ClientHello. One a replay can do no
+ * harm with is answered right away, in the half round trip before the
+ * client finishes the handshake, the rest is handed over with the
+ * connection and answered once the handshake is done.
+ */
+
+extern bool server_run;
+extern int g_epoll_fd;
+extern SSL_CTX *g_ssl_ctx;
+
+typedef enum
+{
+    EARLY_NONE = 0,
+    // Reading early data, a request in it may still be answered
+    EARLY_READING,
+    // Sending the answer to the early request
+    EARLY_SENDING,
+    // Whatever else comes as early data waits for the handshake
+    EARLY_HOLDING
+} early_phase;
+
+typedef struct handshake_conn
+{
+    int fd;
+    SSL *ssl;
+    // Event the socket is registered for, EPOLLIN or EPOLLOUT
+    unsigned int events;
+    time_t deadline;
+    // No free ASYNC_JOB when last driven, retried every poll
+    bool want_job;
+    early_phase early;
+    // Early request answered without keep-alive, closed after the handshake
+    bool early_close;
+    // Early data not answered yet, NUL terminated
+    char *early_buf;
+    size_t early_len;
+    // Early request being answered
+    client_info *early_cinfo;
+    // Handed to the client_info along with the connection
+    int rate_slot;
+#ifdef PHASE_TRACE
+    unsigned long start;
+#endif
+    struct handshake_conn *prev;
+    struct handshake_conn *next;
+} handshake_conn;
+
+typedef struct
+{
+    pthread_t thread;
+    int epoll_fd;
+    bool started;
+    size_t want_job;
+    handshake_conn *conns;
+    // Finished connections, freed once the current batch of events
+    // is done since it may still hold events for them
+    handshake_conn *released;
+} handshake_worker;
+
+static slab_cache conn_slab = SLAB_CACHE(sizeof(handshake_conn));
+static slab_cache early_slab = SLAB_CACHE(sizeof(client_info));
+static handshake_worker *workers = NULL;
+static size_t nr_workers = 0;
+static int listen_fd = -1;
+static bool async_mode = false;
+static bool pool_run = false;
+
+/**
+ * Brings the epoll registrations of the async wait fds of the
+ * connection in line with what OpenSSL currently waits on
+ */
+static int handshake_async_fds(handshake_worker *worker, handshake_conn *conn)
+{
+    size_t i = 0;
+    size_t nr_add = 0;
+    size_t nr_del = 0;
+    OSSL_ASYNC_FD add_fds[HANDSHAKE_ASYNC_FDS];
+    OSSL_ASYNC_FD del_fds[HANDSHAKE_ASYNC_FDS];
+    struct epoll_event ev = {0};
+
+    if (SSL_get_changed_async_fds(conn->ssl, NULL, &nr_add, NULL, &nr_del) != 1 ||
+        nr_add > HANDSHAKE_ASYNC_FDS || nr_del > HANDSHAKE_ASYNC_FDS ||
+        SSL_get_changed_async_fds(conn->ssl, add_fds, &nr_add, del_fds, &nr_del) != 1)
+    {
+        LOG_ERROR("%s: unable to get async fds of client_fd: %d", __func__, conn->fd);
+        return -1;
+    }
+
+    for (i = 0; i < nr_del; i++)
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, del_fds[i], NULL);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    for (i = 0; i < nr_add; i++)
+    {
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, add_fds[i], &ev) != 0)
+        {
+            LOG_ERROR("%s epoll_ctl", __func__);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void handshake_unlink(handshake_worker *worker, handshake_conn *conn)
+{
+    size_t i = 0;
+    size_t nr_fds = 0;
+    OSSL_ASYNC_FD fds[HANDSHAKE_ASYNC_FDS];
+
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    // Jobs still in flight keep their wait fds
+    if (async_mode && SSL_get_all_async_fds(conn->ssl, NULL, &nr_fds) == 1 && nr_fds <= HANDSHAKE_ASYNC_FDS &&
+        SSL_get_all_async_fds(conn->ssl, fds, &nr_fds) == 1)
+    {
+        for (i = 0; i < nr_fds; i++)
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fds[i], NULL);
+    }
+
+    if (conn->want_job)
+        worker->want_job--;
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        worker->conns = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+}
+
+/**
+ * Drops the early request being answered, if any
+ */
+static void early_release(handshake_conn *conn)
+{
+    if (conn->early_cinfo != NULL)
+    {
+        finish_request(conn->early_cinfo, ACCESS_FLAG_ABORTED);
+        arena_reset(&conn->early_cinfo->resp.arena);
+        slab_free(&early_slab, conn->early_cinfo);
+        conn->early_cinfo = NULL;
+    }
+    buf_free(conn->early_buf, BUFFER_SIZE);
+    conn->early_buf = NULL;
+    conn->early_len = 0;
+}
+
+static void handshake_release(handshake_worker *worker, handshake_conn *conn)
+{
+    early_release(conn);
+    rate_limit_disconnect(conn->rate_slot);
+    conn->rate_slot = -1;
+    conn->fd = -1;
+    conn->ssl = NULL;
+    conn->next = worker->released;
+    worker->released = conn;
+}
+
+static void handshake_close(handshake_worker *worker, handshake_conn *conn)
+{
+    handshake_unlink(worker, conn);
+    // Failed handshakes leave errors behind for the next one on this thread
+    ERR_clear_error();
+    SSL_free(conn->ssl);
+    close(conn->fd);
+    handshake_release(worker, conn);
+}
+
+/**
+ * Passes an established connection on to the request workers
+ */
+static void handshake_done(handshake_worker *worker, handshake_conn *conn)
+{
+    int fd = conn->fd;
+    SSL *ssl = conn->ssl;
+    client_info *cinfo = NULL;
+    struct epoll_event ev = {0};
+
+    record_handshake(ssl, true);
+    handshake_unlink(worker, conn);
+    if (async_mode)
+        SSL_clear_mode(ssl, SSL_MODE_ASYNC);
+
+    if (conn->early_close || add_client_info(fd, ssl, conn->rate_slot) != 0)
+    {
+        SSL_shutdown(ssl);
+        ERR_clear_error();
+        release_client_ssl(ssl);
+        record_close();
+        close(fd);
+        handshake_release(worker, conn);
+        return;
+    }
+    conn->rate_slot = -1;
+    cinfo = get_client_info(fd);
+    TRACE_PHASE(cinfo, PHASE_HANDSHAKE, conn->start);
+    // The client waits for an answer rather than sending more,
+    // EPOLLOUT gets the request workers onto it right away
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    if (conn->early_len > 0)
+    {
+        cinfo->early_request = conn->early_buf;
+        cinfo->early_len = (int)conn->early_len;
+        conn->early_buf = NULL;
+        conn->early_len = 0;
+        ev.events = EPOLLOUT | EPOLLRDHUP | EPOLLONESHOT;
+    }
+    handshake_release(worker, conn);
+    if (h2_attach(cinfo) != 0)
+    {
+        remove_client_info(cinfo);
+        return;
+    }
+
+    // Oneshot so only one worker at a time ever owns the connection,
+    // cinfo belongs to the request workers as soon as it is armed
+    ev.data.fd = fd;
+    if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        LOG_ERROR("%s epoll_ctl", __func__);
+        remove_client_info(cinfo);
+        return;
+    }
+    LOG_INFO("Handshake complete on client_fd: %d", fd);
+}
+
+/**
+ * Waits for what the last SSL call asked for, err being its SSL_get_error
+ * Returns 0 once the connection waits, -1 if the call failed
+ */
+static int handshake_wait(handshake_worker *worker, handshake_conn *conn, int err)
+{
+    unsigned int events = 0;
+    struct epoll_event ev = {0};
+
+    switch (err)
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        events = (err == SSL_ERROR_WANT_READ) ? EPOLLIN : EPOLLOUT;
+        ev.events = events | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (async_mode && handshake_async_fds(worker, conn) != 0)
+            break;
+        if (events == conn->events || epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == 0)
+        {
+            conn->events = events;
+            return 0;
+        }
+        LOG_ERROR("%s epoll_ctl", __func__);
+        break;
+    case SSL_ERROR_WANT_ASYNC:
+        if (handshake_async_fds(worker, conn) == 0)
+            return 0;
+        break;
+    case SSL_ERROR_WANT_ASYNC_JOB:
+        conn->want_job = true;
+        worker->want_job++;
+        return 0;
+    default:
+        break;
+    }
+    return -1;
+}
+
+/**
+ * Starts answering the early data read so far if it is one whole
+ * request queue_early_response() accepts, anything else is held
+ * for the request workers. Returns 0 on success, -1 otherwise
+ */
+static int early_answer(handshake_conn *conn)
+{
+    const char *end = strstr(conn->early_buf, "\r\n\r\n");
+
+    // More to come
+    if (end == NULL && conn->early_len < BUFFER_SIZE - 1)
+        return 0;
+
+    conn->early = EARLY_HOLDING;
+    if (end == NULL || end + 4 != conn->early_buf + conn->early_len)
+        return 0;
+
+    conn->early_cinfo = slab_zalloc(&early_slab);
+    if (conn->early_cinfo == NULL)
+    {
+        LOG_ERROR("%s slab_zalloc", __func__);
+        return -1;
+    }
+    conn->early_cinfo->fd = conn->fd;
+    conn->early_cinfo->ssl = conn->ssl;
+    conn->early_cinfo->early_data = true;
+    conn->early_cinfo->rate_slot = conn->rate_slot;
+    if (g_access_log)
+        record_peer(conn->early_cinfo);
+
+    if (queue_early_response(conn->early_cinfo, conn->early_buf) != 0)
+    {
+        slab_free(&early_slab, conn->early_cinfo);
+        conn->early_cinfo = NULL;
+        return 0;
+    }
+    conn->early = EARLY_SENDING;
+    conn->early_len = 0;
+    conn->early_buf[0] = '\0';
+    return 0;
+}
+
+/**
+ * Reads early data until the client ends it, answering the request in
+ * it when early_answer() allows. Returns 1 once the handshake can go
+ * on, 0 while the connection waits, -1 on failure
+ */
+static int early_drive(handshake_worker *worker, handshake_conn *conn)
+{
+    int ret = 0;
+    size_t bytes = 0;
+    worker_metrics *metrics = NULL;
+    char buf[BUFFER_SIZE];
+
+    while (1)
+    {
+        if (conn->early == EARLY_SENDING)
+        {
+            ret = sendfile_to_client(conn->early_cinfo);
+            if (ret == CONN_WANT_READ || ret == CONN_WANT_WRITE)
+                return handshake_wait(worker, conn, (ret == CONN_WANT_READ) ? SSL_ERROR_WANT_READ : SSL_ERROR_WANT_WRITE);
+            if (ret != CONN_DONE)
+                return -1;
+
+            finish_request(conn->early_cinfo, 0);
+            conn->early_close = (conn->early_cinfo->keep_alive == false);
+            slab_free(&early_slab, conn->early_cinfo);
+            conn->early_cinfo = NULL;
+            conn->early = EARLY_HOLDING;
+            metrics = thread_metrics();
+            if (metrics != NULL)
+                METRIC_ADD(metrics, early_answered, 1);
+        }
+
+        ret = SSL_read_early_data(conn->ssl, buf, sizeof(buf), &bytes);
+        if (ret == SSL_READ_EARLY_DATA_FINISH)
+        {
+            conn->early = EARLY_NONE;
+            return 1;
+        }
+        if (ret != SSL_READ_EARLY_DATA_SUCCESS)
+            return handshake_wait(worker, conn, SSL_get_error(conn->ssl, 0));
+
+        // The early data limit keeps it within one request buffer
+        if (conn->early_buf == NULL)
+            conn->early_buf = buf_alloc(BUFFER_SIZE);
+        if (conn->early_buf == NULL || conn->early_len + bytes >= BUFFER_SIZE)
+            return -1;
+        memcpy(conn->early_buf + conn->early_len, buf, bytes);
+        conn->early_len += bytes;
+        conn->early_buf[conn->early_len] = '\0';
+
+        if (conn->early == EARLY_READING && early_answer(conn) != 0)
+            return -1;
+    }
+}
+
+/**
+ * Takes the handshake as far as it goes without blocking
+ */
+static void handshake_drive(handshake_worker *worker, handshake_conn *conn)
+{
+    int ret = 1;
+
+    if (conn->want_job)
+    {
+        conn->want_job = false;
+        worker->want_job--;
+    }
+
+    if (conn->early != EARLY_NONE)
+        ret = early_drive(worker, conn);
+    if (ret > 0)
+    {
+        ret = SSL_do_handshake(conn->ssl);
+        if (ret == 1)
+        {
+            handshake_done(worker, conn);
+            return;
+        }
+        ret = handshake_wait(worker, conn, SSL_get_error(conn->ssl, ret));
+    }
+    if (ret == 0)
+        return;
+
+    record_handshake(conn->ssl, false);
+    ERR_print_errors_cb(ssl_log_err, NULL);
+    handshake_close(worker, conn);
+}
+
+/**
+ * Accepts a batch of pending connections and starts their handshakes
+ */
+static void handshake_accept(handshake_worker *worker)
+{
+    int i = 0;
+    int client_fd = -1;
+    int rate_slot = -1;
+    handshake_conn *conn = NULL;
+    struct epoll_event ev = {0};
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_size = 0;
+
+    for (i = 0; i < HANDSHAKE_ACCEPT_BATCH; i++)
+    {
+        client_addr_size = sizeof(client_addr);
+        client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_addr_size);
+        if (client_fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                LOG_ERROR("%s accept", __func__);
+            }
+            return;
+        }
+
+        LOG_INFO("Incoming Connection from %s", get_ip_address((struct sockaddr *)&client_addr));
+        // Before any TLS work is spent on it
+        if (rate_limit_connect((struct sockaddr *)&client_addr, &rate_slot) != 0)
+        {
+            LOG_DEBUG("%s client over its limits, client_fd: %d", __func__, client_fd);
+            close(client_fd);
+            continue;
+        }
+
+        conn = slab_zalloc(&conn_slab);
+        if (conn == NULL || set_non_blocking(client_fd, true) != 0 || set_socket_nodelay(client_fd) != 0)
+        {
+            rate_limit_disconnect(rate_slot);
+            slab_free(&conn_slab, conn);
+            close(client_fd);
+            continue;
+        }
+        conn->rate_slot = rate_slot;
+
+        conn->ssl = new_client_ssl();
+        if (conn->ssl == NULL)
+        {
+            ERR_print_errors_cb(ssl_log_err, NULL);
+            rate_limit_disconnect(rate_slot);
+            slab_free(&conn_slab, conn);
+            close(client_fd);
+            continue;
+        }
+        SSL_set_fd(conn->ssl, client_fd);
+        SSL_set_accept_state(conn->ssl);
+        // Early data is only read as the first thing of a handshake
+        if (SSL_get_max_early_data(conn->ssl) > 0)
+            conn->early = EARLY_READING;
+        if (async_mode)
+            SSL_set_mode(conn->ssl, SSL_MODE_ASYNC);
+
+        conn->fd = client_fd;
+        conn->events = EPOLLIN;
+        conn->deadline = time(NULL) + TLS_TIMEOUT_SEC;
+#ifdef PHASE_TRACE
+        conn->start = trace_now();
+#endif
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) != 0)
+        {
+            LOG_ERROR("%s epoll_ctl", __func__);
+            SSL_free(conn->ssl);
+            rate_limit_disconnect(rate_slot);
+            slab_free(&conn_slab, conn);
+            close(client_fd);
+            continue;
+        }
+        conn->next = worker->conns;
+        if (worker->conns != NULL)
+            worker->conns->prev = conn;
+        worker->conns = conn;
+
+        // The ClientHello is usually there already
+        handshake_drive(worker, conn);
+    }
+}
+
+/**
+ * Retries the handshakes which found no free ASYNC_JOB and
+ * drops the ones which did not complete within TLS_TIMEOUT_SEC
+ */
+static void handshake_sweep(handshake_worker *worker, const time_t now, bool check_deadline)
+{
+    handshake_conn *conn = worker->conns;
+    handshake_conn *next = NULL;
+
+    while (conn != NULL)
+    {
+        next = conn->next;
+        if (check_deadline && now >= conn->deadline)
+        {
+            LOG_INFO("Handshake timed out on client_fd: %d", conn->fd);
+            record_handshake(conn->ssl, false);
+            handshake_close(worker, conn);
+        }
+        else if (conn->want_job)
+        {
+            handshake_drive(worker, conn);
+        }
+        conn = next;
+    }
+}
+
+static void handshake_free_released(handshake_worker *worker)
+{
+    handshake_conn *conn = NULL;
+
+    while (worker->released != NULL)
+    {
+        conn = worker->released;
+        worker->released = conn->next;
+        slab_free(&conn_slab, conn);
+    }
+}
+
+static void *handshake_worker_run(void *arg)
+{
+    int i = 0;
+    int nfds = 0;
+    time_t now = 0;
+    time_t last_sweep = 0;
+    handshake_worker *worker = arg;
+    handshake_conn *conn = NULL;
+    struct epoll_event events[HANDSHAKE_EVENTS];
+
+    // Only this thread, nice values are per thread on Linux
+    if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), HANDSHAKE_NICE) != 0)
+    {
+        LOG_DEBUG("%s: unable to lower the priority of handshake worker", __func__);
+    }
+    if (async_mode && ASYNC_init_thread(HANDSHAKE_ASYNC_JOBS, HANDSHAKE_ASYNC_JOBS) != 1)
+    {
+        LOG_ERROR("%s: unable to set up the async job pool", __func__);
+    }
+
+    while (pool_run && server_run)
+    {
+        nfds = epoll_wait(worker->epoll_fd, events, HANDSHAKE_EVENTS,
+                          worker->want_job > 0 ? HANDSHAKE_RETRY_MS : HANDSHAKE_POLL_MS);
+        if (nfds == -1 && errno != EINTR)
+        {
+            LOG_ERROR("%s epoll_wait", __func__);
+            break;
+        }
+
+        for (i = 0; i < nfds; i++)
+        {
+            conn = events[i].data.ptr;
+            if (conn == NULL)
+                handshake_accept(worker);
+            else if (conn->fd >= 0)
+                handshake_drive(worker, conn);
+        }
+
+        now = time(NULL);
+        if (worker->want_job > 0 || now != last_sweep)
+        {
+            if (now != last_sweep)
+                rate_limit_age();
+            handshake_sweep(worker, now, now != last_sweep);
+            last_sweep = now;
+        }
+        handshake_free_released(worker);
+    }
+
+    while (worker->conns != NULL)
+        handshake_close(worker, worker->conns);
+    handshake_free_released(worker);
+    if (async_mode)
+        ASYNC_cleanup_thread();
+    return NULL;
+}
+
+/**
+ * Starts nr_threads handshake workers accepting on server_fd, half the
+ * CPU budget when nr_threads is 0. Async mode is dropped with a log
+ * line on builds without ASYNC_JOB support
+ */
+int start_handshake_pool(const int server_fd, size_t nr_threads, bool use_async)
+{
+    struct epoll_event ev = {0};
+
+    if (nr_threads == 0)
+        nr_threads = (detect_cpu_budget() + 1) / 2;
+
+    async_mode = use_async;
+    if (async_mode && ASYNC_is_capable() == 0)
+    {
+        LOG_ERROR("%s: async jobs are not supported, handshakes run synchronously", __func__);
+        async_mode = false;
+    }
+
+    workers = calloc(nr_threads, sizeof(handshake_worker));
+    if (workers == NULL)
+    {
+        LOG_ERROR("%s calloc", __func__);
+        return -1;
+    }
+    listen_fd = server_fd;
+    pool_run = true;
+
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    for (nr_workers = 0; nr_workers < nr_threads; nr_workers++)
+    {
+        workers[nr_workers].epoll_fd = epoll_create1(0);
+        if (workers[nr_workers].epoll_fd == -1 ||
+            epoll_ctl(workers[nr_workers].epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) != 0 ||
+            pthread_create(&workers[nr_workers].thread, NULL, handshake_worker_run, &workers[nr_workers]) != 0)
+        {
+            LOG_ERROR("%s: unable to start handshake worker %zu", __func__, nr_workers);
+            // Counted so its epoll instance gets closed
+            nr_workers++;
+            stop_handshake_pool();
+            return -1;
+        }
+        workers[nr_workers].started = true;
+    }
+
+    LOG_INFO("Started %zu handshake workers%s", nr_workers, async_mode ? " with async jobs" : "");
+    return 0;
+}
+
+/**
+ * Joins the handshake workers, handshakes still in progress are dropped
+ */
+void stop_handshake_pool()
+{
+    size_t i = 0;
+
+    pool_run = false;
+    for (i = 0; i < nr_workers; i++)
+    {
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+        if (workers[i].epoll_fd >= 0)
+            close(workers[i].epoll_fd);
+    }
+    free(workers);
+    workers = NULL;
+    nr_workers = 0;
+}
@@ -0,0 +1,648 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "hpack.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Symbol 256, only ever seen as padding
+#define HUFFMAN_EOS      256
+#define HUFFMAN_EOS_CODE 0x3fffffff
+#define HUFFMAN_EOS_LEN  30
+// A full binary tree with 257 leaves
+#define HUFFMAN_NODES    256
+
+typedef struct
+{
+    const char *name;
+    const char *value;
+} hpack_static_entry;
+
+static const hpack_static_entry static_table[HPACK_STATIC_ENTRIES] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// Codes of RFC 7541 appendix B, right aligned
+static const uint32_t huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const unsigned char huffman_lens[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+// Children of each inner node, a leaf is stored as -(symbol + 1)
+// and 0 marks a code no symbol has, the root is never a child
+static short huffman_tree[HUFFMAN_NODES][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_add(int sym, uint32_t code, int len, int *nr_nodes)
+{
+    int bit = 0;
+    int node = 0;
+
+    for (; len > 1; len--)
+    {
+        bit = (int)((code >> (len - 1)) & 1);
+        if (huffman_tree[node][bit] == 0)
+            huffman_tree[node][bit] = (short)(*nr_nodes)++;
+        node = huffman_tree[node][bit];
+    }
+    huffman_tree[node][code & 1] = (short)-(sym + 1);
+}
+
+static void huffman_build()
+{
+    int sym = 0;
+    int nr_nodes = 1;
+
+    for (sym = 0; sym < HUFFMAN_EOS; sym++)
+        huffman_add(sym, huffman_codes[sym], huffman_lens[sym], &nr_nodes);
+    huffman_add(HUFFMAN_EOS, HUFFMAN_EOS_CODE, HUFFMAN_EOS_LEN, &nr_nodes);
+}
+
+/**
+ * Decodes a Huffman coded string a bit at a time, padding has
+ * to be the most significant bits of EOS, at most 7 of them.
+ * *out_len is the whole decoded length, only cap bytes are written
+ * Returns 0 on success, -1 otherwise
+ */
+static int huffman_decode(const unsigned char *in, size_t len, char *out, size_t cap, size_t *out_len)
+{
+    size_t i = 0;
+    int bit = 0;
+    int node = 0;
+    int child = 0;
+    int pad_bits = 0;
+    bool pad_ones = true;
+
+    *out_len = 0;
+    for (i = 0; i < len; i++)
+    {
+        for (bit = 7; bit >= 0; bit--)
+        {
+            child = huffman_tree[node][(in[i] >> bit) & 1];
+            if (child == 0)
+                return -1;
+
+            if (child > 0)
+            {
+                node = child;
+                pad_bits++;
+                pad_ones = pad_ones && ((in[i] >> bit) & 1);
+                continue;
+            }
+
+            if (child == -(HUFFMAN_EOS + 1))
+                return -1;
+            if (*out_len < cap)
+                out[*out_len] = (char)(-child - 1);
+            (*out_len)++;
+            node = 0;
+            pad_bits = 0;
+            pad_ones = true;
+        }
+    }
+    return (pad_bits <= 7 && pad_ones) ? 0 : -1;
+}
+
+/**
+ * Integer with an N bit prefix, the first byte's other bits
+ * belong to the representation
+ * Returns 0 on success, -1 if it is cut short or too large
+ */
+static int decode_int(const unsigned char **p, const unsigned char *end, int prefix, uint32_t *value)
+{
+    int shift = 0;
+    uint32_t max = (1U << prefix) - 1;
+    uint64_t v = 0;
+    unsigned char b = 0;
+
+    v = **p & max;
+    (*p)++;
+    if (v < max)
+    {
+        *value = (uint32_t)v;
+        return 0;
+    }
+
+    do
+    {
+        if (*p == end || shift > 28)
+            return -1;
+        b = *(*p)++;
+        v += (uint64_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    if (v > UINT32_MAX)
+        return -1;
+    *value = (uint32_t)v;
+    return 0;
+}
+
+/**
+ * Returns the bytes written, 0 if cap is too small
+ */
+static size_t encode_int(unsigned char *out, size_t cap, unsigned char first, int prefix, size_t value)
+{
+    size_t n = 0;
+    size_t max = (1U << prefix) - 1;
+
+    if (cap == 0)
+        return 0;
+    if (value < max)
+    {
+        out[0] = (unsigned char)(first | value);
+        return 1;
+    }
+
+    out[n++] = (unsigned char)(first | max);
+    value -= max;
+    while (value >= 0x80)
+    {
+        if (n == cap)
+            return 0;
+        out[n++] = (unsigned char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    if (n == cap)
+        return 0;
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+/**
+ * Decodes a string into out of cap bytes. One longer than that is
+ * still read past, *out_len is its length and out holds only a part
+ * Returns 0 on success, -1 on a malformed string
+ */
+static int decode_string(const unsigned char **p, const unsigned char *end, char *out, size_t cap, size_t *out_len)
+{
+    bool huffman = (**p & 0x80) != 0;
+    uint32_t len = 0;
+
+    if (decode_int(p, end, 7, &len) != 0 || len > (size_t)(end - *p))
+        return -1;
+
+    if (huffman)
+    {
+        if (huffman_decode(*p, len, out, cap, out_len) != 0)
+            return -1;
+    }
+    else
+    {
+        memcpy(out, *p, (len < cap) ? len : cap);
+        *out_len = len;
+    }
+    *p += len;
+    return 0;
+}
+
+static size_t encode_string(unsigned char *out, size_t cap, const char *str, size_t len)
+{
+    size_t n = encode_int(out, cap, 0, 7, len);
+
+    if (n == 0 || cap - n < len)
+        return 0;
+    memcpy(out + n, str, len);
+    return n + len;
+}
+
+static hpack_entry *table_entry(hpack_table *table, size_t i)
+{
+    return &table->entries[(table->first + i) % HPACK_MAX_ENTRIES];
+}
+
+static void table_evict(hpack_table *table)
+{
+    hpack_entry *entry = table_entry(table, table->count - 1);
+
+    table->size -= entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+    free(entry->name);
+    entry->name = NULL;
+    entry->value = NULL;
+    table->count--;
+}
+
+static void table_resize(hpack_table *table, size_t max_size)
+{
+    table->max_size = max_size;
+    while (table->size > max_size)
+        table_evict(table);
+}
+
+/**
+ * Adds an entry as the newest, evicting old ones to make room.
+ * One larger than the whole table just empties it
+ */
+static int table_add(hpack_table *table, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+    size_t entry_size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    hpack_entry *entry = NULL;
+    char *buf = NULL;
+
+    while (table->count > 0 && table->size + entry_size > table->max_size)
+        table_evict(table);
+    if (entry_size > table->max_size)
+        return 0;
+
+    buf = malloc(name_len + value_len + 2);
+    if (buf == NULL)
+        return -1;
+    memcpy(buf, name, name_len);
+    buf[name_len] = '\0';
+    memcpy(buf + name_len + 1, value, value_len);
+    buf[name_len + 1 + value_len] = '\0';
+
+    table->first = (table->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    entry = table_entry(table, 0);
+    entry->name = buf;
+    entry->name_len = (uint32_t)name_len;
+    entry->value = buf + name_len + 1;
+    entry->value_len = (uint32_t)value_len;
+    table->count++;
+    table->size += entry_size;
+    return 0;
+}
+
+/**
+ * Name and value of an index into the static and dynamic table,
+ * valid until the dynamic table changes
+ * Returns 0 on success, -1 if no such entry
+ */
+static int table_get(hpack_table *table, uint32_t index, const char **name, size_t *name_len, const char **value,
+                     size_t *value_len)
+{
+    const hpack_entry *entry = NULL;
+
+    if (index == 0 || index > HPACK_STATIC_ENTRIES + table->count)
+        return -1;
+
+    if (index <= HPACK_STATIC_ENTRIES)
+    {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        if (value != NULL)
+        {
+            *value = static_table[index - 1].value;
+            *value_len = strlen(*value);
+        }
+        return 0;
+    }
+
+    entry = table_entry(table, index - HPACK_STATIC_ENTRIES - 1);
+    *name = entry->name;
+    *name_len = entry->name_len;
+    if (value != NULL)
+    {
+        *value = entry->value;
+        *value_len = entry->value_len;
+    }
+    return 0;
+}
+
+/**
+ * Index of an entry with both name and value, 0 if there is none,
+ * name_index is set to one with the name at least
+ */
+static size_t table_find(hpack_table *table, const char *name, size_t name_len, const char *value, size_t value_len,
+                         size_t *name_index)
+{
+    size_t i = 0;
+    const hpack_entry *entry = NULL;
+
+    *name_index = 0;
+    for (i = 0; i < HPACK_STATIC_ENTRIES; i++)
+    {
+        if (strncmp(static_table[i].name, name, name_len) != 0 || static_table[i].name[name_len] != '\0')
+            continue;
+        if (strncmp(static_table[i].value, value, value_len) == 0 && static_table[i].value[value_len] == '\0')
+            return i + 1;
+        if (*name_index == 0)
+            *name_index = i + 1;
+    }
+
+    for (i = 0; i < table->count; i++)
+    {
+        entry = table_entry(table, i);
+        if (entry->name_len != name_len || memcmp(entry->name, name, name_len) != 0)
+            continue;
+        if (entry->value_len == value_len && memcmp(entry->value, value, value_len) == 0)
+            return HPACK_STATIC_ENTRIES + i + 1;
+        if (*name_index == 0)
+            *name_index = HPACK_STATIC_ENTRIES + i + 1;
+    }
+    return 0;
+}
+
+/**
+ * Empty table holding at most max_size, HPACK_TABLE_SIZE at most
+ */
+void hpack_init(hpack_table *table, size_t max_size)
+{
+    pthread_once(&huffman_once, huffman_build);
+    memset(table, 0, sizeof(hpack_table));
+    table->max_size = (max_size < HPACK_TABLE_SIZE) ? max_size : HPACK_TABLE_SIZE;
+    table->min_size = table->max_size;
+}
+
+void hpack_free(hpack_table *table)
+{
+    while (table->count > 0)
+        table_evict(table);
+}
+
+/**
+ * Decodes one complete header block, calling cb for every field in
+ * order. Literal strings are decoded into buf, which holds cap bytes
+ * and at least HPACK_TABLE_SIZE. Strings passed to cb only live until
+ * it returns. A field whose name and value do not fit in buf is left
+ * out, it still goes through the table so the block is decoded in full
+ * Returns 0 on success, 1 if fields were left out, -1 on a malformed
+ * block or when cb fails, the table is out of step with the peer then
+ */
+int hpack_decode(hpack_table *table, const unsigned char *in, size_t len, char *buf, size_t cap, hpack_field_cb cb,
+                 void *arg)
+{
+    uint32_t index = 0;
+    size_t name_len = 0;
+    size_t value_len = 0;
+    size_t used = 0;
+    bool indexing = false;
+    bool fields_seen = false;
+    bool left_out = false;
+    const char *name = NULL;
+    const char *value = NULL;
+    const unsigned char *p = in;
+    const unsigned char *end = in + len;
+
+    while (p < end)
+    {
+        if (*p & 0x80)
+        {
+            if (decode_int(&p, end, 7, &index) != 0 ||
+                table_get(table, index, &name, &name_len, &value, &value_len) != 0)
+                return -1;
+        }
+        else if ((*p & 0xe0) == 0x20)
+        {
+            // Table size updates only open a block
+            if (fields_seen || decode_int(&p, end, 5, &index) != 0 || index > HPACK_TABLE_SIZE)
+                return -1;
+            table_resize(table, index);
+            continue;
+        }
+        else
+        {
+            // With incremental indexing, without or never indexed
+            indexing = (*p & 0x40) != 0;
+            if (decode_int(&p, end, indexing ? 6 : 4, &index) != 0)
+                return -1;
+            // Copied, adding the field may evict the entry the name is from
+            if (index > 0)
+            {
+                if (table_get(table, index, &name, &name_len, NULL, NULL) != 0)
+                    return -1;
+                memcpy(buf, name, name_len);
+            }
+            else if (p == end || decode_string(&p, end, buf, cap, &name_len) != 0)
+            {
+                return -1;
+            }
+
+            // The value goes right after the name
+            used = (name_len < cap) ? name_len : cap;
+            if (p == end || decode_string(&p, end, buf + used, cap - used, &value_len) != 0)
+                return -1;
+            name = buf;
+            value = buf + used;
+            // Larger than the whole table, adding it only empties the table
+            // as it does on the peer's side, the strings are not read then
+            if (indexing && table_add(table, name, name_len, value, value_len) != 0)
+                return -1;
+        }
+
+        fields_seen = true;
+        if (name_len + value_len > cap)
+        {
+            left_out = true;
+            continue;
+        }
+        if (cb(name, name_len, value, value_len, arg) != 0)
+            return -1;
+    }
+    return left_out ? 1 : 0;
+}
+
+/**
+ * Applies SETTINGS_HEADER_TABLE_SIZE of the peer to an encoding table,
+ * the change goes out with the next header block
+ */
+void hpack_set_limit(hpack_table *table, size_t limit)
+{
+    size_t max_size = (limit < HPACK_TABLE_SIZE) ? limit : HPACK_TABLE_SIZE;
+
+    if (max_size == table->max_size)
+        return;
+    // A smaller size in between has to be signalled too
+    if (table->size_update == false || max_size < table->min_size)
+        table->min_size = max_size;
+    table_resize(table, max_size);
+    table->size_update = true;
+}
+
+/**
+ * Starts a header block, telling the peer about table size changes
+ * Returns the bytes written, 0 if there was nothing to tell
+ * or not enough room
+ */
+size_t hpack_encode_begin(hpack_table *table, unsigned char *out, size_t cap)
+{
+    size_t n = 0;
+    size_t m = 0;
+
+    if (table->size_update == false)
+        return 0;
+
+    if (table->min_size < table->max_size)
+    {
+        n = encode_int(out, cap, 0x20, 5, table->min_size);
+        if (n == 0)
+            return 0;
+    }
+    m = encode_int(out + n, cap - n, 0x20, 5, table->max_size);
+    if (m == 0)
+        return 0;
+    table->min_size = table->max_size;
+    table->size_update = false;
+    return n + m;
+}
+
+/**
+ * Appends one field, by index where the table has it already
+ * Returns the bytes written, 0 if cap is too small
+ */
+size_t hpack_encode(hpack_table *table, unsigned char *out, size_t cap, const char *name, size_t name_len,
+                    const char *value, size_t value_len, hpack_indexing indexing)
+{
+    size_t n = 0;
+    size_t m = 0;
+    size_t index = 0;
+    size_t name_index = 0;
+
+    index = table_find(table, name, name_len, value, value_len, &name_index);
+    if (index > 0)
+        return encode_int(out, cap, 0x80, 7, index);
+
+    if (indexing == HPACK_INDEX)
+        n = encode_int(out, cap, 0x40, 6, name_index);
+    else
+        n = encode_int(out, cap, 0x00, 4, name_index);
+    if (n == 0)
+        return 0;
+
+    if (name_index == 0)
+    {
+        m = encode_string(out + n, cap - n, name, name_len);
+        if (m == 0)
+            return 0;
+        n += m;
+    }
+    m = encode_string(out + n, cap - n, value, value_len);
+    if (m == 0)
+        return 0;
+
+    if (indexing == HPACK_INDEX && table_add(table, name, name_len, value, value_len) != 0)
+        return 0;
+    return n + m;
+}
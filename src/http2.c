@@ -0,0 +1,1230 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "server.h"
+#include "hpack.h"
+
+#include <stddef.h>
+
+/**
+ * HTTP/2 (RFC 9113) for connections which picked h2 through ALPN.
+ * Every connection multiplexes up to H2_MAX_STREAMS requests, each
+ * answered from the page cache as soon as its headers are in. DATA
+ * frames are copied from the cache into one output buffer, the stream
+ * to fill it from is picked by RFC 9218 urgency first, then stream id
+ * for sequential streams or a weighted round robin for incremental
+ * ones. PRIORITY weights of RFC 7540 mark a stream incremental.
+ * Request bodies are read and thrown away, their flow control window
+ * is handed back to the client right away.
+ */
+
+#define H2_PREFACE         "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN     24
+#define H2_FRAME_HEADER    9
+// SETTINGS_MAX_FRAME_SIZE default, the largest frame accepted and sent
+#define H2_MAX_FRAME       16384
+#define H2_DEFAULT_WINDOW  65535
+#define H2_MAX_WINDOW      0x7fffffff
+
+#define H2_MAX_STREAMS     100
+// Input holds one frame, output two full DATA frames
+#define H2_IN_SIZE         (H2_FRAME_HEADER + H2_MAX_FRAME)
+#define H2_OUT_SIZE        (2 * (H2_FRAME_HEADER + H2_MAX_FRAME))
+// Input frames are only processed while the output has room for
+// whatever they trigger, a response HEADERS frame at most
+#define H2_FRAME_ROOM      512
+// Smaller DATA frames wait for the output to drain
+#define H2_MIN_DATA        1024
+// Header block reassembled from HEADERS and CONTINUATION frames,
+// blocks in a single HEADERS frame are decoded in place. Requests
+// get as much room for their headers as on HTTP/1.1
+#define H2_BLOCK_SIZE      MAX_REQUEST_SIZE
+// RFC 9113 size of a header list, every field counts 32 bytes extra
+#define H2_FIELD_OVERHEAD  32
+
+// Frame types
+#define H2_DATA            0x0
+#define H2_HEADERS         0x1
+#define H2_PRIORITY        0x2
+#define H2_RST_STREAM      0x3
+#define H2_SETTINGS        0x4
+#define H2_PUSH_PROMISE    0x5
+#define H2_PING            0x6
+#define H2_GOAWAY          0x7
+#define H2_WINDOW_UPDATE   0x8
+#define H2_CONTINUATION    0x9
+#define H2_PRIORITY_UPDATE 0x10
+
+// Frame flags
+#define H2_FLAG_END_STREAM  0x01
+#define H2_FLAG_ACK         0x01
+#define H2_FLAG_END_HEADERS 0x04
+#define H2_FLAG_PADDED      0x08
+#define H2_FLAG_PRIORITY    0x20
+
+// Settings
+#define H2_SET_HEADER_TABLE_SIZE      0x1
+#define H2_SET_ENABLE_PUSH            0x2
+#define H2_SET_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SET_INITIAL_WINDOW_SIZE    0x4
+#define H2_SET_MAX_FRAME_SIZE         0x5
+#define H2_SET_MAX_HEADER_LIST_SIZE   0x6
+
+// Error codes
+#define H2_PROTOCOL_ERROR     0x1
+#define H2_INTERNAL_ERROR     0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR   0x6
+#define H2_REFUSED_STREAM     0x7
+#define H2_COMPRESSION_ERROR  0x9
+#define H2_ENHANCE_YOUR_CALM  0xb
+
+// RFC 9218 and RFC 7540 defaults
+#define H2_DEFAULT_URGENCY 3
+#define H2_MAX_URGENCY     7
+#define H2_DEFAULT_WEIGHT  16
+
+#define H2_STATS_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+extern const page_cache *page_404;
+extern const page_cache *page_500;
+extern bool g_stats_endpoint;
+extern bool g_vhosts_enabled;
+
+typedef struct
+{
+    // 0 while the slot is free
+    uint32_t id;
+    // Client still sends the request body
+    bool remote_open;
+    bool incremental;
+    unsigned char urgency;
+    unsigned short weight;
+    // Bytes sent scaled by weight, incremental streams take turns by it
+    unsigned long vtime;
+    int64_t window;
+    const page_cache *page;
+    // Rendered body sent instead of a page, the stats
+    char *body;
+    off_t offset;
+    off_t length;
+    access_record access;
+} h2_stream;
+
+struct h2_conn
+{
+    hpack_table decoder;
+    hpack_table encoder;
+    // Connection send window and the peer's settings
+    int64_t window;
+    int64_t initial_window;
+    size_t max_frame;
+    // Highest stream id the client opened
+    uint32_t last_stream;
+    bool preface;
+    bool settings;
+    // GOAWAY from the client, the connection closes once its streams are done
+    bool goaway;
+    // GOAWAY sent after a connection error
+    bool closing;
+    size_t nr_streams;
+    unsigned long vtime;
+    // Header block in reassembly, block_stream is 0 if there is none.
+    // block is only allocated for blocks that continue
+    uint32_t block_stream;
+    unsigned char block_flags;
+    unsigned short block_weight;
+    size_t block_len;
+    size_t in_len;
+    size_t out_len;
+    size_t out_pos;
+    unsigned char *block;
+    // One allocation while the connection is busy, released when idle
+    unsigned char *in;
+    unsigned char *out;
+    h2_stream streams[H2_MAX_STREAMS];
+};
+
+static slab_cache h2_slab = SLAB_CACHE(sizeof(struct h2_conn));
+
+/**
+ * Pseudo headers and the few fields a request is answered by
+ */
+typedef struct
+{
+    access_method method;
+    bool has_method;
+    bool has_priority;
+    // :path did not fit
+    bool bad_path;
+    // Header list over H2_BLOCK_SIZE, answered with 431
+    bool too_large;
+    size_t list_size;
+    bool incremental;
+    unsigned char urgency;
+    size_t path_len;
+    size_t authority_len;
+    char authority[VHOST_NAME_LEN + 1];
+    char path[PATH_MAX];
+} h2_request;
+
+/**
+ * Keeps the HTTP/2 memory gauge up to date
+ */
+static void count_memory(size_t bytes, bool release)
+{
+    worker_metrics *metrics = thread_metrics();
+
+    if (metrics != NULL)
+        METRIC_ADD(metrics, http2_memory, release ? -bytes : bytes);
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_u32(unsigned char *p, uint32_t value)
+{
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static void put_frame_header(unsigned char *p, size_t len, unsigned char type, unsigned char flags, uint32_t id)
+{
+    p[0] = (unsigned char)(len >> 16);
+    p[1] = (unsigned char)(len >> 8);
+    p[2] = (unsigned char)len;
+    p[3] = type;
+    p[4] = flags;
+    put_u32(p + 5, id & H2_MAX_WINDOW);
+}
+
+/**
+ * Appends a frame to the output, the caller made sure it fits
+ * Returns where its payload goes
+ */
+static unsigned char *h2_queue(struct h2_conn *h2, unsigned char type, unsigned char flags, uint32_t id, size_t len)
+{
+    unsigned char *p = h2->out + h2->out_len;
+
+    put_frame_header(p, len, type, flags, id);
+    h2->out_len += H2_FRAME_HEADER + len;
+    return p + H2_FRAME_HEADER;
+}
+
+static void h2_queue_u32(struct h2_conn *h2, unsigned char type, uint32_t id, uint32_t value)
+{
+    put_u32(h2_queue(h2, type, 0, id, 4), value);
+}
+
+/**
+ * Queues GOAWAY, nothing else is read off the connection
+ * Returns -1 for the caller to pass on
+ */
+static int h2_error(struct h2_conn *h2, uint32_t code)
+{
+    unsigned char *p = h2_queue(h2, H2_GOAWAY, 0, 0, 8);
+
+    LOG_ERROR("HTTP/2 connection error %u", code);
+    put_u32(p, h2->last_stream);
+    put_u32(p + 4, code);
+    h2->closing = true;
+    return -1;
+}
+
+static h2_stream *h2_find(struct h2_conn *h2, uint32_t id)
+{
+    size_t i = 0;
+
+    if (id == 0)
+        return NULL;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if (h2->streams[i].id == id)
+            return &h2->streams[i];
+    }
+    return NULL;
+}
+
+/**
+ * Frees the stream slot, the response is recorded if it was started
+ */
+static void h2_close_stream(client_info *cinfo, struct h2_conn *h2, h2_stream *stream, unsigned char flags)
+{
+    if (stream->access.status != 0)
+        record_response(cinfo->ssl, &stream->access, flags);
+    free(stream->body);
+    memset(stream, 0, sizeof(*stream));
+    h2->nr_streams--;
+}
+
+static void h2_reset_stream(client_info *cinfo, struct h2_conn *h2, h2_stream *stream, uint32_t code)
+{
+    h2_queue_u32(h2, H2_RST_STREAM, stream->id, code);
+    h2_close_stream(cinfo, h2, stream, ACCESS_FLAG_ABORTED);
+}
+
+/**
+ * Response sent in full. A stream whose request body is still coming
+ * stays until the body is read, so its window can be handed back
+ */
+static void h2_end_stream(client_info *cinfo, struct h2_conn *h2, h2_stream *stream)
+{
+    if (stream->remote_open == false)
+    {
+        h2_close_stream(cinfo, h2, stream, 0);
+        return;
+    }
+
+    record_response(cinfo->ssl, &stream->access, 0);
+    stream->access.status = 0;
+    free(stream->body);
+    stream->body = NULL;
+    stream->page = NULL;
+    stream->offset = 0;
+    stream->length = 0;
+}
+
+/**
+ * End of the request body, the stream is done if its response is
+ */
+static void h2_end_remote(client_info *cinfo, struct h2_conn *h2, h2_stream *stream)
+{
+    stream->remote_open = false;
+    if (stream->access.status == 0)
+        h2_close_stream(cinfo, h2, stream, 0);
+}
+
+/**
+ * Reads u and i out of an RFC 9218 priority field value,
+ * members and parameters it does not know are skipped
+ */
+static void parse_priority(const char *value, size_t len, unsigned char *urgency, bool *incremental)
+{
+    size_t pos = 0;
+    size_t end = 0;
+    size_t member_len = 0;
+    const char *member = NULL;
+
+    while (pos < len)
+    {
+        while (pos < len && (value[pos] == ' ' || value[pos] == '\t'))
+            pos++;
+        for (end = pos; end < len && value[end] != ','; end++)
+            ;
+
+        member = value + pos;
+        for (member_len = 0; member_len < end - pos && member[member_len] != ';' && member[member_len] != ' ';
+             member_len++)
+            ;
+        if (member_len == 3 && memcmp(member, "u=", 2) == 0 && member[2] >= '0' && member[2] <= '0' + H2_MAX_URGENCY)
+            *urgency = (unsigned char)(member[2] - '0');
+        else if ((member_len == 1 && member[0] == 'i') || (member_len == 4 && memcmp(member, "i=?1", 4) == 0))
+            *incremental = true;
+        else if (member_len == 4 && memcmp(member, "i=?0", 4) == 0)
+            *incremental = false;
+
+        pos = end + 1;
+    }
+}
+
+/**
+ * hpack_decode() callback, never fails so the
+ * decoder stays in step with the client's encoder
+ */
+static int h2_field(const char *name, size_t name_len, const char *value, size_t value_len, void *arg)
+{
+    h2_request *req = (h2_request *)arg;
+
+    req->list_size += name_len + value_len + H2_FIELD_OVERHEAD;
+    if (req->list_size > H2_BLOCK_SIZE)
+        req->too_large = true;
+
+    if (name_len == 7 && memcmp(name, ":method", 7) == 0)
+    {
+        req->has_method = true;
+        if (value_len == 3 && memcmp(value, "GET", 3) == 0)
+            req->method = ACCESS_METHOD_GET;
+        else if (value_len == 4 && memcmp(value, "HEAD", 4) == 0)
+            req->method = ACCESS_METHOD_HEAD;
+        else
+            req->method = ACCESS_METHOD_OTHER;
+    }
+    else if (name_len == 5 && memcmp(name, ":path", 5) == 0)
+    {
+        if (value_len >= sizeof(req->path))
+        {
+            req->bad_path = true;
+            return 0;
+        }
+        memcpy(req->path, value, value_len);
+        req->path[value_len] = '\0';
+        req->path_len = value_len;
+    }
+    else if ((name_len == 10 && memcmp(name, ":authority", 10) == 0) ||
+             (name_len == 4 && memcmp(name, "host", 4) == 0 && req->authority_len == 0))
+    {
+        if (value_len < sizeof(req->authority))
+        {
+            memcpy(req->authority, value, value_len);
+            req->authority_len = value_len;
+        }
+    }
+    else if (name_len == 8 && memcmp(name, "priority", 8) == 0)
+    {
+        req->has_priority = true;
+        parse_priority(value, value_len, &req->urgency, &req->incremental);
+    }
+    return 0;
+}
+
+/**
+ * Queues the HEADERS frame of a response
+ * Returns 0 on success, -1 if it does not fit
+ */
+static int h2_send_headers(struct h2_conn *h2, h2_stream *stream, const char *mime_type, const char *charset,
+                           off_t content_length, bool end_stream)
+{
+    size_t i = 0;
+    size_t len = 0;
+    size_t ret = 0;
+    size_t cap = 0;
+    unsigned char *frame = h2->out + h2->out_len;
+    char status[6];
+    char content_type[128];
+    char length[24];
+    const struct
+    {
+        const char *name;
+        const char *value;
+        hpack_indexing indexing;
+    } fields[] = {
+        {":status", status, HPACK_INDEX},
+        {"server", "legion", HPACK_INDEX},
+        {"content-type", content_type, HPACK_INDEX},
+        // Differs with nearly every page, would only push useful entries out
+        {"content-length", length, HPACK_NO_INDEX},
+    };
+
+    cap = H2_OUT_SIZE - h2->out_len - H2_FRAME_HEADER;
+    snprintf(status, sizeof(status), "%03u", stream->access.status);
+    snprintf(length, sizeof(length), "%ld", (long)content_length);
+    content_type[0] = '\0';
+    if (mime_type != NULL)
+    {
+        ret = (size_t)snprintf(content_type, sizeof(content_type), "%s%s", mime_type, charset);
+        if (ret >= sizeof(content_type))
+            return -1;
+    }
+
+    len = hpack_encode_begin(&h2->encoder, frame + H2_FRAME_HEADER, cap);
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+    {
+        // Responses without a body have no content-type
+        if (fields[i].value[0] == '\0')
+            continue;
+        ret = hpack_encode(&h2->encoder, frame + H2_FRAME_HEADER + len, cap - len, fields[i].name,
+                           strlen(fields[i].name), fields[i].value, strlen(fields[i].value), fields[i].indexing);
+        if (ret == 0)
+            return -1;
+        len += ret;
+    }
+
+    put_frame_header(frame, len, H2_HEADERS, H2_FLAG_END_HEADERS | (end_stream ? H2_FLAG_END_STREAM : 0), stream->id);
+    h2->out_len += H2_FRAME_HEADER + len;
+    stream->access.bytes += H2_FRAME_HEADER + len;
+    return 0;
+}
+
+/**
+ * Looks the request up and queues the response headers,
+ * the body follows as the scheduler gets to the stream
+ * Returns 0 on success, -1 on a connection error
+ */
+static int h2_respond(client_info *cinfo, struct h2_conn *h2, h2_stream *stream, const h2_request *req)
+{
+    size_t body_len = 0;
+    const char *name = req->path;
+    const char *mime_type = NULL;
+    const char *charset = "; charset=UTF-8";
+    const page_cache *page = NULL;
+    const page_namespace *ns = NULL;
+    worker_metrics *metrics = thread_metrics();
+
+    begin_request(&stream->access, req->method);
+    if (*name == '/')
+        name++;
+    if (g_access_log || TRACE_ENABLED)
+    {
+        stream->access.path_len = (unsigned short)((strlen(name) < ACCESS_PATH_LEN) ? strlen(name) : ACCESS_PATH_LEN);
+        memcpy(stream->access.path, name, stream->access.path_len);
+    }
+    LOG_DEBUG("HTTP/2 stream %u: /%s on client_fd: %d", stream->id, name, cinfo->fd);
+
+    stream->access.status = 200;
+    if (req->too_large)
+    {
+        LOG_ERROR("%s Request header over %d bytes on client_fd: %d", __func__, H2_BLOCK_SIZE, cinfo->fd);
+        stream->access.status = 431;
+    }
+    else if (req->has_method == false || req->method == ACCESS_METHOD_OTHER || req->bad_path || req->path_len == 0)
+    {
+        stream->access.status = 500;
+        page = page_500;
+    }
+    else if (g_stats_endpoint && strcmp(name, STATS_PATH) == 0)
+    {
+        stream->body = render_metrics(&body_len);
+        stream->length = (off_t)body_len;
+        mime_type = H2_STATS_TYPE;
+        charset = "";
+        if (stream->body == NULL)
+        {
+            stream->access.status = 500;
+            page = page_500;
+        }
+    }
+    else
+    {
+        ns = g_vhosts_enabled ? find_host_pages(req->authority, req->authority_len) : NULL;
+        page = (ns != NULL) ? get_namespace_page(ns, name) : get_page_cache(name);
+        if (page == NULL)
+        {
+            if (metrics != NULL)
+                METRIC_ADD(metrics, cache_misses, 1);
+            LOG_ERROR("%s Requested page %s not found", __func__, name);
+            stream->access.status = 404;
+            page = (ns != NULL && ns->page_404 != NULL) ? ns->page_404 : page_404;
+        }
+        else if (metrics != NULL)
+        {
+            METRIC_ADD(metrics, cache_hits, 1);
+        }
+    }
+
+    if (page != NULL)
+    {
+        stream->page = page;
+        stream->length = page->file_size;
+        mime_type = page->mime_type;
+        charset = "; charset=UTF-8";
+    }
+
+    body_len = (size_t)stream->length;
+    if (req->method == ACCESS_METHOD_HEAD)
+        stream->length = 0;
+    if (h2_send_headers(h2, stream, mime_type, charset, (off_t)body_len, stream->length == 0) != 0)
+        return h2_error(h2, H2_INTERNAL_ERROR);
+
+    if (stream->length == 0)
+        h2_end_stream(cinfo, h2, stream);
+    return 0;
+}
+
+/**
+ * Opens the stream of a complete header block, or drops
+ * the block of trailers and streams already gone
+ */
+static int h2_headers_done(client_info *cinfo, struct h2_conn *h2, const unsigned char *block, size_t len)
+{
+    size_t i = 0;
+    uint32_t id = h2->block_stream;
+    int ret = 0;
+    char *strings = NULL;
+    h2_stream *stream = NULL;
+    h2_request req;
+
+    req.method = ACCESS_METHOD_OTHER;
+    req.has_method = false;
+    req.has_priority = false;
+    req.bad_path = false;
+    req.too_large = false;
+    req.list_size = 0;
+    req.incremental = false;
+    req.urgency = H2_DEFAULT_URGENCY;
+    req.path_len = 0;
+    req.authority_len = 0;
+    req.path[0] = '\0';
+
+    h2->block_stream = 0;
+    strings = buf_alloc(H2_BLOCK_SIZE);
+    if (strings == NULL)
+    {
+        LOG_ERROR("%s buf_alloc", __func__);
+        return h2_error(h2, H2_INTERNAL_ERROR);
+    }
+    // Always decoded, the table has to see every block. Fields too
+    // large to keep only fail their own stream
+    ret = hpack_decode(&h2->decoder, block, len, strings, H2_BLOCK_SIZE, h2_field, &req);
+    buf_free(strings, H2_BLOCK_SIZE);
+    if (ret < 0)
+        return h2_error(h2, H2_COMPRESSION_ERROR);
+    if (ret > 0)
+        req.too_large = true;
+
+    if (id <= h2->last_stream)
+    {
+        // Trailers end the request body
+        stream = h2_find(h2, id);
+        if (stream != NULL && stream->remote_open && (h2->block_flags & H2_FLAG_END_STREAM))
+            h2_end_remote(cinfo, h2, stream);
+        return 0;
+    }
+    h2->last_stream = id;
+
+    if (h2->nr_streams == H2_MAX_STREAMS)
+    {
+        h2_queue_u32(h2, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+    if (rate_limit_request(cinfo->rate_slot) != 0)
+    {
+        h2_queue_u32(h2, H2_RST_STREAM, id, H2_ENHANCE_YOUR_CALM);
+        return 0;
+    }
+
+    for (i = 0; h2->streams[i].id != 0; i++)
+        ;
+    stream = &h2->streams[i];
+    h2->nr_streams++;
+    stream->id = id;
+    stream->remote_open = (h2->block_flags & H2_FLAG_END_STREAM) == 0;
+    stream->window = h2->initial_window;
+    stream->urgency = req.urgency;
+    stream->incremental = req.incremental;
+    stream->weight = H2_DEFAULT_WEIGHT;
+    stream->vtime = h2->vtime;
+    if (req.has_priority == false && h2->block_weight != 0)
+    {
+        stream->weight = h2->block_weight;
+        stream->incremental = true;
+    }
+    memcpy(stream->access.addr, cinfo->access.addr, sizeof(stream->access.addr));
+    stream->access.flags = cinfo->access.flags & ACCESS_FLAG_IPV6;
+    return h2_respond(cinfo, h2, stream, &req);
+}
+
+static int h2_on_headers(client_info *cinfo, struct h2_conn *h2, unsigned char flags, uint32_t id,
+                         const unsigned char *p, size_t len)
+{
+    size_t pad = 0;
+
+    if (id == 0 || (id & 1) == 0)
+        return h2_error(h2, H2_PROTOCOL_ERROR);
+
+    if (flags & H2_FLAG_PADDED)
+    {
+        if (len < 1 || p[0] >= len)
+            return h2_error(h2, H2_PROTOCOL_ERROR);
+        pad = p[0];
+        p++;
+        len -= 1 + pad;
+    }
+
+    h2->block_weight = 0;
+    if (flags & H2_FLAG_PRIORITY)
+    {
+        if (len < 5)
+            return h2_error(h2, H2_PROTOCOL_ERROR);
+        h2->block_weight = (unsigned short)(p[4] + 1);
+        p += 5;
+        len -= 5;
+    }
+
+    h2->block_stream = id;
+    h2->block_flags = flags;
+    if (flags & H2_FLAG_END_HEADERS)
+        return h2_headers_done(cinfo, h2, p, len);
+
+    if (h2->block == NULL)
+    {
+        h2->block = buf_alloc(H2_BLOCK_SIZE);
+        if (h2->block == NULL)
+        {
+            LOG_ERROR("%s buf_alloc", __func__);
+            return h2_error(h2, H2_INTERNAL_ERROR);
+        }
+    }
+    memcpy(h2->block, p, len);
+    h2->block_len = len;
+    return 0;
+}
+
+static int h2_on_continuation(client_info *cinfo, struct h2_conn *h2, unsigned char flags, uint32_t id,
+                              const unsigned char *p, size_t len)
+{
+    int ret = 0;
+
+    if (h2->block_stream == 0 || id != h2->block_stream)
+        return h2_error(h2, H2_PROTOCOL_ERROR);
+    if (len > H2_BLOCK_SIZE - h2->block_len)
+        return h2_error(h2, H2_ENHANCE_YOUR_CALM);
+
+    memcpy(h2->block + h2->block_len, p, len);
+    h2->block_len += len;
+    if ((flags & H2_FLAG_END_HEADERS) == 0)
+        return 0;
+
+    ret = h2_headers_done(cinfo, h2, h2->block, h2->block_len);
+    buf_free(h2->block, H2_BLOCK_SIZE);
+    h2->block = NULL;
+    return ret;
+}
+
+/**
+ * Request bodies are dropped, the window they used is given back
+ */
+static int h2_on_data(client_info *cinfo, struct h2_conn *h2, unsigned char flags, uint32_t id, const unsigned char *p, size_t len)
+{
+    h2_stream *stream = NULL;
+
+    if (id == 0 || id > h2->last_stream)
+        return h2_error(h2, H2_PROTOCOL_ERROR);
+    if ((flags & H2_FLAG_PADDED) && (len < 1 || p[0] >= len))
+        return h2_error(h2, H2_PROTOCOL_ERROR);
+
+    if (len > 0)
+        h2_queue_u32(h2, H2_WINDOW_UPDATE, 0, (uint32_t)len);
+
+    stream = h2_find(h2, id);
+    if (stream == NULL || stream->remote_open == false)
+        return 0;
+
+    if (flags & H2_FLAG_END_STREAM)
+        h2_end_remote(cinfo, h2, stream);
+    else if (len > 0)
+        h2_queue_u32(h2, H2_WINDOW_UPDATE, id, (uint32_t)len);
+    return 0;
+}
+
+static int h2_on_settings(struct h2_conn *h2, unsigned char flags, uint32_t id, const unsigned char *p, size_t len)
+{
+    size_t i = 0;
+    size_t s = 0;
+    uint32_t value = 0;
+    int64_t delta = 0;
+
+    if (id != 0)
+        return h2_error(h2, H2_PROTOCOL_ERROR);
+    if (flags & H2_FLAG_ACK)
+        return (len == 0) ? 0 : h2_error(h2, H2_FRAME_SIZE_ERROR);
+    if (len % 6 != 0)
+        return h2_error(h2, H2_FRAME_SIZE_ERROR);
+
+    for (i = 0; i < len; i += 6)
+    {
+        value = get_u32(p + i + 2);
+        switch (p[i] << 8 | p[i + 1])
+        {
+        case H2_SET_HEADER_TABLE_SIZE:
+            hpack_set_limit(&h2->encoder, value);
+            break;
+        case H2_SET_ENABLE_PUSH:
+            if (value > 1)
+                return h2_error(h2, H2_PROTOCOL_ERROR);
+            break;
+        case H2_SET_INITIAL_WINDOW_SIZE:
+            if (value > H2_MAX_WINDOW)
+                return h2_error(h2, H2_FLOW_CONTROL_ERROR);
+            // Applies to the windows of open streams as well
+            delta = (int64_t)value - h2->initial_window;
+            for (s = 0; s < H2_MAX_STREAMS; s++)
+            {
+                if (h2->streams[s].id == 0)
+                    continue;
+                h2->streams[s].window += delta;
+                if (h2->streams[s].window > H2_MAX_WINDOW)
+                    return h2_error(h2, H2_FLOW_CONTROL_ERROR);
+            }
+            h2->initial_window = value;
+            break;
+        case H2_SET_MAX_FRAME_SIZE:
+            if (value < H2_MAX_FRAME || value > 0xffffff)
+                return h2_error(h2, H2_PROTOCOL_ERROR);
+            break;
+        default:
+            break;
+        }
+    }
+
+    h2->settings = true;
+    h2_queue(h2, H2_SETTINGS, H2_FLAG_ACK, 0, 0);
+    return 0;
+}
+
+static int h2_on_window_update(client_info *cinfo, struct h2_conn *h2, uint32_t id, const unsigned char *p, size_t len)
+{
+    uint32_t increment = 0;
+    h2_stream *stream = NULL;
+
+    if (len != 4)
+        return h2_error(h2, H2_FRAME_SIZE_ERROR);
+    increment = get_u32(p) & H2_MAX_WINDOW;
+
+    if (id == 0)
+    {
+        if (increment == 0)
+            return h2_error(h2, H2_PROTOCOL_ERROR);
+        if (h2->window + increment > H2_MAX_WINDOW)
+            return h2_error(h2, H2_FLOW_CONTROL_ERROR);
+        h2->window += increment;
+        return 0;
+    }
+
+    if (id > h2->last_stream)
+        return h2_error(h2, H2_PROTOCOL_ERROR);
+    stream = h2_find(h2, id);
+    if (stream == NULL)
+        return 0;
+
+    if (increment == 0)
+        h2_reset_stream(cinfo, h2, stream, H2_PROTOCOL_ERROR);
+    else if (stream->window + increment > H2_MAX_WINDOW)
+        h2_reset_stream(cinfo, h2, stream, H2_FLOW_CONTROL_ERROR);
+    else
+        stream->window += increment;
+    return 0;
+}
+
+/**
+ * Handles one complete frame
+ * Returns 0 on success, -1 on a connection error
+ */
+static int h2_on_frame(client_info *cinfo, struct h2_conn *h2, unsigned char type, unsigned char flags, uint32_t id,
+                       const unsigned char *p, size_t len)
+{
+    h2_stream *stream = NULL;
+
+    // A header block is never interleaved with other frames,
+    // and the client's SETTINGS come right after the preface
+    if ((h2->block_stream != 0 && type != H2_CONTINUATION) || (h2->settings == false && type != H2_SETTINGS))
+        return h2_error(h2, H2_PROTOCOL_ERROR);
+
+    switch (type)
+    {
+    case H2_DATA:
+        return h2_on_data(cinfo, h2, flags, id, p, len);
+    case H2_HEADERS:
+        return h2_on_headers(cinfo, h2, flags, id, p, len);
+    case H2_CONTINUATION:
+        return h2_on_continuation(cinfo, h2, flags, id, p, len);
+    case H2_SETTINGS:
+        return h2_on_settings(h2, flags, id, p, len);
+    case H2_WINDOW_UPDATE:
+        return h2_on_window_update(cinfo, h2, id, p, len);
+    case H2_PRIORITY:
+        if (id == 0)
+            return h2_error(h2, H2_PROTOCOL_ERROR);
+        if (len != 5)
+            return h2_error(h2, H2_FRAME_SIZE_ERROR);
+        stream = h2_find(h2, id);
+        if (stream != NULL)
+            stream->weight = (unsigned short)(p[4] + 1);
+        return 0;
+    case H2_PRIORITY_UPDATE:
+        if (id != 0)
+            return h2_error(h2, H2_PROTOCOL_ERROR);
+        if (len < 4)
+            return h2_error(h2, H2_FRAME_SIZE_ERROR);
+        stream = h2_find(h2, get_u32(p) & H2_MAX_WINDOW);
+        if (stream != NULL)
+            parse_priority((const char *)p + 4, len - 4, &stream->urgency, &stream->incremental);
+        return 0;
+    case H2_RST_STREAM:
+        if (id == 0 || id > h2->last_stream)
+            return h2_error(h2, H2_PROTOCOL_ERROR);
+        if (len != 4)
+            return h2_error(h2, H2_FRAME_SIZE_ERROR);
+        stream = h2_find(h2, id);
+        if (stream != NULL)
+            h2_close_stream(cinfo, h2, stream, ACCESS_FLAG_ABORTED);
+        return 0;
+    case H2_PING:
+        if (id != 0)
+            return h2_error(h2, H2_PROTOCOL_ERROR);
+        if (len != 8)
+            return h2_error(h2, H2_FRAME_SIZE_ERROR);
+        if ((flags & H2_FLAG_ACK) == 0)
+            memcpy(h2_queue(h2, H2_PING, H2_FLAG_ACK, 0, 8), p, 8);
+        return 0;
+    case H2_GOAWAY:
+        if (id != 0)
+            return h2_error(h2, H2_PROTOCOL_ERROR);
+        if (len < 8)
+            return h2_error(h2, H2_FRAME_SIZE_ERROR);
+        h2->goaway = true;
+        return 0;
+    case H2_PUSH_PROMISE:
+        return h2_error(h2, H2_PROTOCOL_ERROR);
+    default:
+        // Unknown frame types are ignored
+        return 0;
+    }
+}
+
+/**
+ * Handles the complete frames buffered so far, as many as the output
+ * has room for. Partial frames stay buffered
+ * Returns 0 on success, -1 on a connection error
+ */
+static int h2_process(client_info *cinfo, struct h2_conn *h2)
+{
+    int ret = 0;
+    size_t pos = 0;
+    size_t len = 0;
+    const unsigned char *p = NULL;
+
+    if (h2->preface == false)
+    {
+        len = (h2->in_len < H2_PREFACE_LEN) ? h2->in_len : H2_PREFACE_LEN;
+        if (memcmp(h2->in, H2_PREFACE, len) != 0)
+            return h2_error(h2, H2_PROTOCOL_ERROR);
+        if (len < H2_PREFACE_LEN)
+            return 0;
+        h2->preface = true;
+        pos = H2_PREFACE_LEN;
+    }
+
+    while (h2->in_len - pos >= H2_FRAME_HEADER && H2_OUT_SIZE - h2->out_len >= H2_FRAME_ROOM)
+    {
+        p = h2->in + pos;
+        len = (size_t)p[0] << 16 | (size_t)p[1] << 8 | p[2];
+        if (len > H2_MAX_FRAME)
+        {
+            ret = h2_error(h2, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (h2->in_len - pos - H2_FRAME_HEADER < len)
+            break;
+
+        ret = h2_on_frame(cinfo, h2, p[3], p[4], get_u32(p + 5) & H2_MAX_WINDOW, p + H2_FRAME_HEADER, len);
+        if (ret != 0)
+            break;
+        pos += H2_FRAME_HEADER + len;
+    }
+
+    memmove(h2->in, h2->in + pos, h2->in_len - pos);
+    h2->in_len -= pos;
+    return ret;
+}
+
+/**
+ * Whether stream a goes before b: lower urgency first, then sequential
+ * streams one after the other, then incremental ones taking turns
+ */
+static bool h2_before(const h2_stream *a, const h2_stream *b)
+{
+    if (a->urgency != b->urgency)
+        return a->urgency < b->urgency;
+    if (a->incremental != b->incremental)
+        return b->incremental;
+    if (a->incremental && a->vtime != b->vtime)
+        return a->vtime < b->vtime;
+    return a->id < b->id;
+}
+
+/**
+ * Stream the next DATA frame is taken from, NULL if none can send
+ */
+static h2_stream *h2_next_stream(struct h2_conn *h2)
+{
+    size_t i = 0;
+    h2_stream *stream = NULL;
+    h2_stream *best = NULL;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        stream = &h2->streams[i];
+        if (stream->id == 0 || stream->offset >= stream->length || stream->window <= 0)
+            continue;
+        if (best == NULL || h2_before(stream, best))
+            best = stream;
+    }
+    return best;
+}
+
+/**
+ * Fills the output with DATA frames as far as flow control allows.
+ * Small pages are copied out of their mapping, others read with pread
+ */
+static void h2_fill_data(client_info *cinfo, struct h2_conn *h2)
+{
+    size_t n = 0;
+    size_t room = 0;
+    ssize_t bytes_read = 0;
+    bool end_stream = false;
+    unsigned char *payload = NULL;
+    h2_stream *stream = NULL;
+
+    while (h2->window > 0 && (stream = h2_next_stream(h2)) != NULL)
+    {
+        room = H2_OUT_SIZE - h2->out_len;
+        if (room < H2_FRAME_HEADER + H2_MIN_DATA)
+            break;
+
+        n = room - H2_FRAME_HEADER;
+        if (n > h2->max_frame)
+            n = h2->max_frame;
+        if ((int64_t)n > stream->window)
+            n = (size_t)stream->window;
+        if ((int64_t)n > h2->window)
+            n = (size_t)h2->window;
+        if ((off_t)n > stream->length - stream->offset)
+            n = (size_t)(stream->length - stream->offset);
+
+        payload = h2->out + h2->out_len + H2_FRAME_HEADER;
+        if (stream->body != NULL)
+        {
+            memcpy(payload, stream->body + stream->offset, n);
+        }
+        else if (stream->page->file_map != NULL)
+        {
+            memcpy(payload, stream->page->file_map + stream->offset, n);
+        }
+        else
+        {
+            bytes_read = pread(stream->page->fd, payload, n, stream->offset);
+            if (bytes_read <= 0)
+            {
+                LOG_ERROR("%s Error in reading file %s", __func__, stream->page->file_name);
+                h2_reset_stream(cinfo, h2, stream, H2_INTERNAL_ERROR);
+                continue;
+            }
+            n = (size_t)bytes_read;
+        }
+
+        stream->offset += (off_t)n;
+        stream->window -= (int64_t)n;
+        h2->window -= (int64_t)n;
+        stream->access.bytes += n;
+        if (stream->incremental)
+        {
+            h2->vtime = stream->vtime;
+            stream->vtime += n * H2_DEFAULT_WEIGHT / stream->weight;
+        }
+
+        end_stream = (stream->offset == stream->length);
+        h2_queue(h2, H2_DATA, end_stream ? H2_FLAG_END_STREAM : 0, stream->id, n);
+        if (end_stream)
+            h2_end_stream(cinfo, h2, stream);
+    }
+}
+
+/**
+ * Hands the output to SSL, a pending write is retried as is
+ */
+static conn_status h2_flush(client_info *cinfo, struct h2_conn *h2, size_t *bytes_sent)
+{
+    int ssl_ret = 0;
+
+    while (h2->out_pos < h2->out_len)
+    {
+        ssl_ret = SSL_write(cinfo->ssl, h2->out + h2->out_pos, (int)(h2->out_len - h2->out_pos));
+        if (ssl_ret <= 0)
+            return ssl_status(cinfo->ssl, ssl_ret, "SSL_write");
+        h2->out_pos += (size_t)ssl_ret;
+        *bytes_sent += (size_t)ssl_ret;
+    }
+    h2->out_pos = 0;
+    h2->out_len = 0;
+    return CONN_DONE;
+}
+
+/**
+ * Frame buffers for a connection with work to do
+ * Returns 0 on success, -1 otherwise
+ */
+static int h2_alloc_buffers(struct h2_conn *h2)
+{
+    if (h2->in != NULL)
+        return 0;
+
+    h2->in = buf_alloc(H2_IN_SIZE + H2_OUT_SIZE);
+    if (h2->in == NULL)
+    {
+        LOG_ERROR("%s buf_alloc", __func__);
+        return -1;
+    }
+    h2->out = h2->in + H2_IN_SIZE;
+    count_memory(H2_IN_SIZE + H2_OUT_SIZE, false);
+    return 0;
+}
+
+/**
+ * Drops the frame buffers of an idle connection, kept
+ * while they hold part of a frame either way
+ */
+static void h2_release_buffers(struct h2_conn *h2)
+{
+    if (h2->in == NULL || h2->in_len > 0 || h2->out_len > 0)
+        return;
+
+    buf_free(h2->in, H2_IN_SIZE + H2_OUT_SIZE);
+    h2->in = NULL;
+    h2->out = NULL;
+    count_memory(H2_IN_SIZE + H2_OUT_SIZE, true);
+}
+
+/**
+ * Sets up HTTP/2 on a connection once its handshake is done,
+ * if the client picked h2. Our SETTINGS go out first, data
+ * read early is parsed as the start of the connection
+ * Returns 0 on success, -1 otherwise
+ */
+int h2_attach(client_info *cinfo)
+{
+    struct h2_conn *h2 = NULL;
+    const unsigned char *proto = NULL;
+    unsigned int proto_len = 0;
+    unsigned char *p = NULL;
+
+    SSL_get0_alpn_selected(cinfo->ssl, &proto, &proto_len);
+    if (proto_len != 2 || memcmp(proto, "h2", 2) != 0)
+        return 0;
+
+    h2 = slab_zalloc(&h2_slab);
+    if (h2 == NULL)
+    {
+        LOG_ERROR("%s slab_zalloc", __func__);
+        return -1;
+    }
+    if (h2_alloc_buffers(h2) != 0)
+    {
+        slab_free(&h2_slab, h2);
+        return -1;
+    }
+    count_memory(sizeof(struct h2_conn), false);
+
+    hpack_init(&h2->decoder, HPACK_TABLE_SIZE);
+    hpack_init(&h2->encoder, HPACK_TABLE_SIZE);
+    h2->window = H2_DEFAULT_WINDOW;
+    h2->initial_window = H2_DEFAULT_WINDOW;
+    h2->max_frame = H2_MAX_FRAME;
+
+    p = h2_queue(h2, H2_SETTINGS, 0, 0, 12);
+    p[0] = 0;
+    p[1] = H2_SET_MAX_CONCURRENT_STREAMS;
+    put_u32(p + 2, H2_MAX_STREAMS);
+    p[6] = 0;
+    p[7] = H2_SET_MAX_HEADER_LIST_SIZE;
+    put_u32(p + 8, H2_BLOCK_SIZE);
+
+    if (cinfo->early_request != NULL)
+    {
+        memcpy(h2->in, cinfo->early_request, (size_t)cinfo->early_len);
+        h2->in_len = (size_t)cinfo->early_len;
+        buf_free(cinfo->early_request, BUFFER_SIZE);
+        cinfo->early_request = NULL;
+        cinfo->early_len = 0;
+    }
+
+    cinfo->h2 = h2;
+    LOG_DEBUG("HTTP/2 on client_fd: %d", cinfo->fd);
+    return 0;
+}
+
+/**
+ * Reads frames, answers requests and sends their pages until the
+ * connection has to wait on the socket or be closed. Frames from the
+ * client are picked up between DATA frames so a large page does not
+ * hold up other requests, PINGs or window updates.
+ * Returns the status the connection should be parked with
+ */
+conn_status h2_serve(client_info *cinfo)
+{
+    int ssl_ret = 0;
+    size_t bytes_sent = 0;
+    conn_status status = CONN_DONE;
+    struct h2_conn *h2 = cinfo->h2;
+
+    if (h2_alloc_buffers(h2) != 0)
+        return CONN_CLOSE;
+
+    while (1)
+    {
+        status = h2_flush(cinfo, h2, &bytes_sent);
+        if (status != CONN_DONE)
+            return status;
+        if (h2->closing || (h2->goaway && h2->nr_streams == 0))
+            return CONN_CLOSE;
+        // Let other connections have this worker, the socket is still writable
+        if (bytes_sent >= SEND_BUDGET)
+            return CONN_WANT_WRITE;
+
+        if (h2_process(cinfo, h2) != 0)
+            continue;
+
+        if (h2->in_len < H2_IN_SIZE)
+        {
+            ssl_ret = SSL_read(cinfo->ssl, h2->in + h2->in_len, (int)(H2_IN_SIZE - h2->in_len));
+            if (ssl_ret > 0)
+            {
+                h2->in_len += (size_t)ssl_ret;
+                continue;
+            }
+            status = ssl_status(cinfo->ssl, ssl_ret, "SSL_read");
+            if (status != CONN_WANT_READ)
+                return status;
+        }
+
+        h2_fill_data(cinfo, h2);
+        if (h2->out_len == 0)
+        {
+            h2_release_buffers(h2);
+            return CONN_WANT_READ;
+        }
+    }
+}
+
+/**
+ * Releases the HTTP/2 state of a connection being closed,
+ * responses still in progress are recorded as aborted
+ */
+void h2_free(client_info *cinfo)
+{
+    size_t i = 0;
+    struct h2_conn *h2 = cinfo->h2;
+
+    if (h2 == NULL)
+        return;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if (h2->streams[i].id != 0)
+            h2_close_stream(cinfo, h2, &h2->streams[i], ACCESS_FLAG_ABORTED);
+    }
+    hpack_free(&h2->decoder);
+    hpack_free(&h2->encoder);
+    if (h2->in != NULL)
+        count_memory(H2_IN_SIZE + H2_OUT_SIZE, true);
+    count_memory(sizeof(struct h2_conn), true);
+    buf_free(h2->in, H2_IN_SIZE + H2_OUT_SIZE);
+    buf_free(h2->block, H2_BLOCK_SIZE);
+    slab_free(&h2_slab, h2);
+    cinfo->h2 = NULL;
+}
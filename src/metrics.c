@@ -0,0 +1,348 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "server.h"
+#include "threadpool.h"
+
+const char *g_task_class_names[TASK_CLASS_COUNT] = {"interactive", "bulk", "background"};
+
+static const char *resp_codes[RESP_KIND_COUNT] = {"200", "404", "500", "429"};
+
+// Blocks of every thread that ever counted something, the lock
+// is only taken on a thread's first use and by readers
+static worker_metrics *metrics_list = NULL;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+
+static __thread worker_metrics *tl_metrics = NULL;
+
+static void release_metrics(void *arg)
+{
+    worker_metrics *metrics = (worker_metrics *)arg;
+    __atomic_store_n(&metrics->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static void create_metrics_key()
+{
+    pthread_key_create(&metrics_key, release_metrics);
+}
+
+/**
+ * Counters of the calling thread. Adopts the block of an exited
+ * thread if there is one so resizing the pool doesn't grow the list,
+ * its counts carry on into the totals
+ */
+worker_metrics *thread_metrics()
+{
+    worker_metrics *metrics = NULL;
+
+    if (tl_metrics != NULL)
+        return tl_metrics;
+
+    pthread_once(&metrics_key_once, create_metrics_key);
+
+    pthread_mutex_lock(&metrics_lock);
+    for (metrics = metrics_list; metrics != NULL; metrics = metrics->next)
+    {
+        if (__atomic_load_n(&metrics->orphaned, __ATOMIC_ACQUIRE))
+        {
+            metrics->orphaned = 0;
+            break;
+        }
+    }
+
+    if (metrics == NULL)
+    {
+        metrics = aligned_alloc(METRICS_CACHE_LINE, sizeof(worker_metrics));
+        if (metrics != NULL)
+        {
+            memset(metrics, 0, sizeof(worker_metrics));
+            metrics->next = metrics_list;
+            __atomic_store_n(&metrics_list, metrics, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+
+    if (metrics != NULL)
+        pthread_setspecific(metrics_key, metrics);
+    tl_metrics = metrics;
+    return metrics;
+}
+
+/**
+ * Histogram bucket of a value in ns, values below 2^METRIC_SUB_BITS
+ * get a bucket each, above that every power of two is split linearly
+ */
+static size_t latency_bucket(unsigned long ns)
+{
+    int exp = 0;
+
+    if (ns < (1UL << METRIC_SUB_BITS))
+        return (size_t)ns;
+
+    exp = 63 - __builtin_clzl(ns);
+    if (exp > METRIC_MAX_EXP)
+        return METRIC_BUCKETS - 1;
+
+    return ((size_t)(exp - METRIC_SUB_BITS + 1) << METRIC_SUB_BITS) +
+           ((ns >> (exp - METRIC_SUB_BITS)) & ((1UL << METRIC_SUB_BITS) - 1));
+}
+
+/**
+ * Upper bound in ns of a histogram bucket
+ */
+static unsigned long bucket_limit(size_t bucket)
+{
+    size_t exp = (bucket >> METRIC_SUB_BITS) + METRIC_SUB_BITS - 1;
+    size_t sub = bucket & ((1UL << METRIC_SUB_BITS) - 1);
+
+    if (bucket < (1UL << METRIC_SUB_BITS))
+        return bucket + 1;
+    return (((1UL << METRIC_SUB_BITS) + sub + 1) << (exp - METRIC_SUB_BITS));
+}
+
+void record_latency(worker_metrics *metrics, unsigned long ns)
+{
+    size_t bucket = latency_bucket(ns);
+
+    METRIC_ADD(metrics, latency[bucket], 1);
+    METRIC_ADD(metrics, latency_sum_ns, ns);
+}
+
+/**
+ * Counts a finished TLS handshake as full or resumed, or a failed one
+ */
+void record_handshake(SSL *ssl, bool success)
+{
+    worker_metrics *metrics = thread_metrics();
+
+    if (metrics == NULL)
+        return;
+
+    if (success == false)
+        METRIC_ADD(metrics, handshake_failures, 1);
+    else if (SSL_session_reused(ssl))
+        METRIC_ADD(metrics, handshakes_resumed, 1);
+    else
+        METRIC_ADD(metrics, handshakes_full, 1);
+    METRIC_ADD(metrics, connections, 1);
+}
+
+/**
+ * Counts a connection closed after a successful handshake
+ */
+void record_close()
+{
+    worker_metrics *metrics = thread_metrics();
+
+    if (metrics != NULL)
+        METRIC_ADD(metrics, closed, 1);
+}
+
+/**
+ * Adds up the counters of all threads
+ */
+static void sum_metrics(worker_metrics *total)
+{
+    size_t i = 0;
+    worker_metrics *m = NULL;
+
+    memset(total, 0, sizeof(worker_metrics));
+    pthread_mutex_lock(&metrics_lock);
+    for (m = metrics_list; m != NULL; m = m->next)
+    {
+        total->requests += __atomic_load_n(&m->requests, __ATOMIC_RELAXED);
+        for (i = 0; i < RESP_KIND_COUNT; i++)
+            total->responses[i] += __atomic_load_n(&m->responses[i], __ATOMIC_RELAXED);
+        total->aborted += __atomic_load_n(&m->aborted, __ATOMIC_RELAXED);
+        total->bytes_sent += __atomic_load_n(&m->bytes_sent, __ATOMIC_RELAXED);
+        total->cache_hits += __atomic_load_n(&m->cache_hits, __ATOMIC_RELAXED);
+        total->cache_misses += __atomic_load_n(&m->cache_misses, __ATOMIC_RELAXED);
+        total->connections += __atomic_load_n(&m->connections, __ATOMIC_RELAXED);
+        total->handshakes_full += __atomic_load_n(&m->handshakes_full, __ATOMIC_RELAXED);
+        total->handshakes_resumed += __atomic_load_n(&m->handshakes_resumed, __ATOMIC_RELAXED);
+        total->handshake_failures += __atomic_load_n(&m->handshake_failures, __ATOMIC_RELAXED);
+        total->early_answered += __atomic_load_n(&m->early_answered, __ATOMIC_RELAXED);
+        total->closed += __atomic_load_n(&m->closed, __ATOMIC_RELAXED);
+        total->connections_limited += __atomic_load_n(&m->connections_limited, __ATOMIC_RELAXED);
+        total->requests_limited += __atomic_load_n(&m->requests_limited, __ATOMIC_RELAXED);
+        total->http2_memory += __atomic_load_n(&m->http2_memory, __ATOMIC_RELAXED);
+        total->latency_sum_ns += __atomic_load_n(&m->latency_sum_ns, __ATOMIC_RELAXED);
+        for (i = 0; i < METRIC_BUCKETS; i++)
+            total->latency[i] += __atomic_load_n(&m->latency[i], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+static void print_counter(FILE *fp, const char *name, const char *help, unsigned long value)
+{
+    fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, value);
+}
+
+/**
+ * Request duration as a Prometheus histogram with a bucket per power
+ * of two, plus quantiles taken from the fine grained buckets
+ */
+static void print_latency(FILE *fp, const worker_metrics *total)
+{
+    int exp = 0;
+    size_t i = 0;
+    size_t q = 0;
+    unsigned long count = 0;
+    unsigned long seen = 0;
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    for (i = 0; i < METRIC_BUCKETS; i++)
+        count += total->latency[i];
+
+    fprintf(fp, "# HELP legion_request_duration_seconds Time from reading a request to handing the last byte to TLS.\n"
+                "# TYPE legion_request_duration_seconds histogram\n");
+    i = 0;
+    for (exp = 10; exp <= 34; exp++)
+    {
+        // Power of two boundaries fall on bucket edges
+        for (; i < METRIC_BUCKETS && bucket_limit(i) <= (1UL << exp); i++)
+            seen += total->latency[i];
+        fprintf(fp, "legion_request_duration_seconds_bucket{le=\"%.9g\"} %lu\n", (double)(1UL << exp) / 1e9, seen);
+    }
+    fprintf(fp, "legion_request_duration_seconds_bucket{le=\"+Inf\"} %lu\n", count);
+    fprintf(fp, "legion_request_duration_seconds_sum %.9f\n", (double)total->latency_sum_ns / 1e9);
+    fprintf(fp, "legion_request_duration_seconds_count %lu\n", count);
+
+    fprintf(fp, "# HELP legion_request_duration_quantile_seconds Request duration quantiles, within 12.5%%.\n"
+                "# TYPE legion_request_duration_quantile_seconds gauge\n");
+    seen = 0;
+    i = 0;
+    for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]) && count > 0; q++)
+    {
+        while (i < METRIC_BUCKETS && (double)(seen + total->latency[i]) < quantiles[q] * (double)count)
+            seen += total->latency[i++];
+        fprintf(fp, "legion_request_duration_quantile_seconds{quantile=\"%g\"} %.9g\n", quantiles[q],
+                (double)bucket_limit(i < METRIC_BUCKETS ? i : METRIC_BUCKETS - 1) / 1e9);
+    }
+}
+
+/**
+ * Connections past their handshake and what they hold: OpenSSL heap
+ * (contexts and the session cache included), HTTP/2 state and the
+ * client_info slot, plus the average over open connections
+ */
+static void print_connection_memory(FILE *fp, const worker_metrics *total)
+{
+    long tls = tls_memory_in_use();
+    unsigned long opened = total->handshakes_full + total->handshakes_resumed;
+    unsigned long open = 0;
+    unsigned long slots = 0;
+    unsigned long sum = 0;
+
+    // Threads are summed one after the other, a close may be seen before its handshake
+    open = (opened > total->closed) ? opened - total->closed : 0;
+    slots = open * sizeof(client_info);
+    sum = total->http2_memory + slots + ((tls > 0) ? (unsigned long)tls : 0);
+
+    fprintf(fp, "# HELP legion_connections_open Connections past their TLS handshake and not closed yet.\n"
+                "# TYPE legion_connections_open gauge\nlegion_connections_open %lu\n", open);
+    fprintf(fp, "# HELP legion_connection_memory_bytes Memory held for connections by part.\n"
+                "# TYPE legion_connection_memory_bytes gauge\n");
+    if (tls >= 0)
+        fprintf(fp, "legion_connection_memory_bytes{part=\"tls\"} %ld\n", tls);
+    fprintf(fp, "legion_connection_memory_bytes{part=\"http2\"} %lu\n", total->http2_memory);
+    fprintf(fp, "legion_connection_memory_bytes{part=\"client_info\"} %lu\n", slots);
+    fprintf(fp, "# HELP legion_connection_memory_average_bytes Memory held per open connection.\n"
+                "# TYPE legion_connection_memory_average_bytes gauge\nlegion_connection_memory_average_bytes %lu\n",
+            (open > 0) ? sum / open : 0);
+}
+
+/**
+ * Renders all metrics in Prometheus text format.
+ * Returns a malloced buffer of *len bytes, NULL on failure
+ */
+char *render_metrics(size_t *len)
+{
+    int cls = 0;
+    size_t i = 0;
+    char *buf = NULL;
+    FILE *fp = NULL;
+    thpool_class_stats stats;
+    static worker_metrics total;
+    static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    fp = open_memstream(&buf, len);
+    if (fp == NULL)
+        return NULL;
+
+    // total is too big for a worker's stack
+    pthread_mutex_lock(&render_lock);
+    sum_metrics(&total);
+
+    print_counter(fp, "legion_requests_total", "Requests read off connections.", total.requests);
+    fprintf(fp, "# HELP legion_responses_total Responses by status code.\n# TYPE legion_responses_total counter\n");
+    for (i = 0; i < RESP_KIND_COUNT; i++)
+        fprintf(fp, "legion_responses_total{code=\"%s\"} %lu\n", resp_codes[i], total.responses[i]);
+    print_counter(fp, "legion_responses_aborted_total", "Responses cut short by the connection going away.", total.aborted);
+    print_counter(fp, "legion_bytes_sent_total", "Response bytes handed to TLS.", total.bytes_sent);
+    print_counter(fp, "legion_cache_hits_total", "Requests served from the page cache.", total.cache_hits);
+    print_counter(fp, "legion_cache_misses_total", "Requests for pages not in the cache.", total.cache_misses);
+    print_counter(fp, "legion_connections_total", "Connections accepted, whether the handshake succeeded or not.", total.connections);
+    fprintf(fp, "# HELP legion_handshakes_total Completed TLS handshakes by kind.\n# TYPE legion_handshakes_total counter\n"
+                "legion_handshakes_total{kind=\"full\"} %lu\nlegion_handshakes_total{kind=\"resumed\"} %lu\n",
+            total.handshakes_full, total.handshakes_resumed);
+    print_counter(fp, "legion_handshake_failures_total", "Failed TLS handshakes.", total.handshake_failures);
+    print_counter(fp, "legion_early_data_answered_total", "Requests answered out of TLS 1.3 early data.", total.early_answered);
+    print_counter(fp, "legion_connections_limited_total", "Connections closed before their handshake by the per client limits.",
+                  total.connections_limited);
+    print_counter(fp, "legion_requests_limited_total", "Requests refused for going over the per client rate.", total.requests_limited);
+    print_latency(fp, &total);
+    print_connection_memory(fp, &total);
+    pthread_mutex_unlock(&render_lock);
+
+    fprintf(fp, "# HELP legion_workers Threadpool workers running.\n# TYPE legion_workers gauge\nlegion_workers %zu\n",
+            threadpool_size());
+    fprintf(fp, "# HELP legion_task_queue_depth Tasks waiting per class.\n# TYPE legion_task_queue_depth gauge\n");
+    for (cls = 0; cls < TASK_CLASS_COUNT; cls++)
+    {
+        threadpool_class_stats((task_class)cls, &stats);
+        fprintf(fp, "legion_task_queue_depth{class=\"%s\"} %zu\n", g_task_class_names[cls], stats.queued);
+    }
+    fprintf(fp, "# HELP legion_task_rejections_total Tasks add_task_to_queue turned away.\n# TYPE legion_task_rejections_total counter\n");
+    for (cls = 0; cls < TASK_CLASS_COUNT; cls++)
+    {
+        threadpool_class_stats((task_class)cls, &stats);
+        fprintf(fp, "legion_task_rejections_total{class=\"%s\"} %zu\n", g_task_class_names[cls], stats.rejected);
+    }
+    fprintf(fp, "# HELP legion_tasks_completed_total Tasks run per class.\n# TYPE legion_tasks_completed_total counter\n");
+    for (cls = 0; cls < TASK_CLASS_COUNT; cls++)
+    {
+        threadpool_class_stats((task_class)cls, &stats);
+        fprintf(fp, "legion_tasks_completed_total{class=\"%s\"} %zu\n", g_task_class_names[cls], stats.completed);
+    }
+
+    if (fclose(fp) != 0)
+    {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
@@ -30,8 +30,6 @@
 #define SOCKADDR_4_SIZE sizeof(struct sockaddr_in)
 #define SOCKADDR_6_SIZE sizeof(struct sockaddr_in6)
 
-extern SSL_CTX *g_ssl_ctx;
-
 /**
  * Function to get an IPv4 address of the machine which
  * is used to communicate with internet
@@ -79,7 +77,7 @@ const char *get_internet_facing_ipv4()
 
     // Convert the IP address to a string
     inet_ntop(AF_INET, &local_addr.sin_addr, ip_addr, INET_ADDRSTRLEN);
-    LOG_INFO("Internet facing IP is %d", ip_addr);
+    LOG_INFO("Internet facing IP is %s", ip_addr);
     close(dns_fd);
     return ip_addr;
 }
@@ -93,7 +91,8 @@ const char *get_ip_address(struct sockaddr *addr)
     short unsigned port = 0;
     struct sockaddr_in6 *ipv6 = NULL;
     struct sockaddr_in *ipv4 = NULL;
-    static char ipstr[INET6_ADDRSTRLEN + 8] = {0};
+    // Handshake workers log addresses concurrently
+    static __thread char ipstr[INET6_ADDRSTRLEN + 8] = {0};
 
     if (addr->sa_family == AF_INET)
     {
@@ -193,108 +192,6 @@ err_cleanup:
     return -1;
 }
 
-static int accept_client(int server_fd, int *client_fd_ptr)
-{
-    int client_fd = 0, ret = 0;
-    SSL *client_ssl = NULL;
-    struct sockaddr client_addr = {0};
-    socklen_t client_addr_size = sizeof(struct sockaddr);
-    
-    (*client_fd_ptr) = -1; 
-    client_fd = accept(server_fd, &client_addr, &client_addr_size);
-    if (client_fd < 0)
-    {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-        {
-            return 0;
-
-        }
-        LOG_ERROR("%s accept", __func__);
-        return -1;
-    }
-
-    LOG_INFO("Incoming Connection from %s", get_ip_address(&client_addr));
-    ret = set_socket_timeout(client_fd, TLS_TIMEOUT_SEC, 0);
-    if(ret != 0)
-    {
-        close(client_fd);
-        return -1;
-    }
-
-    client_ssl = SSL_new(g_ssl_ctx);
-    if (client_ssl == NULL)
-    {
-        ERR_print_errors_cb(ssl_log_err, NULL);
-        close(client_fd);
-        return -1;
-    }
-
-    SSL_set_fd(client_ssl, client_fd);
-    ret = SSL_accept(client_ssl);
-    if (ret != 1)
-    {
-        ERR_print_errors_cb(ssl_log_err, NULL);
-        SSL_free(client_ssl);
-        close(client_fd);
-        return -1;
-    }
-
-    ret = set_non_blocking(client_fd, true);
-    if (ret != 0)
-    {
-        SSL_shutdown(client_ssl);
-        SSL_free(client_ssl);
-        close(client_fd);
-        return -1;
-    }
-
-    ret = add_client_info(client_fd, client_ssl);
-    if (ret == -1)
-    {
-        SSL_shutdown(client_ssl);
-        SSL_free(client_ssl);
-        close(client_fd);
-    }
-    (*client_fd_ptr) = client_fd;
-    return 1;
-}
-
-/**
- * Function that accepts all new incoming connections
- * on the server socket and adds them to epoll event listener
- */
-int accept_connections(const int server_fd, const int epoll_fd)
-{
-    int ret = 0, client_fd = 0;
-    struct epoll_event ev = {0};
-
-    // Loop until all incoming connections have been accepted
-    while (1)
-    {
-        ret = accept_client(server_fd, &client_fd);
-
-        if(ret == 0)
-            break;
-
-        else if(ret == -1)
-            continue;
-
-        // Add new connection to epoll event listener
-        ev.events = EPOLLIN | EPOLLET;
-        ev.data.fd = client_fd;
-        ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
-        if (ret != 0)
-        {
-            LOG_ERROR("%s epoll_ctl", __func__);
-            remove_client_info_fd(client_fd);
-            continue;
-        }
-        LOG_INFO("Connection accepted and bound to client_fd: %d", client_fd);
-    }
-
-    return 0;
-}
-
 #ifdef IPV6_SERVER
 char *get_internet_facing_ipv6()
 {
@@ -0,0 +1,469 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "server.h"
+
+#include <openssl/ocsp.h>
+#include <sys/stat.h>
+
+/**
+ * OCSP stapling out of locally supplied responses, fetched from the CA
+ * by whatever the operator uses, e.g. openssl ocsp -respout. Each file is
+ * read, parsed and checked once, then kept as DER and handed to every
+ * handshake that asks for it, the hot path only copies bytes. A monitor
+ * thread reloads files changed on disk, expired responses are no longer
+ * stapled until a fresh one shows up.
+ *
+ * Handshakes copy a staple under a reader count of the current epoch,
+ * checking after the count that the epoch is still the same. A replaced
+ * staple is freed once the monitor has moved the epoch on and the
+ * readers of the previous one are gone, a handshake counted in the new
+ * epoch can only have seen the new staple.
+ */
+
+typedef struct
+{
+    unsigned char *der;
+    size_t len;
+    // 0 when the responder gave no next update
+    time_t next_update;
+} ocsp_staple;
+
+typedef struct
+{
+    const char *path;
+    // Certificate the response is about, owned by the context
+    X509 *cert;
+    X509 *issuer;
+    // Published to handshakes, read without locks
+    ocsp_staple *current;
+    struct stat st;
+    bool expired;
+} ocsp_source;
+
+static ocsp_source g_sources[MAX_SSL_CERTS];
+static size_t g_nr_sources = 0;
+static pthread_t monitor;
+static bool monitor_run = false;
+// Handshakes copying a staple, per epoch
+static unsigned int reader_epoch = 0;
+static unsigned long readers[2] = {0, 0};
+
+static void free_staple(ocsp_staple *staple)
+{
+    if (staple == NULL)
+        return;
+    free(staple->der);
+    free(staple);
+}
+
+static bool staple_expired(const ocsp_staple *staple, const time_t now)
+{
+    return staple->next_update != 0 && now >= staple->next_update;
+}
+
+/**
+ * Reads a whole DER file, st is filled from the same descriptor
+ * Returns the buffer on success, NULL otherwise
+ */
+static unsigned char *read_response_file(const char *path, struct stat *st)
+{
+    int fd = -1;
+    ssize_t ret = 0;
+    size_t done = 0;
+    unsigned char *buf = NULL;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, st) != 0)
+    {
+        LOG_ERROR("%s: %s: %s", __func__, path, strerror(errno));
+        goto err;
+    }
+    if (st->st_size <= 0 || st->st_size > OCSP_MAX_RESPONSE)
+    {
+        LOG_ERROR("%s: %s has %ld bytes, 1 to %d expected", __func__, path, (long)st->st_size, OCSP_MAX_RESPONSE);
+        goto err;
+    }
+
+    buf = malloc((size_t)st->st_size);
+    if (buf == NULL)
+        goto err;
+    while (done < (size_t)st->st_size)
+    {
+        ret = read(fd, buf + done, (size_t)st->st_size - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+        {
+            LOG_ERROR("%s: %s: short read", __func__, path);
+            goto err;
+        }
+        done += (size_t)ret;
+    }
+    close(fd);
+    return buf;
+
+err:
+    free(buf);
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/**
+ * Checks the responder signed it on behalf of the issuer, either
+ * the issuer itself or a responder it delegated to
+ */
+static int verify_response(OCSP_BASICRESP *bs, X509 *issuer)
+{
+    int ret = -1;
+    X509_STORE *store = X509_STORE_new();
+    STACK_OF(X509) *signers = sk_X509_new_null();
+
+    // The issuer is trusted as it is, it need not lead to a root we know of.
+    // Responses signed by the issuer itself may leave out its certificate
+    if (store != NULL && signers != NULL && sk_X509_push(signers, issuer) > 0 &&
+        X509_STORE_add_cert(store, issuer) == 1 &&
+        X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN) == 1 &&
+        OCSP_basic_verify(bs, signers, store, 0) == 1)
+        ret = 0;
+    sk_X509_free(signers);
+    X509_STORE_free(store);
+    return ret;
+}
+
+/**
+ * Parses and validates a response about src->cert, picking the certificate
+ * among the candidates first when src->cert is still NULL
+ * Returns the staple on success, NULL otherwise
+ */
+static ocsp_staple *load_response(ocsp_source *src, X509 *const *certs, X509 *const *issuers,
+                                  size_t nr_certs, struct stat *st)
+{
+    size_t i = 0;
+    int status = -1;
+    int reason = 0;
+    struct tm tm;
+    const unsigned char *p = NULL;
+    unsigned char *der = NULL;
+    OCSP_RESPONSE *resp = NULL;
+    OCSP_BASICRESP *bs = NULL;
+    OCSP_CERTID *id = NULL;
+    ASN1_GENERALIZEDTIME *this_update = NULL;
+    ASN1_GENERALIZEDTIME *next_update = NULL;
+    ocsp_staple *staple = NULL;
+
+    der = read_response_file(src->path, st);
+    if (der == NULL)
+        return NULL;
+
+    p = der;
+    resp = d2i_OCSP_RESPONSE(NULL, &p, (long)st->st_size);
+    if (resp == NULL || p != der + st->st_size)
+    {
+        LOG_ERROR("%s: %s is not a DER encoded OCSP response", __func__, src->path);
+        goto err;
+    }
+    if (OCSP_response_status(resp) != OCSP_RESPONSE_STATUS_SUCCESSFUL ||
+        (bs = OCSP_response_get1_basic(resp)) == NULL)
+    {
+        LOG_ERROR("%s: %s: responder answered %s", __func__, src->path,
+                  OCSP_response_status_str(OCSP_response_status(resp)));
+        goto err;
+    }
+
+    for (i = 0; i < nr_certs && status < 0; i++)
+    {
+        if (src->cert != NULL && certs[i] != src->cert)
+            continue;
+        OCSP_CERTID_free(id);
+        id = OCSP_cert_to_id(NULL, certs[i], issuers[i]);
+        if (id != NULL &&
+            OCSP_resp_find_status(bs, id, &status, &reason, NULL, &this_update, &next_update) == 1)
+        {
+            if (verify_response(bs, issuers[i]) != 0)
+            {
+                LOG_ERROR("%s: %s: signature does not verify", __func__, src->path);
+                goto err;
+            }
+            src->cert = certs[i];
+            src->issuer = issuers[i];
+        }
+        else
+            status = -1;
+    }
+    if (status < 0)
+    {
+        LOG_ERROR("%s: %s covers none of the certificates served", __func__, src->path);
+        goto err;
+    }
+    // Expired ones are kept but not stapled, see staple_expired()
+    if (OCSP_check_validity(this_update, NULL, OCSP_MAX_SKEW_SEC, -1) != 1)
+    {
+        LOG_ERROR("%s: %s is not valid yet", __func__, src->path);
+        goto err;
+    }
+    // Clients reject the certificate on their own, not stapling would let them try the responder
+    if (status != V_OCSP_CERTSTATUS_GOOD)
+        LOG_ERROR("%s: %s says the certificate is %s", __func__, src->path, OCSP_cert_status_str(status));
+
+    staple = calloc(1, sizeof(ocsp_staple));
+    if (staple == NULL)
+        goto err;
+    if (next_update != NULL && (ASN1_TIME_to_tm(next_update, &tm) != 1 || (staple->next_update = timegm(&tm)) <= 0))
+    {
+        free(staple);
+        staple = NULL;
+        goto err;
+    }
+    staple->der = der;
+    staple->len = (size_t)st->st_size;
+    der = NULL;
+
+err:
+    ERR_clear_error();
+    OCSP_CERTID_free(id);
+    OCSP_BASICRESP_free(bs);
+    OCSP_RESPONSE_free(resp);
+    free(der);
+    return staple;
+}
+
+/**
+ * Makes staple the one handed out and frees the one it replaces once
+ * no handshake can still be copying it. Called on init and then only
+ * by the monitor, never concurrently
+ */
+static void publish_staple(ocsp_source *src, ocsp_staple *staple)
+{
+    unsigned int epoch = 0;
+    struct timespec pause = {0, 1000000};
+    ocsp_staple *old = __atomic_exchange_n(&src->current, staple, __ATOMIC_SEQ_CST);
+
+    epoch = __atomic_load_n(&reader_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&reader_epoch, epoch ^ 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&readers[epoch], __ATOMIC_SEQ_CST) > 0)
+        nanosleep(&pause, NULL);
+
+    free_staple(old);
+    src->expired = false;
+}
+
+/**
+ * Called on handshakes with a status request, only for
+ * the certificate picked for the client
+ */
+static int ocsp_status_cb(SSL *ssl, void *arg)
+{
+    size_t i = 0;
+    size_t len = 0;
+    unsigned int epoch = 0;
+    unsigned char *der = NULL;
+    const ocsp_staple *staple = NULL;
+    X509 *cert = SSL_get_certificate(ssl);
+    (void)arg;
+
+    for (i = 0; i < g_nr_sources; i++)
+    {
+        if (g_sources[i].cert != cert)
+            continue;
+
+        // Counted before the load, the staple stays until the count drops.
+        // The count only holds off the monitor if the epoch did not move
+        // in between, a stale one may already have been waited out
+        while (1)
+        {
+            epoch = __atomic_load_n(&reader_epoch, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&readers[epoch], 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&reader_epoch, __ATOMIC_SEQ_CST) == epoch)
+                break;
+            __atomic_sub_fetch(&readers[epoch], 1, __ATOMIC_RELEASE);
+        }
+        staple = __atomic_load_n(&g_sources[i].current, __ATOMIC_SEQ_CST);
+        if (staple != NULL && staple_expired(staple, time(NULL)) == false)
+        {
+            len = staple->len;
+            der = OPENSSL_memdup(staple->der, len);
+        }
+        __atomic_sub_fetch(&readers[epoch], 1, __ATOMIC_RELEASE);
+
+        // OpenSSL takes the buffer and frees it with the connection
+        if (der == NULL || SSL_set_tlsext_status_ocsp_resp(ssl, der, (long)len) != 1)
+        {
+            OPENSSL_free(der);
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        return SSL_TLSEXT_ERR_OK;
+    }
+    return SSL_TLSEXT_ERR_NOACK;
+}
+
+static void refresh_source(ocsp_source *src, const time_t now)
+{
+    struct stat st;
+    ocsp_staple *staple = NULL;
+    const ocsp_staple *current = src->current;
+
+    // Replaced files are usually renamed over, checking the inode catches those too
+    if (stat(src->path, &st) == 0 &&
+        (st.st_ino != src->st.st_ino || st.st_size != src->st.st_size ||
+         st.st_mtim.tv_sec != src->st.st_mtim.tv_sec || st.st_mtim.tv_nsec != src->st.st_mtim.tv_nsec))
+    {
+        staple = load_response(src, &src->cert, &src->issuer, 1, &st);
+        // A broken file is retried only once it changes again
+        src->st = st;
+        if (staple != NULL)
+        {
+            publish_staple(src, staple);
+            LOG_INFO("OCSP response %s reloaded", src->path);
+            current = staple;
+        }
+        else
+            LOG_ERROR("OCSP response %s not reloaded, keeping the previous one", src->path);
+    }
+
+    if (current != NULL && src->expired == false && staple_expired(current, now))
+    {
+        src->expired = true;
+        LOG_ERROR("OCSP response %s expired, stapling stops until it is renewed", src->path);
+    }
+}
+
+static void *ocsp_monitor(void *arg)
+{
+    size_t i = 0;
+    struct timespec interval = {OCSP_CHECK_SEC, 0};
+    (void)arg;
+
+    while (__atomic_load_n(&monitor_run, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&interval, NULL);
+        for (i = 0; i < g_nr_sources; i++)
+            refresh_source(&g_sources[i], time(NULL));
+    }
+    return NULL;
+}
+
+/**
+ * Staples the responses in files to the handshakes of ctx, each one
+ * has to be about one of its certificates, signed for its issuer
+ * taken from the chain. Done before the context is used
+ * Returns 0 on success, -1 otherwise
+ */
+int init_ocsp_stapling(SSL_CTX *ctx, const char *const *files, const size_t nr_files)
+{
+    int ret = 0;
+    int j = 0;
+    size_t i = 0;
+    size_t nr_certs = 0;
+    X509 *certs[MAX_SSL_CERTS] = {NULL};
+    X509 *issuers[MAX_SSL_CERTS] = {NULL};
+    STACK_OF(X509) *chain = NULL;
+    ocsp_staple *staple = NULL;
+
+    if (nr_files == 0 || nr_files > MAX_SSL_CERTS)
+    {
+        LOG_ERROR("%s: %zu responses given, 1 to %d supported", __func__, nr_files, MAX_SSL_CERTS);
+        return -1;
+    }
+
+    // Every chain loaded for a key type, the issuer is the one signing its leaf
+    ret = (int)SSL_CTX_set_current_cert(ctx, SSL_CERT_SET_FIRST);
+    while (ret == 1 && nr_certs < MAX_SSL_CERTS)
+    {
+        certs[nr_certs] = SSL_CTX_get0_certificate(ctx);
+        if (SSL_CTX_get0_chain_certs(ctx, &chain) == 1)
+        {
+            for (j = 0; j < sk_X509_num(chain); j++)
+            {
+                if (X509_check_issued(sk_X509_value(chain, j), certs[nr_certs]) == X509_V_OK)
+                {
+                    issuers[nr_certs] = sk_X509_value(chain, j);
+                    break;
+                }
+            }
+        }
+        if (issuers[nr_certs] != NULL)
+            nr_certs++;
+        ret = (int)SSL_CTX_set_current_cert(ctx, SSL_CERT_SET_NEXT);
+    }
+    ERR_clear_error();
+    if (nr_certs == 0)
+    {
+        LOG_ERROR("%s: no certificate comes with its issuer, the chain files need it", __func__);
+        return -1;
+    }
+
+    for (i = 0; i < nr_files; i++)
+    {
+        g_sources[i].path = files[i];
+        staple = load_response(&g_sources[i], certs, issuers, nr_certs, &g_sources[i].st);
+        if (staple == NULL)
+            return -1;
+        for (j = 0; j < (int)i; j++)
+        {
+            if (g_sources[j].cert == g_sources[i].cert)
+            {
+                LOG_ERROR("%s: %s is about the same certificate as %s", __func__, files[i], files[j]);
+                free_staple(staple);
+                return -1;
+            }
+        }
+        publish_staple(&g_sources[i], staple);
+        g_nr_sources++;
+        if (staple_expired(staple, time(NULL)))
+            LOG_ERROR("OCSP response %s already expired, not stapled until it is renewed", files[i]);
+        else
+            LOG_INFO("OCSP response %s loaded, %zu bytes", files[i], staple->len);
+    }
+
+    SSL_CTX_set_tlsext_status_cb(ctx, ocsp_status_cb);
+    __atomic_store_n(&monitor_run, true, __ATOMIC_RELEASE);
+    if (pthread_create(&monitor, NULL, ocsp_monitor, NULL) != 0)
+    {
+        LOG_ERROR("%s pthread_create", __func__);
+        __atomic_store_n(&monitor_run, false, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stops reloading and frees the responses, handshakes
+ * have to be over as they may still copy them
+ */
+void stop_ocsp_stapling()
+{
+    size_t i = 0;
+
+    if (__atomic_exchange_n(&monitor_run, false, __ATOMIC_ACQ_REL))
+        pthread_join(monitor, NULL);
+
+    for (i = 0; i < g_nr_sources; i++)
+    {
+        free_staple(g_sources[i].current);
+        g_sources[i].current = NULL;
+    }
+    g_nr_sources = 0;
+}
@@ -23,162 +23,395 @@
  */
 
 #include "server.h"
-#include <sys/sendfile.h>
 
-#define RTT_TIMEOUT_US 200000
+#include <strings.h>
 
-extern const int g_epoll_fd;
 extern const page_cache *page_404;
 extern const page_cache *page_500;
 
-int sendfile_to_client(SSL *client_ssl, const page_cache * cache_ptr)
+/**
+ * Maps a failed SSL_read/SSL_write to what the connection waits on
+ */
+conn_status ssl_status(SSL *ssl, int ssl_ret, const char *op)
 {
-    char buffer[BUFFER_SIZE];
-    int bytes_read = 0, bytes_written = 0;
-    int ssl_ret = 0;
-    off_t total_bytes_read = 0;
-    if(cache_ptr->file_map == NULL)
+    int err = SSL_get_error(ssl, ssl_ret);
+
+    if (err == SSL_ERROR_WANT_READ)
+        return CONN_WANT_READ;
+    if (err == SSL_ERROR_WANT_WRITE)
+        return CONN_WANT_WRITE;
+
+    if (err != SSL_ERROR_ZERO_RETURN)
+    {
+#ifndef DEBUG
+        (void)op;
+#endif
+        LOG_ERROR("%s error: %d", op, err);
+        ERR_print_errors_cb(ssl_log_err, NULL);
+    }
+    return CONN_CLOSE;
+}
+
+extern bool g_stats_endpoint;
+extern bool g_vhosts_enabled;
+
+/**
+ * Starts the record of the request just read, it feeds
+ * both the metrics and the access log
+ */
+void begin_request(access_record *rec, access_method method)
+{
+    worker_metrics *metrics = thread_metrics();
+
+    if (metrics != NULL)
+        METRIC_ADD(metrics, requests, 1);
+
+    rec->start_ns = access_log_clock();
+    rec->method = (unsigned char)method;
+    rec->flags &= ACCESS_FLAG_IPV6;
+    rec->status = 0;
+    rec->bytes = 0;
+    rec->path_len = 0;
+}
+
+/**
+ * Counts a sent response and hands its record to the access log,
+ * ACCESS_FLAG_ABORTED marks responses that were cut short
+ */
+void record_response(SSL *ssl, access_record *rec, unsigned char flags)
+{
+    worker_metrics *metrics = NULL;
+    unsigned long duration_ns = 0;
+
+    duration_ns = access_log_clock() - rec->start_ns;
+    metrics = thread_metrics();
+    if (metrics != NULL)
+    {
+        METRIC_ADD(metrics, bytes_sent, rec->bytes);
+        if (flags & ACCESS_FLAG_ABORTED)
+            METRIC_ADD(metrics, aborted, 1);
+        else
+            record_latency(metrics, duration_ns);
+
+        if (rec->status == 404)
+            METRIC_ADD(metrics, responses[RESP_NOT_FOUND], 1);
+        else if (rec->status == 500)
+            METRIC_ADD(metrics, responses[RESP_SERVER_ERROR], 1);
+        else if (rec->status == 429)
+            METRIC_ADD(metrics, responses[RESP_TOO_MANY], 1);
+        else
+            METRIC_ADD(metrics, responses[RESP_OK], 1);
+    }
+
+    if (g_access_log)
     {
-        // Read file and send in chunks
-        bytes_read = (int) pread(cache_ptr->fd, buffer, BUFFER_SIZE, total_bytes_read);
-        total_bytes_read += bytes_read;
-        while (bytes_read > 0)
+        rec->duration_us = (unsigned int)(duration_ns / 1000);
+        rec->flags |= flags;
+        if (ssl != NULL && SSL_session_reused(ssl))
+            rec->flags |= ACCESS_FLAG_RESUMED;
+        access_log_write(rec);
+    }
+}
+
+/**
+ * Records the current request of the connection, if there is one
+ */
+void finish_request(client_info *cinfo, unsigned char flags)
+{
+    if (cinfo->access.status == 0)
+        return;
+
+    record_response(cinfo->ssl, &cinfo->access, flags);
+    TRACE_END(cinfo);
+    cinfo->access.status = 0;
+}
+
+/**
+ * Points the send state at the next piece of the page body.
+ * mmapped entries are sent straight from the mapping, fd backed
+ * entries are read one TLS record at a time into the bounce buffer
+ * Returns 0 on success (out_len is 0 once the body is exhausted), -1 otherwise
+ */
+static int load_next_chunk(send_state *resp)
+{
+    off_t remaining = 0;
+    ssize_t bytes_read = 0;
+    const page_cache *page = resp->page;
+
+    if (page == NULL)
+        return 0;
+
+    remaining = page->file_size - resp->offset;
+    if (remaining <= 0)
+    {
+        resp->page = NULL;
+        return 0;
+    }
+
+    if (page->file_map != NULL)
+    {
+        resp->out = page->file_map + resp->offset;
+        resp->out_len = (remaining > SEND_CHUNK_SIZE) ? SEND_CHUNK_SIZE : (int)remaining;
+    }
+    else
+    {
+        if (resp->chunk == NULL)
         {
-            bytes_written = 0;
-            while (bytes_written < bytes_read)
-            {
-                ssl_ret = SSL_write(client_ssl, buffer + bytes_written, bytes_read - bytes_written);
-                if (ssl_ret <= 0)
-                {
-                    LOG_ERROR(" %s SSL_write error: %d", __func__, SSL_get_error(client_ssl, ssl_ret));
-                    return -1;
-                }
-                bytes_written += ssl_ret;
-            }
-            bytes_read = (int) pread(cache_ptr->fd, buffer, BUFFER_SIZE, total_bytes_read);
-            total_bytes_read += bytes_read;
+            resp->chunk = arena_alloc(&resp->arena, SEND_CHUNK_SIZE);
+            if (resp->chunk == NULL)
+                return -1;
         }
 
-        // lseek(cache_ptr->fd, 0, SEEK_SET);
-        if (total_bytes_read < 0)
+        bytes_read = pread(page->fd, resp->chunk, SEND_CHUNK_SIZE, resp->offset);
+        if (bytes_read <= 0)
         {
-            LOG_ERROR("%s Error in reading file", __func__);
+            LOG_ERROR("%s Error in reading file %s", __func__, page->file_name);
             return -1;
         }
+        resp->out = resp->chunk;
+        resp->out_len = (int)bytes_read;
     }
-    else
+
+    resp->offset += resp->out_len;
+    return 0;
+}
+
+/**
+ * SSL_write for the half round trip before the client finished the
+ * handshake, the only time a server may use SSL_write_early_data
+ */
+static int write_early_data(SSL *ssl, const char *buf, int len)
+{
+    size_t written = 0;
+
+    if (SSL_write_early_data(ssl, buf, (size_t)len, &written) != 1)
+        return 0;
+    return (int)written;
+}
+
+/**
+ * Continues sending the response queued on the client.
+ * Returns CONN_DONE once everything is handed to SSL, the caller
+ * then finishes the request, CONN_WANT_WRITE if
+ * the socket is full or the SEND_BUDGET for this run is used up,
+ * CONN_WANT_READ if TLS needs to read first, CONN_WANT_FILE if the next
+ * chunk has to be read asynchronously, CONN_CLOSE on error
+ */
+int sendfile_to_client(client_info *cinfo)
+{
+    int ssl_ret = 0;
+    size_t bytes_sent = 0;
+    send_state *resp = &cinfo->resp;
+
+    while (1)
     {
-        bytes_written = 0;
-        while(bytes_written < cache_ptr->file_size)
+        if (resp->out_len == 0)
         {
-            ssl_ret = SSL_write(client_ssl, cache_ptr->file_map + bytes_written, (int)cache_ptr->file_size - bytes_written);
-            if (ssl_ret <= 0)
-            {
-                LOG_ERROR(" %s SSL_write error: %d", __func__, SSL_get_error(client_ssl, ssl_ret));
-                ERR_print_errors_fp(stderr);
-                fflush(stderr);
-                return -1;
-            }
-            bytes_written += ssl_ret;
+            // The io_uring engine reads fd backed entries asynchronously
+            // into resp->chunk and refills out/out_len itself
+            if (cinfo->async_file && resp->page != NULL && resp->page->file_map == NULL &&
+                resp->offset < resp->page->file_size)
+                return CONN_WANT_FILE;
+
+            if (load_next_chunk(resp) != 0)
+                return CONN_CLOSE;
+
+            if (resp->out_len == 0)
+                break;
         }
+
+        // Let other connections have this worker, socket is still writable
+        // so parking on EPOLLOUT brings us back right away
+        if (bytes_sent >= SEND_BUDGET)
+            return CONN_WANT_WRITE;
+
+        if (cinfo->early_data)
+            ssl_ret = write_early_data(cinfo->ssl, resp->out, resp->out_len);
+        else
+            ssl_ret = SSL_write(cinfo->ssl, resp->out, resp->out_len);
+        if (ssl_ret <= 0)
+            return ssl_status(cinfo->ssl, ssl_ret, "SSL_write");
+
+        resp->out += ssl_ret;
+        resp->out_len -= ssl_ret;
+        bytes_sent += (size_t)ssl_ret;
+        cinfo->access.bytes += (unsigned long)ssl_ret;
     }
 
+    arena_reset(&resp->arena);
+    resp->chunk = NULL;
+    resp->page = NULL;
+    resp->offset = 0;
+    return CONN_DONE;
+}
+
+/**
+ * Queues a formatted header and optionally a page body on the client
+ */
+static int start_response(client_info *cinfo, unsigned short status, int hdr_len, const page_cache *page)
+{
+    send_state *resp = &cinfo->resp;
+
+    if (hdr_len <= 0 || hdr_len >= RESP_HEADER_SIZE)
+        return -1;
+
+    cinfo->access.status = status;
+    resp->out = resp->header;
+    resp->out_len = hdr_len;
+    resp->page = page;
+    resp->offset = 0;
     return 0;
 }
 
 /**
- * Sends back 500 response code to client and
+ * Queues 500 response code for the client and
  * Returns -1 to instruct closing of this connection
  */
-int send_server_error(SSL *client_ssl)
+int send_server_error(client_info *cinfo)
 {
     int buf_len = 0;
-    char resp[256];
-    buf_len = (int)snprintf(resp, 255, "HTTP/1.1 500 Internal Server Error\r\n"
-                                       "Content-Type: %s; charset=UTF-8\r\n"
-                                       "Content-Length: %lu\r\nConnection: close\r\n\r\n",
-                                        page_500->mime_type, page_500->file_size);
-    if (buf_len <= 0)
-        return -1;
+    buf_len = snprintf(cinfo->resp.header, RESP_HEADER_SIZE, "HTTP/1.1 500 Internal Server Error\r\n"
+                                                             "Content-Type: %s; charset=UTF-8\r\n"
+                                                             "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+                                                             page_500->mime_type, page_500->file_size);
+    start_response(cinfo, 500, buf_len, page_500);
+    return -1;
+}
 
-    SSL_write(client_ssl, resp, buf_len);
-    sendfile_to_client(client_ssl, page_500);
+/**
+ * Queues 429 response code for a client over its request rate
+ * Returns -1 to instruct closing of this connection
+ */
+int send_too_many_requests(client_info *cinfo)
+{
+    int buf_len = 0;
+    buf_len = snprintf(cinfo->resp.header, RESP_HEADER_SIZE, "HTTP/1.1 429 Too Many Requests\r\n"
+                                                             "Retry-After: 1\r\n"
+                                                             "Content-Length: 0\r\nConnection: close\r\n\r\n");
+    start_response(cinfo, 429, buf_len, NULL);
     return -1;
 }
 
 /**
- * Sends back 404 response code to client
+ * Queues 404 response code for the client with the given error page
  * Returns -1 to instruct closing of this connection
  */
-int send_not_found(SSL *client_ssl)
+int send_not_found(client_info *cinfo, const page_cache *page)
 {
     int buf_len = 0;
-    char resp[256];
-    buf_len = (int)snprintf(resp, 255, "HTTP/1.1 404 Not Found\r\n"
-                                       "Content-Type: %s charset=UTF-8\r\n"
-                                       "Content-Length: %lu\r\nConnection: close\r\n\r\n",
-                                        page_404->mime_type, page_404->file_size);
-    if (buf_len <= 0)
-        return -1;
-    SSL_write(client_ssl, resp, buf_len);
-    sendfile_to_client(client_ssl, page_404);
+    buf_len = snprintf(cinfo->resp.header, RESP_HEADER_SIZE, "HTTP/1.1 404 Not Found\r\n"
+                                                             "Content-Type: %s; charset=UTF-8\r\n"
+                                                             "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+                                                             page->mime_type, page->file_size);
+    start_response(cinfo, 404, buf_len, page);
     return -1;
 }
 
 /**
- * Construct appropriate header and send back the requested file
+ * Construct appropriate header and queue the requested file
  * Returns 0 on success, -1 otherwise
  */
-int send_response(SSL *client_ssl, const page_cache *page, bool is_head)
+int send_response(client_info *cinfo, const page_cache *page, bool is_head)
 {
     int buf_len = 0;
-    char resp[256];
 
-    buf_len = (int)snprintf(resp, 255, "HTTP/1.1 200 OK\r\nServer: legion\r\n"
-                                       "Content-Type: %s; charset=UTF-8\r\n"
-                                       "Content-Length: %lu\r\nConnection: keep-alive\r\n\r\n",
-                                        page->mime_type, page->file_size);
-    if (buf_len <= 0)
-        return -1;
+    buf_len = snprintf(cinfo->resp.header, RESP_HEADER_SIZE, "HTTP/1.1 200 OK\r\nServer: legion\r\n"
+                                                             "Content-Type: %s; charset=UTF-8\r\n"
+                                                             "Content-Length: %lu\r\nConnection: keep-alive\r\n\r\n",
+                                                             page->mime_type, page->file_size);
 
-    SSL_write(client_ssl, resp, buf_len);
-    if (!is_head)
+    return start_response(cinfo, 200, buf_len, is_head ? NULL : page);
+}
+
+/**
+ * Queues the metrics page, header and body go out
+ * of one buffer in the request arena
+ * Returns 0 on success, -1 otherwise
+ */
+static int send_stats(client_info *cinfo, bool is_head)
+{
+    int hdr_len = 0;
+    size_t body_len = 0;
+    char *body = NULL;
+    char *out = NULL;
+    send_state *resp = &cinfo->resp;
+
+    body = render_metrics(&body_len);
+    if (body == NULL)
+        return send_server_error(cinfo);
+
+    hdr_len = snprintf(resp->header, RESP_HEADER_SIZE, "HTTP/1.1 200 OK\r\nServer: legion\r\n"
+                                                        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                                                        "Content-Length: %zu\r\nConnection: keep-alive\r\n\r\n",
+                                                        body_len);
+    if (hdr_len > 0 && hdr_len < RESP_HEADER_SIZE)
+        out = arena_alloc(&resp->arena, (size_t)hdr_len + body_len);
+    if (out == NULL)
     {
-        sendfile_to_client(client_ssl, page);
+        free(body);
+        return send_server_error(cinfo);
     }
+
+    memcpy(out, resp->header, (size_t)hdr_len);
+    memcpy(out + hdr_len, body, body_len);
+    free(body);
+
+    resp->out = out;
+    resp->out_len = hdr_len + (is_head ? 0 : (int)body_len);
+    resp->page = NULL;
+    resp->offset = 0;
+    cinfo->access.status = 200;
     return 0;
 }
 
 /**
  * Parse the incoming message for the requested webpage
- * And send back the page if it's found
+ * And queue the page if it's found
  * Returns 0 on success, -1 otherwise
  */
-int process_get_request(SSL *client_ssl, char *buf, bool is_head)
+int process_get_request(client_info *cinfo, char *buf, bool is_head, const page_namespace *ns)
 {
     ssize_t len = 0;
     char *file_end = NULL;
     const page_cache *page_reqd = NULL;
+    worker_metrics *metrics = NULL;
 
     if (*buf == '/')
         buf++;
 
     file_end = strchr(buf, ' ');
     if (file_end == NULL)
-        return send_server_error(client_ssl);
+        return send_server_error(cinfo);
 
     len = file_end - buf;
     if (len < 0 || len >= PATH_MAX)
-        return send_server_error(client_ssl);
+        return send_server_error(cinfo);
 
     (*file_end) = '\0';
-    page_reqd = get_page_cache(buf);
+    if (g_access_log || TRACE_ENABLED)
+    {
+        cinfo->access.path_len = (unsigned short)((len < ACCESS_PATH_LEN) ? len : ACCESS_PATH_LEN);
+        memcpy(cinfo->access.path, buf, cinfo->access.path_len);
+    }
+    LOG_DEBUG("%s /%s on client_fd: %d", is_head ? "HEAD" : "GET", buf, cinfo->fd);
+    TRACE_PHASE(cinfo, PHASE_PARSE, cinfo->trace.start);
+    if (g_stats_endpoint && strcmp(buf, STATS_PATH) == 0)
+        return send_stats(cinfo, is_head);
+
+    metrics = thread_metrics();
+    TRACE_STAMP(lookup_start);
+    page_reqd = (ns != NULL) ? get_namespace_page(ns, buf) : get_page_cache(buf);
+    TRACE_PHASE(cinfo, PHASE_LOOKUP, lookup_start);
     if (page_reqd == NULL)
     {
+        if (metrics != NULL)
+            METRIC_ADD(metrics, cache_misses, 1);
         LOG_ERROR("%s Requested page %s not found", __func__, buf);
-        return send_not_found(client_ssl);
+        return send_not_found(cinfo, (ns != NULL && ns->page_404 != NULL) ? ns->page_404 : page_404);
     }
-    return send_response(client_ssl, page_reqd, is_head);
+    if (metrics != NULL)
+        METRIC_ADD(metrics, cache_hits, 1);
+    return send_response(cinfo, page_reqd, is_head);
 }
 
 int parse_header(const char *buffer, client_info *cinfo)
@@ -194,39 +427,305 @@ int parse_header(const char *buffer, client_info *cinfo)
     return 0;
 }
 
-void handle_http_request(void *arg)
+/**
+ * Namespace of the virtual host named by the Host header,
+ * NULL for the default one
+ */
+static const page_namespace *request_namespace(const char *buffer)
 {
-    client_info *cinfo = (client_info *)arg;
-    int bytes_read = 0, ret = 0;
-    char buffer[BUFFER_SIZE];
+    size_t len = 0;
+    const char *line = buffer;
 
-    set_non_blocking(cinfo->fd, false);
-    set_socket_timeout(cinfo->fd, 0, RTT_TIMEOUT_US);
-    bytes_read = SSL_read(cinfo->ssl, buffer, BUFFER_SIZE - 1);
-    if (bytes_read <= 0)
+    if (g_vhosts_enabled == false)
+        return NULL;
+
+    while ((line = strchr(line, '\n')) != NULL)
     {
-        remove_client_info(cinfo);
-        return;
+        line++;
+        if (strncasecmp(line, "Host:", 5) != 0)
+            continue;
+
+        line += 5;
+        line += strspn(line, " \t");
+        len = strcspn(line, " \t\r\n");
+        return find_host_pages(line, len);
+    }
+    return NULL;
+}
+
+/**
+ * Queues the answer to a request read as TLS 1.3 early data, before the
+ * client proved it is not replaying someone else's. Only a GET or HEAD
+ * of a cached page is answered, sending it again changes nothing and
+ * the response is useless without the session keys. Everything else
+ * waits for the handshake and is counted against the request rate then
+ * Returns 0 once queued, -1 if the request has to wait
+ */
+int queue_early_response(client_info *cinfo, char *buffer)
+{
+    bool is_head = false;
+    char *path = NULL;
+    char *path_end = NULL;
+    const char *name = NULL;
+    const page_cache *page = NULL;
+    const page_namespace *ns = NULL;
+    TRACE_STAMP(read_start);
+
+    if (strncmp(buffer, "GET ", 4) == 0)
+    {
+        path = buffer + 4;
+    }
+    else if (strncmp(buffer, "HEAD ", 5) == 0)
+    {
+        path = buffer + 5;
+        is_head = true;
+    }
+    else
+        return -1;
+
+    path_end = strchr(path, ' ');
+    if (path_end == NULL || path_end - path >= PATH_MAX)
+        return -1;
+
+    ns = request_namespace(buffer);
+    *path_end = '\0';
+    name = (*path == '/') ? path + 1 : path;
+    // The stats page is not a cached page, it changes with every request
+    if (g_stats_endpoint == false || strcmp(name, STATS_PATH) != 0)
+        page = (ns != NULL) ? get_namespace_page(ns, name) : get_page_cache(name);
+    *path_end = ' ';
+    if (page == NULL)
+        return -1;
+
+    TRACE_BEGIN(cinfo, read_start);
+    parse_header(buffer, cinfo);
+    begin_request(&cinfo->access, is_head ? ACCESS_METHOD_HEAD : ACCESS_METHOD_GET);
+    // Answered either way, so it is counted only here
+    if (rate_limit_request(cinfo->rate_slot) != 0)
+    {
+        cinfo->keep_alive = false;
+        send_too_many_requests(cinfo);
+        return 0;
+    }
+    return process_get_request(cinfo, path, is_head, ns);
+}
+
+/**
+ * NUL terminates the request read so far and tells if it holds
+ * its whole header block, bytes from 'from' on are new
+ */
+static bool request_complete(char *buf, int from, int len)
+{
+    buf[len] = '\0';
+    // The terminator may have started in the previous read
+    from = (from > 3) ? from - 3 : 0;
+    return strstr(buf + from, "\r\n\r\n") != NULL || strstr(buf + from, "\n\n") != NULL;
+}
+
+/**
+ * Makes room in the request buffer of the connection for more than
+ * need bytes, moving to the next size class as it grows
+ * Returns 0 on success, -1 if the request is too large
+ */
+static int reserve_request(client_info *cinfo, int need)
+{
+    int cap = (cinfo->req_cap > 0) ? cinfo->req_cap : BUF_SMALL;
+    char *buf = NULL;
+
+    while (cap <= need)
+        cap *= 4;
+    if (cap == cinfo->req_cap)
+        return 0;
+    if (cap > MAX_REQUEST_SIZE)
+        return -1;
+
+    buf = buf_realloc(cinfo->req_buf, (size_t)cinfo->req_cap, (size_t)cap);
+    if (buf == NULL)
+        return -1;
+    cinfo->req_buf = buf;
+    cinfo->req_cap = cap;
+    return 0;
+}
+
+/**
+ * Reads until a request with its whole header block is in. Most fit the
+ * first read into the caller's stack buffer, others move to a pooled
+ * buffer on the connection which outlives this run, so a request split
+ * over several reads is picked up where it was left. Bytes read past the
+ * header block are dropped, requests are not pipelined into one read
+ * Returns CONN_DONE with *request and *len set once a request is in, its
+ * buffer has room for a NUL after it, *request is NULL if it is too large.
+ * Otherwise the status the connection is parked with
+ */
+static conn_status read_request(client_info *cinfo, char *buffer, char **request, int *len)
+{
+    int ret = 0;
+    int old_len = 0;
+
+    if (cinfo->req_buf == NULL)
+    {
+        ret = SSL_read(cinfo->ssl, buffer, BUFFER_SIZE - 1);
+        if (ret <= 0)
+            return ssl_status(cinfo->ssl, ret, "SSL_read");
+        if (request_complete(buffer, 0, ret))
+        {
+            *request = buffer;
+            *len = ret;
+            return CONN_DONE;
+        }
+
+        if (reserve_request(cinfo, ret) != 0)
+            return CONN_CLOSE;
+        memcpy(cinfo->req_buf, buffer, (size_t)ret);
+        cinfo->req_len = ret;
     }
 
-    buffer[bytes_read] = '\0';
     while (1)
     {
-        // LOG_INFO("\n%s", buffer);
-        ret = parse_header(buffer, cinfo);
-        if (strncmp(buffer, "GET", 3) == 0)
-            ret = process_get_request(cinfo->ssl, buffer + 4, false);
-        else if (strncmp(buffer, "HEAD", 4) == 0)
-            ret = process_get_request(cinfo->ssl, buffer + 5, true);
+        *request = NULL;
+        *len = 0;
+        if (reserve_request(cinfo, cinfo->req_len + 1) != 0)
+            return CONN_DONE;
+
+        old_len = cinfo->req_len;
+        ret = SSL_read(cinfo->ssl, cinfo->req_buf + old_len, cinfo->req_cap - old_len - 1);
+        if (ret <= 0)
+            return ssl_status(cinfo->ssl, ret, "SSL_read");
+        cinfo->req_len += ret;
+        if (request_complete(cinfo->req_buf, old_len, cinfo->req_len))
+        {
+            *request = cinfo->req_buf;
+            *len = cinfo->req_len;
+            return CONN_DONE;
+        }
+    }
+}
+
+/**
+ * Reads requests off the connection and answers them until the
+ * connection has to wait on the socket or be closed.
+ * Returns the status the connection should be parked with
+ */
+conn_status serve_client(client_info *cinfo)
+{
+    int ret = 0;
+    int bytes_read = 0;
+    size_t requests = 0;
+    char *request = NULL;
+    const page_namespace *ns = NULL;
+    char buffer[BUFFER_SIZE];
+
+    if (cinfo->h2 != NULL)
+        return h2_serve(cinfo);
+
+    // Finish whatever response was interrupted last time
+    if (cinfo->resp.out_len > 0 || cinfo->resp.page != NULL)
+    {
+        TRACE_STAMP(resume_start);
+        ret = sendfile_to_client(cinfo);
+        TRACE_PHASE(cinfo, PHASE_SEND, resume_start);
+        if (ret != CONN_DONE)
+            return ret;
+        finish_request(cinfo, 0);
+        if (cinfo->keep_alive == false)
+            return CONN_CLOSE;
+    }
+
+    for (requests = 0; requests < MAX_REQ_PER_RUN; requests++)
+    {
+        TRACE_STAMP(read_start);
+        if (cinfo->early_request != NULL)
+        {
+            // Came in as early data, safe to answer now the handshake is done
+            bytes_read = cinfo->early_len;
+            memcpy(buffer, cinfo->early_request, (size_t)bytes_read);
+            buf_free(cinfo->early_request, BUFFER_SIZE);
+            cinfo->early_request = NULL;
+            cinfo->early_len = 0;
+            request = buffer;
+        }
         else
-            ret = send_server_error(cinfo->ssl);
+        {
+            ret = read_request(cinfo, buffer, &request, &bytes_read);
+            if (ret != CONN_DONE)
+                return ret;
+        }
 
-        if (ret != 0 || cinfo->keep_alive == false)
-            break;
+        TRACE_BEGIN(cinfo, read_start);
+        if (request == NULL)
+        {
+            LOG_ERROR("%s Request header over %d bytes on client_fd: %d", __func__, MAX_REQUEST_SIZE, cinfo->fd);
+            begin_request(&cinfo->access, ACCESS_METHOD_OTHER);
+            ret = send_server_error(cinfo);
+        }
+        else if (rate_limit_request(cinfo->rate_slot) != 0)
+        {
+            LOG_DEBUG("%s Request over the rate on client_fd: %d", __func__, cinfo->fd);
+            begin_request(&cinfo->access, ACCESS_METHOD_OTHER);
+            ret = send_too_many_requests(cinfo);
+        }
+        else
+        {
+            request[bytes_read] = '\0';
+            parse_header(request, cinfo);
+            // Before the request line gets cut at the end of the path
+            ns = request_namespace(request);
+            if (strncmp(request, "GET", 3) == 0)
+            {
+                begin_request(&cinfo->access, ACCESS_METHOD_GET);
+                ret = process_get_request(cinfo, request + 4, false, ns);
+            }
+            else if (strncmp(request, "HEAD", 4) == 0)
+            {
+                begin_request(&cinfo->access, ACCESS_METHOD_HEAD);
+                ret = process_get_request(cinfo, request + 5, true, ns);
+            }
+            else
+            {
+                begin_request(&cinfo->access, ACCESS_METHOD_OTHER);
+                ret = send_server_error(cinfo);
+            }
+        }
 
-        bytes_read = SSL_read(cinfo->ssl, buffer, BUFFER_SIZE - 1);
-        if (bytes_read <= 0)
-            break;
+        // Everything needed from the request is copied out by now
+        if (cinfo->req_buf != NULL)
+        {
+            buf_free(cinfo->req_buf, (size_t)cinfo->req_cap);
+            cinfo->req_buf = NULL;
+            cinfo->req_len = 0;
+            cinfo->req_cap = 0;
+        }
+
+        if (ret != 0)
+            cinfo->keep_alive = false;
+
+        TRACE_STAMP(send_start);
+        ret = sendfile_to_client(cinfo);
+        TRACE_PHASE(cinfo, PHASE_SEND, send_start);
+        if (ret != CONN_DONE)
+            return ret;
+        finish_request(cinfo, 0);
+
+        if (cinfo->keep_alive == false)
+            return CONN_CLOSE;
     }
-    remove_client_info(cinfo);
-}
\ No newline at end of file
+
+    // Request budget used up, more may be buffered inside SSL
+    // where EPOLLIN can't see it, EPOLLOUT fires right away instead
+    return CONN_WANT_WRITE;
+}
+
+/**
+ * Threadpool task run whenever a parked connection becomes ready
+ */
+void handle_http_request(void *arg)
+{
+    conn_status status = CONN_CLOSE;
+    client_info *cinfo = (client_info *)arg;
+
+    TRACE_RESUME(cinfo);
+    status = serve_client(cinfo);
+    // Before parking, the connection may be queued again right after
+    TRACE_PARK(cinfo);
+    park_client(cinfo, status);
+}
@@ -0,0 +1,390 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "server.h"
+
+/**
+ * Slab caches hand out blocks of one size without going to malloc once
+ * they are warm. Every thread keeps a magazine of free blocks for each
+ * cache it used, linked through the blocks themselves, so the common
+ * alloc and free touch nothing shared. A full magazine gives half of
+ * itself to the cache's depot and an empty one takes a batch back, which
+ * evens out blocks allocated on one thread and freed on another, like a
+ * connection accepted by a handshake worker and closed by a request
+ * worker. Only a miss in both calls malloc and only a full depot free.
+ *
+ * Buffers come from one cache per size class, request arenas bump
+ * allocate out of those buffers and give them back all at once.
+ */
+
+// Blocks start on a 16 byte boundary like malloc's
+#define ARENA_ALIGN  16
+#define ARENA_HEADER ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+typedef struct
+{
+    slab_cache *cache;
+    void *head;
+    unsigned int count;
+} slab_magazine;
+
+// The small classes take OpenSSL's per record allocations
+static slab_cache buf_classes[] = {
+    SLAB_CACHE(64),
+    SLAB_CACHE(256),
+    SLAB_CACHE(1024),
+    SLAB_CACHE(BUF_SMALL + BUF_SLACK),
+    SLAB_CACHE(BUF_MEDIUM + BUF_SLACK),
+    SLAB_CACHE(BUF_LARGE + BUF_SLACK),
+};
+
+#define NR_BUF_CLASSES (sizeof(buf_classes) / sizeof(buf_classes[0]))
+
+static __thread slab_magazine magazines[SLAB_MAX_CACHES];
+// Set once the thread flushed its magazines on exit
+static __thread bool magazines_closed = false;
+static int nr_caches = 0;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t magazine_key;
+static pthread_once_t magazine_once = PTHREAD_ONCE_INIT;
+
+static unsigned int clamp_blocks(size_t bytes, size_t size, unsigned int min, unsigned int max)
+{
+    size_t blocks = bytes / size;
+
+    if (blocks < min)
+        return min;
+    return (blocks > max) ? max : (unsigned int)blocks;
+}
+
+/**
+ * Moves up to n blocks off the magazine into the depot,
+ * what does not fit there is freed
+ */
+static void slab_drain(slab_magazine *mag, unsigned int n)
+{
+    void *block = NULL;
+    void *spill = NULL;
+    slab_cache *cache = mag->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    for (; n > 0 && mag->head != NULL; n--)
+    {
+        block = mag->head;
+        mag->head = *(void **)block;
+        mag->count--;
+        if (cache->depot_count < cache->depot_max)
+        {
+            *(void **)block = cache->depot;
+            cache->depot = block;
+            cache->depot_count++;
+        }
+        else
+        {
+            *(void **)block = spill;
+            spill = block;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    while (spill != NULL)
+    {
+        block = spill;
+        spill = *(void **)block;
+        free(block);
+    }
+}
+
+/**
+ * Takes half a magazine worth of blocks from the depot
+ */
+static void slab_refill(slab_magazine *mag)
+{
+    void *block = NULL;
+    slab_cache *cache = mag->cache;
+    unsigned int n = cache->thread_max / 2;
+
+    pthread_mutex_lock(&cache->lock);
+    for (; n > 0 && cache->depot != NULL; n--)
+    {
+        block = cache->depot;
+        cache->depot = *(void **)block;
+        cache->depot_count--;
+        *(void **)block = mag->head;
+        mag->head = block;
+        mag->count++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Hands the magazines of an exiting thread back to their caches.
+ * Destructors of other keys, OpenSSL's among them, may still free
+ * blocks afterwards, those bypass the magazines
+ */
+static void slab_thread_exit(void *arg)
+{
+    size_t i = 0;
+    slab_magazine *mags = arg;
+
+    magazines_closed = true;
+    for (i = 0; i < SLAB_MAX_CACHES; i++)
+    {
+        if (mags[i].cache != NULL)
+            slab_drain(&mags[i], mags[i].count);
+    }
+}
+
+static void slab_key_create()
+{
+    if (pthread_key_create(&magazine_key, slab_thread_exit) != 0)
+        LOG_ERROR("%s pthread_key_create", __func__);
+}
+
+/**
+ * Gives the cache its id and sizes its magazines and depot
+ */
+static void slab_register(slab_cache *cache)
+{
+    pthread_mutex_lock(&registry_lock);
+    if (cache->id == 0)
+    {
+        if (nr_caches < SLAB_MAX_CACHES)
+        {
+            cache->thread_max = clamp_blocks(SLAB_THREAD_BYTES, cache->size, 2, SLAB_THREAD_MAX);
+            cache->depot_max = clamp_blocks(SLAB_DEPOT_BYTES, cache->size, cache->thread_max, SLAB_DEPOT_MAX);
+            __atomic_store_n(&cache->id, ++nr_caches, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            LOG_ERROR("%s: more than %d caches, blocks of %zu bytes are not cached", __func__, SLAB_MAX_CACHES,
+                      cache->size);
+            __atomic_store_n(&cache->id, -1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/**
+ * Magazine of this thread for the cache, NULL if it is not cached
+ */
+static slab_magazine *slab_magazine_of(slab_cache *cache)
+{
+    int id = __atomic_load_n(&cache->id, __ATOMIC_ACQUIRE);
+    slab_magazine *mag = NULL;
+
+    if (id == 0)
+    {
+        slab_register(cache);
+        id = __atomic_load_n(&cache->id, __ATOMIC_ACQUIRE);
+    }
+    if (id < 0 || magazines_closed)
+        return NULL;
+
+    mag = &magazines[id - 1];
+    if (mag->cache == NULL)
+    {
+        // First block of this cache on this thread
+        mag->cache = cache;
+        pthread_once(&magazine_once, slab_key_create);
+        pthread_setspecific(magazine_key, magazines);
+    }
+    return mag;
+}
+
+/**
+ * Block of cache->size bytes, its contents are undefined
+ * Returns NULL if malloc fails
+ */
+void *slab_alloc(slab_cache *cache)
+{
+    void *block = NULL;
+    slab_magazine *mag = slab_magazine_of(cache);
+
+    if (mag != NULL && mag->count == 0)
+        slab_refill(mag);
+    if (mag == NULL || mag->count == 0)
+        return malloc(cache->size);
+
+    block = mag->head;
+    mag->head = *(void **)block;
+    mag->count--;
+    return block;
+}
+
+/**
+ * Zeroed block of cache->size bytes, the calloc of slab caches
+ */
+void *slab_zalloc(slab_cache *cache)
+{
+    void *block = slab_alloc(cache);
+
+    if (block != NULL)
+        memset(block, 0, cache->size);
+    return block;
+}
+
+void slab_free(slab_cache *cache, void *block)
+{
+    slab_magazine *mag = NULL;
+
+    if (block == NULL)
+        return;
+
+    mag = slab_magazine_of(cache);
+    if (mag == NULL)
+    {
+        free(block);
+        return;
+    }
+
+    if (mag->count >= cache->thread_max)
+        slab_drain(mag, cache->thread_max / 2);
+    *(void **)block = mag->head;
+    mag->head = block;
+    mag->count++;
+}
+
+/**
+ * Smallest size class a buffer of size bytes fits in, NULL if none
+ */
+static slab_cache *buf_class(size_t size)
+{
+    size_t i = 0;
+
+    for (i = 0; i < NR_BUF_CLASSES; i++)
+    {
+        if (size <= buf_classes[i].size)
+            return &buf_classes[i];
+    }
+    return NULL;
+}
+
+/**
+ * Buffer of at least size bytes, larger than every class comes from malloc
+ * Returns NULL on failure
+ */
+void *buf_alloc(size_t size)
+{
+    slab_cache *cls = buf_class(size);
+
+    return (cls != NULL) ? slab_alloc(cls) : malloc(size);
+}
+
+/**
+ * Frees a buffer, size being the one it was last allocated with
+ */
+void buf_free(void *buf, size_t size)
+{
+    slab_cache *cls = buf_class(size);
+
+    if (cls != NULL)
+        slab_free(cls, buf);
+    else
+        free(buf);
+}
+
+/**
+ * Resizes a buffer, which stays where it is while it fits its class
+ * Returns NULL on failure, buf is left as it was then
+ */
+void *buf_realloc(void *buf, size_t old_size, size_t size)
+{
+    void *resized = NULL;
+    slab_cache *old_cls = buf_class(old_size);
+    slab_cache *cls = buf_class(size);
+
+    if (buf == NULL)
+        return buf_alloc(size);
+    if (old_cls == cls && cls != NULL)
+        return buf;
+    if (old_cls == NULL && cls == NULL)
+        return realloc(buf, size);
+
+    resized = buf_alloc(size);
+    if (resized == NULL)
+        return NULL;
+    memcpy(resized, buf, (old_size < size) ? old_size : size);
+    buf_free(buf, old_size);
+    return resized;
+}
+
+/**
+ * Memory valid until the next arena_reset(), aligned like malloc's
+ * Returns NULL on failure
+ */
+void *arena_alloc(request_arena *arena, size_t size)
+{
+    void *mem = NULL;
+    size_t need = 0;
+    struct arena_block *block = arena->head;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (block == NULL || block->size - block->used < size)
+    {
+        need = ARENA_HEADER + size;
+        if (need < BUF_SMALL)
+            need = BUF_SMALL;
+        // Fill the class it comes from, oversized ones are malloced as is
+        if (buf_class(need) != NULL)
+            need = buf_class(need)->size;
+
+        block = buf_alloc(need);
+        if (block == NULL)
+        {
+            LOG_ERROR("%s buf_alloc", __func__);
+            return NULL;
+        }
+        block->next = arena->head;
+        block->size = need;
+        block->used = ARENA_HEADER;
+        arena->head = block;
+    }
+
+    mem = (char *)block + block->used;
+    block->used += size;
+    return mem;
+}
+
+/**
+ * Gives every block of the arena back to the pool
+ */
+void arena_reset(request_arena *arena)
+{
+    struct arena_block *block = NULL;
+
+    while (arena->head != NULL)
+    {
+        block = arena->head;
+        arena->head = block->next;
+        buf_free(block, block->size);
+    }
+}
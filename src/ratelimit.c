@@ -0,0 +1,331 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "server.h"
+
+#include <time.h>
+
+/**
+ * Per client limits checked on every new connection and request. A
+ * client is an IPv4 address or an IPv6 /64, the smallest block a
+ * single host is usually handed. Each one gets a slot with two token
+ * buckets, connections and requests per second with RATE_BURST_SEC
+ * worth of burst, and a count of its open connections.
+ *
+ * Slots live in a fixed table split into sets of RATE_WAYS by a hash of
+ * the client, so a lookup only ever scans one set and threads working
+ * on different clients rarely share a cache line. Nothing is locked:
+ * keys are claimed with a CAS and every bucket is a single word holding
+ * the tokens and the time they were last refilled. A slot goes back to
+ * the table once its client has nothing open and both buckets have
+ * filled up again, at which point forgetting it loses nothing.
+ *
+ * The first connections of a new client racing each other may each
+ * claim a slot, the extra one ages out like any other. A client that
+ * finds its set full is let through untracked.
+ */
+
+// Tokens are counted in thousandths, a refill then adds rate per ms
+#define RATE_TOKEN 1000U
+// Open count of a slot being aged, keeps new connections off it
+#define RATE_AGING UINT32_MAX
+// IPv4 addresses go under an IPv6 prefix nobody is assigned
+#define RATE_KEY_V4 0xffffffff00000000ULL
+
+typedef struct
+{
+    uint64_t key;
+    // Refill time in ms in the high half, tokens in the low half, 0 when full
+    uint64_t conns;
+    uint64_t requests;
+    uint32_t open;
+} rate_slot;
+
+bool g_rate_limit = false;
+
+static rate_slot table[RATE_SETS * RATE_WAYS] __attribute__((aligned(METRICS_CACHE_LINE)));
+static uint32_t conn_rate = 0;
+static uint32_t request_rate = 0;
+static struct timespec clock_base;
+static unsigned int age_cursor = 0;
+
+/**
+ * Milliseconds since init_rate_limit(), never 0
+ */
+static uint32_t rate_clock()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint32_t)((now.tv_sec - clock_base.tv_sec) * 1000 + (now.tv_nsec - clock_base.tv_nsec) / 1000000) + 1;
+}
+
+static uint64_t client_key(const struct sockaddr *addr)
+{
+    uint64_t key = 0;
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+
+    if (addr->sa_family == AF_INET)
+        return RATE_KEY_V4 | ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr);
+    if (addr->sa_family != AF_INET6)
+        return 0;
+    if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+    {
+        memcpy(&key, &in6->sin6_addr.s6_addr[12], 4);
+        return RATE_KEY_V4 | ntohl((uint32_t)key);
+    }
+
+    memcpy(&key, &in6->sin6_addr, sizeof(key));
+    // ::/64 only holds loopback, 0 marks a free slot
+    return (key != 0) ? key : 1;
+}
+
+static uint32_t bucket_tokens(uint64_t bucket, uint32_t rate, uint32_t now)
+{
+    uint64_t cap = (uint64_t)rate * RATE_BURST_SEC * RATE_TOKEN;
+    uint64_t tokens = bucket & UINT32_MAX;
+    int32_t elapsed = (int32_t)(now - (uint32_t)(bucket >> 32));
+
+    if (bucket == 0)
+        return (uint32_t)cap;
+    // Another thread may have read the clock later than this one
+    if (elapsed > 0)
+        tokens += (uint64_t)elapsed * rate;
+    return (uint32_t)((tokens < cap) ? tokens : cap);
+}
+
+/**
+ * Takes one token from the bucket, rate 0 is no limit
+ * Returns 0 on success, -1 if the bucket is empty
+ */
+static int bucket_take(uint64_t *bucket, uint32_t rate, uint32_t now)
+{
+    uint32_t tokens = 0;
+    uint64_t old = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+
+    if (rate == 0)
+        return 0;
+
+    do
+    {
+        tokens = bucket_tokens(old, rate, now);
+        if (tokens < RATE_TOKEN)
+            return -1;
+    } while (!__atomic_compare_exchange_n(bucket, &old, ((uint64_t)now << 32) | (tokens - RATE_TOKEN), true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+static bool bucket_full(const uint64_t *bucket, uint32_t rate, uint32_t now)
+{
+    uint64_t value = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+
+    return rate == 0 || bucket_tokens(value, rate, now) == (uint64_t)rate * RATE_BURST_SEC * RATE_TOKEN;
+}
+
+/**
+ * Frees the slot if its client has nothing open and would start
+ * over with full buckets anyway. Returns true if it was freed
+ */
+static bool age_slot(rate_slot *slot, uint32_t now)
+{
+    bool freed = false;
+    uint32_t idle = 0;
+
+    if (__atomic_load_n(&slot->key, __ATOMIC_RELAXED) == 0 ||
+        !__atomic_compare_exchange_n(&slot->open, &idle, RATE_AGING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return false;
+
+    if (bucket_full(&slot->conns, conn_rate, now) && bucket_full(&slot->requests, request_rate, now))
+    {
+        __atomic_store_n(&slot->conns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->requests, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->key, 0, __ATOMIC_RELEASE);
+        freed = true;
+    }
+    __atomic_store_n(&slot->open, 0, __ATOMIC_RELEASE);
+    return freed;
+}
+
+/**
+ * Finds the slot of the client in its set or claims a free one,
+ * aging the set when it is full. Returns -1 if there is none
+ */
+static int find_slot(uint64_t key, uint32_t now)
+{
+    int i = 0;
+    int pass = 0;
+    int set = (int)((key * 0x9e3779b97f4a7c15ULL) >> (64 - RATE_SET_BITS)) * RATE_WAYS;
+    uint64_t free_key = 0;
+
+    for (i = 0; i < RATE_WAYS; i++)
+    {
+        if (__atomic_load_n(&table[set + i].key, __ATOMIC_ACQUIRE) == key)
+            return set + i;
+    }
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        for (i = 0; i < RATE_WAYS; i++)
+        {
+            free_key = 0;
+            if (__atomic_compare_exchange_n(&table[set + i].key, &free_key, key, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || free_key == key)
+                return set + i;
+        }
+        for (i = 0; i < RATE_WAYS; i++)
+            age_slot(&table[set + i], now);
+    }
+    return -1;
+}
+
+/**
+ * Turns the limits on, rates are per second and 0 leaves that one out
+ * Returns 0 on success, -1 otherwise
+ */
+int init_rate_limit(const long conns_per_sec, const long requests_per_sec)
+{
+    if (conns_per_sec < 0 || conns_per_sec > RATE_MAX || requests_per_sec < 0 || requests_per_sec > RATE_MAX)
+    {
+        LOG_ERROR("%s: rates go up to %d per second", __func__, RATE_MAX);
+        return -1;
+    }
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &clock_base) != 0)
+    {
+        LOG_ERROR("%s clock_gettime", __func__);
+        return -1;
+    }
+
+    conn_rate = (uint32_t)conns_per_sec;
+    request_rate = (uint32_t)requests_per_sec;
+    g_rate_limit = true;
+    LOG_INFO("Per client limits: %ld connections/s, %ld requests/s, %d open connections",
+             conns_per_sec, requests_per_sec, RATE_MAX_OPEN);
+    return 0;
+}
+
+/**
+ * Counts a new connection from addr against its client, meant to run
+ * before any TLS work is spent on it. *slot is what the connection
+ * passes to the other calls, -1 when it is not tracked
+ * Returns 0 if the connection may go on, -1 if it has to be closed
+ */
+int rate_limit_connect(const struct sockaddr *addr, int *slot)
+{
+    int i = 0;
+    uint32_t now = 0;
+    uint32_t open = 0;
+    uint64_t key = 0;
+    rate_slot *entry = NULL;
+    worker_metrics *metrics = NULL;
+
+    *slot = -1;
+    key = g_rate_limit ? client_key(addr) : 0;
+    if (key == 0)
+        return 0;
+
+    now = rate_clock();
+    while ((i = find_slot(key, now)) >= 0)
+    {
+        entry = &table[i];
+        open = __atomic_load_n(&entry->open, __ATOMIC_RELAXED);
+        do
+        {
+            if (open == RATE_AGING || open >= RATE_MAX_OPEN)
+                break;
+        } while (!__atomic_compare_exchange_n(&entry->open, &open, open + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+        // Being aged, it is looked up again once that is over
+        if (open == RATE_AGING)
+            continue;
+        if (open >= RATE_MAX_OPEN)
+            break;
+        // The slot may have changed hands between the lookup and
+        // the count, it can't anymore now that the count is held
+        if (__atomic_load_n(&entry->key, __ATOMIC_ACQUIRE) != key)
+        {
+            __atomic_fetch_sub(&entry->open, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (bucket_take(&entry->conns, conn_rate, now) == 0)
+        {
+            *slot = i;
+            return 0;
+        }
+        __atomic_fetch_sub(&entry->open, 1, __ATOMIC_RELEASE);
+        break;
+    }
+    if (i < 0)
+        return 0;
+
+    metrics = thread_metrics();
+    if (metrics != NULL)
+        METRIC_ADD(metrics, connections_limited, 1);
+    return -1;
+}
+
+/**
+ * Counts a request against the client of the connection
+ * Returns 0 if it may be served, -1 if it is over the rate
+ */
+int rate_limit_request(const int slot)
+{
+    worker_metrics *metrics = NULL;
+
+    if (slot < 0 || bucket_take(&table[slot].requests, request_rate, rate_clock()) == 0)
+        return 0;
+
+    metrics = thread_metrics();
+    if (metrics != NULL)
+        METRIC_ADD(metrics, requests_limited, 1);
+    return -1;
+}
+
+/**
+ * Gives back the open connection counted by rate_limit_connect()
+ */
+void rate_limit_disconnect(const int slot)
+{
+    if (slot >= 0)
+        __atomic_fetch_sub(&table[slot].open, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Frees the slots of clients gone quiet in the next RATE_AGE_SETS sets,
+ * called about once a second by every thread accepting connections
+ */
+void rate_limit_age()
+{
+    int i = 0;
+    int set = 0;
+    uint32_t now = 0;
+
+    if (g_rate_limit == false)
+        return;
+
+    now = rate_clock();
+    set = (int)(__atomic_fetch_add(&age_cursor, RATE_AGE_SETS, __ATOMIC_RELAXED) % RATE_SETS);
+    for (i = set * RATE_WAYS; i < (set + RATE_AGE_SETS) * RATE_WAYS; i++)
+        age_slot(&table[i], now);
+}
@@ -30,25 +30,20 @@
 // Flag to maintain running status of the server
 bool server_run = true;
 
-// Store the global ssl context
-SSL_CTX *g_ssl_ctx = NULL;
+// epoll instance parked connections are re-armed on
+int g_epoll_fd = -1;
 
-const int g_epoll_fd = -1;
+// Serve the metrics on STATS_PATH
+bool g_stats_endpoint = false;
 
-/**
- * Select http 1.1 as the communication protocol
- */
-int alpn_select_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg)
-{
-    static const unsigned char http1_1[] = "\x08http/1.1";
-    (void) ssl;
-    (void) arg;
-    if (SSL_select_next_proto((unsigned char **)out, outlen, http1_1, sizeof(http1_1) - 1, in, inlen) == OPENSSL_NPN_NEGOTIATED)
-    {
-        return SSL_TLSEXT_ERR_OK;
-    }
-    return SSL_TLSEXT_ERR_NOACK;
-}
+// Requests are matched to virtual hosts by their Host header
+bool g_vhosts_enabled = false;
+
+// Offer h2 through ALPN, HTTP/1.1 is always offered
+bool g_http2_enabled = true;
+
+extern thpool_queue g_th_queue;
+extern SSL_CTX *g_ssl_ctx;
 
 /**
  * Signal handler to catch signals and
@@ -96,6 +91,14 @@ int signal_setup()
         return -1;
     }
 
+    // Peers closing mid response must not kill the server
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1)
+    {
+        LOG_ERROR("sigaction: SIGPIPE");
+        return -1;
+    }
+
     LOG_INFO("Signal Handler Registration complete");
     return 0;
 }
@@ -105,76 +108,54 @@ int signal_setup()
  */
 void cleanup_server()
 {
+    int cls = 0;
+    thpool_class_stats stats;
+
+    for (cls = 0; cls < TASK_CLASS_COUNT; cls++)
+    {
+        threadpool_class_stats((task_class)cls, &stats);
+        if (stats.completed > 0)
+        {
+            LOG_INFO("%s tasks: %zu run, %zu rejected, avg wait %lu us, max wait %lu us",
+                     g_task_class_names[cls], stats.completed, stats.rejected,
+                     stats.wait_ns / stats.completed / 1000, stats.max_wait_ns / 1000);
+        }
+    }
+
+    // Workers are joined first, they may still hold cache entries
+    stop_handshake_pool();
+    stop_threadpool();
+    stop_ocsp_stapling();
     release_cache();
+    release_vhosts();
+    stop_access_log();
     stop_logging();
-    stop_threadpool();
     cleanup_client_list();
+    release_ssl_pool();
 
     if (g_ssl_ctx != NULL)
         SSL_CTX_free(g_ssl_ctx);
 }
 
 /**
- * Initialize structs for secured socket communication
- * Setup the cert and key files for authentication
- */
-int init_openssl_context(const char *cert_file, const char *key_file)
-{
-    if (access(cert_file, F_OK | R_OK) != 0)
-    {
-        LOG_ERROR("ssl_cert_file: %s cannot be accessed\n", cert_file);
-        return -1;
-    }
-
-    if (access(key_file, F_OK | R_OK) != 0)
-    {
-        LOG_ERROR("ssl_key_file: %s cannot be accessed\n", key_file);
-        return -1;
-    }
-
-    SSL_library_init();
-    OpenSSL_add_all_algorithms();
-    SSL_load_error_strings();
-
-    g_ssl_ctx = SSL_CTX_new(TLS_server_method());
-    if (g_ssl_ctx == NULL)
-    {
-        ERR_print_errors_cb(ssl_log_err, NULL);
-        return -1;
-    }
-
-    SSL_CTX_set_alpn_select_cb(g_ssl_ctx, alpn_select_cb, NULL);
-    // Load certificate and private key for authentication
-    LOG_INFO("SSL using cert file %s", cert_file);
-    if (SSL_CTX_use_certificate_file(g_ssl_ctx, cert_file, SSL_FILETYPE_PEM) <= 0)
-    {
-        ERR_print_errors_cb(ssl_log_err, NULL);
-        return -1;
-    }
-
-    LOG_INFO("SSL using private key file %s", key_file);
-    if (SSL_CTX_use_PrivateKey_file(g_ssl_ctx, key_file, SSL_FILETYPE_PEM) <= 0)
-    {
-        ERR_print_errors_cb(ssl_log_err, NULL);
-        return -1;
-    }
-
-    LOG_INFO("SSL Initialisation Complete");
-    return 0;
-}
-
-/**
- * Worker function to accept and serve HTTPS Requests
+ * Worker function to serve HTTPS Requests, connections are
+ * accepted and handshaked by the handshake workers
  */
-void run_https_server(int server_fd)
+void run_https_server(int server_fd, size_t handshake_threads, bool handshake_async)
 {
     ssize_t nfds = 0;
     ssize_t curr = 0;
+    size_t queued = 0;
+    size_t ready[TASK_CLASS_COUNT] = {0};
+    int cls = 0;
     int epoll_fd = 0;
+    time_t now = 0;
+    time_t last_reap = 0;
     client_info * cinfo = NULL;
     unsigned int curr_event = 0;
     struct epoll_event ev = {0};
     struct epoll_event events[MAX_ALIVE_CONN] = {{0}};
+    th_task batch[TASK_CLASS_COUNT][MAX_ALIVE_CONN];
 
     // Setup epoll to track incoming connection on server port
     epoll_fd = epoll_create1(0);
@@ -183,12 +164,12 @@ void run_https_server(int server_fd)
         LOG_ERROR("%s epoll_create1", __func__);
         return;
     }
+    g_epoll_fd = epoll_fd;
 
-    ev.events = EPOLLIN;
-    ev.data.fd = server_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1)
+    // Established connections show up on epoll_fd
+    if (start_handshake_pool(server_fd, handshake_threads, handshake_async) != 0)
     {
-        LOG_ERROR("%s epoll_ctl server_fd", __func__);
+        g_epoll_fd = -1;
         close(epoll_fd);
         return;
     }
@@ -202,6 +183,10 @@ void run_https_server(int server_fd)
         nfds = epoll_wait(epoll_fd, events, MAX_ALIVE_CONN, EPOLL_TIMEOUT_MS);
         if (nfds == -1)
         {
+            // Signals that don't stop the server, like the trace dump
+            if (errno == EINTR && server_run)
+                continue;
+
             // If wait didn't exit due to interrupt signal
             // Then error happened, in any case exit the loop
             if (errno != EINTR)
@@ -212,42 +197,65 @@ void run_https_server(int server_fd)
             break;
         }
 
-        else if(nfds == 0)
-            continue;
+        TRACE_POLL();
 
         // Iterate through the list of sockets which triggered an event
+        memset(ready, 0, sizeof(ready));
         for (curr = 0; curr < nfds; curr++)
         {
-            // New event on server_fd means incoming connection
-            if (events[curr].data.fd == server_fd)
-            {
-                // Accept new connections then add them to epoll
-                if (accept_connections(server_fd, epoll_fd) == -1)
-                {
-                    server_run = false;
-                    break;
-                }
-                continue;
-            }
-
+            // Client fds are registered with EPOLLONESHOT
+            // so they stay disarmed until a worker parks them again
             curr_event = events[curr].events;
-            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, events[curr].data.fd, NULL);
-
             cinfo = get_client_info(events[curr].data.fd);
-            if(cinfo == NULL)
-            {
-                close(events[curr].data.fd);
-            }
-            else if (curr_event && POLL_IN)
+            // Stale, the fd may already be a new connection's
+            // that a handshake worker is still setting up
+            if (cinfo == NULL)
+                continue;
+
+            if (curr_event & (EPOLLIN | EPOLLOUT))
             {
-                add_task_to_queue(handle_http_request, cinfo);
+                // Clients parked on EPOLLOUT are resuming a large response,
+                // they must not delay newly readable requests
+                cls = (curr_event & EPOLLIN) ? TASK_INTERACTIVE : TASK_BULK;
+                cinfo->is_parked = false;
+                TRACE_MARK(cinfo);
+                batch[cls][ready[cls]].func = handle_http_request;
+                batch[cls][ready[cls]].arg = cinfo;
+                ready[cls]++;
             }
             else if (curr_event & (EPOLLHUP | EPOLLERR))
             {
                 remove_client_info(cinfo);
             }
         }
+
+        // Each class of the epoll batch goes to the threadpool with a single wakeup
+        for (cls = 0; cls < TASK_CLASS_COUNT; cls++)
+        {
+            queued = add_tasks_batch((task_class)cls, batch[cls], ready[cls]);
+            for (; queued < ready[cls]; queued++)
+            {
+                // Queue is full, retry on the next epoll_wait
+                cinfo = (client_info *)batch[cls][queued].arg;
+                ev.events = ((cls == TASK_BULK) ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP | EPOLLONESHOT;
+                ev.data.fd = cinfo->fd;
+                cinfo->is_parked = true;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cinfo->fd, &ev);
+            }
+        }
+
+        // Only once the events above are handled, a connection closed
+        // here may have one of them pending and its fd may be reused
+        now = time(NULL);
+        if (now != last_reap)
+        {
+            reap_idle_clients(epoll_fd, now);
+            last_reap = now;
+        }
     }
+    // Handshake workers hand connections over to epoll_fd
+    stop_handshake_pool();
+    g_epoll_fd = -1;
     // Close epoll file descriptor and exit
     close(epoll_fd);
 }
@@ -257,21 +265,66 @@ int main(int argc, char *argv[])
     int opt = 0;
     int server_fd = 0;
     bool is_daemon_mode = false;
+    bool use_uring = false;
+    long handshake_threads = HANDSHAKE_THREADS_DEFAULT;
+    bool handshake_async = false;
+    long max_early_data = 0;
+    char *vhosts_file = NULL;
+    long queue_size = TASK_QUEUE_SIZE;
+    log_mode logging_mode = LOG_MODE_TEXT;
+    log_level logging_level = LOG_LEVEL_INFO;
+    long min_threads = 0;
+    long max_threads = 0;
+    char *bound = NULL;
+    thpool_config pool_cfg;
+    long sample = 1;
+    long conn_rate = 0;
+    long request_rate = 0;
+    bool use_access_log = false;
+    access_log_config access_cfg;
     char *server_ip = SERVER_IP_ADDR;
     char *server_port = SERVER_PORT;
     char *assets_dir = DEFAULT_ASSET_PATH;
-    char *ssl_key_file = DEFAULT_SSL_KEY_FILE;
-    char *ssl_cert_file = DEFAULT_SSL_CERT_FILE;
-
-    while ((opt = getopt(argc, argv, "c:k:i:p:a:d:")) != -1)
+    const char *ssl_key_files[MAX_SSL_CERTS] = {DEFAULT_SSL_KEY_FILE};
+    const char *ssl_cert_files[MAX_SSL_CERTS] = {DEFAULT_SSL_CERT_FILE};
+    size_t nr_keys = 0;
+    size_t nr_certs = 0;
+    const char *ocsp_files[MAX_SSL_CERTS] = {NULL};
+    size_t nr_ocsp_files = 0;
+
+    memset(&pool_cfg, 0, sizeof(pool_cfg));
+    memset(&access_cfg, 0, sizeof(access_cfg));
+    access_cfg.max_bytes = ACCESS_LOG_MAX_BYTES;
+    access_cfg.rotate_sec = ACCESS_LOG_ROTATE_SEC;
+    while ((opt = getopt(argc, argv, "c:k:O:i:p:a:V:de:q:t:H:AE:Pbvl:f:s:m1r:")) != -1)
     {
         switch (opt)
         {
+        // Repeated for every key type, the nth key belongs to the nth cert
         case 'c':
-            ssl_cert_file = optarg;
+            if (nr_certs == MAX_SSL_CERTS)
+            {
+                fprintf(stderr, "At most %d certificates are supported\n", MAX_SSL_CERTS);
+                return EXIT_FAILURE;
+            }
+            ssl_cert_files[nr_certs++] = optarg;
             break;
         case 'k':
-            ssl_key_file = optarg;
+            if (nr_keys == MAX_SSL_CERTS)
+            {
+                fprintf(stderr, "At most %d keys are supported\n", MAX_SSL_CERTS);
+                return EXIT_FAILURE;
+            }
+            ssl_key_files[nr_keys++] = optarg;
+            break;
+        // One OCSP response per certificate at most, matched on load
+        case 'O':
+            if (nr_ocsp_files == MAX_SSL_CERTS)
+            {
+                fprintf(stderr, "At most %d OCSP responses are supported\n", MAX_SSL_CERTS);
+                return EXIT_FAILURE;
+            }
+            ocsp_files[nr_ocsp_files++] = optarg;
             break;
         case 'i':
             server_ip = optarg;
@@ -282,21 +335,134 @@ int main(int argc, char *argv[])
         case 'a':
             assets_dir = optarg;
             break;
+        case 'V':
+            vhosts_file = optarg;
+            break;
         case 'd':
             is_daemon_mode = true;
             break;
+        case 'e':
+            use_uring = (strcmp(optarg, "uring") == 0);
+            if (use_uring == false && strcmp(optarg, "epoll") != 0)
+            {
+                fprintf(stderr, "Unknown event engine %s, expected epoll or uring\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'q':
+            queue_size = strtol(optarg, NULL, 10);
+            if (queue_size <= 0)
+            {
+                fprintf(stderr, "Invalid task queue size %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            // Either a fixed size or min:max
+            min_threads = strtol(optarg, &bound, 10);
+            max_threads = (*bound == ':') ? strtol(bound + 1, NULL, 10) : min_threads;
+            if (min_threads <= 0 || max_threads < min_threads || max_threads > MAX_THREAD_COUNT)
+            {
+                fprintf(stderr, "Invalid worker count %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'H':
+            handshake_threads = strtol(optarg, NULL, 10);
+            if (handshake_threads <= 0 || handshake_threads > MAX_THREAD_COUNT)
+            {
+                fprintf(stderr, "Invalid handshake worker count %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'A':
+            handshake_async = true;
+            break;
+        case 'E':
+            max_early_data = strtol(optarg, NULL, 10);
+            if (max_early_data <= 0 || max_early_data >= BUFFER_SIZE)
+            {
+                fprintf(stderr, "Invalid early data size %s, 1 to %d bytes\n", optarg, BUFFER_SIZE - 1);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            pool_cfg.pin_threads = true;
+            break;
+        case 'b':
+            logging_mode = LOG_MODE_BINARY;
+            break;
+        case 'v':
+            logging_level = LOG_LEVEL_DEBUG;
+            break;
+        case 'l':
+            use_access_log = true;
+            access_cfg.path = optarg;
+            break;
+        case 'f':
+            use_access_log = true;
+            if (strcmp(optarg, "binary") == 0)
+                access_cfg.format = ACCESS_LOG_BINARY;
+            else if (strcmp(optarg, "csv") != 0)
+            {
+                fprintf(stderr, "Unknown access log format %s, expected csv or binary\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            use_access_log = true;
+            sample = strtol(optarg, NULL, 10);
+            if (sample <= 0 || sample > UINT_MAX)
+            {
+                fprintf(stderr, "Invalid access log sampling %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            access_cfg.sample = (unsigned int)sample;
+            break;
+        case 'm':
+            g_stats_endpoint = true;
+            break;
+        case '1':
+            g_http2_enabled = false;
+            break;
+        case 'r':
+            // Connections and optionally requests per second and client, 0 is no limit
+            conn_rate = strtol(optarg, &bound, 10);
+            request_rate = (*bound == ':') ? strtol(bound + 1, NULL, 10) : 0;
+            if (conn_rate < 0 || conn_rate > RATE_MAX || request_rate < 0 || request_rate > RATE_MAX ||
+                (conn_rate == 0 && request_rate == 0))
+            {
+                fprintf(stderr, "Invalid rate limit %s, expected <connections/s>[:<requests/s>] up to %d\n", optarg, RATE_MAX);
+                return EXIT_FAILURE;
+            }
+            break;
         default:
-            fprintf(stderr, "Usage: %s [-c cert.pem] [-k key.pem] [-i <ip addr>] [-p <port>] [-a <asset folder>]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-c cert.pem -k key.pem]... [-O <ocsp response>]... [-i <ip addr>] [-p <port>] [-a <asset folder>] [-V <hosts file>] [-e epoll|uring] [-q <task queue size>] [-t <workers>|<min:max>] [-H <handshake workers>] [-A] [-E <max early data>] [-P] [-b] [-v] [-l <access log>] [-f csv|binary] [-s <record 1 in N>] [-m] [-1] [-r <connections/s>[:<requests/s>]]\n", argv[0]);
             return EXIT_FAILURE;
         }
     }
 
+    if (nr_certs != nr_keys)
+    {
+        fprintf(stderr, "Every certificate needs its key, got %zu certificates and %zu keys\n", nr_certs, nr_keys);
+        return EXIT_FAILURE;
+    }
+
     if (is_daemon_mode && daemon(1, 0) != 0)
     {
         fprintf(stderr, "Switch to daemon mode failed. Exiting ...\n");
         return EXIT_FAILURE;
     }
 
+    // First so the setup below is logged
+    if (init_logging(logging_mode, logging_level) != 0)
+        return EXIT_FAILURE;
+
+    if (use_access_log && init_access_log(&access_cfg) != 0)
+        return EXIT_FAILURE;
+
+    TRACE_INIT();
+
     if (signal_setup() != 0)
         return EXIT_FAILURE;
 
@@ -306,17 +472,36 @@ int main(int argc, char *argv[])
     if (set_fd_limit() != 0)
         return EXIT_FAILURE;
 
-    if (init_logging() != 0)
+    if ((conn_rate > 0 || request_rate > 0) && init_rate_limit(conn_rate, request_rate) != 0)
         return EXIT_FAILURE;
 
-    if (init_openssl_context(ssl_cert_file, ssl_key_file) != 0)
+    if (init_openssl_context(ssl_cert_files, ssl_key_files, (nr_certs > 0) ? nr_certs : 1) != 0)
+        return EXIT_FAILURE;
+
+    if (nr_ocsp_files > 0 && init_ocsp_stapling(g_ssl_ctx, ocsp_files, nr_ocsp_files) != 0)
+        return EXIT_FAILURE;
+
+    if (max_early_data > 0 && enable_early_data(g_ssl_ctx, (uint32_t)max_early_data) != 0)
         return EXIT_FAILURE;
 
     if (initiate_cache(assets_dir) == 0)
         return EXIT_FAILURE;
 
-    if (init_threadpool() != 0)
+    if (vhosts_file != NULL)
+    {
+        if (load_vhosts(vhosts_file) < 0)
+            return EXIT_FAILURE;
+        g_vhosts_enabled = true;
+    }
+
+    pool_cfg.queue_size = (size_t)queue_size;
+    pool_cfg.min_threads = (size_t)min_threads;
+    pool_cfg.max_threads = (size_t)max_threads;
+    if (init_threadpool(&pool_cfg) != 0)
         return EXIT_FAILURE;
+    LOG_INFO("Started %zu workers, %zu to %zu allowed on %zu CPUs in %zu NUMA nodes%s",
+             threadpool_size(), g_th_queue.min_threads, g_th_queue.max_threads,
+             g_th_queue.nr_cpus, g_th_queue.nr_nodes, g_th_queue.pin_threads ? ", pinned" : "");
 
     init_client_list();
     // Initiate the server using the parsed input
@@ -324,7 +509,9 @@ int main(int argc, char *argv[])
     if (server_fd < 0)
         return EXIT_FAILURE;
 
-    run_https_server(server_fd);
+    // epoll stays the fallback whenever io_uring can't be set up
+    if (use_uring == false || run_uring_server(server_fd) != 0)
+        run_https_server(server_fd, (size_t)handshake_threads, handshake_async);
 
     sleep(1);
     close(server_fd);
@@ -0,0 +1,355 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "server.h"
+
+// Store the global ssl context
+SSL_CTX *g_ssl_ctx = NULL;
+
+// Cleared SSL objects of closed connections, handed to the next ones
+static SSL *ssl_pool[SSL_POOL_SIZE];
+static size_t ssl_pool_count = 0;
+static pthread_mutex_t ssl_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Heap OpenSSL holds, see count_tls_memory()
+static unsigned long tls_memory = 0;
+static bool tls_memory_counted = false;
+
+extern bool g_http2_enabled;
+
+/**
+ * Select h2 or http 1.1 as the communication protocol,
+ * our order wins so every client offering h2 gets it
+ */
+int alpn_select_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg)
+{
+    static const unsigned char h2_http1_1[] = "\x02h2\x08http/1.1";
+    static const unsigned char http1_1[] = "\x08http/1.1";
+    const unsigned char *protos = g_http2_enabled ? h2_http1_1 : http1_1;
+    unsigned int protos_len = g_http2_enabled ? sizeof(h2_http1_1) - 1 : sizeof(http1_1) - 1;
+    (void) ssl;
+    (void) arg;
+    if (SSL_select_next_proto((unsigned char **)out, outlen, protos, protos_len, in, inlen) == OPENSSL_NPN_NEGOTIATED)
+    {
+        return SSL_TLSEXT_ERR_OK;
+    }
+    return SSL_TLSEXT_ERR_NOACK;
+}
+
+/**
+ * Loads one certificate chain and its key, OpenSSL keeps one
+ * chain per key type and picks among them on every handshake
+ */
+static int load_certificate(SSL_CTX *ctx, const char *cert_file, const char *key_file, int *key_type)
+{
+    EVP_PKEY *pkey = NULL;
+
+    if (access(cert_file, F_OK | R_OK) != 0)
+    {
+        LOG_ERROR("ssl_cert_file: %s cannot be accessed\n", cert_file);
+        return -1;
+    }
+
+    if (access(key_file, F_OK | R_OK) != 0)
+    {
+        LOG_ERROR("ssl_key_file: %s cannot be accessed\n", key_file);
+        return -1;
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        ERR_print_errors_cb(ssl_log_err, NULL);
+        return -1;
+    }
+
+    pkey = SSL_CTX_get0_privatekey(ctx);
+    *key_type = EVP_PKEY_get_base_id(pkey);
+    LOG_INFO("SSL using cert file %s and key file %s, %s %d bits", cert_file, key_file,
+             EVP_PKEY_get0_type_name(pkey), EVP_PKEY_get_bits(pkey));
+    return 0;
+}
+
+/**
+ * Server context with the cert and key files for authentication,
+ * one pair per key type such as ECDSA and RSA. Clients able to
+ * verify ECDSA get it, being several times cheaper to sign with,
+ * the rest get RSA
+ * Returns the context on success, NULL otherwise
+ */
+SSL_CTX *new_ssl_context(const char *const *cert_files, const char *const *key_files, const size_t nr_certs)
+{
+    size_t i = 0;
+    size_t j = 0;
+    int key_types[MAX_SSL_CERTS] = {0};
+    SSL_CTX *ctx = NULL;
+
+    if (nr_certs == 0 || nr_certs > MAX_SSL_CERTS)
+    {
+        LOG_ERROR("%s: %zu certificates given, 1 to %d supported", __func__, nr_certs, MAX_SSL_CERTS);
+        return NULL;
+    }
+
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL)
+    {
+        ERR_print_errors_cb(ssl_log_err, NULL);
+        return NULL;
+    }
+
+    // Responses are sent in resumable pieces from non-blocking sockets
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_alpn_select_cb(ctx, alpn_select_cb, NULL);
+
+    // Our order decides ciphers and signature algorithms, ECDSA first.
+    // Clients which list ChaCha20 first, usually for lack of AES-NI, get it
+    SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_PRIORITIZE_CHACHA);
+    if (SSL_CTX_set1_groups_list(ctx, TLS_GROUPS) != 1 ||
+        SSL_CTX_set_ciphersuites(ctx, TLS13_CIPHERSUITES) != 1 ||
+        SSL_CTX_set_cipher_list(ctx, TLS12_CIPHERS) != 1 ||
+        SSL_CTX_set1_sigalgs_list(ctx, TLS_SIGALGS) != 1)
+    {
+        ERR_print_errors_cb(ssl_log_err, NULL);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    for (i = 0; i < nr_certs; i++)
+    {
+        if (load_certificate(ctx, cert_files[i], key_files[i], &key_types[i]) != 0)
+        {
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+
+        // A chain of a key type already loaded would silently replace it
+        for (j = 0; j < i; j++)
+        {
+            if (key_types[j] == key_types[i])
+            {
+                LOG_ERROR("%s: %s has the same key type as %s", __func__, cert_files[i], cert_files[j]);
+                SSL_CTX_free(ctx);
+                return NULL;
+            }
+        }
+    }
+    return ctx;
+}
+
+/**
+ * OpenSSL allocators which keep tls_memory up to date, every block is
+ * prefixed with its size. Blocks come from the buffer pool, so the
+ * record buffers SSL_free_buffers() drops on idle connections are
+ * reused rather than going through malloc on the next request
+ */
+static void *tls_malloc(size_t num, const char *file, int line)
+{
+    size_t *block = NULL;
+    (void)file;
+    (void)line;
+
+    block = buf_alloc(num + TLS_MEM_HEADER);
+    if (block == NULL)
+        return NULL;
+    *block = num;
+    __atomic_add_fetch(&tls_memory, num, __ATOMIC_RELAXED);
+    return (char *)block + TLS_MEM_HEADER;
+}
+
+static void tls_free(void *ptr, const char *file, int line)
+{
+    size_t *block = NULL;
+    (void)file;
+    (void)line;
+
+    if (ptr == NULL)
+        return;
+    block = (size_t *)((char *)ptr - TLS_MEM_HEADER);
+    __atomic_sub_fetch(&tls_memory, *block, __ATOMIC_RELAXED);
+    buf_free(block, *block + TLS_MEM_HEADER);
+}
+
+static void *tls_realloc(void *ptr, size_t num, const char *file, int line)
+{
+    size_t old_num = 0;
+    size_t *block = NULL;
+
+    if (ptr == NULL)
+        return tls_malloc(num, file, line);
+    if (num == 0)
+    {
+        tls_free(ptr, file, line);
+        return NULL;
+    }
+
+    block = (size_t *)((char *)ptr - TLS_MEM_HEADER);
+    old_num = *block;
+    block = buf_realloc(block, old_num + TLS_MEM_HEADER, num + TLS_MEM_HEADER);
+    if (block == NULL)
+        return NULL;
+    *block = num;
+    __atomic_add_fetch(&tls_memory, num - old_num, __ATOMIC_RELAXED);
+    return (char *)block + TLS_MEM_HEADER;
+}
+
+/**
+ * Counts the heap OpenSSL holds from here on, which is mostly
+ * SSL objects and their buffers, and takes it from the buffer
+ * pool. Only possible before OpenSSL allocated anything
+ */
+void init_tls_memory()
+{
+    if (tls_memory_counted)
+        return;
+    tls_memory_counted = CRYPTO_set_mem_functions(tls_malloc, tls_realloc, tls_free) == 1;
+    if (tls_memory_counted == false)
+        LOG_DEBUG("%s OpenSSL allocated memory already, not counting it", __func__);
+}
+
+/**
+ * Heap held by OpenSSL in bytes
+ * Returns -1 if it is not counted
+ */
+long tls_memory_in_use()
+{
+    if (tls_memory_counted == false)
+        return -1;
+    return (long)__atomic_load_n(&tls_memory, __ATOMIC_RELAXED);
+}
+
+/**
+ * SSL object for a new connection on the default context,
+ * recycled from a closed connection when there is one
+ */
+SSL *new_client_ssl()
+{
+    SSL *ssl = NULL;
+
+    pthread_mutex_lock(&ssl_pool_lock);
+    if (ssl_pool_count > 0)
+        ssl = ssl_pool[--ssl_pool_count];
+    pthread_mutex_unlock(&ssl_pool_lock);
+
+    if (ssl == NULL)
+        ssl = SSL_new(g_ssl_ctx);
+    return ssl;
+}
+
+/**
+ * Takes the SSL object of a connection that completed its handshake
+ * and is closed now. SSL_clear() readies it for the next connection,
+ * the socket BIOs, session and record buffers are dropped until then.
+ * Objects SNI moved to a virtual host's context are freed instead, so
+ * are all of them with early data on, SSL_clear() leaves its state as
+ * the last handshake left it and SSL_read_early_data() fails after
+ */
+void release_client_ssl(SSL *ssl)
+{
+    if (ssl == NULL)
+        return;
+
+    if (SSL_get_SSL_CTX(ssl) == g_ssl_ctx && SSL_CTX_get_max_early_data(g_ssl_ctx) == 0 &&
+        __atomic_load_n(&ssl_pool_count, __ATOMIC_RELAXED) < SSL_POOL_SIZE)
+    {
+        SSL_set_bio(ssl, NULL, NULL);
+        SSL_set_session(ssl, NULL);
+        if (SSL_clear(ssl) == 1 && SSL_free_buffers(ssl) == 1)
+        {
+            pthread_mutex_lock(&ssl_pool_lock);
+            if (ssl_pool_count < SSL_POOL_SIZE)
+            {
+                ssl_pool[ssl_pool_count++] = ssl;
+                ssl = NULL;
+            }
+            pthread_mutex_unlock(&ssl_pool_lock);
+        }
+        ERR_clear_error();
+    }
+    SSL_free(ssl);
+}
+
+/**
+ * Frees the pooled SSL objects at exit
+ */
+void release_ssl_pool()
+{
+    pthread_mutex_lock(&ssl_pool_lock);
+    while (ssl_pool_count > 0)
+        SSL_free(ssl_pool[--ssl_pool_count]);
+    pthread_mutex_unlock(&ssl_pool_lock);
+}
+
+/**
+ * Initialize structs for secured socket communication
+ * and the default context, used for every connection
+ * unless SNI picks a virtual host with its own
+ */
+int init_openssl_context(const char *const *cert_files, const char *const *key_files, const size_t nr_certs)
+{
+    init_tls_memory();
+    SSL_library_init();
+    OpenSSL_add_all_algorithms();
+    SSL_load_error_strings();
+
+    g_ssl_ctx = new_ssl_context(cert_files, key_files, nr_certs);
+    if (g_ssl_ctx == NULL)
+        return -1;
+
+    LOG_INFO("SSL Initialisation Complete");
+    return 0;
+}
+
+/**
+ * Lets clients resuming a session send up to max_early_data bytes of
+ * requests along with their ClientHello. Anyone who recorded such a
+ * ClientHello can send it again, so with early data on OpenSSL issues
+ * stateful tickets and drops a session from the cache when it is
+ * resumed, a replay finds nothing to resume. The cache is bounded,
+ * sessions pushed out of it just take a full handshake next time.
+ * Early data is read by the handshake workers only, the io_uring
+ * engine turns it down
+ * Returns 0 on success, -1 otherwise
+ */
+int enable_early_data(SSL_CTX *ctx, const uint32_t max_early_data)
+{
+    // Early requests are read whole into one request buffer
+    if (max_early_data == 0 || max_early_data >= BUFFER_SIZE)
+    {
+        LOG_ERROR("%s: %u bytes of early data, 1 to %d supported", __func__, max_early_data, BUFFER_SIZE - 1);
+        return -1;
+    }
+
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_ANTI_REPLAY);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, EARLY_SESSION_CACHE_SIZE);
+    if (SSL_CTX_set_max_early_data(ctx, max_early_data) != 1 ||
+        SSL_CTX_set_recv_max_early_data(ctx, max_early_data) != 1)
+    {
+        ERR_print_errors_cb(ssl_log_err, NULL);
+        return -1;
+    }
+    LOG_INFO("TLS 1.3 early data enabled, up to %u bytes", max_early_data);
+    return 0;
+}
@@ -0,0 +1,351 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "server.h"
+
+#ifdef PHASE_TRACE
+
+#include <signal.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+static const char *phase_names[PHASE_COUNT] = {"handshake", "queue", "wait", "parse", "lookup", "send"};
+
+// Rings of every thread that ever traced, never freed so
+// the segments of exited workers still show up in a dump
+static trace_ring *ring_list = NULL;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_tid = 0;
+static unsigned int next_req = 0;
+static volatile sig_atomic_t dump_requested = 0;
+
+static unsigned long tsc0 = 0;
+static double ticks_per_us = 1000.0;
+
+static __thread trace_ring *tl_ring = NULL;
+
+unsigned long trace_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+#endif
+}
+
+static void trace_signal(int sig)
+{
+    (void)sig;
+    dump_requested = 1;
+}
+
+/**
+ * Measures the tick rate and registers the SIGUSR1 dump trigger
+ */
+void trace_init()
+{
+    struct sigaction sa;
+    struct timespec pause = {0, 20000000L};
+    unsigned long begin_ns = 0;
+    unsigned long end_ns = 0;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    begin_ns = (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+    tsc0 = trace_now();
+    nanosleep(&pause, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    end_ns = (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+    ticks_per_us = (double)(trace_now() - tsc0) * 1000.0 / (double)(end_ns - begin_ns);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR1, &sa, NULL) == -1)
+        LOG_ERROR("sigaction: SIGUSR1");
+
+    LOG_INFO("Phase tracing on, %.0f ticks/us, SIGUSR1 dumps to %s and %s",
+             ticks_per_us, TRACE_SLOWEST_FILE, TRACE_JSON_FILE);
+}
+
+static trace_ring *get_ring()
+{
+    trace_ring *ring = NULL;
+
+    if (tl_ring != NULL)
+        return tl_ring;
+
+    ring = calloc(1, sizeof(trace_ring));
+    if (ring == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&ring_lock);
+    ring->tid = ++next_tid;
+    ring->next = ring_list;
+    __atomic_store_n(&ring_list, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ring_lock);
+
+    tl_ring = ring;
+    return ring;
+}
+
+/**
+ * Charges [begin, end) to phase and records the segment
+ */
+static void record_segment(phase_trace *trace, int fd, trace_phase phase, unsigned long begin, unsigned long end)
+{
+    unsigned long head = 0;
+    trace_ring *ring = get_ring();
+    trace_event *ev = NULL;
+
+    if (begin == 0 || end < begin)
+        return;
+
+    if (trace->first == 0)
+        trace->first = begin;
+    trace->ticks[phase] += end - begin;
+
+    if (ring == NULL)
+        return;
+
+    head = ring->events_head++;
+    ev = &ring->events[head % TRACE_EVENT_SLOTS];
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ev->begin = begin;
+    ev->end = end;
+    ev->req = trace->req;
+    ev->fd = fd;
+    ev->phase = phase;
+    __atomic_store_n(&ev->seq, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_phase_end(phase_trace *trace, int fd, trace_phase phase, unsigned long since)
+{
+    record_segment(trace, fd, phase, since, trace_now());
+}
+
+/**
+ * Request read off the connection, since is when reading started
+ */
+void trace_begin(phase_trace *trace, unsigned long since)
+{
+    trace->start = since;
+    trace->req = __atomic_add_fetch(&next_req, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * A worker picked up the connection. Charges the time it sat in the
+ * queue and, in the middle of a response, the time it was parked
+ * until the socket took more data. Idle keep-alive time is not charged
+ */
+void trace_resume(phase_trace *trace, int fd, bool in_request)
+{
+    if (in_request && trace->parked != 0 && trace->mark >= trace->parked)
+        record_segment(trace, fd, PHASE_WAIT, trace->parked, trace->mark);
+    record_segment(trace, fd, PHASE_QUEUE, trace->mark, trace_now());
+    trace->mark = 0;
+    trace->parked = 0;
+}
+
+/**
+ * Records the summary of the finished request and starts over
+ */
+void trace_end(phase_trace *trace, int fd, int status, const char *path, size_t path_len)
+{
+    unsigned long head = 0;
+    trace_ring *ring = get_ring();
+    trace_request *req = NULL;
+
+    if (ring != NULL && trace->start != 0)
+    {
+        head = ring->requests_head++;
+        req = &ring->requests[head % TRACE_REQUEST_SLOTS];
+        __atomic_store_n(&req->seq, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        req->first = (trace->first != 0 && trace->first < trace->start) ? trace->first : trace->start;
+        req->end = trace_now();
+        memcpy(req->ticks, trace->ticks, sizeof(req->ticks));
+        req->req = trace->req;
+        req->fd = fd;
+        req->status = status;
+        if (path_len >= TRACE_PATH_LEN)
+            path_len = TRACE_PATH_LEN - 1;
+        memcpy(req->path, path, path_len);
+        req->path[path_len] = '\0';
+        __atomic_store_n(&req->seq, head + 1, __ATOMIC_RELEASE);
+    }
+    memset(trace, 0, sizeof(phase_trace));
+}
+
+static unsigned long total_ticks(const trace_request *req)
+{
+    return req->end - req->first;
+}
+
+static int slower_first(const void *a, const void *b)
+{
+    unsigned long ta = total_ticks((const trace_request *)a);
+    unsigned long tb = total_ticks((const trace_request *)b);
+    return (ta < tb) - (ta > tb);
+}
+
+/**
+ * Copies a ring entry unless the writer is in the middle of it
+ */
+static bool copy_stable(const unsigned long *seq, unsigned long expect, void *dst, const void *src, size_t len)
+{
+    if (__atomic_load_n(seq, __ATOMIC_ACQUIRE) != expect)
+        return false;
+    memcpy(dst, src, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) == expect;
+}
+
+/**
+ * Writes the slowest requests still in the rings with their phases
+ */
+static void dump_slowest()
+{
+    int phase = 0;
+    size_t count = 0;
+    size_t i = 0;
+    unsigned long pos = 0;
+    unsigned long head = 0;
+    trace_ring *ring = NULL;
+    trace_request *reqs = NULL;
+    FILE *fp = NULL;
+
+    reqs = malloc(sizeof(trace_request) * TRACE_REQUEST_SLOTS * (size_t)(next_tid + 1));
+    fp = fopen(TRACE_SLOWEST_FILE, "w");
+    if (reqs == NULL || fp == NULL)
+    {
+        LOG_ERROR("%s unable to write %s", __func__, TRACE_SLOWEST_FILE);
+        free(reqs);
+        if (fp != NULL)
+            fclose(fp);
+        return;
+    }
+
+    for (ring = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        head = __atomic_load_n(&ring->requests_head, __ATOMIC_RELAXED);
+        pos = (head > TRACE_REQUEST_SLOTS) ? head - TRACE_REQUEST_SLOTS : 0;
+        for (; pos < head; pos++)
+        {
+            if (copy_stable(&ring->requests[pos % TRACE_REQUEST_SLOTS].seq, pos + 1, &reqs[count],
+                            &ring->requests[pos % TRACE_REQUEST_SLOTS], sizeof(trace_request)))
+                count++;
+        }
+    }
+    qsort(reqs, count, sizeof(trace_request), slower_first);
+
+    fprintf(fp, "%-8s %-6s %-6s %12s", "req", "fd", "status", "total_us");
+    for (phase = 0; phase < PHASE_COUNT; phase++)
+        fprintf(fp, " %10s", phase_names[phase]);
+    fprintf(fp, "  path\n");
+
+    for (i = 0; i < count && i < TRACE_SLOWEST; i++)
+    {
+        fprintf(fp, "%-8u %-6d %-6d %12.1f", reqs[i].req, reqs[i].fd, reqs[i].status,
+                (double)total_ticks(&reqs[i]) / ticks_per_us);
+        for (phase = 0; phase < PHASE_COUNT; phase++)
+            fprintf(fp, " %10.1f", (double)reqs[i].ticks[phase] / ticks_per_us);
+        fprintf(fp, "  /%s\n", reqs[i].path);
+    }
+    fclose(fp);
+    free(reqs);
+    LOG_INFO("Wrote the slowest %zu of %zu traced requests to %s",
+             (count < TRACE_SLOWEST) ? count : TRACE_SLOWEST, count, TRACE_SLOWEST_FILE);
+}
+
+/**
+ * Writes every segment still in the rings as Chrome trace events,
+ * one track per thread, loadable in chrome://tracing or Perfetto
+ */
+static void dump_chrome_trace()
+{
+    size_t count = 0;
+    unsigned long pos = 0;
+    unsigned long head = 0;
+    trace_ring *ring = NULL;
+    trace_event ev;
+    FILE *fp = fopen(TRACE_JSON_FILE, "w");
+
+    if (fp == NULL)
+    {
+        LOG_ERROR("%s unable to write %s", __func__, TRACE_JSON_FILE);
+        return;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (ring = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                count++ ? "," : "", ring->tid, ring->tid);
+
+        head = __atomic_load_n(&ring->events_head, __ATOMIC_RELAXED);
+        pos = (head > TRACE_EVENT_SLOTS) ? head - TRACE_EVENT_SLOTS : 0;
+        for (; pos < head; pos++)
+        {
+            if (copy_stable(&ring->events[pos % TRACE_EVENT_SLOTS].seq, pos + 1, &ev,
+                            &ring->events[pos % TRACE_EVENT_SLOTS], sizeof(ev)) == false ||
+                ev.begin < tsc0 || ev.phase < 0 || ev.phase >= PHASE_COUNT)
+                continue;
+
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"legion\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"req\":%u,\"fd\":%d}}",
+                    phase_names[ev.phase], ring->tid, (double)(ev.begin - tsc0) / ticks_per_us,
+                    (double)(ev.end - ev.begin) / ticks_per_us, ev.req, ev.fd);
+            count++;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    LOG_INFO("Wrote %zu trace events to %s", count, TRACE_JSON_FILE);
+}
+
+/**
+ * Called from the event loops, dumps once per SIGUSR1
+ */
+void trace_poll()
+{
+    if (dump_requested == 0)
+        return;
+
+    pthread_mutex_lock(&ring_lock);
+    if (dump_requested)
+    {
+        dump_requested = 0;
+        dump_slowest();
+        dump_chrome_trace();
+    }
+    pthread_mutex_unlock(&ring_lock);
+}
+
+#endif
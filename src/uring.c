@@ -0,0 +1,877 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "server.h"
+#include "threadpool.h"
+#include <linux/io_uring.h>
+
+/**
+ * io_uring event engine, an alternative to the epoll + threadpool path.
+ * Every engine thread owns one ring and runs its connections start to end:
+ * a multishot accept on the shared listening socket, a multishot recv into
+ * a provided buffer ring per connection, TLS over memory BIOs so OpenSSL
+ * never touches the socket, sends of whole batches of TLS records and
+ * async reads for fd backed cache entries. All SQEs queued while handling
+ * one batch of completions go to the kernel with a single io_uring_enter.
+ */
+#ifdef IORING_RECV_MULTISHOT
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES     1024
+#define URING_MAX_THREADS 16
+#define URING_BUF_COUNT   256
+#define URING_BUF_SIZE    16384
+#define URING_BUF_GROUP   0
+#define URING_SEND_SIZE   65536
+
+// Operation kind stored in the low bits of the sqe user_data
+#define UOP_MASK    7UL
+#define UOP_ACCEPT  1UL
+#define UOP_RECV    2UL
+#define UOP_SEND    3UL
+#define UOP_READ    4UL
+#define UOP_TIMEOUT 5UL
+#define UOP_IGNORE  6UL
+
+extern bool server_run;
+extern bool g_rate_limit;
+extern SSL_CTX *g_ssl_ctx;
+
+typedef struct uring_conn
+{
+    client_info cinfo;
+    BIO *rbio;
+    BIO *wbio;
+    char *send_buf;
+    int send_len;
+    int send_off;
+    bool handshake_done;
+    bool recv_armed;
+    bool send_inflight;
+    bool read_inflight;
+    bool closing;
+    bool cancel_sent;
+    struct uring_conn *prev;
+    struct uring_conn *next;
+} uring_conn;
+
+static slab_cache conn_slab = SLAB_CACHE(sizeof(uring_conn));
+
+typedef struct
+{
+    int ring_fd;
+    int server_fd;
+    unsigned sq_mask;
+    unsigned cq_mask;
+    unsigned sq_entries;
+    unsigned to_submit;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_len;
+    size_t sqes_len;
+
+    struct io_uring_buf_ring *buf_ring;
+    char *bufs;
+    size_t buf_ring_len;
+
+    struct __kernel_timespec tick;
+    uring_conn *conns;
+} uring_ctx;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Pushes queued SQEs to the kernel, optionally waiting for a completion
+ */
+static int uring_submit(uring_ctx *ctx, unsigned wait_nr)
+{
+    int ret = 0;
+    unsigned flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+
+    ret = sys_io_uring_enter(ctx->ring_fd, ctx->to_submit, wait_nr, flags);
+    if (ret < 0)
+    {
+        if (errno != EINTR && errno != EBUSY)
+        {
+            LOG_ERROR("%s io_uring_enter", __func__);
+        }
+        return -1;
+    }
+    ctx->to_submit -= ((unsigned)ret < ctx->to_submit) ? (unsigned)ret : ctx->to_submit;
+    return 0;
+}
+
+/**
+ * Returns a zeroed SQE, flushing the submission queue if it is full
+ */
+static struct io_uring_sqe *uring_get_sqe(uring_ctx *ctx)
+{
+    unsigned head = 0;
+    unsigned tail = *ctx->sq_tail;
+    struct io_uring_sqe *sqe = NULL;
+
+    head = __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ctx->sq_entries)
+    {
+        uring_submit(ctx, 0);
+        head = __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ctx->sq_entries)
+            return NULL;
+    }
+
+    sqe = &ctx->sqes[tail & ctx->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ctx->sq_array[tail & ctx->sq_mask] = tail & ctx->sq_mask;
+    __atomic_store_n(ctx->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ctx->to_submit++;
+    return sqe;
+}
+
+/**
+ * Hands a provided buffer back to the kernel once its data was consumed
+ */
+static void uring_recycle_buf(uring_ctx *ctx, unsigned short bid)
+{
+    unsigned short tail = ctx->buf_ring->tail;
+    struct io_uring_buf *buf = &ctx->buf_ring->bufs[tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (unsigned long)(ctx->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&ctx->buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * Maps the rings of a fresh io_uring instance and
+ * registers the provided buffer ring used by recv
+ */
+static int uring_init(uring_ctx *ctx, const int server_fd)
+{
+    unsigned short i = 0;
+    char *ring = NULL;
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->ring_fd = -1;
+    ctx->server_fd = server_fd;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ctx->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ctx->ring_fd < 0)
+    {
+        // Older kernels, retry without the task running hints
+        memset(&params, 0, sizeof(params));
+        ctx->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    }
+    if (ctx->ring_fd < 0)
+    {
+        LOG_ERROR("%s io_uring_setup", __func__);
+        return -1;
+    }
+
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0)
+    {
+        LOG_ERROR("%s kernel lacks IORING_FEAT_SINGLE_MMAP", __func__);
+        goto err_cleanup;
+    }
+
+    ctx->ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ctx->ring_len)
+        ctx->ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    ctx->ring_ptr = mmap(NULL, ctx->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ctx->ring_fd, (off_t)IORING_OFF_SQ_RING);
+    if (ctx->ring_ptr == MAP_FAILED)
+    {
+        LOG_ERROR("%s mmap rings", __func__);
+        ctx->ring_ptr = NULL;
+        goto err_cleanup;
+    }
+
+    ctx->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ctx->sqes = mmap(NULL, ctx->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ctx->ring_fd, (off_t)IORING_OFF_SQES);
+    if (ctx->sqes == MAP_FAILED)
+    {
+        LOG_ERROR("%s mmap sqes", __func__);
+        ctx->sqes = NULL;
+        goto err_cleanup;
+    }
+
+    ring = (char *)ctx->ring_ptr;
+    ctx->sq_head = (unsigned *)(ring + params.sq_off.head);
+    ctx->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    ctx->sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+    ctx->sq_array = (unsigned *)(ring + params.sq_off.array);
+    ctx->sq_entries = params.sq_entries;
+    ctx->cq_head = (unsigned *)(ring + params.cq_off.head);
+    ctx->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    ctx->cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+    ctx->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    // Buffer ring and the buffers it hands out live in one mapping
+    ctx->buf_ring_len = URING_BUF_COUNT * sizeof(struct io_uring_buf) + (size_t)URING_BUF_COUNT * URING_BUF_SIZE;
+    ctx->buf_ring = mmap(NULL, ctx->buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ctx->buf_ring == MAP_FAILED)
+    {
+        LOG_ERROR("%s mmap buffer ring", __func__);
+        ctx->buf_ring = NULL;
+        goto err_cleanup;
+    }
+    ctx->bufs = (char *)ctx->buf_ring + URING_BUF_COUNT * sizeof(struct io_uring_buf);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ctx->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_io_uring_register(ctx->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        LOG_ERROR("%s register buffer ring", __func__);
+        goto err_cleanup;
+    }
+
+    ctx->buf_ring->tail = 0;
+    for (i = 0; i < URING_BUF_COUNT; i++)
+        uring_recycle_buf(ctx, i);
+
+    ctx->tick.tv_sec = 1;
+    ctx->tick.tv_nsec = 0;
+    return 0;
+
+err_cleanup:
+    if (ctx->buf_ring != NULL)
+        munmap(ctx->buf_ring, ctx->buf_ring_len);
+    if (ctx->sqes != NULL)
+        munmap(ctx->sqes, ctx->sqes_len);
+    if (ctx->ring_ptr != NULL)
+        munmap(ctx->ring_ptr, ctx->ring_len);
+    close(ctx->ring_fd);
+    ctx->ring_fd = -1;
+    return -1;
+}
+
+static void uring_arm_accept(uring_ctx *ctx)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ctx);
+    if (sqe == NULL)
+        return;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ctx->server_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = UOP_ACCEPT;
+}
+
+static void uring_arm_tick(uring_ctx *ctx)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ctx);
+    if (sqe == NULL)
+        return;
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)&ctx->tick;
+    sqe->len = 1;
+    sqe->user_data = UOP_TIMEOUT;
+}
+
+static void uring_arm_recv(uring_ctx *ctx, uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ctx);
+    if (sqe == NULL)
+        return;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->cinfo.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = (unsigned long)conn | UOP_RECV;
+    conn->recv_armed = true;
+}
+
+/**
+ * Moves pending TLS records from the write BIO into one send
+ */
+static void uring_flush(uring_ctx *ctx, uring_conn *conn)
+{
+    int len = 0;
+    struct io_uring_sqe *sqe = NULL;
+
+    if (conn->send_inflight || BIO_ctrl_pending(conn->wbio) == 0)
+        return;
+
+    len = BIO_read(conn->wbio, conn->send_buf, URING_SEND_SIZE);
+    if (len <= 0)
+        return;
+
+    sqe = uring_get_sqe(ctx);
+    if (sqe == NULL)
+        return;
+
+    conn->send_len = len;
+    conn->send_off = 0;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->cinfo.fd;
+    sqe->addr = (unsigned long)conn->send_buf;
+    sqe->len = (unsigned)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long)conn | UOP_SEND;
+    conn->send_inflight = true;
+}
+
+static void uring_resend(uring_ctx *ctx, uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ctx);
+    if (sqe == NULL)
+        return;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->cinfo.fd;
+    sqe->addr = (unsigned long)(conn->send_buf + conn->send_off);
+    sqe->len = (unsigned)(conn->send_len - conn->send_off);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long)conn | UOP_SEND;
+    conn->send_inflight = true;
+}
+
+/**
+ * Queues an async read of the next chunk of an fd backed cache entry
+ */
+static int uring_read_chunk(uring_ctx *ctx, uring_conn *conn)
+{
+    send_state *resp = &conn->cinfo.resp;
+    struct io_uring_sqe *sqe = NULL;
+
+    if (resp->chunk == NULL)
+    {
+        resp->chunk = arena_alloc(&resp->arena, SEND_CHUNK_SIZE);
+        if (resp->chunk == NULL)
+            return -1;
+    }
+
+    sqe = uring_get_sqe(ctx);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = resp->page->fd;
+    sqe->addr = (unsigned long)resp->chunk;
+    sqe->len = SEND_CHUNK_SIZE;
+    sqe->off = (unsigned long long)resp->offset;
+    sqe->user_data = (unsigned long)conn | UOP_READ;
+    conn->read_inflight = true;
+    return 0;
+}
+
+/**
+ * Frees the connection once the kernel holds no more references to it
+ */
+static void uring_release(uring_ctx *ctx, uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = NULL;
+
+    if (conn->recv_armed && conn->cancel_sent == false)
+    {
+        sqe = uring_get_sqe(ctx);
+        if (sqe != NULL)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (unsigned long)conn | UOP_RECV;
+            sqe->user_data = UOP_IGNORE;
+            conn->cancel_sent = true;
+        }
+    }
+
+    if (conn->recv_armed || conn->send_inflight || conn->read_inflight)
+        return;
+
+    sqe = uring_get_sqe(ctx);
+    if (sqe != NULL)
+    {
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = conn->cinfo.fd;
+        sqe->user_data = UOP_IGNORE;
+    }
+    else
+    {
+        close(conn->cinfo.fd);
+    }
+
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        ctx->conns = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+
+    finish_request(&conn->cinfo, ACCESS_FLAG_ABORTED);
+    h2_free(&conn->cinfo);
+    if (conn->handshake_done)
+    {
+        ERR_clear_error();
+        release_client_ssl(conn->cinfo.ssl);
+        record_close();
+    }
+    else
+    {
+        SSL_free(conn->cinfo.ssl);
+    }
+    rate_limit_disconnect(conn->cinfo.rate_slot);
+    release_client_buffers(&conn->cinfo);
+    buf_free(conn->send_buf, URING_SEND_SIZE);
+    slab_free(&conn_slab, conn);
+}
+
+/**
+ * Starts closing a connection, output still buffered is sent first
+ */
+static void uring_close(uring_ctx *ctx, uring_conn *conn)
+{
+    if (conn->closing == false)
+    {
+        conn->closing = true;
+        if (conn->handshake_done)
+        {
+            SSL_shutdown(conn->cinfo.ssl);
+            uring_flush(ctx, conn);
+        }
+    }
+
+    if (conn->send_inflight == false)
+        uring_release(ctx, conn);
+}
+
+/**
+ * Runs the TLS handshake and the request pipeline as far as
+ * buffered input allows, then queues whatever the connection waits on
+ */
+static void uring_drive(uring_ctx *ctx, uring_conn *conn)
+{
+    int ret = 0;
+    conn_status status = CONN_WANT_READ;
+
+    while (conn->closing == false && conn->send_inflight == false && conn->read_inflight == false)
+    {
+        if (conn->handshake_done == false)
+        {
+            ret = SSL_do_handshake(conn->cinfo.ssl);
+            if (ret == 1)
+            {
+                conn->handshake_done = true;
+                record_handshake(conn->cinfo.ssl, true);
+                TRACE_PHASE(&conn->cinfo, PHASE_HANDSHAKE, conn->cinfo.trace.mark);
+                LOG_INFO("Handshake complete on client_fd: %d", conn->cinfo.fd);
+                if (h2_attach(&conn->cinfo) != 0)
+                {
+                    uring_close(ctx, conn);
+                    return;
+                }
+            }
+            else if (SSL_get_error(conn->cinfo.ssl, ret) == SSL_ERROR_WANT_READ)
+            {
+                uring_flush(ctx, conn);
+                return;
+            }
+            else
+            {
+                record_handshake(conn->cinfo.ssl, false);
+                ERR_print_errors_cb(ssl_log_err, NULL);
+                uring_flush(ctx, conn);
+                conn->handshake_done = false;
+                uring_close(ctx, conn);
+                return;
+            }
+        }
+
+        conn->cinfo.last_active = time(NULL);
+        status = serve_client(&conn->cinfo);
+        uring_flush(ctx, conn);
+
+        switch (status)
+        {
+        case CONN_WANT_READ:
+            // Idle, the record buffers come back with the next read
+            SSL_free_buffers(conn->cinfo.ssl);
+            return;
+        case CONN_WANT_WRITE:
+            // Yielded after SEND_BUDGET, the loop picks up again
+            // once the queued send completes
+            break;
+        case CONN_WANT_FILE:
+            if (uring_read_chunk(ctx, conn) != 0)
+                uring_close(ctx, conn);
+            return;
+        default:
+            uring_close(ctx, conn);
+            return;
+        }
+    }
+}
+
+static void uring_on_accept(uring_ctx *ctx, struct io_uring_cqe *cqe)
+{
+    uring_conn *conn = NULL;
+    SSL *ssl = NULL;
+    int client_fd = cqe->res;
+    int rate_slot = -1;
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0 && server_run)
+        uring_arm_accept(ctx);
+
+    if (client_fd < 0)
+    {
+        if (client_fd != -ECANCELED)
+        {
+            LOG_ERROR("%s accept failed: %s", __func__, strerror(-client_fd));
+        }
+        return;
+    }
+
+    // Multishot accept leaves out the address, only looked up when it is needed
+    if (g_rate_limit && (getpeername(client_fd, (struct sockaddr *)&addr, &addr_len) != 0 ||
+                         rate_limit_connect((struct sockaddr *)&addr, &rate_slot) != 0))
+    {
+        LOG_DEBUG("%s client over its limits, client_fd: %d", __func__, client_fd);
+        close(client_fd);
+        return;
+    }
+
+    set_socket_nodelay(client_fd);
+    conn = slab_zalloc(&conn_slab);
+    ssl = new_client_ssl();
+    if (conn == NULL || ssl == NULL)
+        goto err_cleanup;
+
+    conn->send_buf = buf_alloc(URING_SEND_SIZE);
+    conn->rbio = BIO_new(BIO_s_mem());
+    conn->wbio = BIO_new(BIO_s_mem());
+    if (conn->send_buf == NULL || conn->rbio == NULL || conn->wbio == NULL)
+    {
+        BIO_free(conn->rbio);
+        BIO_free(conn->wbio);
+        goto err_cleanup;
+    }
+
+    BIO_set_mem_eof_return(conn->rbio, -1);
+    BIO_set_mem_eof_return(conn->wbio, -1);
+    SSL_set_bio(ssl, conn->rbio, conn->wbio);
+    SSL_set_accept_state(ssl);
+
+    conn->cinfo.fd = client_fd;
+    conn->cinfo.ssl = ssl;
+    conn->cinfo.async_file = true;
+    conn->cinfo.rate_slot = rate_slot;
+    conn->cinfo.last_active = time(NULL);
+    // Handshake is timed from here
+    TRACE_MARK(&conn->cinfo);
+    if (g_access_log)
+        record_peer(&conn->cinfo);
+
+    conn->next = ctx->conns;
+    if (ctx->conns != NULL)
+        ctx->conns->prev = conn;
+    ctx->conns = conn;
+
+    LOG_INFO("Connection accepted on ring %d client_fd: %d", ctx->ring_fd, client_fd);
+    uring_arm_recv(ctx, conn);
+    return;
+
+err_cleanup:
+    LOG_ERROR("%s unable to allocate connection", __func__);
+    ERR_print_errors_cb(ssl_log_err, NULL);
+    if (ssl != NULL)
+        SSL_free(ssl);
+    if (conn != NULL)
+        buf_free(conn->send_buf, URING_SEND_SIZE);
+    slab_free(&conn_slab, conn);
+    rate_limit_disconnect(rate_slot);
+    close(client_fd);
+}
+
+static void uring_on_recv(uring_ctx *ctx, uring_conn *conn, struct io_uring_cqe *cqe)
+{
+    unsigned short bid = 0;
+
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+        conn->recv_armed = false;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe->res > 0 && conn->closing == false)
+            BIO_write(conn->rbio, ctx->bufs + (size_t)bid * URING_BUF_SIZE, cqe->res);
+        uring_recycle_buf(ctx, bid);
+    }
+
+    if (conn->closing)
+    {
+        uring_release(ctx, conn);
+        return;
+    }
+
+    if (cqe->res <= 0 && cqe->res != -ENOBUFS)
+    {
+        uring_close(ctx, conn);
+        return;
+    }
+
+    // Multishot stops when the buffer ring runs dry, re-arm it
+    if (conn->recv_armed == false)
+        uring_arm_recv(ctx, conn);
+
+    uring_drive(ctx, conn);
+}
+
+static void uring_on_send(uring_ctx *ctx, uring_conn *conn, struct io_uring_cqe *cqe)
+{
+    conn->send_inflight = false;
+    if (cqe->res <= 0)
+    {
+        conn->closing = true;
+        uring_release(ctx, conn);
+        return;
+    }
+
+    conn->send_off += cqe->res;
+    if (conn->send_off < conn->send_len)
+    {
+        uring_resend(ctx, conn);
+        return;
+    }
+
+    uring_flush(ctx, conn);
+    if (conn->closing)
+    {
+        if (conn->send_inflight == false)
+            uring_release(ctx, conn);
+        return;
+    }
+
+    if (conn->send_inflight == false)
+        uring_drive(ctx, conn);
+}
+
+static void uring_on_read(uring_ctx *ctx, uring_conn *conn, struct io_uring_cqe *cqe)
+{
+    send_state *resp = &conn->cinfo.resp;
+
+    conn->read_inflight = false;
+    if (conn->closing)
+    {
+        uring_release(ctx, conn);
+        return;
+    }
+
+    if (cqe->res <= 0)
+    {
+        LOG_ERROR("%s Error in reading file %s", __func__, resp->page->file_name);
+        uring_close(ctx, conn);
+        return;
+    }
+
+    resp->out = resp->chunk;
+    resp->out_len = cqe->res;
+    resp->offset += cqe->res;
+    uring_drive(ctx, conn);
+}
+
+/**
+ * Closes connections idle for KEEP_ALIVE_TIMEOUT_SEC, this also
+ * bounds handshakes since they never refresh last_active
+ */
+static void uring_reap(uring_ctx *ctx)
+{
+    uring_conn *conn = ctx->conns;
+    uring_conn *next = NULL;
+    time_t now = time(NULL);
+
+    while (conn != NULL)
+    {
+        next = conn->next;
+        if (conn->closing == false && conn->send_inflight == false && conn->read_inflight == false &&
+            now - conn->cinfo.last_active >= KEEP_ALIVE_TIMEOUT_SEC)
+        {
+            LOG_INFO("Closing idle connection on client_fd: %d", conn->cinfo.fd);
+            uring_close(ctx, conn);
+        }
+        conn = next;
+    }
+}
+
+static void uring_handle_cqe(uring_ctx *ctx, struct io_uring_cqe *cqe)
+{
+    unsigned long op = cqe->user_data & UOP_MASK;
+    uring_conn *conn = (uring_conn *)(cqe->user_data & ~UOP_MASK);
+
+    switch (op)
+    {
+    case UOP_ACCEPT:
+        uring_on_accept(ctx, cqe);
+        break;
+    case UOP_RECV:
+        uring_on_recv(ctx, conn, cqe);
+        break;
+    case UOP_SEND:
+        uring_on_send(ctx, conn, cqe);
+        break;
+    case UOP_READ:
+        uring_on_read(ctx, conn, cqe);
+        break;
+    case UOP_TIMEOUT:
+        uring_reap(ctx);
+        rate_limit_age();
+        TRACE_POLL();
+        if (server_run)
+            uring_arm_tick(ctx);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Event loop of one engine thread
+ */
+static void *uring_worker(void *arg)
+{
+    uring_ctx *ctx = (uring_ctx *)arg;
+    unsigned head = 0;
+    struct io_uring_cqe *cqe = NULL;
+
+    uring_arm_accept(ctx);
+    uring_arm_tick(ctx);
+
+    while (server_run)
+    {
+        if (uring_submit(ctx, 1) != 0 && errno != EINTR && errno != EBUSY)
+            break;
+
+        head = *ctx->cq_head;
+        while (head != __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            cqe = &ctx->cqes[head & ctx->cq_mask];
+            uring_handle_cqe(ctx, cqe);
+            head++;
+            __atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    while (ctx->conns != NULL)
+    {
+        uring_conn *conn = ctx->conns;
+        ctx->conns = conn->next;
+        close(conn->cinfo.fd);
+        h2_free(&conn->cinfo);
+        SSL_free(conn->cinfo.ssl);
+        release_client_buffers(&conn->cinfo);
+        buf_free(conn->send_buf, URING_SEND_SIZE);
+        slab_free(&conn_slab, conn);
+    }
+
+    munmap(ctx->buf_ring, ctx->buf_ring_len);
+    munmap(ctx->sqes, ctx->sqes_len);
+    munmap(ctx->ring_ptr, ctx->ring_len);
+    close(ctx->ring_fd);
+    return NULL;
+}
+
+/**
+ * Serves HTTPS using one io_uring per CPU the process may use, bound
+ * by affinity and the cgroup quota, the calling thread runs the first
+ * ring. Returns -1 without serving anything if io_uring is unavailable
+ * so the caller can fall back to epoll
+ */
+int run_uring_server(const int server_fd)
+{
+    size_t count = detect_cpu_budget();
+    size_t i = 0;
+    pthread_t threads[URING_MAX_THREADS];
+    static uring_ctx ctx[URING_MAX_THREADS];
+
+    if (count > URING_MAX_THREADS)
+        count = URING_MAX_THREADS;
+
+    if (uring_init(&ctx[0], server_fd) != 0)
+        return -1;
+
+    for (i = 1; i < count; i++)
+    {
+        if (uring_init(&ctx[i], server_fd) != 0)
+            break;
+        if (pthread_create(&threads[i], NULL, uring_worker, &ctx[i]) != 0)
+        {
+            close(ctx[i].ring_fd);
+            break;
+        }
+    }
+    count = i;
+
+    LOG_INFO("io_uring engine running on %lu rings", count);
+    uring_worker(&ctx[0]);
+
+    for (i = 1; i < count; i++)
+        pthread_join(threads[i], NULL);
+
+    return 0;
+}
+
+#else
+
+int run_uring_server(const int server_fd)
+{
+    (void)server_fd;
+    LOG_ERROR("io_uring engine not available in this build");
+    return -1;
+}
+
+#endif
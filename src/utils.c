@@ -24,6 +24,7 @@
 
 #include "server.h"
 #include <sys/resource.h>
+#include <netinet/tcp.h>
 
 /**
  * Util fucntion to save ssl error to log file
@@ -143,3 +144,20 @@ int set_socket_timeout(const int fd, const time_t sec, const time_t usec)
     }
     return 0;
 }
+
+/**
+ * Disables Nagle, the header and body records of a response are
+ * written separately and the second would otherwise wait for the
+ * client's delayed ACK
+ */
+int set_socket_nodelay(const int fd)
+{
+    int one = 1;
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) != 0)
+    {
+        LOG_ERROR("%s setsockopt TCP_NODELAY failed", __func__);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,250 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "server.h"
+
+#include <ctype.h>
+
+/**
+ * Virtual hosts, many sites out of one process. Every host has its own
+ * page namespace and optionally its own certificates, read from a
+ * hosts file with one host per line:
+ *
+ *   <host> <asset dir> [<cert.pem> <key.pem>]...
+ *
+ * '#' starts a comment. Hosts without certificates are served with the
+ * default ones, which then have to cover them. SNI picks the context of
+ * the handshake, the Host header the namespace of every request, hosts
+ * not listed fall back to the default namespace of -a.
+ */
+
+typedef struct
+{
+    char *name;
+    page_namespace pages;
+    // NULL when the default context serves the host
+    SSL_CTX *ssl_ctx;
+} vhost;
+
+extern SSL_CTX *g_ssl_ctx;
+
+static vhost *g_vhosts = NULL;
+static size_t g_nr_vhosts = 0;
+static hashtable g_vhost_index;
+
+/**
+ * Lower case copy of a host name without port and trailing dot
+ * Returns its length, 0 if it is empty or too long
+ */
+static size_t normalize_host(const char *host, size_t len, char *out)
+{
+    size_t i = 0;
+    const char *colon = memchr(host, ':', len);
+
+    // IPv6 literals are left as they are, none of them is a listed host
+    if (colon != NULL && host[0] != '[')
+        len = (size_t)(colon - host);
+    if (len > 0 && host[len - 1] == '.')
+        len--;
+    if (len == 0 || len > VHOST_NAME_LEN)
+        return 0;
+
+    for (i = 0; i < len; i++)
+        out[i] = (char)tolower((unsigned char)host[i]);
+    out[len] = '\0';
+    return len;
+}
+
+static const vhost *find_vhost(const char *host, size_t len)
+{
+    char name[VHOST_NAME_LEN + 1];
+
+    if (g_nr_vhosts == 0)
+        return NULL;
+
+    len = normalize_host(host, len, name);
+    if (len == 0)
+        return NULL;
+    return hashtable_lookup(&g_vhost_index, name, len);
+}
+
+/**
+ * Namespace of the host, NULL if it is not a virtual host
+ */
+const page_namespace *find_host_pages(const char *host, size_t len)
+{
+    const vhost *site = find_vhost(host, len);
+
+    return (site != NULL) ? &site->pages : NULL;
+}
+
+/**
+ * Swaps in the context of the virtual host named by SNI, unknown
+ * names and hosts without certificates stay on the default one
+ */
+static int servername_cb(SSL *ssl, int *alert, void *arg)
+{
+    const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    const vhost *site = NULL;
+
+    (void)alert;
+    (void)arg;
+    if (name == NULL)
+        return SSL_TLSEXT_ERR_NOACK;
+
+    site = find_vhost(name, strlen(name));
+    if (site == NULL)
+        return SSL_TLSEXT_ERR_NOACK;
+
+    if (site->ssl_ctx != NULL && SSL_set_SSL_CTX(ssl, site->ssl_ctx) == NULL)
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Sets up one host from the fields of its line
+ */
+static int add_vhost(vhost *site, char **fields, size_t nr_fields)
+{
+    size_t i = 0;
+    size_t len = 0;
+    char name[VHOST_NAME_LEN + 1];
+    const char *cert_files[MAX_SSL_CERTS];
+    const char *key_files[MAX_SSL_CERTS];
+
+    len = normalize_host(fields[0], strlen(fields[0]), name);
+    if (len == 0 || nr_fields % 2 != 0 || (nr_fields - 2) / 2 > MAX_SSL_CERTS)
+    {
+        LOG_ERROR("%s: expected <host> <asset dir> [<cert.pem> <key.pem>]... for %s", __func__, fields[0]);
+        return -1;
+    }
+    if (hashtable_lookup(&g_vhost_index, name, len) != NULL)
+    {
+        LOG_ERROR("%s: host %s is listed twice", __func__, name);
+        return -1;
+    }
+
+    site->name = strdup(name);
+    if (site->name == NULL || load_namespace(&site->pages, fields[1]) == 0)
+        return -1;
+
+    for (i = 2; i < nr_fields; i += 2)
+    {
+        cert_files[(i - 2) / 2] = fields[i];
+        key_files[(i - 2) / 2] = fields[i + 1];
+    }
+    if (nr_fields > 2)
+    {
+        site->ssl_ctx = new_ssl_context(cert_files, key_files, (nr_fields - 2) / 2);
+        if (site->ssl_ctx == NULL)
+            return -1;
+    }
+
+    if (hashtable_insert(&g_vhost_index, site->name, len, site) < 0)
+        return -1;
+
+    LOG_INFO("Virtual host %s serving %zu pages from %s%s", site->name, site->pages.nr_pages,
+             site->pages.root, site->ssl_ctx != NULL ? " with its own certificates" : "");
+    return 0;
+}
+
+/**
+ * Reads the hosts file and registers the SNI callback on g_ssl_ctx,
+ * which has to be set up already
+ * Returns the number of hosts, -1 on error
+ */
+int load_vhosts(const char *path)
+{
+    FILE *file = NULL;
+    char line[VHOST_LINE_LEN];
+    char *fields[VHOST_MAX_FIELDS];
+    char *save = NULL;
+    char *token = NULL;
+    size_t nr_fields = 0;
+    size_t nr_lines = 0;
+    size_t line_no = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        LOG_ERROR("%s: unable to open %s", __func__, path);
+        return -1;
+    }
+
+    // Every line may be a host, sized once so hosts never move
+    while (fgets(line, sizeof(line), file) != NULL)
+        nr_lines++;
+    g_vhosts = calloc(nr_lines + 1, sizeof(vhost));
+    if (g_vhosts == NULL || init_hashtable(&g_vhost_index, nr_lines) != 0)
+    {
+        LOG_ERROR("%s calloc", __func__);
+        fclose(file);
+        release_vhosts();
+        return -1;
+    }
+
+    rewind(file);
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_no++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        nr_fields = 0;
+        for (token = strtok_r(line, " \t", &save); token != NULL && nr_fields < VHOST_MAX_FIELDS;
+             token = strtok_r(NULL, " \t", &save))
+            fields[nr_fields++] = token;
+
+        if (nr_fields == 0)
+            continue;
+        if (token != NULL || add_vhost(&g_vhosts[g_nr_vhosts], fields, nr_fields) != 0)
+        {
+            LOG_ERROR("%s: invalid host at %s:%zu", __func__, path, line_no);
+            fclose(file);
+            // Counted so its partial setup is released too
+            g_nr_vhosts++;
+            release_vhosts();
+            return -1;
+        }
+        g_nr_vhosts++;
+    }
+    fclose(file);
+
+    SSL_CTX_set_tlsext_servername_callback(g_ssl_ctx, servername_cb);
+    return (int)g_nr_vhosts;
+}
+
+void release_vhosts()
+{
+    size_t i = 0;
+
+    for (i = 0; g_vhosts != NULL && i < g_nr_vhosts; i++)
+    {
+        release_namespace(&g_vhosts[i].pages);
+        SSL_CTX_free(g_vhosts[i].ssl_ctx);
+        free(g_vhosts[i].name);
+    }
+    free(g_vhosts);
+    free_hashtable(&g_vhost_index);
+    g_vhosts = NULL;
+    g_nr_vhosts = 0;
+}
@@ -57,6 +57,7 @@ SSL_CTX * init_client()
         ERR_print_errors_fp(stderr);
         exit(EXIT_FAILURE);
     }
+    return ctx;
 }
 
 int connect_server(const char *ip, const int port, SSL_CTX *ctx)
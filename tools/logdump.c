@@ -0,0 +1,395 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2024 Aniruddha Kawade
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/**
+ * legion-logdump, expands a binary log written with -b into the
+ * same lines the text logger writes. Binary access logs written
+ * with -f binary are printed as the CSV the access log writes.
+ * Usage: legion-logdump [-u] [-s] [log file]
+ *   -u  microsecond timestamps
+ *   -s  append the call site file:line to every line
+ */
+
+#include "logger.h"
+#include "access_log.h"
+
+#include <stddef.h>
+#include <arpa/inet.h>
+
+typedef struct
+{
+    int level;
+    int line;
+    char *file;
+    char *fmt;
+    int nargs;
+    unsigned char args[LOG_MAX_ARGS];
+} dump_site;
+
+static const char *level_names[] = {"ERROR", "INFO", "DEBUG"};
+
+static char *read_string(FILE *fp)
+{
+    unsigned short len = 0;
+    char *str = NULL;
+
+    if (fread(&len, sizeof(len), 1, fp) != 1)
+        return NULL;
+
+    str = calloc(1, (size_t)len + 1);
+    if (str == NULL || fread(str, 1, len, fp) != len)
+    {
+        free(str);
+        return NULL;
+    }
+    return str;
+}
+
+/**
+ * Prints one conversion of a format with its argument,
+ * stars holds the values of * widths and precisions
+ */
+static void print_arg(const char *spec, const long *stars, int nr_stars, unsigned char kind,
+                      long lval, double dval, const char *str)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#define PRINT_WITH_STARS(val)                                           \
+    do                                                                  \
+    {                                                                   \
+        if (nr_stars == 0)                                              \
+            printf(spec, val);                                          \
+        else if (nr_stars == 1)                                         \
+            printf(spec, (int)stars[0], val);                           \
+        else                                                            \
+            printf(spec, (int)stars[0], (int)stars[1], val);            \
+    } while (0)
+
+    switch (kind)
+    {
+    case LOG_ARG_INT:
+        PRINT_WITH_STARS((int)lval);
+        break;
+    case LOG_ARG_LONG:
+        PRINT_WITH_STARS(lval);
+        break;
+    case LOG_ARG_DOUBLE:
+        PRINT_WITH_STARS(dval);
+        break;
+    case LOG_ARG_PTR:
+        PRINT_WITH_STARS((void *)lval);
+        break;
+    default:
+        PRINT_WITH_STARS(str);
+        break;
+    }
+#undef PRINT_WITH_STARS
+#pragma GCC diagnostic pop
+}
+
+/**
+ * Reads the next argument of kind off a record payload
+ * Returns 0 on success, -1 if the payload is too short
+ */
+static int read_arg(unsigned char kind, const char *payload, size_t len, size_t *pos,
+                    long *lval, double *dval, char *str)
+{
+    unsigned short str_len = 0;
+
+    if (kind == LOG_ARG_STR)
+    {
+        if (*pos + sizeof(str_len) > len)
+            return -1;
+        memcpy(&str_len, payload + *pos, sizeof(str_len));
+        if (*pos + sizeof(str_len) + str_len > len || str_len >= LOG_SIZE)
+            return -1;
+        memcpy(str, payload + *pos + sizeof(str_len), str_len);
+        str[str_len] = '\0';
+        *pos += sizeof(str_len) + str_len;
+        return 0;
+    }
+
+    if (*pos + sizeof(*lval) > len)
+        return -1;
+    memcpy(lval, payload + *pos, sizeof(*lval));
+    memcpy(dval, payload + *pos, sizeof(*dval));
+    *pos += sizeof(*lval);
+    return 0;
+}
+
+/**
+ * Walks the format of a site printing literals as they are and
+ * each conversion with its argument taken from the record payload
+ * Returns 0 on success, -1 if the payload doesn't match the format
+ */
+static int print_message(const dump_site *site, const char *payload, size_t len)
+{
+    int arg = 0;
+    int nr_stars = 0;
+    size_t pos = 0;
+    size_t spec_len = 0;
+    long lval = 0;
+    long stars[2] = {0, 0};
+    double dval = 0;
+    char spec[64];
+    char str[LOG_SIZE];
+    const char *p = site->fmt;
+    const char *start = NULL;
+
+    for (; *p != '\0'; p++)
+    {
+        if (*p != '%')
+        {
+            putchar(*p);
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            putchar('%');
+            p++;
+            continue;
+        }
+
+        // Conversion runs up to the first conversion letter
+        start = p++;
+        while (*p != '\0' && strchr("diuxXocfFeEgGaAps", *p) == NULL)
+            p++;
+        if (*p == '\0')
+            return -1;
+
+        spec_len = (size_t)(p - start) + 1;
+        if (spec_len >= sizeof(spec))
+            return -1;
+        memcpy(spec, start, spec_len);
+        spec[spec_len] = '\0';
+
+        // * widths and precisions come before the value
+        nr_stars = 0;
+        for (start = spec; *start != '\0'; start++)
+        {
+            if (*start != '*')
+                continue;
+            if (nr_stars == 2 || arg >= site->nargs ||
+                read_arg(site->args[arg], payload, len, &pos, &lval, &dval, str) != 0)
+                return -1;
+            stars[nr_stars++] = lval;
+            arg++;
+        }
+
+        if (arg >= site->nargs || read_arg(site->args[arg], payload, len, &pos, &lval, &dval, str) != 0)
+            return -1;
+        print_arg(spec, stars, nr_stars, site->args[arg], lval, dval, str);
+        arg++;
+    }
+    return 0;
+}
+
+/**
+ * Prints a binary access log as CSV
+ * Returns 0 on success, -1 otherwise
+ */
+static int dump_access_log(FILE *fp, const char *path)
+{
+    unsigned short i = 0;
+    time_t sec = 0;
+    struct tm tm;
+    char stamp[STAMP_LEN];
+    char client[INET6_ADDRSTRLEN];
+    access_file_header header;
+    access_record rec;
+    const size_t fixed = offsetof(access_record, path);
+    static const char *methods[] = {"-", "GET", "HEAD"};
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.version != ACCESS_BINARY_VERSION ||
+        header.record_size != sizeof(access_record))
+    {
+        fprintf(stderr, "%s: unsupported access log version\n", path);
+        return -1;
+    }
+
+    printf("time,client,method,path,status,bytes,duration_us,resumed,aborted\n");
+    while (fread(&rec, fixed, 1, fp) == 1)
+    {
+        if (rec.path_len > ACCESS_PATH_LEN || fread(rec.path, 1, rec.path_len, fp) != rec.path_len)
+        {
+            fprintf(stderr, "%s: corrupt record\n", path);
+            return -1;
+        }
+
+        sec = (time_t)(rec.start_ns / 1000000000UL);
+        gmtime_r(&sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        if (inet_ntop((rec.flags & ACCESS_FLAG_IPV6) ? AF_INET6 : AF_INET, rec.addr, client, sizeof(client)) == NULL)
+            strcpy(client, "-");
+
+        printf("%s.%06luZ,%s,%s,\"/", stamp, (rec.start_ns % 1000000000UL) / 1000, client,
+               methods[rec.method <= ACCESS_METHOD_HEAD ? rec.method : 0]);
+        for (i = 0; i < rec.path_len; i++)
+        {
+            if (rec.path[i] == '"')
+                putchar('"');
+            putchar((rec.path[i] < 0x20 || rec.path[i] == 0x7f) ? '?' : rec.path[i]);
+        }
+        printf("\",%u,%lu,%u,%d,%d\n", rec.status, rec.bytes, rec.duration_us,
+               (rec.flags & ACCESS_FLAG_RESUMED) ? 1 : 0, (rec.flags & ACCESS_FLAG_ABORTED) ? 1 : 0);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt = 0;
+    bool micros = false;
+    bool show_site = false;
+    char stamp[STAMP_LEN];
+    char payload[LOG_SIZE];
+    const char *path = BINARY_LOG_FILE;
+    unsigned int i = 0;
+    unsigned int entry[2];
+    unsigned short text_len = 0;
+    double offset_ns = 0;
+    long when_ns = 0;
+    time_t sec = 0;
+    long usec = 0;
+    struct tm time_local;
+    log_file_header header;
+    log_record rec;
+    dump_site *sites = NULL;
+    dump_site *site = NULL;
+    FILE *fp = NULL;
+
+    while ((opt = getopt(argc, argv, "us")) != -1)
+    {
+        switch (opt)
+        {
+        case 'u':
+            micros = true;
+            break;
+        case 's':
+            show_site = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-u] [-s] [log file]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc)
+        path = argv[optind];
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    if (fread(header.magic, sizeof(header.magic), 1, fp) == 1 &&
+        memcmp(header.magic, ACCESS_BINARY_MAGIC, sizeof(header.magic)) == 0)
+    {
+        rewind(fp);
+        opt = dump_access_log(fp, path);
+        fclose(fp);
+        return (opt == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    rewind(fp);
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, LOG_BINARY_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != LOG_BINARY_VERSION || header.tsc_hz == 0)
+    {
+        fprintf(stderr, "%s is not a legion binary log\n", path);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+
+    sites = calloc(header.nr_sites, sizeof(dump_site));
+    if (sites == NULL && header.nr_sites > 0)
+        return EXIT_FAILURE;
+
+    for (i = 0; i < header.nr_sites; i++)
+    {
+        if (fread(entry, sizeof(entry), 1, fp) != 1)
+            break;
+        sites[i].level = (int)entry[0];
+        sites[i].line = (int)entry[1];
+        sites[i].file = read_string(fp);
+        sites[i].fmt = read_string(fp);
+        if (sites[i].file == NULL || sites[i].fmt == NULL)
+            break;
+        sites[i].nargs = log_parse_format(sites[i].fmt, sites[i].args, LOG_MAX_ARGS);
+    }
+    if (i != header.nr_sites)
+    {
+        fprintf(stderr, "%s: truncated call site table\n", path);
+        return EXIT_FAILURE;
+    }
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+        if (rec.len < sizeof(rec) || rec.len > LOG_SIZE || rec.site >= header.nr_sites ||
+            fread(payload, 1, rec.len - sizeof(rec), fp) != rec.len - sizeof(rec))
+        {
+            fprintf(stderr, "%s: corrupt record\n", path);
+            break;
+        }
+        site = &sites[rec.site];
+
+        offset_ns = (double)(long)(rec.tsc - header.tsc0) * 1e9 / (double)header.tsc_hz;
+        when_ns = (long)header.realtime_ns0 + (long)offset_ns;
+        sec = (time_t)(when_ns / 1000000000L);
+        usec = (when_ns / 1000L) % 1000000L;
+        localtime_r(&sec, &time_local);
+        strftime(stamp, STAMP_LEN, "%Y-%m-%d %H:%M:%S", &time_local);
+
+        printf("[%s] [%s", (site->level >= 0 && site->level <= LOG_LEVEL_DEBUG) ? level_names[site->level] : "?", stamp);
+        if (micros)
+            printf(".%06ld", usec);
+        printf("] ");
+        if (rec.err != 0)
+            printf("%s ", strerror(rec.err));
+
+        if (site->nargs < 0)
+        {
+            // Format couldn't be recorded raw, the text was stored instead
+            memcpy(&text_len, payload, sizeof(text_len));
+            if (text_len + sizeof(text_len) <= rec.len - sizeof(rec))
+                fwrite(payload + sizeof(text_len), 1, text_len, stdout);
+        }
+        else if (print_message(site, payload, rec.len - sizeof(rec)) != 0)
+        {
+            printf("<bad arguments for %s:%d>\n", site->file, site->line);
+        }
+
+        if (show_site)
+            printf("    at %s:%d\n", site->file, site->line);
+    }
+
+    for (i = 0; i < header.nr_sites; i++)
+    {
+        free(sites[i].file);
+        free(sites[i].fmt);
+    }
+    free(sites);
+    fclose(fp);
+    return EXIT_SUCCESS;
+}